@@ -0,0 +1,214 @@
+﻿/*
+ * AccessStats.cpp - Per-Entry Access Frequency Tracking
+ *
+ * Implements TAccessStats. Every thread that records gets its own shard,
+ * found through a thread-local cache keyed by instance id, so the hot path
+ * is one cache check plus one uncontended increment.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "AccessStats.h"
+
+#include <cstdio>                 // std::remove, std::rename
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static std::atomic<uint64_t> NextStatsId(1);
+
+/*
+ * Thread Shard Cache
+ * The last used shard is checked first; the map covers threads that
+ * record into several TAccessStats instances.
+ */
+struct TShardRef
+{
+    uint64_t generation;
+    void* shard;
+};
+
+static thread_local uint64_t LastOwner = 0;
+static thread_local TShardRef LastShard = {0, nullptr};
+static thread_local std::unordered_map<uint64_t, TShardRef>* ShardCache = nullptr;
+//---------------------------------------------------------------------------
+
+TAccessStats::TAccessStats(size_t entryCount)
+    : id(NextStatsId.fetch_add(1)), entryCount(entryCount), generation(1)
+{
+}
+
+TAccessStats::~TAccessStats()
+{
+}
+
+/*
+ * Reset Counters
+ * Must not run concurrently with Record(). Existing shards are dropped and
+ * threads pick up fresh ones on their next Record().
+ */
+void TAccessStats::Reset(size_t count)
+{
+    std::lock_guard<std::mutex> lock(shardLock);
+    entryCount = count;
+    shards.clear();
+    generation.fetch_add(1);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Find Or Create This Thread's Shard
+ */
+TAccessStats::TShard* TAccessStats::LocalShard()
+{
+    uint64_t gen = generation.load(std::memory_order_relaxed);
+    if (LastOwner == id && LastShard.generation == gen)
+        return static_cast<TShard*>(LastShard.shard);
+
+    if (ShardCache == nullptr)
+        ShardCache = new std::unordered_map<uint64_t, TShardRef>(); // Lives as long as the thread
+    std::unordered_map<uint64_t, TShardRef>::iterator it = ShardCache->find(id);
+    if (it == ShardCache->end() || it->second.generation != gen) {
+        std::lock_guard<std::mutex> lock(shardLock);
+        shards.push_back(std::unique_ptr<TShard>(new TShard(entryCount)));
+        TShardRef ref = {gen, shards.back().get()};
+        (*ShardCache)[id] = ref;
+        it = ShardCache->find(id);
+    }
+
+    LastOwner = id;
+    LastShard = it->second;
+    return static_cast<TShard*>(LastShard.shard);
+}
+
+/*
+ * Record One Access
+ * Single writer per shard: a relaxed load/store pair compiles to a plain
+ * increment, with no locked instruction on the hot path.
+ */
+void TAccessStats::Record(size_t entry)
+{
+    TShard* shard = LocalShard();
+    if (entry >= shard->size)
+        return;
+    std::atomic<uint64_t>& counter = shard->counts[entry];
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Merge Shards
+ */
+std::vector<uint64_t> TAccessStats::Merge() const
+{
+    std::lock_guard<std::mutex> lock(shardLock);
+    std::vector<uint64_t> totals(entryCount, 0);
+    for (size_t s = 0; s < shards.size(); s++) {
+        const TShard& shard = *shards[s];
+        for (size_t i = 0; i < shard.size && i < totals.size(); i++)
+            totals[i] += shard.counts[i].load(std::memory_order_relaxed);
+    }
+    return totals;
+}
+
+TAccessCounts TAccessStats::Totals(const std::vector<std::string>& names) const
+{
+    TAccessCounts totals(history);
+    std::vector<uint64_t> session = Merge();
+    for (size_t i = 0; i < session.size() && i < names.size(); i++) {
+        if (session[i] > 0)
+            totals[names[i]] += session[i];
+    }
+    return totals;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Stats File I/O
+ * One "<count>\t<name>" line per entry; unknown or malformed lines are
+ * ignored so an old stats file never blocks startup.
+ */
+TAccessCounts TAccessStats::ReadFile(const std::string& path)
+{
+    TAccessCounts counts;
+    std::ifstream file(path.c_str(), std::ios::binary);
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        size_t tab = line.find('\t');
+        if (tab == std::string::npos || tab == 0 || tab + 1 >= line.size())
+            continue;
+        std::istringstream number(line.substr(0, tab));
+        uint64_t count = 0;
+        if (number >> count)
+            counts[line.substr(tab + 1)] += count;
+    }
+    return counts;
+}
+
+void TAccessStats::Load(const std::string& path)
+{
+    TAccessCounts loaded = ReadFile(path);
+    for (TAccessCounts::const_iterator it = loaded.begin(); it != loaded.end(); ++it)
+        history[it->first] += it->second;
+}
+
+void TAccessStats::Save(const std::string& path, const std::vector<std::string>& names) const
+{
+    TAccessCounts totals = Totals(names);
+
+    // Write to a temporary file first so a crash never leaves a torn file
+    std::string temp = path + ".tmp";
+    {
+        std::ofstream file(temp.c_str(), std::ios::binary | std::ios::trunc);
+        for (TAccessCounts::const_iterator it = totals.begin(); it != totals.end(); ++it)
+            file << it->second << '\t' << it->first << '\n';
+        if (!file)
+            return;
+    }
+    std::remove(path.c_str());
+    std::rename(temp.c_str(), path.c_str());
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Access Trace I/O
+ * Appending opens the file for each access; the viewer records one click
+ * at a time, far too rarely for that to matter.
+ */
+TAccessTrace ReadAccessTrace(const std::string& path)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    if (!file)
+        throw std::runtime_error("Unable to read " + path);
+    TAccessTrace trace;
+    std::string line;
+    while (std::getline(file, line)) {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (!line.empty() && line[0] != '#')
+            trace.push_back(line);
+    }
+    return trace;
+}
+
+void WriteAccessTrace(const std::string& path, const TAccessTrace& trace)
+{
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::trunc);
+    for (size_t i = 0; i < trace.size(); i++)
+        file << trace[i] << '\n';
+    if (!file)
+        throw std::runtime_error("Unable to write " + path);
+}
+
+void AppendAccessTrace(const std::string& path, const std::string& name)
+{
+    std::ofstream file(path.c_str(), std::ios::binary | std::ios::app);
+    file << name << '\n';
+}
+//---------------------------------------------------------------------------
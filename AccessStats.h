@@ -0,0 +1,106 @@
+﻿/*
+ * AccessStats.h - Per-Entry Access Frequency Tracking
+ *
+ * Declares TAccessStats, which counts how often each pack entry is read.
+ * Recording is a plain increment in a per-thread shard (no locks, no
+ * atomic read-modify-write), and shards are summed on demand. Counts are
+ * persisted by entry name so the pack builder can reorder entries for
+ * locality (see ReorderPack() in PackBuilder.h). Access traces keep the
+ * order of the accesses as well, for replaying through the image cache.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef AccessStatsH
+#define AccessStatsH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+// Access counts keyed by entry name, as stored in a stats file
+typedef std::unordered_map<std::string, uint64_t> TAccessCounts;
+
+/*
+ * TAccessStats - Sharded Access Counters
+ *
+ * Record() may be called from any thread. Each thread writes only its own
+ * shard, so the counters stay in that core's cache; Merge() reads every
+ * shard (relaxed atomics keep this race-free without slowing the writer).
+ */
+class TAccessStats
+{
+  public:
+    explicit TAccessStats(size_t entryCount = 0);
+    ~TAccessStats();
+
+    // Sizes the counters for a pack; clears all counts
+    void Reset(size_t entryCount);
+
+    // Counts one access to an entry (hot path)
+    void Record(size_t entry);
+
+    // Sums all thread shards into per-entry totals
+    std::vector<uint64_t> Merge() const;
+
+    // Persistence: "<count>\t<name>" lines. Load() adds to history that
+    // Save() writes back together with this session's counts
+    void Load(const std::string& path);
+    void Save(const std::string& path, const std::vector<std::string>& names) const;
+
+    // History plus this session, keyed by name
+    TAccessCounts Totals(const std::vector<std::string>& names) const;
+
+    // Reads a stats file without needing a pack
+    static TAccessCounts ReadFile(const std::string& path);
+
+  private:
+    TAccessStats(const TAccessStats&);
+    TAccessStats& operator=(const TAccessStats&);
+
+    struct TShard
+    {
+        explicit TShard(size_t count) : counts(new std::atomic<uint64_t>[count]), size(count)
+        {
+            for (size_t i = 0; i < count; i++)
+                counts[i].store(0, std::memory_order_relaxed);
+        }
+        std::unique_ptr<std::atomic<uint64_t>[]> counts;
+        size_t size;
+    };
+
+    TShard* LocalShard();
+
+    const uint64_t id;              // Distinguishes instances in thread caches
+    size_t entryCount;
+    std::atomic<uint64_t> generation; // Bumped by Reset() to drop cached shards
+    mutable std::mutex shardLock;
+    std::vector<std::unique_ptr<TShard> > shards;
+    TAccessCounts history;
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * Access Traces
+ * One entry name per line, in the order the entries were used; blank lines
+ * and lines starting with '#' are skipped. The viewer appends to one when
+ * ZIP_TRACE names a file; RunCacheTraceBench() (ImageCache.h) replays them.
+ */
+typedef std::vector<std::string> TAccessTrace;
+
+// Throws std::runtime_error if the file cannot be read
+TAccessTrace ReadAccessTrace(const std::string& path);
+void WriteAccessTrace(const std::string& path, const TAccessTrace& trace);
+// Adds one access to the end of a trace file, creating it if needed
+void AppendAccessTrace(const std::string& path, const std::string& name);
+
+//---------------------------------------------------------------------------
+#endif // AccessStatsH
@@ -0,0 +1,53 @@
+﻿/*
+ * CancelToken.cpp - Cooperative Cancellation And Deadlines
+ *
+ * Implements the cancellation reason lookup along the parent chain.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "CancelToken.h"
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+ECancelled::ECancelled(TCancelReason reason)
+    : std::runtime_error(reason == crDeadline ? "Deadline passed" : "Operation cancelled"),
+      reason(reason)
+{
+}
+//---------------------------------------------------------------------------
+
+TCancelToken::TCancelToken(const TCancelToken* parent)
+    : parent(parent), cancelled(false), deadline(NoDeadline)
+{
+}
+
+void TCancelToken::SetDeadline(TClock::time_point when)
+{
+    deadline.store(static_cast<int64_t>(when.time_since_epoch().count()), std::memory_order_relaxed);
+}
+
+TCancelToken::TClock::time_point TCancelToken::Deadline() const
+{
+    return TClock::time_point(TClock::duration(deadline.load(std::memory_order_relaxed)));
+}
+
+/*
+ * Cancellation Reason
+ * An explicit Cancel() wins over a deadline, and this token's state over
+ * its parent's. The clock is only read when a deadline is set.
+ */
+TCancelReason TCancelToken::Reason() const
+{
+    for (const TCancelToken* token = this; token != nullptr; token = token->parent) {
+        if (token->cancelled.load(std::memory_order_relaxed))
+            return crCancelled;
+        int64_t limit = token->deadline.load(std::memory_order_relaxed);
+        if (limit != NoDeadline && TClock::now().time_since_epoch().count() >= limit)
+            return crDeadline;
+    }
+    return crNone;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,90 @@
+﻿/*
+ * CancelToken.h - Cooperative Cancellation And Deadlines
+ *
+ * Declares the token long-running decodes poll to find out whether their
+ * result is still wanted. Nothing is interrupted from outside: the inflater
+ * checks once per output chunk and the PNG decoder once per scanline, so
+ * an abandoned decode stops within a few microseconds of being cancelled
+ * and unwinds through ECancelled like any other error.
+ *
+ * A token is cancelled explicitly, by passing its deadline, or when its
+ * parent is; a scheduler hangs every job's token off one of its own so a
+ * shutdown stops all of them at once. Check() costs one relaxed load when
+ * no deadline is set, and a clock read when one is.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef CancelTokenH
+#define CancelTokenH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <stdexcept>
+
+//---------------------------------------------------------------------------
+
+enum TCancelReason { crNone, crCancelled, crDeadline };
+
+/*
+ * ECancelled - Work Stopped Because Nobody Wants It
+ * Not a decode error: callers that count failures tell the two apart.
+ */
+class ECancelled : public std::runtime_error
+{
+  public:
+    explicit ECancelled(TCancelReason reason);
+
+    TCancelReason Reason() const { return reason; }
+
+  private:
+    TCancelReason reason;
+};
+
+/*
+ * TCancelToken - Cancellation Flag With Optional Deadline
+ * Cancel() and SetDeadline() may be called from any thread while another
+ * one polls. A parent must outlive its children.
+ */
+class TCancelToken
+{
+  public:
+    typedef std::chrono::steady_clock TClock;
+
+    explicit TCancelToken(const TCancelToken* parent = nullptr);
+
+    void Cancel() { cancelled.store(true, std::memory_order_relaxed); }
+
+    // Work still running at `deadline` is cancelled; a later call replaces it
+    void SetDeadline(TClock::time_point deadline);
+    void ClearDeadline() { deadline.store(NoDeadline, std::memory_order_relaxed); }
+    bool HasDeadline() const { return deadline.load(std::memory_order_relaxed) != NoDeadline; }
+    TClock::time_point Deadline() const;
+
+    // crNone while the work is still wanted
+    TCancelReason Reason() const;
+    bool Cancelled() const { return Reason() != crNone; }
+
+    // Throws ECancelled once the token is cancelled or past its deadline
+    void Check() const
+    {
+        TCancelReason reason = Reason();
+        if (reason != crNone)
+            throw ECancelled(reason);
+    }
+
+  private:
+    static const int64_t NoDeadline = INT64_MAX;
+
+    const TCancelToken* parent;
+    std::atomic<bool> cancelled;
+    std::atomic<int64_t> deadline;      // TClock ticks since its epoch
+
+    TCancelToken(const TCancelToken&);
+    TCancelToken& operator=(const TCancelToken&);
+};
+
+//---------------------------------------------------------------------------
+#endif // CancelTokenH
@@ -0,0 +1,344 @@
+﻿/*
+ * Checksum.cpp - CRC-32 And Adler-32
+ *
+ * CRC-32 uses slicing-by-8: eight 256-entry tables let the loop consume
+ * eight input bytes per iteration instead of one. Crc32Combine() works in
+ * GF(2) polynomial arithmetic modulo the CRC polynomial, as zlib does.
+ *
+ * Both checksums are dispatched kernels (CpuDispatch.h): CRC-32 has a
+ * carry-less multiply variant for the SSE4.1 tier and Adler-32 an SSSE3
+ * one; the portable loops are the scalar variants.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "Checksum.h"
+#include "CpuDispatch.h"          // TKernel
+
+
+#ifdef CPU_X86
+#include <immintrin.h>            // SSSE3, SSE4.1 and PCLMULQDQ intrinsics
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const uint32_t CrcPolynomial = 0xEDB88320; // Reflected 0x04C11DB7
+
+struct TCrcTables
+{
+    uint32_t table[8][256];
+
+    TCrcTables()
+    {
+        for (uint32_t n = 0; n < 256; n++) {
+            uint32_t c = n;
+            for (int k = 0; k < 8; k++)
+                c = (c & 1) ? CrcPolynomial ^ (c >> 1) : c >> 1;
+            table[0][n] = c;
+        }
+        for (uint32_t n = 0; n < 256; n++) {
+            for (int t = 1; t < 8; t++)
+                table[t][n] = table[0][table[t - 1][n] & 0xFF] ^ (table[t - 1][n] >> 8);
+        }
+    }
+};
+
+static const TCrcTables& CrcTables()
+{
+    static const TCrcTables tables; // Built once, thread-safe initialization
+    return tables;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * CRC-32, Scalar
+ */
+static uint32_t Crc32Scalar(const void* data, size_t size, uint32_t crc)
+{
+    const uint32_t (*t)[256] = CrcTables().table;
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    crc = ~crc;
+
+    while (size >= 8) {
+        uint32_t lo = crc ^ (static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+                             (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24));
+        crc = t[7][lo & 0xFF] ^ t[6][(lo >> 8) & 0xFF] ^ t[5][(lo >> 16) & 0xFF] ^ t[4][lo >> 24] ^
+              t[3][p[4]] ^ t[2][p[5]] ^ t[1][p[6]] ^ t[0][p[7]];
+        p += 8;
+        size -= 8;
+    }
+    while (size-- > 0)
+        crc = t[0][(crc ^ *p++) & 0xFF] ^ (crc >> 8);
+
+    return ~crc;
+}
+
+#ifdef CPU_X86
+/*
+ * CRC-32, Carry-Less Multiply
+ * Folds four 128-bit lanes across the input with PCLMULQDQ, then folds the
+ * lanes into one and Barrett-reduces it to 32 bits (Gopal et al., "Fast
+ * CRC Computation for Generic Polynomials Using PCLMULQDQ", Intel 2009;
+ * the bit-reflected constants are the ones zlib uses). Inputs under 64
+ * bytes and the last size % 16 bytes go through the scalar loop.
+ */
+CPU_TARGET("sse4.1,pclmul")
+static uint32_t Crc32Clmul(const void* data, size_t size, uint32_t crc)
+{
+    if (size < 64)
+        return Crc32Scalar(data, size, crc);
+
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    const __m128i k1k2 = _mm_set_epi64x(0x01C6E41596ll, 0x0154442BD4ll);
+    const __m128i k3k4 = _mm_set_epi64x(0x00CCAA009Ell, 0x01751997D0ll);
+    const __m128i k5 = _mm_set_epi64x(0, 0x0163CD6124ll);
+    const __m128i poly = _mm_set_epi64x(0x01F7011641ll, 0x01DB710641ll);
+    const __m128i low32 = _mm_setr_epi32(-1, 0, -1, 0);
+
+    __m128i x1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+    __m128i x2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+    __m128i x3 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32));
+    __m128i x4 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(static_cast<int>(~crc)));
+    p += 64;
+    size -= 64;
+
+    // Four lanes, 64 bytes per step
+    while (size >= 64) {
+        __m128i f1 = _mm_clmulepi64_si128(x1, k1k2, 0x00);
+        __m128i f2 = _mm_clmulepi64_si128(x2, k1k2, 0x00);
+        __m128i f3 = _mm_clmulepi64_si128(x3, k1k2, 0x00);
+        __m128i f4 = _mm_clmulepi64_si128(x4, k1k2, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k1k2, 0x11);
+        x2 = _mm_clmulepi64_si128(x2, k1k2, 0x11);
+        x3 = _mm_clmulepi64_si128(x3, k1k2, 0x11);
+        x4 = _mm_clmulepi64_si128(x4, k1k2, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, f1), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        x2 = _mm_xor_si128(_mm_xor_si128(x2, f2), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16)));
+        x3 = _mm_xor_si128(_mm_xor_si128(x3, f3), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 32)));
+        x4 = _mm_xor_si128(_mm_xor_si128(x4, f4), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 48)));
+        p += 64;
+        size -= 64;
+    }
+
+    // Fold the lanes into one, then 16 bytes per step
+    __m128i f = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x2), f);
+    f = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x3), f);
+    f = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+    x1 = _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x1, k3k4, 0x11), x4), f);
+    while (size >= 16) {
+        f = _mm_clmulepi64_si128(x1, k3k4, 0x00);
+        x1 = _mm_clmulepi64_si128(x1, k3k4, 0x11);
+        x1 = _mm_xor_si128(_mm_xor_si128(x1, f), _mm_loadu_si128(reinterpret_cast<const __m128i*>(p)));
+        p += 16;
+        size -= 16;
+    }
+
+    // 128 -> 64 bits
+    x2 = _mm_clmulepi64_si128(x1, k3k4, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_xor_si128(_mm_clmulepi64_si128(_mm_and_si128(x1, low32), k5, 0x00), x2);
+
+    // Barrett reduction to 32 bits
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x1, low32), poly, 0x10);
+    x2 = _mm_clmulepi64_si128(_mm_and_si128(x2, low32), poly, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    crc = ~static_cast<uint32_t>(_mm_extract_epi32(x1, 1));
+
+    return Crc32Scalar(p, size, crc);
+}
+#endif
+
+static uint64_t BenchCrc32(uint32_t (*fn)(const void*, size_t, uint32_t), const uint8_t* input,
+                           size_t size, std::vector<uint8_t>&)
+{
+    // Odd lengths and offsets exercise the scalar head and tail paths too
+    uint64_t digest = fn(input, size, 0);
+    for (size_t n = 0; n < 200; n++)
+        digest = digest * 31 + fn(input + n, n * 7 + 1, static_cast<uint32_t>(n));
+    return digest;
+}
+
+typedef TKernel<uint32_t (*)(const void*, size_t, uint32_t)> TChecksumKernel;
+
+static const TChecksumKernel::TVariant Crc32Variants[] = {
+    {clScalar, Crc32Scalar},
+#ifdef CPU_X86
+    {clSse41, Crc32Clmul},
+#endif
+};
+static TChecksumKernel Crc32Kernel("crc32", Crc32Variants, BenchCrc32);
+
+/*
+ * CRC-32
+ */
+uint32_t Crc32(const void* data, size_t size, uint32_t crc)
+{
+    return Crc32Kernel.Get()(data, size, crc);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Polynomial Arithmetic Modulo The CRC Polynomial
+ * Bit 31 is x^0 (reflected order). MultModP() returns a * b mod p;
+ * X2nModP() returns x^(n * 2^k) mod p from a table of x^(2^k).
+ */
+static uint32_t MultModP(uint32_t a, uint32_t b)
+{
+    uint32_t m = 1u << 31;
+    uint32_t product = 0;
+    for (;;) {
+        if (a & m) {
+            product ^= b;
+            if ((a & (m - 1)) == 0)
+                break;
+        }
+        m >>= 1;
+        b = (b & 1) ? (b >> 1) ^ CrcPolynomial : b >> 1;
+    }
+    return product;
+}
+
+struct TPowerTable
+{
+    uint32_t x2n[32];               // x^(2^n) mod p
+
+    TPowerTable()
+    {
+        uint32_t p = 1u << 30;      // x^1
+        x2n[0] = p;
+        for (int n = 1; n < 32; n++)
+            x2n[n] = p = MultModP(p, p);
+    }
+};
+
+static uint32_t X2nModP(uint64_t n, unsigned k)
+{
+    static const TPowerTable table;
+    uint32_t p = 1u << 31;          // x^0 == 1
+    while (n != 0) {
+        if (n & 1)
+            p = MultModP(table.x2n[k & 31], p);
+        n >>= 1;
+        k++;
+    }
+    return p;
+}
+
+/*
+ * Combine CRC-32 Values
+ * Appending length2 bytes multiplies crc1 by x^(8 * length2).
+ */
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t length2)
+{
+    return MultModP(X2nModP(length2, 3), crc1) ^ crc2;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Adler-32, Scalar
+ * The sums are reduced only every 5552 bytes, the largest run that cannot
+ * overflow 32 bits (same bound as zlib's NMAX).
+ */
+static const uint32_t AdlerBase = 65521;
+static const size_t AdlerMaxRun = 5552;
+
+static uint32_t Adler32Scalar(const void* data, size_t size, uint32_t adler)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+    while (size > 0) {
+        size_t run = size < AdlerMaxRun ? size : AdlerMaxRun;
+        size -= run;
+        while (run-- > 0) {
+            a += *p++;
+            b += a;
+        }
+        a %= AdlerBase;
+        b %= AdlerBase;
+    }
+    return (b << 16) | a;
+}
+
+#ifdef CPU_X86
+/*
+ * Adler-32, SSSE3
+ * Takes 32 bytes per step: PSADBW sums them for `a`, PMADDUBSW weighs them
+ * by their distance from the end of the block (32 .. 1) for `b`. Across
+ * steps, `b` also gains 32 times the `a` of every earlier step, which is
+ * accumulated separately and added once per run.
+ */
+CPU_TARGET("ssse3")
+static uint32_t Adler32Ssse3(const void* data, size_t size, uint32_t adler)
+{
+    const uint8_t* p = static_cast<const uint8_t*>(data);
+    uint32_t a = adler & 0xFFFF;
+    uint32_t b = adler >> 16;
+
+    const __m128i weightsHi = _mm_setr_epi8(32, 31, 30, 29, 28, 27, 26, 25, 24, 23, 22, 21, 20, 19, 18, 17);
+    const __m128i weightsLo = _mm_setr_epi8(16, 15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1);
+    const __m128i ones = _mm_set1_epi16(1);
+    const __m128i zero = _mm_setzero_si128();
+
+    size_t blocks = size / 32;
+    size -= blocks * 32;
+    while (blocks > 0) {
+        size_t n = blocks < AdlerMaxRun / 32 ? blocks : AdlerMaxRun / 32;
+        blocks -= n;
+
+        __m128i previous = _mm_cvtsi32_si128(static_cast<int>(a * n)); // a before each step
+        __m128i sumA = zero;
+        __m128i sumB = _mm_cvtsi32_si128(static_cast<int>(b));
+        do {
+            __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+            __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 16));
+            previous = _mm_add_epi32(previous, sumA);
+            sumA = _mm_add_epi32(sumA, _mm_add_epi32(_mm_sad_epu8(hi, zero), _mm_sad_epu8(lo, zero)));
+            sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_maddubs_epi16(hi, weightsHi), ones));
+            sumB = _mm_add_epi32(sumB, _mm_madd_epi16(_mm_maddubs_epi16(lo, weightsLo), ones));
+            p += 32;
+        } while (--n > 0);
+        sumB = _mm_add_epi32(sumB, _mm_slli_epi32(previous, 5));
+
+        sumA = _mm_add_epi32(sumA, _mm_shuffle_epi32(sumA, 0xB1));
+        sumA = _mm_add_epi32(sumA, _mm_shuffle_epi32(sumA, 0x4E));
+        sumB = _mm_add_epi32(sumB, _mm_shuffle_epi32(sumB, 0xB1));
+        sumB = _mm_add_epi32(sumB, _mm_shuffle_epi32(sumB, 0x4E));
+        a = (a + static_cast<uint32_t>(_mm_cvtsi128_si32(sumA))) % AdlerBase;
+        b = static_cast<uint32_t>(_mm_cvtsi128_si32(sumB)) % AdlerBase;
+    }
+    return Adler32Scalar(p, size, (b << 16) | a);
+}
+#endif
+
+static uint64_t BenchAdler32(uint32_t (*fn)(const void*, size_t, uint32_t), const uint8_t* input,
+                             size_t size, std::vector<uint8_t>&)
+{
+    uint64_t digest = fn(input, size, 1);
+    for (size_t n = 0; n < 200; n++)
+        digest = digest * 31 + fn(input + n, n * 37 + 1, static_cast<uint32_t>(n * 0x10001));
+    return digest;
+}
+
+static const TChecksumKernel::TVariant Adler32Variants[] = {
+    {clScalar, Adler32Scalar},
+#ifdef CPU_X86
+    {clSsse3, Adler32Ssse3},
+#endif
+};
+static TChecksumKernel Adler32Kernel("adler32", Adler32Variants, BenchAdler32);
+
+/*
+ * Adler-32
+ */
+uint32_t Adler32(const void* data, size_t size, uint32_t adler)
+{
+    return Adler32Kernel.Get()(data, size, adler);
+}
+//---------------------------------------------------------------------------
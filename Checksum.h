@@ -0,0 +1,31 @@
+﻿/*
+ * Checksum.h - CRC-32 And Adler-32
+ *
+ * Declares the checksums used by the pack writers: CRC-32 (ZIP entries,
+ * PNG chunks) and Adler-32 (zlib streams inside PNG IDAT data).
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef ChecksumH
+#define ChecksumH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+
+//---------------------------------------------------------------------------
+
+// CRC-32 (ISO 3309, as used by ZIP and PNG). Pass the previous result as
+// `crc` to continue a running checksum; start with 0
+uint32_t Crc32(const void* data, size_t size, uint32_t crc = 0);
+
+// CRC-32 of two concatenated blocks from the CRCs of each block and the
+// length of the second one, without touching the data (zlib's crc32_combine)
+uint32_t Crc32Combine(uint32_t crc1, uint32_t crc2, uint64_t length2);
+
+// Adler-32 (RFC 1950). Start with 1
+uint32_t Adler32(const void* data, size_t size, uint32_t adler = 1);
+
+//---------------------------------------------------------------------------
+#endif // ChecksumH
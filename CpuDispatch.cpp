@@ -0,0 +1,273 @@
+﻿/*
+ * CpuDispatch.cpp - Runtime CPU Feature Dispatch
+ *
+ * Implements the cpuid probe, the tier override and the kernel registry
+ * with its side-by-side benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "CpuDispatch.h"
+#include "PerfCounters.h"         // TPerfCounters for the perf columns
+
+#include <chrono>
+#include <cstdlib>                // getenv
+#include <iomanip>
+#include <memory>
+#include <random>
+
+#if defined(CPU_X86) && defined(_MSC_VER)
+#include <intrin.h>               // __cpuidex, _xgetbv
+#elif defined(CPU_X86)
+#include <cpuid.h>                // __cpuid_count
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const char* const LevelNames[CpuLevelCount] = {"scalar", "sse2", "ssse3", "sse41", "avx2"};
+
+static const size_t BenchBytes = 1 << 20;
+static const double BenchSeconds = 0.2;     // Minimum timed run per variant
+//---------------------------------------------------------------------------
+
+/*
+ * CPU Probe
+ * Leaf 1 has SSE2 to SSE4.1, PCLMULQDQ, OSXSAVE and AVX; leaf 7 has AVX2.
+ * AVX2 is only usable if the OS saves the YMM registers (XCR0 bits 1-2).
+ */
+#ifdef CPU_X86
+static void CpuId(unsigned leaf, unsigned subleaf, unsigned regs[4])
+{
+#ifdef _MSC_VER
+    int r[4];
+    __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; i++)
+        regs[i] = static_cast<unsigned>(r[i]);
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+static uint64_t ReadXcr0()
+{
+#ifdef _MSC_VER
+    return _xgetbv(0);
+#else
+    unsigned lo, hi;
+    __asm__ volatile("xgetbv" : "=a"(lo), "=d"(hi) : "c"(0));
+    return (static_cast<uint64_t>(hi) << 32) | lo;
+#endif
+}
+#endif
+
+static TCpuLevel ProbeCpuLevel()
+{
+#ifdef CPU_X86
+    unsigned regs[4];
+    CpuId(0, 0, regs);
+    unsigned maxLeaf = regs[0];
+    CpuId(1, 0, regs);
+    unsigned ecx = regs[2], edx = regs[3];
+
+    if (!(edx & (1u << 26)))
+        return clScalar;
+    if (!(ecx & (1u << 9)))
+        return clSse2;
+    if (!(ecx & (1u << 19)) || !(ecx & (1u << 1)))
+        return clSsse3;
+
+    bool osAvx = (ecx & (1u << 27)) && (ecx & (1u << 28)) && (ReadXcr0() & 6) == 6;
+    if (!osAvx || maxLeaf < 7)
+        return clSse41;
+    CpuId(7, 0, regs);
+    return (regs[1] & (1u << 5)) ? clAvx2 : clSse41;
+#else
+    return clScalar;
+#endif
+}
+
+TCpuLevel DetectCpuLevel()
+{
+    static const TCpuLevel level = ProbeCpuLevel();
+    return level;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Tier Override
+ * ZIP_SIMD is read once, before the first kernel binds.
+ */
+static TCpuLevel InitialLevel()
+{
+    TCpuLevel level = DetectCpuLevel();
+    const char* env = getenv("ZIP_SIMD");
+    TCpuLevel limit;
+    if (env != nullptr && ParseCpuLevel(env, limit) && limit < level)
+        level = limit;
+    return level;
+}
+
+static std::atomic<int>& ActiveLevel()
+{
+    static std::atomic<int> level(InitialLevel());
+    return level;
+}
+
+TCpuLevel ActiveCpuLevel()
+{
+    return static_cast<TCpuLevel>(ActiveLevel().load(std::memory_order_relaxed));
+}
+
+void LimitCpuLevel(TCpuLevel level)
+{
+    if (level > DetectCpuLevel())
+        level = DetectCpuLevel();
+    ActiveLevel().store(level, std::memory_order_relaxed);
+
+    const std::vector<TKernelSlot*>& kernels = KernelRegistry();
+    for (size_t i = 0; i < kernels.size(); i++)
+        kernels[i]->Bind(level);
+}
+
+const char* CpuLevelName(TCpuLevel level)
+{
+    return LevelNames[level];
+}
+
+bool ParseCpuLevel(const std::string& name, TCpuLevel& level)
+{
+    for (unsigned i = 0; i < CpuLevelCount; i++) {
+        if (name == LevelNames[i]) {
+            level = static_cast<TCpuLevel>(i);
+            return true;
+        }
+    }
+    return false;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Kernel Registry
+ * A function-local static, so kernels in any unit can register during
+ * static initialisation regardless of unit order.
+ */
+static std::vector<TKernelSlot*>& Registry()
+{
+    static std::vector<TKernelSlot*> kernels;
+    return kernels;
+}
+
+TKernelSlot::TKernelSlot(const char* name) : name(name)
+{
+    Registry().push_back(this);
+}
+
+const std::vector<TKernelSlot*>& KernelRegistry()
+{
+    return Registry();
+}
+
+void PrintKernels(std::ostream& out)
+{
+    out << "CPU tier: " << CpuLevelName(DetectCpuLevel()) << ", active: "
+        << CpuLevelName(ActiveCpuLevel()) << "\n";
+
+    const std::vector<TKernelSlot*>& kernels = KernelRegistry();
+    for (size_t i = 0; i < kernels.size(); i++) {
+        out << std::left << std::setw(16) << kernels[i]->Name() << std::right
+            << CpuLevelName(kernels[i]->BoundLevel()) << "  (";
+        for (size_t v = 0; v < kernels[i]->VariantCount(); v++)
+            out << (v > 0 ? " " : "") << CpuLevelName(kernels[i]->VariantLevel(v));
+        out << ")\n";
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Kernel Benchmark
+ * Every variant runs on the same random input until BenchSeconds have
+ * passed; throughput is input bytes per second. Variants above the
+ * detected tier are listed but skipped, and the bound one is marked.
+ * Hardware counters cover the same timed runs.
+ */
+bool RunKernelBench(std::ostream& out, bool perf)
+{
+    std::unique_ptr<TPerfCounters> counters;
+    if (perf) {
+        counters.reset(new TPerfCounters());
+        if (!counters->Available()) {
+            out << "Hardware counters unavailable: " << counters->Error() << "\n";
+            counters.reset();
+        }
+    }
+
+    std::vector<uint8_t> input(BenchBytes);
+    std::mt19937 random(1);
+    for (size_t i = 0; i < input.size(); i++)
+        input[i] = static_cast<uint8_t>(random() >> 24);
+    std::vector<uint8_t> work;
+
+    out << "CPU tier: " << CpuLevelName(DetectCpuLevel()) << ", active: "
+        << CpuLevelName(ActiveCpuLevel()) << "\n"
+        << std::left << std::setw(16) << "kernel" << std::setw(9) << "variant" << std::right
+        << std::setw(10) << "MB/s" << std::setw(9) << "speedup";
+    if (counters)
+        WritePerfHeader(out, "B");
+    out << "  result" << std::endl;
+
+    bool allMatch = true;
+    const std::vector<TKernelSlot*>& kernels = KernelRegistry();
+    for (size_t k = 0; k < kernels.size(); k++) {
+        const TKernelSlot* kernel = kernels[k];
+        uint64_t reference = 0;
+        double baseline = 0;
+        for (size_t v = 0; v < kernel->VariantCount(); v++) {
+            TCpuLevel level = kernel->VariantLevel(v);
+            out << std::left << std::setw(16) << kernel->Name()
+                << std::setw(9) << (std::string(CpuLevelName(level)) +
+                                     (level == kernel->BoundLevel() ? "*" : ""))
+                << std::right;
+            if (level > DetectCpuLevel()) {
+                out << std::setw(10) << "-" << std::setw(9) << "-";
+                if (counters)
+                    WritePerfColumns(out, TPerfSample(), 0);
+                out << "  unsupported" << std::endl;
+                continue;
+            }
+
+            uint64_t digest = kernel->Run(v, input.data(), input.size(), work);
+            unsigned runs = 0;
+            if (counters)
+                counters->Start();
+            TClock::time_point start = TClock::now();
+            double seconds;
+            do {
+                kernel->Run(v, input.data(), input.size(), work);
+                runs++;
+                seconds = std::chrono::duration<double>(TClock::now() - start).count();
+            } while (seconds < BenchSeconds);
+            TPerfSample sample;
+            if (counters)
+                sample = counters->Stop();
+            double mbps = input.size() / 1048576.0 * runs / seconds;
+
+            if (v == 0) {
+                reference = digest;
+                baseline = mbps;
+            }
+            bool match = digest == reference;
+            allMatch = allMatch && match;
+            out << std::fixed << std::setprecision(1) << std::setw(10) << mbps
+                << std::setprecision(2) << std::setw(8) << mbps / baseline << "x";
+            if (counters)
+                WritePerfColumns(out, sample, static_cast<double>(input.size()) * runs);
+            out << (match ? "  ok" : "  MISMATCH") << std::endl;
+        }
+    }
+    return allMatch;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,174 @@
+﻿/*
+ * CpuDispatch.h - Runtime CPU Feature Dispatch
+ *
+ * Declares the SIMD kernel registry. The CPU is probed once with cpuid and
+ * mapped to one of a few cumulative instruction set tiers; every kernel
+ * that has SIMD variants (CRC-32, Adler-32, PNG unfiltering, pixel
+ * conversion) registers them here and is bound to the best variant the
+ * machine supports. Callers go through the bound pointer and never test
+ * features themselves.
+ *
+ * The tier can be capped to test the lower variants on a fast machine:
+ * set ZIP_SIMD=scalar|sse2|ssse3|sse41|avx2 in the environment, or call
+ * LimitCpuLevel() before any decoding starts. "Zip.exe --pack kernels
+ * bench" times every variant of every kernel side by side and checks that
+ * they all produce the same result.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef CpuDispatchH
+#define CpuDispatchH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+#if defined(_M_X64) || defined(__x86_64__) || defined(_M_IX86) || defined(__i386__)
+#define CPU_X86
+#endif
+
+// Lets one function use instructions above the compiler's baseline
+#if defined(__GNUC__) || defined(__clang__)
+#define CPU_TARGET(features) __attribute__((target(features)))
+#else
+#define CPU_TARGET(features)
+#endif
+
+/*
+ * TCpuLevel - Instruction Set Tiers
+ * Each tier includes the ones below it. clSse41 also requires PCLMULQDQ
+ * (every SSE4.1 CPU since Westmere and Silvermont has it); clAvx2 also
+ * requires the OS to save AVX state.
+ */
+enum TCpuLevel { clScalar, clSse2, clSsse3, clSse41, clAvx2 };
+const unsigned CpuLevelCount = 5;
+
+// Highest tier of this CPU (cpuid runs on the first call only)
+TCpuLevel DetectCpuLevel();
+
+// Tier kernels are currently bound for: the detected one, capped by
+// ZIP_SIMD and LimitCpuLevel()
+TCpuLevel ActiveCpuLevel();
+
+// Caps the tier and rebinds every kernel. Not synchronised with running
+// kernels: call it before worker threads start decoding
+void LimitCpuLevel(TCpuLevel level);
+
+// "scalar", "sse2", "ssse3", "sse41", "avx2"
+const char* CpuLevelName(TCpuLevel level);
+bool ParseCpuLevel(const std::string& name, TCpuLevel& level);
+
+//---------------------------------------------------------------------------
+
+/*
+ * TKernelSlot - Registry Entry
+ *
+ * The type-independent face of a TKernel, used to list, rebind and
+ * benchmark kernels. Slots register themselves on construction and live
+ * for the whole program (they are namespace-scope statics).
+ */
+class TKernelSlot
+{
+  public:
+    const char* Name() const { return name; }
+
+    virtual size_t VariantCount() const = 0;
+    virtual TCpuLevel VariantLevel(size_t variant) const = 0;
+    virtual TCpuLevel BoundLevel() const = 0;
+    virtual void Bind(TCpuLevel limit) = 0;
+
+    // Runs one variant over `input` for the benchmark; returns a digest of
+    // the result that must be equal for all variants
+    virtual uint64_t Run(size_t variant, const uint8_t* input, size_t size,
+                         std::vector<uint8_t>& work) const = 0;
+
+  protected:
+    explicit TKernelSlot(const char* name);
+    virtual ~TKernelSlot() {}
+
+  private:
+    const char* name;
+
+    TKernelSlot(const TKernelSlot&);
+    TKernelSlot& operator=(const TKernelSlot&);
+};
+
+/*
+ * TKernel - One Dispatched Kernel
+ *
+ * `Fn` is usually a function pointer, but any trivially copyable handle
+ * works (the PNG unfilter kernel binds a whole table). Variants are listed
+ * in ascending tier order; only those compiled for this target appear.
+ */
+template <typename Fn>
+class TKernel : public TKernelSlot
+{
+  public:
+    struct TVariant
+    {
+        TCpuLevel level;
+        Fn fn;
+    };
+
+    // Benchmark driver: runs `fn` on the input, returns a result digest
+    typedef uint64_t (*TBenchFn)(Fn fn, const uint8_t* input, size_t size, std::vector<uint8_t>& work);
+
+    template <size_t N>
+    TKernel(const char* name, const TVariant (&variants)[N], TBenchFn bench)
+        : TKernelSlot(name), variants(variants), count(N), bench(bench), bound(0)
+    {
+        Bind(ActiveCpuLevel());
+    }
+
+    // The bound variant (hot path: one relaxed load)
+    Fn Get() const { return variants[bound.load(std::memory_order_relaxed)].fn; }
+
+    size_t VariantCount() const override { return count; }
+    TCpuLevel VariantLevel(size_t variant) const override { return variants[variant].level; }
+    TCpuLevel BoundLevel() const override { return variants[bound.load(std::memory_order_relaxed)].level; }
+
+    void Bind(TCpuLevel limit) override
+    {
+        size_t best = 0;
+        for (size_t i = 0; i < count; i++) {
+            if (variants[i].level <= limit)
+                best = i;
+        }
+        bound.store(best, std::memory_order_relaxed);
+    }
+
+    uint64_t Run(size_t variant, const uint8_t* input, size_t size,
+                 std::vector<uint8_t>& work) const override
+    {
+        return bench(variants[variant].fn, input, size, work);
+    }
+
+  private:
+    const TVariant* variants;
+    size_t count;
+    TBenchFn bench;
+    std::atomic<size_t> bound;
+};
+
+//---------------------------------------------------------------------------
+
+// Every registered kernel, in registration order
+const std::vector<TKernelSlot*>& KernelRegistry();
+
+// Prints the detected and active tiers and each kernel's bound variant
+void PrintKernels(std::ostream& out);
+
+// Times every variant this CPU supports, side by side, on 1 MB of data,
+// with hardware counters per byte if `perf` is set (see PerfCounters.h);
+// returns false if any variant disagreed with the scalar one
+bool RunKernelBench(std::ostream& out, bool perf = false);
+
+//---------------------------------------------------------------------------
+#endif // CpuDispatchH
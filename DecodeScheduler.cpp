@@ -0,0 +1,669 @@
+﻿/*
+ * DecodeScheduler.cpp - Priority-Aware Flag Decoding
+ *
+ * Implements request deduplication and promotion, the claim that lets a
+ * waiting thread run a queued job itself, and the click latency benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "DecodeScheduler.h"
+#include "ImageCache.h"           // TImageCache
+#include "Metrics.h"              // MetricCounter, MetricHistogram, SamplePercentile
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <thread>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+/*
+ * TFormatSink - Decodes Into One Buffer Of The Image's Format
+ * BGRA and palette indices go straight into the image. Other formats
+ * are decoded into one BGRA row, converted when the decoder asks for the
+ * next one, and once more by Finish(). Interlaced images revisit their
+ * rows in every pass, so those are staged whole and converted at the end.
+ */
+class TFormatSink : public TImageSink
+{
+  public:
+    TFormatSink(TDecodedImage& image, bool direct, uint32_t matte)
+        : image(image), direct(direct), matte(matte), stride(0), pending(-1)
+    {
+    }
+
+    void Begin(const TPngInfo& info) override
+    {
+        stride = image.Stride();
+        image.pixels.resize(stride * info.height);
+        if (!direct)
+            staging.resize(static_cast<size_t>(info.width) * (info.interlace ? info.height : 1));
+    }
+
+    uint8_t* Row(uint32_t y) override
+    {
+        if (direct)
+            return image.pixels.data() + y * stride;
+        if (image.info.interlace) {
+            size_t offset = static_cast<size_t>(y) * image.info.width;
+            return reinterpret_cast<uint8_t*>(staging.data() + offset);
+        }
+        Finish();
+        pending = y;
+        return reinterpret_cast<uint8_t*>(staging.data());
+    }
+
+    void Finish()
+    {
+        if (direct)
+            return;
+        if (image.info.interlace) {
+            for (uint32_t y = 0; y < image.info.height; y++)
+                Convert(y, staging.data() + static_cast<size_t>(y) * image.info.width);
+        } else if (pending >= 0) {
+            Convert(static_cast<uint32_t>(pending), staging.data());
+            pending = -1;
+        }
+    }
+
+  private:
+    TDecodedImage& image;
+    bool direct;
+    uint32_t matte;
+    size_t stride;
+    std::vector<uint32_t> staging;
+    int64_t pending;                // Row waiting in staging; -1 if none
+
+    void Convert(uint32_t y, const uint32_t* row)
+    {
+        ConvertBgraRow(image.format, row, image.info.width, y, matte,
+                       image.pixels.data() + y * stride);
+    }
+};
+
+/*
+ * Decode One Entry
+ * Palette PNGs decoded to ifIndexed8 keep their own palette, blended onto
+ * the matte; everything else is converted from BGRA, onto the colour
+ * cube for ifIndexed8.
+ */
+void DecodePngEntry(const TPackVolumeSet& pack, size_t entry, TDecodedImage& image,
+                    const TCancelToken* cancel, const TImageOutput& output)
+{
+    std::unique_ptr<TByteSource> source = pack.OpenEntry(entry);
+    TPngDecoder decoder(source.get());
+    decoder.SetCancelToken(cancel);
+    image.info = decoder.ReadHeader();
+    image.format = output.format;
+    image.palette.clear();
+
+    bool indices = output.format == ifIndexed8 && image.info.colorType == 3;
+    if (indices) {
+        decoder.SetIndexOutput(true);
+        image.palette.assign(decoder.Palette(), decoder.Palette() + (1u << image.info.bitDepth));
+        for (size_t i = 0; i < image.palette.size(); i++)
+            image.palette[i] = BlendOnMatte(image.palette[i], output.matte);
+    } else if (output.format == ifIndexed8) {
+        CubePalette(image.palette);
+    }
+    TFormatSink sink(image, output.format == ifBgra32 || indices, output.matte);
+    decoder.Decode(&sink);
+    sink.Finish();
+
+    // The decoder stops at the end of the image data; reading on to the
+    // end of the entry is what checks its CRC-32
+    const uint8_t* rest;
+    size_t restSize;
+    while (source->Next(rest, restSize)) {
+    }
+}
+//---------------------------------------------------------------------------
+
+enum TDecodeState { dsQueued, dsRunning, dsDone };
+
+/*
+ * Process-Wide Decode Metrics
+ * The same events as TDecodeStats, summed over every scheduler.
+ */
+struct TDecodeMetrics
+{
+    TCounter& requests;
+    TCounter& reused;
+    TCounter& completed;
+    TCounter& failed;
+    TCounter& cancelled;
+    TCounter& expired;
+    THistogram& wasted;
+    THistogram& wait;
+
+    TDecodeMetrics()
+        : requests(MetricCounter("zip_decode_requests_total", "Decode requests made to a scheduler")),
+          reused(MetricCounter("zip_decode_reused_total", "Requests that joined an existing decode")),
+          completed(MetricCounter("zip_decode_completed_total", "Scheduled decodes that delivered an image")),
+          failed(MetricCounter("zip_decode_failed_total", "Scheduled decodes stopped by a decode error")),
+          cancelled(MetricCounter("zip_decode_cancelled_total",
+                                    "Decodes stopped part way because they were abandoned")),
+          expired(MetricCounter("zip_decode_expired_total", "Decodes stopped part way by their deadline")),
+          wasted(MetricHistogram("zip_decode_wasted_seconds", "Decode time spent before a cancellation")),
+          wait(MetricHistogram("zip_decode_wait_seconds", "Time from waiting on a decode to having its image"))
+    {
+    }
+};
+
+static TDecodeMetrics& DecodeMetrics()
+{
+    static TDecodeMetrics metrics;
+    return metrics;
+}
+
+/*
+ * TDecodeWork - State Of One Decode
+ * Shared by the job handles and the tasks queued for it, so it outlives
+ * the last handle while a task still has to notice the cancellation.
+ */
+struct TDecodeWork
+{
+    size_t entry;
+    std::atomic<int> state;             // TDecodeState
+    std::atomic<unsigned> priority;     // Best class it was requested at
+    TCancelToken cancel;
+    std::atomic<int64_t> cancelledAt;   // TClock ticks of Cancel(), 0 = not cancelled
+    std::mutex lock;                    // Guards image and error; signals done
+    std::condition_variable done;
+    std::shared_ptr<const TDecodedImage> image;
+    std::exception_ptr error;
+
+    TDecodeWork(size_t entry, TTaskPriority priority, const TCancelToken* parent)
+        : entry(entry), state(dsQueued), priority(priority), cancel(parent), cancelledAt(0)
+    {
+    }
+};
+
+static int64_t Ticks(TClock::time_point when)
+{
+    return static_cast<int64_t>(when.time_since_epoch().count());
+}
+
+static void Finish(TDecodeWork& work, const std::shared_ptr<const TDecodedImage>& image,
+                   std::exception_ptr error)
+{
+    std::lock_guard<std::mutex> guard(work.lock);
+    work.image = image;
+    work.error = error;
+    work.state.store(dsDone, std::memory_order_release);
+    work.done.notify_all();
+}
+
+// A job that stopped early, or is about to, is no good to a new requester
+static bool Reusable(TDecodeWork& work)
+{
+    if (!work.cancel.Cancelled())
+        return true;
+    std::lock_guard<std::mutex> guard(work.lock);
+    return work.image != nullptr;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Job Handles
+ * The last handle going away means nobody wants the image any more.
+ */
+TDecodeJob::TDecodeJob(const std::shared_ptr<TDecodeWork>& work) : work(work)
+{
+}
+
+TDecodeJob::~TDecodeJob()
+{
+    if (!Done())
+        Cancel();
+}
+
+size_t TDecodeJob::Entry() const
+{
+    return work->entry;
+}
+
+TTaskPriority TDecodeJob::Priority() const
+{
+    return static_cast<TTaskPriority>(work->priority.load());
+}
+
+bool TDecodeJob::Done() const
+{
+    return work->state.load(std::memory_order_acquire) == dsDone;
+}
+
+void TDecodeJob::Cancel()
+{
+    int64_t none = 0;
+    work->cancelledAt.compare_exchange_strong(none, Ticks(TClock::now()));
+    work->cancel.Cancel();
+}
+//---------------------------------------------------------------------------
+
+TDecodeScheduler::TDecodeScheduler(const TPackVolumeSet& pack, TTaskPool& pool, TImageCache* cache,
+                                   const TImageOutput& output)
+    : pack(pack), pool(pool), cache(cache), output(output), jobs(pack.Count()), requests(0),
+      reused(0), promoted(0), inlined(0), cached(0), completed(0), failed(0), cancelled(0),
+      expired(0), dropped(0), completedNs(0), wastedNs(0), maxStopNs(0), tasks(pool)
+{
+}
+
+TDecodeScheduler::~TDecodeScheduler()
+{
+    shutdown.Cancel();
+    try {
+        tasks.Wait();
+    } catch (...) {
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Request A Decode
+ * A job stays findable for as long as anyone holds it, so a click on the
+ * flag that was prefetched gets the decoded image, or joins the decode in
+ * progress, instead of starting another one. Joining can only relax the
+ * deadline: the work stops when the last requester would give up on it.
+ * A flag in the cache's hot tier gets a job that is done already.
+ */
+TDecodeJobPtr TDecodeScheduler::Request(size_t entry, TTaskPriority priority)
+{
+    return Enqueue(entry, priority, false, TClock::time_point());
+}
+
+TDecodeJobPtr TDecodeScheduler::Request(size_t entry, TTaskPriority priority,
+                                        TClock::time_point deadline)
+{
+    return Enqueue(entry, priority, true, deadline);
+}
+
+TDecodeJobPtr TDecodeScheduler::Enqueue(size_t entry, TTaskPriority priority, bool hasDeadline,
+                                        TClock::time_point deadline)
+{
+    if (entry >= jobs.size())
+        throw std::out_of_range("Pack entry out of range");
+    requests.fetch_add(1, std::memory_order_relaxed);
+    DecodeMetrics().requests.Add();
+
+    std::lock_guard<std::mutex> guard(lock);
+    TDecodeJobPtr job = jobs[entry].lock();
+    if (!job || !Reusable(*job->work)) {
+        std::shared_ptr<TDecodeWork> work(new TDecodeWork(entry, priority, &shutdown));
+        job.reset(new TDecodeJob(work));
+        jobs[entry] = job;
+        std::shared_ptr<const TDecodedImage> image = cache ? cache->FindHot(entry) : nullptr;
+        if (image) {
+            cached.fetch_add(1, std::memory_order_relaxed);
+            Finish(*work, image, nullptr);
+            return job;
+        }
+        if (hasDeadline)
+            work->cancel.SetDeadline(deadline);
+        Schedule(work, priority);
+        return job;
+    }
+
+    TDecodeWork& work = *job->work;
+    reused.fetch_add(1, std::memory_order_relaxed);
+    DecodeMetrics().reused.Add();
+    if (!hasDeadline)
+        work.cancel.ClearDeadline();
+    else if (work.cancel.HasDeadline() && deadline > work.cancel.Deadline())
+        work.cancel.SetDeadline(deadline);
+
+    unsigned current = work.priority.load();
+    if (static_cast<unsigned>(priority) < current &&
+        work.state.load(std::memory_order_acquire) == dsQueued &&
+        work.priority.compare_exchange_strong(current, priority)) {
+        promoted.fetch_add(1, std::memory_order_relaxed);
+        Schedule(job->work, priority);
+    }
+    return job;
+}
+
+/*
+ * Queue A Job
+ * A promoted job is queued twice; whichever copy claims it first runs it.
+ * A job cancelled while it sat in the queue finishes without decoding.
+ */
+void TDecodeScheduler::Schedule(const std::shared_ptr<TDecodeWork>& work, TTaskPriority priority)
+{
+    tasks.Spawn([this, work]() {
+        int queued = dsQueued;
+        if (!work->state.compare_exchange_strong(queued, dsRunning)) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        TCancelReason reason = work->cancel.Reason();
+        if (reason != crNone) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            Finish(*work, nullptr, std::make_exception_ptr(ECancelled(reason)));
+            return;
+        }
+        Execute(*work);
+    }, priority);
+}
+
+/*
+ * Run A Decode
+ * Time spent on a decode that was then cancelled is counted as wasted,
+ * together with how long it took to notice the cancellation. A cached
+ * image is decompressed rather than decoded; a decoded one is handed to
+ * the cache by a maintenance task, off the path of whoever waits for it.
+ * So is one read from the disk cache, to compress it and to keep it in
+ * the disk cache's active generation.
+ */
+void TDecodeScheduler::Execute(TDecodeWork& work)
+{
+    if (cache) {
+        std::shared_ptr<const TDecodedImage> found;
+        TCacheTier tier = ctNone;
+        try {
+            found = cache->Find(work.entry, &tier);
+        } catch (EDecodeError&) {
+        }
+        if (found) {
+            cached.fetch_add(1, std::memory_order_relaxed);
+            if (tier == ctDisk) {
+                size_t entry = work.entry;
+                tasks.Spawn([this, entry, found]() { cache->Insert(entry, found); }, tpMaintenance);
+            }
+            Finish(work, found, nullptr);
+            return;
+        }
+    }
+
+    TClock::time_point start = TClock::now();
+    std::shared_ptr<TDecodedImage> image;
+    std::exception_ptr error;
+    TCancelReason stopped = crNone;
+    try {
+        image = std::make_shared<TDecodedImage>();
+        DecodePngEntry(pack, work.entry, *image, &work.cancel, output);
+    } catch (ECancelled& e) {
+        error = std::current_exception();
+        stopped = e.Reason();
+    } catch (...) {
+        error = std::current_exception();
+    }
+    TClock::time_point end = TClock::now();
+    uint64_t ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count());
+
+    TDecodeMetrics& metrics = DecodeMetrics();
+    if (!error) {
+        completed.fetch_add(1, std::memory_order_relaxed);
+        completedNs.fetch_add(ns, std::memory_order_relaxed);
+        metrics.completed.Add();
+        if (cache) {
+            size_t entry = work.entry;
+            std::shared_ptr<const TDecodedImage> decoded = image;
+            tasks.Spawn([this, entry, decoded]() { cache->Insert(entry, decoded); }, tpMaintenance);
+        }
+    } else if (stopped == crNone) {
+        failed.fetch_add(1, std::memory_order_relaxed);
+        metrics.failed.Add();
+        image.reset();
+    } else {
+        (stopped == crDeadline ? expired : cancelled).fetch_add(1, std::memory_order_relaxed);
+        (stopped == crDeadline ? metrics.expired : metrics.cancelled).Add();
+        wastedNs.fetch_add(ns, std::memory_order_relaxed);
+        metrics.wasted.Record(ns);
+        image.reset();
+
+        int64_t since = stopped == crDeadline ? Ticks(work.cancel.Deadline()) : work.cancelledAt.load();
+        if (since != 0) {
+            uint64_t stopNs = static_cast<uint64_t>(std::max<int64_t>(
+                0, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       TClock::duration(Ticks(end) - since)).count()));
+            uint64_t seen = maxStopNs.load(std::memory_order_relaxed);
+            while (stopNs > seen && !maxStopNs.compare_exchange_weak(seen, stopNs)) {
+            }
+        }
+    }
+    Finish(work, image, error);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Wait For A Job
+ * A job still queued is claimed and decoded right here: the waiting thread
+ * would otherwise sit idle while the pool works through the classes above
+ * it. A job already running is waited for.
+ */
+std::shared_ptr<const TDecodedImage> TDecodeScheduler::Wait(const TDecodeJobPtr& job)
+{
+    TClock::time_point start = TClock::now();
+    TDecodeWork& work = *job->work;
+    int queued = dsQueued;
+    if (work.state.compare_exchange_strong(queued, dsRunning)) {
+        inlined.fetch_add(1, std::memory_order_relaxed);
+        Execute(work);
+    }
+
+    std::unique_lock<std::mutex> guard(work.lock);
+    work.done.wait(guard, [&work]() { return work.state.load(std::memory_order_acquire) == dsDone; });
+    DecodeMetrics().wait.RecordSince(start);
+    if (work.error)
+        std::rethrow_exception(work.error);
+    return work.image;
+}
+
+std::shared_ptr<const TDecodedImage> TDecodeScheduler::Decode(size_t entry)
+{
+    return Wait(Request(entry, tpInteractive));
+}
+
+/*
+ * Warm The Cache
+ * One maintenance task per entry, decoding straight into the compressed
+ * tier so the hot tier keeps what the user is actually looking at. An
+ * entry the disk cache holds is copied from there instead. A shutdown
+ * stops the remaining ones.
+ */
+void TDecodeScheduler::Warm(const std::vector<size_t>& entries)
+{
+    if (!cache)
+        return;
+    for (size_t i = 0; i < entries.size(); i++) {
+        size_t entry = entries[i];
+        tasks.Spawn([this, entry]() {
+            if (shutdown.Cancelled() || cache->Contains(entry) || cache->Restore(entry))
+                return;
+            std::shared_ptr<TDecodedImage> image = std::make_shared<TDecodedImage>();
+            try {
+                DecodePngEntry(pack, entry, *image, &shutdown, output);
+            } catch (std::exception&) {
+                return;         // Cancelled, or a broken entry a click will report
+            }
+            cache->Insert(entry, image, false);
+        }, tpMaintenance);
+    }
+}
+
+TDecodeStats TDecodeScheduler::Stats() const
+{
+    TDecodeStats stats;
+    stats.requests = requests.load(std::memory_order_relaxed);
+    stats.reused = reused.load(std::memory_order_relaxed);
+    stats.promoted = promoted.load(std::memory_order_relaxed);
+    stats.inlined = inlined.load(std::memory_order_relaxed);
+    stats.cached = cached.load(std::memory_order_relaxed);
+    stats.completed = completed.load(std::memory_order_relaxed);
+    stats.failed = failed.load(std::memory_order_relaxed);
+    stats.cancelled = cancelled.load(std::memory_order_relaxed);
+    stats.expired = expired.load(std::memory_order_relaxed);
+    stats.dropped = dropped.load(std::memory_order_relaxed);
+    stats.completedMs = completedNs.load(std::memory_order_relaxed) / 1e6;
+    stats.wastedMs = wastedNs.load(std::memory_order_relaxed) / 1e6;
+    stats.maxStopUs = maxStopNs.load(std::memory_order_relaxed) / 1e3;
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Click Latency Benchmark
+ *
+ * A click asks for a random flag and waits for its pixels; between clicks
+ * the "user" looks at the flag for ThinkTime. Three cases:
+ * - idle: nothing else runs
+ * - loaded: every worker is kept busy decoding at tpMaintenance
+ * - prefetch: the same load, and after each click the next flag is
+ *   requested at tpPrefetch, then promoted when it is clicked
+ * Without the background reserve the loaded case waits for a maintenance
+ * decode to finish before the click can even start.
+ *
+ * The scroll case then moves a gallery of GalleryPage thumbnails one page
+ * every ScrollStep, far faster than they decode; each page is requested
+ * at tpVisible with a deadline and dropped by the next one. Only the last
+ * page is waited for. Ideally the wasted time is close to zero.
+ */
+static const std::chrono::milliseconds ThinkTime(20);
+static const std::chrono::milliseconds ScrollStep(2);
+static const std::chrono::milliseconds ScrollDeadline(50);
+static const unsigned GalleryPage = 8;
+
+/*
+ * TBackgroundLoad - Keeps The Pool Busy With Maintenance Decodes
+ * Two chains per worker, each decoding one entry and then queueing its
+ * successor, so there is always more background work than threads.
+ */
+class TBackgroundLoad
+{
+  public:
+    TBackgroundLoad(const TPackVolumeSet& pack, const std::vector<size_t>& entries, TTaskPool& pool)
+        : pack(pack), entries(entries), group(pool), stopping(false), next(0), completed(0)
+    {
+        for (unsigned i = 0; i < pool.Workers() * 2; i++)
+            Queue();
+    }
+
+    ~TBackgroundLoad()
+    {
+        stopping.store(true);
+        try {
+            group.Wait();
+        } catch (...) {
+        }
+    }
+
+    uint64_t Completed() const { return completed.load(); }
+
+  private:
+    const TPackVolumeSet& pack;
+    const std::vector<size_t>& entries;
+    TTaskGroup group;
+    std::atomic<bool> stopping;
+    std::atomic<size_t> next;
+    std::atomic<uint64_t> completed;
+
+    void Queue()
+    {
+        group.Spawn([this]() {
+            if (stopping.load())
+                return;
+            TDecodedImage image;
+            DecodePngEntry(pack, entries[next.fetch_add(7) % entries.size()], image);
+            completed.fetch_add(1);
+            Queue();
+        }, tpMaintenance);
+    }
+};
+
+void RunLatencyBench(const TPackVolumeSet& pack, unsigned clicks, std::ostream& out)
+{
+    std::vector<size_t> entries = PngEntries(pack);
+    if (entries.empty())
+        throw std::runtime_error("Pack has no PNG entries");
+    clicks = std::max(clicks, 1u);
+
+    TTaskPool& pool = TTaskPool::Shared();
+    out << "Workers: " << pool.Workers() << ", background limit " << pool.BackgroundLimit()
+        << ", " << clicks << " clicks per case\n"
+        << std::left << std::setw(10) << "case" << std::right << std::setw(10) << "p50 ms"
+        << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << std::setw(12)
+        << "background" << "\n";
+
+    static const char* const names[] = {"idle", "loaded", "prefetch"};
+    for (unsigned c = 0; c < 3; c++) {
+        TDecodeScheduler scheduler(pack, pool);
+        std::unique_ptr<TBackgroundLoad> load;
+        if (c > 0)
+            load.reset(new TBackgroundLoad(pack, entries, pool));
+
+        uint32_t random = 2463534242u;
+        std::vector<double> samples;
+        TDecodeJobPtr prefetched;
+        for (unsigned i = 0; i < clicks; i++) {
+            random ^= random << 13;
+            random ^= random >> 17;
+            random ^= random << 5;
+            size_t entry = entries[random % entries.size()];
+            if (prefetched)
+                entry = prefetched->Entry();
+
+            std::this_thread::sleep_for(ThinkTime);
+            TClock::time_point start = TClock::now();
+            scheduler.Wait(scheduler.Request(entry, tpInteractive));
+            samples.push_back(std::chrono::duration<double, std::milli>(TClock::now() - start).count());
+
+            if (c == 2)
+                prefetched = scheduler.Request(entries[(random >> 8) % entries.size()], tpPrefetch);
+        }
+        uint64_t background = load ? load->Completed() : 0;
+        load.reset();
+
+        out << std::left << std::setw(10) << names[c] << std::right << std::fixed
+            << std::setprecision(2) << std::setw(10) << SamplePercentile(samples, 0.5)
+            << std::setw(10) << SamplePercentile(samples, 0.99) << std::setw(10)
+            << SamplePercentile(samples, 1.0)
+            << std::setw(12) << background << "\n";
+        if (c == 2) {
+            TDecodeStats stats = scheduler.Stats();
+            out << "Scheduler: " << stats.requests << " requests, " << stats.reused << " reused, "
+                << stats.promoted << " promoted, " << stats.inlined << " run by the waiter, "
+                << stats.completed << " completed, " << stats.dropped << " dropped\n";
+        }
+    }
+
+    TDecodeStats stats;
+    TClock::time_point start = TClock::now();
+    {
+        TDecodeScheduler scheduler(pack, pool);
+        std::vector<TDecodeJobPtr> page;
+        for (unsigned step = 0; step < clicks; step++) {
+            std::vector<TDecodeJobPtr> next;
+            TClock::time_point deadline = TClock::now() + ScrollDeadline;
+            for (unsigned i = 0; i < GalleryPage; i++)
+                next.push_back(scheduler.Request(entries[(step * GalleryPage + i) % entries.size()],
+                                                 tpVisible, deadline));
+            page.swap(next);        // The previous page scrolls out of view
+            next.clear();
+            std::this_thread::sleep_for(ScrollStep);
+        }
+        for (size_t i = 0; i < page.size(); i++) {
+            try {
+                scheduler.Wait(page[i]);
+            } catch (ECancelled&) {
+            }
+        }
+        stats = scheduler.Stats();
+    }
+    double wallMs = std::chrono::duration<double, std::milli>(TClock::now() - start).count();
+    out << "Scroll: " << clicks << " pages of " << GalleryPage << " in " << wallMs << " ms: "
+        << stats.completed << " completed (" << stats.completedMs << " ms), " << stats.cancelled
+        << " cancelled, " << stats.expired << " expired (" << stats.wastedMs << " ms wasted), "
+        << stats.dropped << " dropped unstarted, slowest stop " << stats.maxStopUs << " us\n";
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,206 @@
+﻿/*
+ * DecodeScheduler.h - Priority-Aware Flag Decoding
+ *
+ * Declares the scheduler the viewer decodes flags through. Every request
+ * carries a TTaskPriority class: a click is tpInteractive, the flag about
+ * to be shown next is tpPrefetch, bulk jobs run as tpMaintenance. The task
+ * pool keeps one worker clear of the background classes, and on top of
+ * that the scheduler makes sure the same flag is never decoded twice:
+ *
+ * - A request for a flag that is already queued, running or decoded (and
+ *   still held by someone) returns the existing job
+ * - If that job is still queued at a lower class it is promoted: queued
+ *   again at the new class, and the stale copy turns into a no-op
+ * - Wait() on a job nobody has started runs it on the waiting thread, so
+ *   a click never sits behind queued prefetch work
+ * - When the last holder of a job lets go, the job is cancelled: a queued
+ *   one is skipped, a running one stops at the next scanline
+ * - A job can carry a deadline; past it the decode stops the same way
+ * - With a TImageCache (ImageCache.h) a flag in its hot tier is returned
+ *   at once, one in its compressed tier or its disk cache is copied out
+ *   instead of decoded, and every fresh decode is added to it in the
+ *   background
+ * - Flags come out in the scheduler's pixel format (PixelFormat.h),
+ *   converted row by row as they are decoded, so a small format never
+ *   holds a whole BGRA copy of the image
+ *
+ * "Zip.exe --pack latency" measures click latency with and without a full
+ * background load, and the CPU time spent on work nobody wanted.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef DecodeSchedulerH
+#define DecodeSchedulerH
+//---------------------------------------------------------------------------
+
+#include "CancelToken.h"          // TCancelToken, ECancelled
+#include "PackVolumes.h"          // TPackVolumeSet
+#include "PixelFormat.h"          // TImageFormat, TImageOutput
+#include "PngDecode.h"            // TPngInfo
+#include "TaskPool.h"             // TTaskPool, TTaskGroup, TTaskPriority
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+class TImageCache;
+
+/*
+ * TDecodedImage - One Decoded Flag
+ */
+struct TDecodedImage
+{
+    TPngInfo info;
+    TImageFormat format;
+    std::vector<uint8_t> pixels;    // Rows top-down, Stride() bytes each; BGRA is straight alpha
+    std::vector<uint32_t> palette;  // ifIndexed8: the BGRA colour of each index
+
+    TDecodedImage() : format(ifBgra32) {}
+
+    size_t Stride() const { return static_cast<size_t>(info.width) * ImageFormatBytes(format); }
+    size_t Bytes() const { return pixels.size() + palette.size() * sizeof(uint32_t); }
+};
+
+struct TDecodeWork;
+
+/*
+ * TDecodeJob - Shared Handle To One Decode
+ * Held by everyone who requested the entry; the decoded image lives as
+ * long as the last handle, and dropping the last handle before the decode
+ * has finished cancels it.
+ */
+class TDecodeJob
+{
+  public:
+    ~TDecodeJob();
+
+    size_t Entry() const;
+    TTaskPriority Priority() const;
+    bool Done() const;
+
+    // Stops the decode for every holder; Wait() then throws ECancelled
+    void Cancel();
+
+  private:
+    friend class TDecodeScheduler;
+
+    std::shared_ptr<TDecodeWork> work;  // Also held by the task running it
+
+    explicit TDecodeJob(const std::shared_ptr<TDecodeWork>& work);
+
+    TDecodeJob(const TDecodeJob&);
+    TDecodeJob& operator=(const TDecodeJob&);
+};
+
+typedef std::shared_ptr<TDecodeJob> TDecodeJobPtr;
+
+/*
+ * TDecodeStats - Scheduler Counters Since Start
+ */
+struct TDecodeStats
+{
+    uint64_t requests;
+    uint64_t reused;                // Joined a job already queued, running or done
+    uint64_t promoted;              // Of those, queued again at a higher class
+    uint64_t inlined;               // Run by the thread waiting for it
+    uint64_t cached;                // Served from the image cache instead of decoded
+    uint64_t completed;             // Decodes that delivered an image
+    uint64_t failed;                // Stopped by a decode error
+    uint64_t cancelled;             // Stopped part way: cancelled or abandoned
+    uint64_t expired;               // Stopped part way: deadline passed
+    uint64_t dropped;               // Queued tasks skipped: stale, cancelled or expired
+    double completedMs;             // Decode time of the completed ones
+    double wastedMs;                // Decode time thrown away by cancelled and expired ones
+    double maxStopUs;               // Longest time from cancel to the decode stopping
+};
+
+/*
+ * TDecodeScheduler - Deduplicating, Promoting Decode Queue
+ * The pack and the cache, if any, must outlive the scheduler. The
+ * destructor cancels queued and running decodes and waits for them to stop.
+ */
+class TDecodeScheduler
+{
+  public:
+    explicit TDecodeScheduler(const TPackVolumeSet& pack, TTaskPool& pool = TTaskPool::Shared(),
+                              TImageCache* cache = nullptr,
+                              const TImageOutput& output = TImageOutput());
+    ~TDecodeScheduler();
+
+    // Starts decoding `entry` at `priority`, or joins the job already there.
+    // With a deadline the decode stops once it passes, unless another
+    // requester wants it for longer (the latest deadline applies)
+    TDecodeJobPtr Request(size_t entry, TTaskPriority priority);
+    TDecodeJobPtr Request(size_t entry, TTaskPriority priority,
+                          TCancelToken::TClock::time_point deadline);
+
+    // Result of `job`, running it here if it has not started; rethrows the
+    // decode error
+    std::shared_ptr<const TDecodedImage> Wait(const TDecodeJobPtr& job);
+
+    // Request() and Wait() in one, at tpInteractive
+    std::shared_ptr<const TDecodedImage> Decode(size_t entry);
+
+    // Decodes the listed entries the cache does not hold yet into its
+    // compressed tier, or restores them from its disk cache, at
+    // tpMaintenance; nothing without a cache
+    void Warm(const std::vector<size_t>& entries);
+
+    TDecodeStats Stats() const;
+    const TImageOutput& Output() const { return output; }
+
+  private:
+    const TPackVolumeSet& pack;
+    TTaskPool& pool;
+    TImageCache* cache;
+    TImageOutput output;
+    TCancelToken shutdown;                      // Parent of every job's token
+    std::mutex lock;                            // Guards jobs
+    std::vector<std::weak_ptr<TDecodeJob> > jobs;   // Per pack entry
+
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> reused;
+    std::atomic<uint64_t> promoted;
+    std::atomic<uint64_t> inlined;
+    std::atomic<uint64_t> cached;
+    std::atomic<uint64_t> completed;
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> cancelled;
+    std::atomic<uint64_t> expired;
+    std::atomic<uint64_t> dropped;
+    std::atomic<uint64_t> completedNs;
+    std::atomic<uint64_t> wastedNs;
+    std::atomic<uint64_t> maxStopNs;
+
+    TTaskGroup tasks;                           // Declared last: waited for first
+
+    TDecodeJobPtr Enqueue(size_t entry, TTaskPriority priority, bool hasDeadline,
+                          TCancelToken::TClock::time_point deadline);
+    void Schedule(const std::shared_ptr<TDecodeWork>& work, TTaskPriority priority);
+    void Execute(TDecodeWork& work);
+
+    TDecodeScheduler(const TDecodeScheduler&);
+    TDecodeScheduler& operator=(const TDecodeScheduler&);
+};
+
+//---------------------------------------------------------------------------
+
+// Decodes the PNG entry `entry` of `pack` on the calling thread into
+// `output`'s format; polls `cancel` (if given) once per scanline
+void DecodePngEntry(const TPackVolumeSet& pack, size_t entry, TDecodedImage& image,
+                    const TCancelToken* cancel = nullptr,
+                    const TImageOutput& output = TImageOutput());
+
+// Click latency with the pool idle, under a full maintenance load, and
+// under that load with the next flag prefetched; then a fast gallery
+// scroll that abandons most of the decodes it starts
+void RunLatencyBench(const TPackVolumeSet& pack, unsigned clicks, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // DecodeSchedulerH
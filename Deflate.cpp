@@ -0,0 +1,698 @@
+﻿/*
+ * Deflate.cpp - DEFLATE Encoder
+ *
+ * Implements TDeflater: LZ77 match finding with hash chains, Huffman code
+ * construction with a 15-bit length limit, and block output. Every block
+ * is costed as dynamic, fixed and stored, and the smallest form is written.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "Deflate.h"
+#include "Checksum.h"             // Adler32, Crc32, Crc32Combine
+#include "TaskPool.h"             // TTaskPool::Shared for DeflateParallel
+
+#include <algorithm>
+#include <atomic>
+#include <functional>             // std::greater
+#include <queue>                  // std::priority_queue for Huffman trees
+#include <stdexcept>
+#include <utility>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+// Length and distance code tables (RFC 1951, section 3.2.5)
+static const uint16_t LengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577};
+static const uint8_t DistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which code length code lengths are transmitted
+static const uint8_t CodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+static const size_t WindowSize = 32768;
+static const unsigned MinMatch = 3;
+static const unsigned MaxMatch = 258;
+static const size_t MaxStored = 65535;      // Largest stored block payload
+static const unsigned MaxCodeBits = 15;
+static const unsigned MaxCodeLengthBits = 7;
+
+/*
+ * Level Parameters
+ * Chain lengths and nice lengths roughly follow zlib's configuration table.
+ */
+struct TLevelConfig
+{
+    unsigned maxChain;
+    unsigned niceLength;
+    bool lazy;
+};
+
+static const TLevelConfig LevelConfig[10] = {
+    {0, 0, false},          // 0: stored
+    {4, 8, false},
+    {8, 16, false},
+    {16, 32, false},
+    {16, 16, true},
+    {32, 32, true},
+    {128, 128, true},       // 6: default
+    {256, 258, true},
+    {1024, 258, true},
+    {4096, 258, true}};
+//---------------------------------------------------------------------------
+
+static uint16_t ReverseBits(unsigned code, unsigned length)
+{
+    unsigned result = 0;
+    for (unsigned i = 0; i < length; i++) {
+        result = (result << 1) | (code & 1);
+        code >>= 1;
+    }
+    return static_cast<uint16_t>(result);
+}
+
+/*
+ * Canonical Huffman Codes
+ * Codes are stored bit-reversed, since DEFLATE sends Huffman codes
+ * starting with the most significant bit into an LSB-first bit stream.
+ */
+static void BuildCodes(const uint8_t* lengths, unsigned count, uint16_t* codes)
+{
+    unsigned lengthCount[MaxCodeBits + 1] = {0};
+    for (unsigned s = 0; s < count; s++)
+        lengthCount[lengths[s]]++;
+    lengthCount[0] = 0;
+
+    unsigned nextCode[MaxCodeBits + 1];
+    unsigned code = 0;
+    for (unsigned bits = 1; bits <= MaxCodeBits; bits++) {
+        code = (code + lengthCount[bits - 1]) << 1;
+        nextCode[bits] = code;
+    }
+    for (unsigned s = 0; s < count; s++)
+        codes[s] = lengths[s] != 0 ? ReverseBits(nextCode[lengths[s]]++, lengths[s]) : 0;
+}
+
+/*
+ * Length-Limited Huffman Code Lengths
+ * Builds an ordinary Huffman tree, clamps depths to `limit` and then
+ * rebalances until the Kraft sum is exactly one, so the code is complete
+ * (standard inflaters reject incomplete literal/length codes).
+ */
+static void BuildLengths(const uint32_t* freq, unsigned count, unsigned limit, uint8_t* lengths)
+{
+    std::vector<unsigned> used;
+    for (unsigned s = 0; s < count; s++) {
+        lengths[s] = 0;
+        if (freq[s] != 0)
+            used.push_back(s);
+    }
+
+    // A complete code needs at least two symbols
+    if (used.size() < 2) {
+        unsigned a = used.empty() ? 0 : used[0];
+        lengths[a] = 1;
+        lengths[a == 0 ? 1 : 0] = 1;
+        return;
+    }
+
+    // Huffman tree: leaves first, each parent appended after its children
+    size_t leaves = used.size();
+    std::vector<uint64_t> weight(2 * leaves - 1);
+    std::vector<size_t> parent(2 * leaves - 1, 0);
+    typedef std::pair<uint64_t, size_t> TNode;
+    std::priority_queue<TNode, std::vector<TNode>, std::greater<TNode> > heap;
+    for (size_t i = 0; i < leaves; i++) {
+        weight[i] = freq[used[i]];
+        heap.push(TNode(weight[i], i));
+    }
+    size_t next = leaves;
+    while (heap.size() > 1) {
+        TNode a = heap.top();
+        heap.pop();
+        TNode b = heap.top();
+        heap.pop();
+        weight[next] = a.first + b.first;
+        parent[a.second] = parent[b.second] = next;
+        heap.push(TNode(weight[next], next));
+        next++;
+    }
+
+    // Depths, walking from the root (last node) down
+    std::vector<unsigned> depth(2 * leaves - 1, 0);
+    for (size_t i = 2 * leaves - 2; i-- > 0;)
+        depth[i] = depth[parent[i]] + 1;
+
+    const uint64_t full = uint64_t(1) << limit;
+    uint64_t kraft = 0;
+    for (size_t i = 0; i < leaves; i++) {
+        unsigned length = depth[i] < limit ? depth[i] : limit;
+        lengths[used[i]] = static_cast<uint8_t>(length);
+        kraft += uint64_t(1) << (limit - length);
+    }
+
+    // Over-subscribed after clamping: lengthen the deepest short codes
+    while (kraft > full) {
+        size_t pick = leaves;
+        for (size_t i = 0; i < leaves; i++) {
+            unsigned length = lengths[used[i]];
+            if (length < limit &&
+                (pick == leaves || length > lengths[used[pick]] ||
+                 (length == lengths[used[pick]] && freq[used[i]] < freq[used[pick]])))
+                pick = i;
+        }
+        kraft -= uint64_t(1) << (limit - lengths[used[pick]] - 1);
+        lengths[used[pick]]++;
+    }
+
+    // Under-subscribed: shorten codes while the sum still fits
+    while (kraft < full) {
+        size_t pick = leaves;
+        for (size_t i = 0; i < leaves; i++) {
+            unsigned length = lengths[used[i]];
+            if (length > 1 && kraft + (uint64_t(1) << (limit - length)) <= full &&
+                (pick == leaves || length > lengths[used[pick]] ||
+                 (length == lengths[used[pick]] && freq[used[i]] > freq[used[pick]])))
+                pick = i;
+        }
+        kraft += uint64_t(1) << (limit - lengths[used[pick]]);
+        lengths[used[pick]]--;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Symbol Lookup Tables
+ * Length -> length code, distance -> distance code (zlib's two-level
+ * distance table: direct for 1..256, by 128-byte buckets above), and the
+ * fixed Huffman codes.
+ */
+struct TSymbolTables
+{
+    uint8_t lengthCode[MaxMatch + 1];
+    uint8_t distCode[512];
+    uint8_t fixedLiteralLengths[288];
+    uint16_t fixedLiteralCodes[288];
+    uint8_t fixedDistLengths[30];
+    uint16_t fixedDistCodes[30];
+
+    TSymbolTables()
+    {
+        for (unsigned c = 0; c < 29; c++) {
+            for (unsigned n = 0; n < (1u << LengthExtra[c]) && LengthBase[c] + n <= MaxMatch; n++)
+                lengthCode[LengthBase[c] + n] = static_cast<uint8_t>(c);
+        }
+        for (unsigned c = 0; c < 30; c++) {
+            for (unsigned n = 0; n < (1u << DistExtra[c]); n++) {
+                unsigned d = DistBase[c] + n;
+                distCode[d <= 256 ? d - 1 : 256 + ((d - 1) >> 7)] = static_cast<uint8_t>(c);
+            }
+        }
+
+        for (unsigned s = 0; s < 288; s++)
+            fixedLiteralLengths[s] = s < 144 ? 8 : s < 256 ? 9 : s < 280 ? 7 : 8;
+        for (unsigned s = 0; s < 30; s++)
+            fixedDistLengths[s] = 5;
+        BuildCodes(fixedLiteralLengths, 288, fixedLiteralCodes);
+        BuildCodes(fixedDistLengths, 30, fixedDistCodes);
+    }
+
+    unsigned DistCode(unsigned dist) const
+    {
+        return distCode[dist <= 256 ? dist - 1 : 256 + ((dist - 1) >> 7)];
+    }
+};
+
+static const TSymbolTables& SymbolTables()
+{
+    static const TSymbolTables tables; // Built once, thread-safe initialization
+    return tables;
+}
+//---------------------------------------------------------------------------
+
+TDeflater::TDeflater(int compressionLevel)
+    : level(compressionLevel < 0 ? 0 : compressionLevel > 9 ? 9 : compressionLevel),
+      hashBits(HashBits), windowMask(WindowSize - 1), out(nullptr), bitBuffer(0), bitCount(0)
+{
+    maxChain = LevelConfig[level].maxChain;
+    niceLength = LevelConfig[level].niceLength;
+    lazy = LevelConfig[level].lazy;
+    for (unsigned s = 0; s < 286; s++)
+        literalFreq[s] = 0;
+    for (unsigned s = 0; s < 30; s++)
+        distFreq[s] = 0;
+}
+
+/*
+ * Compress To Raw DEFLATE
+ */
+void TDeflater::Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& output)
+{
+    CompressPart(data, size, 0, true, output);
+}
+
+/*
+ * Compress One Part Of A Stream
+ */
+void TDeflater::CompressPart(const uint8_t* data, size_t size, size_t history, bool final,
+                             std::vector<uint8_t>& output)
+{
+    if (history > WindowSize)
+        history = WindowSize;
+    if (size > 0x7FFFFFFF - history)
+        throw std::runtime_error("Deflate input too large");
+
+    out = &output;
+    bitBuffer = 0;
+    bitCount = 0;
+    Deflate(data - history, history, history + size, final);
+    if (!final) {
+        PutBits(0, 1);  // Empty stored block: aligns to a byte boundary
+        PutBits(0, 2);
+        AlignToByte();
+        static const uint8_t SyncMarker[4] = {0x00, 0x00, 0xFF, 0xFF};
+        output.insert(output.end(), SyncMarker, SyncMarker + 4);
+    }
+    AlignToByte();
+    out = nullptr;
+}
+
+/*
+ * Compress To zlib
+ * The header's level hint (FLEVEL) follows zlib's mapping.
+ */
+void TDeflater::CompressZlib(const uint8_t* data, size_t size, std::vector<uint8_t>& output)
+{
+    static const uint8_t LevelHint[10] = {0x01, 0x01, 0x5E, 0x5E, 0x5E, 0x5E, 0x9C, 0xDA, 0xDA, 0xDA};
+
+    output.push_back(0x78);                     // CM = 8 (deflate), 32 KB window
+    output.push_back(LevelHint[level]);         // FLEVEL plus FCHECK
+    Compress(data, size, output);
+
+    uint32_t adler = Adler32(data, size);
+    for (int shift = 24; shift >= 0; shift -= 8)
+        output.push_back(static_cast<uint8_t>(adler >> shift));
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Bit Writer
+ */
+void TDeflater::PutBits(uint32_t value, unsigned count)
+{
+    bitBuffer |= static_cast<uint64_t>(value) << bitCount;
+    bitCount += count;
+    if (bitCount >= 32) {
+        for (int i = 0; i < 4; i++) {
+            out->push_back(static_cast<uint8_t>(bitBuffer));
+            bitBuffer >>= 8;
+        }
+        bitCount -= 32;
+    }
+}
+
+void TDeflater::AlignToByte()
+{
+    while (bitCount > 0) {
+        out->push_back(static_cast<uint8_t>(bitBuffer));
+        bitBuffer >>= 8;
+        bitCount = bitCount > 8 ? bitCount - 8 : 0;
+    }
+    bitBuffer = 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Hash Chains
+ * Three-byte multiplicative hash; prev[] links each position to the
+ * previous one with the same hash inside the 32 KB window.
+ */
+static inline uint32_t Hash3(const uint8_t* p, unsigned bits)
+{
+    uint32_t v = (static_cast<uint32_t>(p[0]) << 16) | (static_cast<uint32_t>(p[1]) << 8) | p[2];
+    return (v * 2654435761u) >> (32 - bits);
+}
+
+void TDeflater::InsertHash(const uint8_t* base, size_t pos)
+{
+    uint32_t h = Hash3(base + pos, hashBits);
+    prev[pos & windowMask] = head[h];
+    head[h] = static_cast<int32_t>(pos);
+}
+
+/*
+ * Longest Match
+ * Returns the match length at `pos` (0 if shorter than MinMatch) and its
+ * distance. Chain positions strictly decrease; anything older than the
+ * window or out of order ends the walk.
+ */
+unsigned TDeflater::FindMatch(const uint8_t* base, size_t pos, size_t end, unsigned& dist) const
+{
+    size_t maxLength = end - pos < MaxMatch ? end - pos : MaxMatch;
+    if (maxLength < MinMatch)
+        return 0;
+
+    const uint8_t* cur = base + pos;
+    size_t limit = pos > WindowSize ? pos - WindowSize : 0;
+    unsigned best = MinMatch - 1;
+    unsigned chain = maxChain;
+    int32_t candidate = head[Hash3(cur, hashBits)];
+
+    while (candidate >= 0 && static_cast<size_t>(candidate) >= limit && chain-- > 0) {
+        const uint8_t* match = base + candidate;
+        if (match[best] == cur[best] && match[0] == cur[0] && match[1] == cur[1]) {
+            unsigned length = 2;
+            while (length < maxLength && match[length] == cur[length])
+                length++;
+            if (length > best) {
+                best = length;
+                dist = static_cast<unsigned>(pos - candidate);
+                if (length >= niceLength || length == maxLength)
+                    break;
+            }
+        }
+        int32_t older = prev[candidate & windowMask];
+        if (older >= candidate)
+            break;
+        candidate = older;
+    }
+    return best >= MinMatch ? best : 0;
+}
+//---------------------------------------------------------------------------
+
+void TDeflater::AddLiteral(uint8_t value)
+{
+    TToken token = {value, 0};
+    tokens.push_back(token);
+    literalFreq[value]++;
+}
+
+void TDeflater::AddMatch(unsigned length, unsigned dist)
+{
+    const TSymbolTables& tables = SymbolTables();
+    TToken token = {static_cast<uint16_t>(length), static_cast<uint16_t>(dist)};
+    tokens.push_back(token);
+    literalFreq[257 + tables.lengthCode[length]]++;
+    distFreq[tables.DistCode(dist)]++;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * LZ77 Pass
+ * Compresses base[start, end). Bytes before `start` (up to one window)
+ * are history the stream may refer back to, e.g. a preset dictionary.
+ */
+void TDeflater::Deflate(const uint8_t* base, size_t start, size_t end, bool final)
+{
+    if (level == 0) {
+        WriteStored(base + start, end - start, final);
+        return;
+    }
+
+    // Hash and chain tables no larger than the bytes they will index; the
+    // chain table still has a distinct slot for every position in range
+    size_t primeFrom = start > WindowSize ? start - WindowSize : 0;
+    size_t span = end - primeFrom;
+    hashBits = 8;
+    while (hashBits < HashBits && (size_t(1) << hashBits) < span)
+        hashBits++;
+    size_t window = 256;
+    while (window < WindowSize && window < span)
+        window <<= 1;
+    windowMask = window - 1;
+    head.assign(size_t(1) << hashBits, -1);
+    prev.assign(window, -1);
+    tokens.clear();
+    tokens.reserve(MaxTokens + MaxMatch);
+
+    for (size_t pos = primeFrom; pos < start && pos + MinMatch <= end; pos++)
+        InsertHash(base, pos);
+
+    size_t blockStart = start;
+    size_t pos = start;
+    while (pos < end) {
+        if (tokens.size() >= MaxTokens) {
+            FlushBlock(base + blockStart, pos - blockStart, false);
+            blockStart = pos;
+        }
+
+        unsigned dist = 0;
+        unsigned length = 0;
+        if (end - pos >= MinMatch) {
+            length = FindMatch(base, pos, end, dist);
+            InsertHash(base, pos);
+        }
+
+        // Lazy evaluation: emit a literal if the next position matches longer
+        while (lazy && length >= MinMatch && length < niceLength && end - pos - 1 >= MinMatch) {
+            unsigned nextDist = 0;
+            unsigned nextLength = FindMatch(base, pos + 1, end, nextDist);
+            if (nextLength <= length)
+                break;
+            AddLiteral(base[pos]);
+            pos++;
+            InsertHash(base, pos);
+            length = nextLength;
+            dist = nextDist;
+        }
+
+        if (length >= MinMatch) {
+            AddMatch(length, dist);
+            for (size_t k = 1; k < length && pos + k + MinMatch <= end; k++)
+                InsertHash(base, pos + k);
+            pos += length;
+        } else {
+            AddLiteral(base[pos]);
+            pos++;
+        }
+    }
+    FlushBlock(base + blockStart, end - blockStart, final);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Flush Block
+ * Builds dynamic codes for the pending tokens, costs all three block
+ * types and writes the cheapest. `raw` is the input the tokens cover,
+ * needed if storing wins.
+ */
+void TDeflater::FlushBlock(const uint8_t* raw, size_t rawSize, bool last)
+{
+    const TSymbolTables& tables = SymbolTables();
+    literalFreq[256] = 1; // End of block
+
+    uint8_t literalLengths[286];
+    uint8_t distLengths[30];
+    BuildLengths(literalFreq, 286, MaxCodeBits, literalLengths);
+    BuildLengths(distFreq, 30, MaxCodeBits, distLengths);
+    unsigned literalCount = 286;
+    while (literalCount > 257 && literalLengths[literalCount - 1] == 0)
+        literalCount--;
+    unsigned distCount = 30;
+    while (distCount > 1 && distLengths[distCount - 1] == 0)
+        distCount--;
+
+    // Run-length encode both length tables as one sequence (RFC 1951, 3.2.7)
+    uint8_t all[286 + 30];
+    unsigned total = 0;
+    for (unsigned s = 0; s < literalCount; s++)
+        all[total++] = literalLengths[s];
+    for (unsigned s = 0; s < distCount; s++)
+        all[total++] = distLengths[s];
+
+    uint8_t runSymbols[286 + 30];
+    uint8_t runExtra[286 + 30];
+    unsigned runCount = 0;
+    uint32_t codeLengthFreq[19] = {0};
+    for (unsigned i = 0; i < total;) {
+        uint8_t length = all[i];
+        unsigned run = 1;
+        while (i + run < total && all[i + run] == length)
+            run++;
+
+        uint8_t symbol = length;
+        uint8_t extra = 0;
+        if (length == 0 && run >= 3) {
+            run = run < 138 ? run : 138;
+            symbol = run >= 11 ? 18 : 17;
+            extra = static_cast<uint8_t>(run >= 11 ? run - 11 : run - 3);
+            i += run;
+        } else if (length != 0 && run >= 3 && i > 0 && all[i - 1] == length) {
+            run = run < 6 ? run : 6;
+            symbol = 16;
+            extra = static_cast<uint8_t>(run - 3);
+            i += run;
+        } else {
+            i++;
+        }
+        runSymbols[runCount] = symbol;
+        runExtra[runCount] = extra;
+        runCount++;
+        codeLengthFreq[symbol]++;
+    }
+
+    uint8_t codeLengthLengths[19];
+    uint16_t codeLengthCodes[19];
+    BuildLengths(codeLengthFreq, 19, MaxCodeLengthBits, codeLengthLengths);
+    BuildCodes(codeLengthLengths, 19, codeLengthCodes);
+    unsigned codeLengthCount = 19;
+    while (codeLengthCount > 4 && codeLengthLengths[CodeLengthOrder[codeLengthCount - 1]] == 0)
+        codeLengthCount--;
+
+    // Block sizes in bits
+    uint64_t dynamicBits = 3 + 5 + 5 + 4 + 3 * codeLengthCount;
+    for (unsigned r = 0; r < runCount; r++) {
+        uint8_t symbol = runSymbols[r];
+        dynamicBits += codeLengthLengths[symbol] + (symbol == 16 ? 2 : symbol == 17 ? 3 : symbol == 18 ? 7 : 0);
+    }
+    uint64_t fixedBits = 3;
+    for (unsigned s = 0; s < 286; s++) {
+        uint64_t extra = s > 256 ? LengthExtra[s - 257] : 0;
+        dynamicBits += static_cast<uint64_t>(literalFreq[s]) * (literalLengths[s] + extra);
+        fixedBits += static_cast<uint64_t>(literalFreq[s]) * (tables.fixedLiteralLengths[s] + extra);
+    }
+    for (unsigned d = 0; d < 30; d++) {
+        dynamicBits += static_cast<uint64_t>(distFreq[d]) * (distLengths[d] + DistExtra[d]);
+        fixedBits += static_cast<uint64_t>(distFreq[d]) * (5 + DistExtra[d]);
+    }
+    uint64_t storedBlocks = rawSize == 0 ? 1 : (rawSize + MaxStored - 1) / MaxStored;
+    uint64_t storedBits = storedBlocks * (3 + 7 + 32) + static_cast<uint64_t>(rawSize) * 8;
+
+    if (storedBits <= dynamicBits && storedBits <= fixedBits) {
+        WriteStored(raw, rawSize, last);
+    } else if (fixedBits <= dynamicBits) {
+        PutBits(last ? 1 : 0, 1);
+        PutBits(1, 2);
+        WriteTokens(tables.fixedLiteralLengths, tables.fixedLiteralCodes,
+                    tables.fixedDistLengths, tables.fixedDistCodes);
+    } else {
+        uint16_t literalCodes[286];
+        uint16_t distCodes[30];
+        BuildCodes(literalLengths, 286, literalCodes);
+        BuildCodes(distLengths, 30, distCodes);
+
+        PutBits(last ? 1 : 0, 1);
+        PutBits(2, 2);
+        PutBits(literalCount - 257, 5);
+        PutBits(distCount - 1, 5);
+        PutBits(codeLengthCount - 4, 4);
+        for (unsigned i = 0; i < codeLengthCount; i++)
+            PutBits(codeLengthLengths[CodeLengthOrder[i]], 3);
+        for (unsigned r = 0; r < runCount; r++) {
+            uint8_t symbol = runSymbols[r];
+            PutBits(codeLengthCodes[symbol], codeLengthLengths[symbol]);
+            if (symbol == 16)
+                PutBits(runExtra[r], 2);
+            else if (symbol == 17)
+                PutBits(runExtra[r], 3);
+            else if (symbol == 18)
+                PutBits(runExtra[r], 7);
+        }
+        WriteTokens(literalLengths, literalCodes, distLengths, distCodes);
+    }
+
+    tokens.clear();
+    for (unsigned s = 0; s < 286; s++)
+        literalFreq[s] = 0;
+    for (unsigned s = 0; s < 30; s++)
+        distFreq[s] = 0;
+}
+
+void TDeflater::WriteTokens(const uint8_t* literalLengths, const uint16_t* literalCodes,
+                            const uint8_t* distLengths, const uint16_t* distCodes)
+{
+    const TSymbolTables& tables = SymbolTables();
+    for (size_t t = 0; t < tokens.size(); t++) {
+        const TToken& token = tokens[t];
+        if (token.dist == 0) {
+            PutBits(literalCodes[token.length], literalLengths[token.length]);
+            continue;
+        }
+        unsigned lc = tables.lengthCode[token.length];
+        PutBits(literalCodes[257 + lc], literalLengths[257 + lc]);
+        if (LengthExtra[lc] != 0)
+            PutBits(token.length - LengthBase[lc], LengthExtra[lc]);
+        unsigned dc = tables.DistCode(token.dist);
+        PutBits(distCodes[dc], distLengths[dc]);
+        if (DistExtra[dc] != 0)
+            PutBits(token.dist - DistBase[dc], DistExtra[dc]);
+    }
+    PutBits(literalCodes[256], literalLengths[256]);
+}
+
+/*
+ * Stored Blocks
+ * Split at 65535 bytes; only the very last one carries BFINAL.
+ */
+void TDeflater::WriteStored(const uint8_t* raw, size_t rawSize, bool last)
+{
+    do {
+        size_t n = rawSize < MaxStored ? rawSize : MaxStored;
+        PutBits(last && n == rawSize ? 1 : 0, 1);
+        PutBits(0, 2);
+        AlignToByte();
+        out->push_back(static_cast<uint8_t>(n));
+        out->push_back(static_cast<uint8_t>(n >> 8));
+        out->push_back(static_cast<uint8_t>(~n));
+        out->push_back(static_cast<uint8_t>(~n >> 8));
+        out->insert(out->end(), raw, raw + n);
+        raw += n;
+        rawSize -= n;
+    } while (rawSize > 0);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Parallel DEFLATE
+ * Parts are claimed from a shared counter, so the workers stay busy even
+ * when some parts compress much slower than others.
+ */
+uint32_t DeflateParallel(const uint8_t* data, size_t size, int level, std::vector<uint8_t>& out,
+                         unsigned threads, size_t partSize)
+{
+    if (partSize < WindowSize)
+        partSize = WindowSize;
+    size_t parts = size == 0 ? 1 : (size + partSize - 1) / partSize;
+    threads = TTaskPool::Shared().Concurrency(threads);
+    if (threads > parts)
+        threads = static_cast<unsigned>(parts);
+
+    std::vector<std::vector<uint8_t> > pieces(parts);
+    std::vector<uint32_t> crcs(parts);
+    std::atomic<size_t> cursor(0);
+    TTaskPool::Shared().Run(threads, [&](unsigned) {
+        TDeflater deflater(level);
+        for (size_t p = cursor.fetch_add(1); p < parts; p = cursor.fetch_add(1)) {
+            size_t begin = p * partSize;
+            size_t length = std::min(partSize, size - begin);
+            deflater.CompressPart(data + begin, length, std::min(begin, WindowSize),
+                                  p + 1 == parts, pieces[p]);
+            crcs[p] = Crc32(data + begin, length);
+        }
+    });
+
+    size_t total = 0;
+    for (size_t p = 0; p < parts; p++)
+        total += pieces[p].size();
+    out.reserve(out.size() + total);
+
+    uint32_t crc = 0;
+    for (size_t p = 0; p < parts; p++) {
+        out.insert(out.end(), pieces[p].begin(), pieces[p].end());
+        size_t length = std::min(partSize, size - p * partSize);
+        crc = p == 0 ? crcs[0] : Crc32Combine(crc, crcs[p], length);
+    }
+    return crc;
+}
+//---------------------------------------------------------------------------
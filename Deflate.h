@@ -0,0 +1,127 @@
+﻿/*
+ * Deflate.h - DEFLATE Encoder
+ *
+ * Declares TDeflater, the compressor used by the pack writers. It produces
+ * standard DEFLATE (RFC 1951) streams that any inflater can read, and an
+ * optional zlib (RFC 1950) wrapper for PNG IDAT data.
+ *
+ * Key Features:
+ * - Hash-chain LZ77 matching with lazy evaluation at higher levels
+ * - Per block choice of dynamic Huffman, fixed Huffman or stored coding,
+ *   whichever is smallest
+ * - Works on a whole input buffer: packs compress entries held in memory
+ * - Large inputs can be split into parts compressed on all cores and
+ *   joined into one standard stream (DeflateParallel, pigz style)
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef DeflateH
+#define DeflateH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TDeflater - Whole-Buffer DEFLATE Compressor
+ *
+ * Levels follow zlib: 0 stores, 1 is fastest, 9 searches hardest. One
+ * instance may be reused for many inputs but not shared between threads.
+ */
+class TDeflater
+{
+  public:
+    static const int DefaultLevel = 6;
+
+    explicit TDeflater(int level = DefaultLevel);
+
+    int Level() const { return level; }
+
+    // Appends a complete raw DEFLATE stream of `data` to `out`
+    void Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+    // Appends one part of a larger stream. The `history` bytes before
+    // `data` must be readable: matches may refer back into them like into a
+    // preset dictionary (at most 32 KB are used). A part that is not final
+    // ends byte-aligned with an empty stored block (a sync flush), so parts
+    // compressed independently can simply be concatenated
+    void CompressPart(const uint8_t* data, size_t size, size_t history, bool final,
+                      std::vector<uint8_t>& out);
+
+    // Appends a complete zlib stream (header, DEFLATE data, Adler-32)
+    void CompressZlib(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+  private:
+    TDeflater(const TDeflater&);
+    TDeflater& operator=(const TDeflater&);
+
+    static const unsigned HashBits = 15;
+    static const size_t MaxTokens = 16384;   // Symbols per Huffman block
+
+    struct TToken
+    {
+        uint16_t length;            // Match length, or the literal byte if dist == 0
+        uint16_t dist;
+    };
+
+    // Level parameters
+    int level;
+    unsigned maxChain;              // Hash chain links followed per search
+    unsigned niceLength;            // Stop searching at a match this long
+    bool lazy;                      // Try the next position before taking a match
+
+    // Match finder over the input buffer (positions are buffer offsets).
+    // Tables are sized to the input so small entries stay cheap
+    unsigned hashBits;
+    size_t windowMask;
+    std::vector<int32_t> head;      // Newest position per hash bucket
+    std::vector<int32_t> prev;      // Older position with the same hash, by pos & windowMask
+
+    // Pending block
+    std::vector<TToken> tokens;
+    uint32_t literalFreq[286];
+    uint32_t distFreq[30];
+
+    // Bit writer
+    std::vector<uint8_t>* out;
+    uint64_t bitBuffer;
+    unsigned bitCount;
+
+    void PutBits(uint32_t value, unsigned count);
+    void AlignToByte();
+
+    void Deflate(const uint8_t* base, size_t start, size_t end, bool final);
+    void InsertHash(const uint8_t* base, size_t pos);
+    unsigned FindMatch(const uint8_t* base, size_t pos, size_t end, unsigned& dist) const;
+    void AddLiteral(uint8_t value);
+    void AddMatch(unsigned length, unsigned dist);
+
+    void FlushBlock(const uint8_t* raw, size_t rawSize, bool last);
+    void WriteStored(const uint8_t* raw, size_t rawSize, bool last);
+    void WriteTokens(const uint8_t* literalLengths, const uint16_t* literalCodes,
+                     const uint8_t* distLengths, const uint16_t* distCodes);
+};
+
+//---------------------------------------------------------------------------
+
+// Part size for DeflateParallel (pigz uses the same default)
+static const size_t DefaultDeflatePart = 128 * 1024;
+
+/*
+ * Parallel DEFLATE
+ *
+ * Splits `data` into parts that are compressed concurrently by up to
+ * `threads` runners on the shared task pool (0 = all of it), each primed with the 32 KB before it, and
+ * appends the joined raw DEFLATE stream to `out`. The CRC-32 of each part
+ * is computed by its worker and combined with Crc32Combine(). Returns the
+ * CRC-32 of all of `data`.
+ */
+uint32_t DeflateParallel(const uint8_t* data, size_t size, int level, std::vector<uint8_t>& out,
+                         unsigned threads = 0, size_t partSize = DefaultDeflatePart);
+
+//---------------------------------------------------------------------------
+#endif // DeflateH
@@ -0,0 +1,717 @@
+﻿/*
+ * DiskImageCache.cpp - Persistent Decoded Image Cache
+ *
+ * Implements the segment format, the scan that rebuilds the index on
+ * open, appends with their two flushes, generation rotation, and the
+ * disk cache benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "DiskImageCache.h"
+#include "Checksum.h"             // Crc32
+#include "MappedFile.h"           // TMappedFile, MakeFolders
+#include "Metrics.h"              // MetricCounter, MetricHistogram
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>                // memcpy, memcmp
+#include <iomanip>
+#include <random>
+#include <stdexcept>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>                   // _commit, _fileno
+#else
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/file.h>             // flock
+#include <sys/stat.h>
+#include <unistd.h>               // fsync
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const char FileMagic[8] = {'Z', 'I', 'P', 'I', 'M', 'G', 'C', '1'};
+static const uint32_t FileVersion = 1;
+static const uint32_t TagRecord = 0x474D4944;   // "DIMG"
+static const uint32_t TagCommit = 0x544D4344;   // "DCMT"
+static const size_t BlockSize = 64;             // Headers, commits and payload padding
+static const char* const SegmentPrefix = "images-";
+static const char* const SegmentSuffix = ".cache";
+
+typedef std::chrono::steady_clock TClock;
+
+static uint64_t NanosecondsSince(TClock::time_point start)
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - start).count());
+}
+
+static void PutLE32(uint8_t* p, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; i++)
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+static void PutLE64(uint8_t* p, uint64_t value)
+{
+    for (unsigned i = 0; i < 8; i++)
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+static uint32_t GetLE32(const uint8_t* p)
+{
+    return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static uint64_t GetLE64(const uint8_t* p)
+{
+    return GetLE32(p) | (static_cast<uint64_t>(GetLE32(p + 4)) << 32);
+}
+
+static uint64_t PaddedSize(uint64_t size)
+{
+    return (size + BlockSize - 1) / BlockSize * BlockSize;
+}
+
+// Record header, padded payload and commit
+static uint64_t RecordSize(uint64_t payload)
+{
+    return BlockSize + PaddedSize(payload) + BlockSize;
+}
+
+// Palette, then pixels; false for a format this version does not know
+static bool PayloadSize(uint32_t format, uint64_t width, uint64_t height, uint64_t colours,
+                        uint64_t& payload)
+{
+    if (format >= ImageFormatCount || colours > 256)
+        return false;
+    payload = colours * 4 + width * height * ImageFormatBytes(static_cast<TImageFormat>(format));
+    return true;
+}
+
+/*
+ * Process-Wide Disk Cache Metrics
+ */
+struct TDiskCacheMetrics
+{
+    TCounter& hits;
+    TCounter& misses;
+    TCounter& stores;
+    THistogram& read;
+
+    TDiskCacheMetrics()
+        : hits(MetricCounter("zip_disk_cache_hits_total", "Images read from the disk cache")),
+          misses(MetricCounter("zip_disk_cache_misses_total",
+                               "Disk cache lookups that found nothing")),
+          stores(MetricCounter("zip_disk_cache_stores_total", "Images appended to the disk cache")),
+          read(MetricHistogram("zip_disk_cache_read_seconds",
+                               "Time to copy an image out of the disk cache"))
+    {
+    }
+};
+
+static TDiskCacheMetrics& DiskMetrics()
+{
+    static TDiskCacheMetrics metrics;
+    return metrics;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * File System Helpers
+ * UTF-8 paths; converted to UTF-16 on Windows.
+ */
+#ifdef _WIN32
+static std::wstring WidePath(const std::string& path)
+{
+    int length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, NULL, 0);
+    std::wstring wide(length > 0 ? length : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], length);
+    return wide;
+}
+#endif
+
+static void RemoveFile(const std::string& path)
+{
+#ifdef _WIN32
+    DeleteFileW(WidePath(path).c_str());
+#else
+    unlink(path.c_str());
+#endif
+}
+
+static FILE* OpenSegmentFile(const std::string& path)
+{
+#ifdef _WIN32
+    return _wfopen(WidePath(path).c_str(), L"ab");
+#else
+    return fopen(path.c_str(), "ab");
+#endif
+}
+
+// Flushes the stdio buffer and then the operating system's
+static bool SyncFile(FILE* file)
+{
+    if (fflush(file) != 0)
+        return false;
+#ifdef _WIN32
+    return _commit(_fileno(file)) == 0;
+#else
+    return fsync(fileno(file)) == 0;
+#endif
+}
+
+/*
+ * Writer Lock
+ * Held open for the life of the cache. Windows refuses a second handle
+ * to a file opened without sharing; elsewhere flock() does the same job.
+ * Either way the lock goes away with the process, so a crash never leaves
+ * the cache read-only.
+ */
+static intptr_t TakeWriterLock(const std::string& path)
+{
+#ifdef _WIN32
+    HANDLE file = CreateFileW(WidePath(path).c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+                              OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    return file == INVALID_HANDLE_VALUE ? -1 : reinterpret_cast<intptr_t>(file);
+#else
+    int fd = open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0)
+        return -1;
+    if (flock(fd, LOCK_EX | LOCK_NB) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+#endif
+}
+
+static void ReleaseWriterLock(intptr_t handle)
+{
+#ifdef _WIN32
+    CloseHandle(reinterpret_cast<HANDLE>(handle));
+#else
+    close(static_cast<int>(handle));
+#endif
+}
+
+// Generations of the segment files in `folder`, oldest first
+static std::vector<uint64_t> ListGenerations(const std::string& folder)
+{
+    std::vector<std::string> names;
+#ifdef _WIN32
+    WIN32_FIND_DATAW found;
+    HANDLE search = FindFirstFileW(WidePath(folder + "\\images-*.cache").c_str(), &found);
+    if (search != INVALID_HANDLE_VALUE) {
+        do {
+            std::string name;
+            for (const wchar_t* c = found.cFileName; *c != L'\0'; c++)
+                name += *c < 128 ? static_cast<char>(*c) : '?';
+            names.push_back(name);
+        } while (FindNextFileW(search, &found));
+        FindClose(search);
+    }
+#else
+    if (DIR* dir = opendir(folder.c_str())) {
+        while (dirent* found = readdir(dir))
+            names.push_back(found->d_name);
+        closedir(dir);
+    }
+#endif
+
+    std::vector<uint64_t> generations;
+    size_t prefix = strlen(SegmentPrefix);
+    size_t suffix = strlen(SegmentSuffix);
+    for (size_t i = 0; i < names.size(); i++) {
+        const std::string& name = names[i];
+        if (name.size() <= prefix + suffix || name.compare(0, prefix, SegmentPrefix) != 0 ||
+            name.compare(name.size() - suffix, suffix, SegmentSuffix) != 0)
+            continue;
+        std::string digits = name.substr(prefix, name.size() - prefix - suffix);
+        if (digits.size() > 19 || digits.find_first_not_of("0123456789") != std::string::npos)
+            continue;
+        uint64_t generation = std::stoull(digits);
+        if (generation != 0)
+            generations.push_back(generation);
+    }
+    std::sort(generations.begin(), generations.end());
+    return generations;
+}
+//---------------------------------------------------------------------------
+
+size_t TDiskImageKeyHash::operator()(const TDiskImageKey& key) const
+{
+    uint64_t hash = key.pack;
+    uint64_t parts[] = {key.entry, key.width, key.height, key.format, key.matte};
+    for (size_t i = 0; i < sizeof(parts) / sizeof(parts[0]); i++)
+        hash = (hash ^ parts[i]) * 0x100000001B3ull;
+    return static_cast<size_t>(hash ^ (hash >> 32));
+}
+
+TDiskImageCache::TDiskImageCache(const std::string& folder, uint64_t capBytes)
+    : folder(folder), capBytes(capBytes), lockHandle(NoLock), output(nullptr), hits(0), misses(0),
+      stores(0), refreshed(0), rotations(0), discarded(0)
+{
+    for (unsigned i = 0; i < 2; i++) {
+        segments[i].generation = 0;
+        segments[i].size = 0;
+    }
+    TMappedFile::MakeFolders(folder);
+    if (!TMappedFile::IsFolder(folder))
+        throw std::runtime_error("Unable to create image cache folder " + folder);
+    lockHandle = TakeWriterLock(folder + "/writer.lock");
+    OpenSegments();
+}
+
+TDiskImageCache::~TDiskImageCache()
+{
+    if (output != nullptr)
+        fclose(output);
+    if (lockHandle != NoLock)
+        ReleaseWriterLock(lockHandle);
+}
+
+/*
+ * Open
+ * The newest two segment files are the active and previous generations;
+ * anything older is left over from a rotation that could not delete it
+ * and the writer removes it now. The writer appends to the active segment
+ * only if it ends cleanly, and otherwise starts a new generation: the
+ * torn one becomes the previous generation, its committed records still
+ * readable.
+ */
+void TDiskImageCache::OpenSegments()
+{
+    std::vector<uint64_t> generations = ListGenerations(folder);
+    size_t count = generations.size();
+    for (unsigned i = 0; i < 2 && i < count; i++) {
+        TSegment& segment = segments[1 - i];
+        segment.generation = generations[count - 1 - i];
+        segment.path = folder + "/" + SegmentPrefix + std::to_string(segment.generation) +
+                       SegmentSuffix;
+    }
+    if (!Writable()) {
+        Scan(0);
+        Scan(1);
+        return;
+    }
+
+    for (size_t i = 0; i + 2 < count; i++)
+        RemoveFile(folder + "/" + SegmentPrefix + std::to_string(generations[i]) + SegmentSuffix);
+    Scan(0);
+    Scan(1);
+
+    TSegment& active = segments[1];
+    bool clean = active.generation != 0 && active.mapping && active.size == active.mapping->Size();
+    if (clean)
+        output = OpenSegmentFile(active.path);
+    if (output == nullptr)
+        StartGeneration(active.generation + 1);
+}
+
+/*
+ * Scan
+ * Walks the records from the start of the segment and indexes every one
+ * whose header CRC checks out and whose commit is present and matches.
+ * The first record that fails ends the scan: everything after it is the
+ * tail of an interrupted append. Records of the active segment replace
+ * those of the previous one.
+ */
+void TDiskImageCache::Scan(unsigned segmentIndex)
+{
+    TSegment& segment = segments[segmentIndex];
+    segment.size = 0;
+    if (segment.generation == 0)
+        return;
+    std::shared_ptr<TMappedFile> mapping = std::make_shared<TMappedFile>();
+    try {
+        mapping->Open(segment.path, true);
+    } catch (const std::runtime_error&) {
+        return;                     // Missing or empty
+    }
+    segment.mapping = mapping;
+    const uint8_t* data = mapping->Data();
+    uint64_t size = mapping->Size();
+    if (size < BlockSize || memcmp(data, FileMagic, sizeof(FileMagic)) != 0 ||
+        GetLE32(data + 8) != FileVersion) {
+        discarded++;
+        return;
+    }
+
+    uint64_t position = BlockSize;
+    while (size - position >= 2 * BlockSize) {
+        const uint8_t* header = data + position;
+        uint32_t crc = GetLE32(header + 4);
+        if (GetLE32(header) != TagRecord || Crc32(header + 8, BlockSize - 8) != crc)
+            break;
+        uint64_t payload = GetLE64(header + 32);
+        uint64_t expected;
+        if (!PayloadSize(GetLE32(header + 28), GetLE32(header + 40), GetLE32(header + 44),
+                         GetLE32(header + 56), expected) ||
+            payload != expected || payload > size - position - 2 * BlockSize ||
+            RecordSize(payload) > size - position)
+            break;
+        const uint8_t* commit = header + BlockSize + PaddedSize(payload);
+        if (GetLE32(commit) != TagCommit || GetLE32(commit + 4) != crc ||
+            GetLE64(commit + 8) != position)
+            break;
+
+        TDiskImageKey key;
+        key.pack = GetLE64(header + 8);
+        key.entry = GetLE32(header + 16);
+        key.width = GetLE32(header + 20);
+        key.height = GetLE32(header + 24);
+        key.format = GetLE32(header + 28);
+        key.matte = GetLE32(header + 52);
+        TLocation location;
+        location.segment = segmentIndex;
+        location.offset = position;
+        location.payload = payload;
+        index[key] = location;
+        position += RecordSize(payload);
+    }
+    segment.size = position;
+    if (position != size)
+        discarded++;
+}
+
+/*
+ * Start Generation
+ * Writes the header of a new, empty segment file and makes it the active
+ * generation. The active one becomes the previous generation; the old
+ * previous generation's records leave the index and its file is deleted.
+ * Readers copying out of it hold their own reference to the mapping, and
+ * on Windows the file goes once the last of them lets go.
+ */
+bool TDiskImageCache::StartGeneration(uint64_t generation)
+{
+    if (output != nullptr) {
+        fclose(output);
+        output = nullptr;
+    }
+    std::string path = folder + "/" + SegmentPrefix + std::to_string(generation) + SegmentSuffix;
+    FILE* file = OpenSegmentFile(path);
+    if (file == nullptr)
+        return false;
+    uint8_t header[BlockSize] = {0};
+    memcpy(header, FileMagic, sizeof(FileMagic));
+    PutLE32(header + 8, FileVersion);
+    PutLE64(header + 16, generation);
+    if (fwrite(header, 1, sizeof(header), file) != sizeof(header) || !SyncFile(file)) {
+        fclose(file);
+        RemoveFile(path);
+        return false;
+    }
+
+    std::string dropped;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (TIndex::iterator i = index.begin(); i != index.end();) {
+            if (i->second.segment == 0) {
+                i = index.erase(i);
+            } else {
+                i->second.segment = 0;
+                ++i;
+            }
+        }
+        dropped = segments[0].path;
+        segments[0] = segments[1];
+        segments[1].generation = generation;
+        segments[1].path = path;
+        segments[1].size = BlockSize;
+        segments[1].mapping.reset();
+        rotations++;
+    }
+    if (!dropped.empty())
+        RemoveFile(dropped);
+    output = file;
+    return true;
+}
+
+/*
+ * Append
+ * Header and payload are flushed to disk before the commit is written, so
+ * a commit on disk always vouches for a complete record.
+ */
+bool TDiskImageCache::Append(const TDiskImageKey& key, const TDecodedImage& image)
+{
+    uint64_t offset = segments[1].size;
+    uint64_t payload = image.Bytes();
+    size_t paletteBytes = image.palette.size() * sizeof(uint32_t);
+
+    uint8_t header[BlockSize] = {0};
+    PutLE32(header, TagRecord);
+    PutLE64(header + 8, key.pack);
+    PutLE32(header + 16, key.entry);
+    PutLE32(header + 20, key.width);
+    PutLE32(header + 24, key.height);
+    PutLE32(header + 28, key.format);
+    PutLE64(header + 32, payload);
+    PutLE32(header + 40, image.info.width);
+    PutLE32(header + 44, image.info.height);
+    header[48] = image.info.bitDepth;
+    header[49] = image.info.colorType;
+    header[50] = image.info.interlace;
+    header[51] = static_cast<uint8_t>(image.info.channels);
+    PutLE32(header + 52, key.matte);
+    PutLE32(header + 56, static_cast<uint32_t>(image.palette.size()));
+    uint32_t crc = Crc32(header + 8, BlockSize - 8);
+    PutLE32(header + 4, crc);
+
+    static const uint8_t zeros[BlockSize] = {0};
+    size_t padding = static_cast<size_t>(PaddedSize(payload) - payload);
+    if (fwrite(header, 1, sizeof(header), output) != sizeof(header) ||
+        fwrite(image.palette.data(), 1, paletteBytes, output) != paletteBytes ||
+        fwrite(image.pixels.data(), 1, image.pixels.size(), output) != image.pixels.size() ||
+        fwrite(zeros, 1, padding, output) != padding || !SyncFile(output))
+        return false;
+
+    uint8_t commit[BlockSize] = {0};
+    PutLE32(commit, TagCommit);
+    PutLE32(commit + 4, crc);
+    PutLE64(commit + 8, offset);
+    return fwrite(commit, 1, sizeof(commit), output) == sizeof(commit) && SyncFile(output);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Find
+ * The index lookup and any remapping happen under the lock; the copy out
+ * of the mapping does not. A segment the writer has appended to since it
+ * was mapped is mapped again, whole, the first time a record past the old
+ * end is wanted.
+ */
+std::shared_ptr<TDecodedImage> TDiskImageCache::Find(const TDiskImageKey& key)
+{
+    std::shared_ptr<TMappedFile> mapping;
+    TLocation location;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        TIndex::const_iterator found = index.find(key);
+        if (found == index.end()) {
+            misses++;
+            DiskMetrics().misses.Add();
+            return nullptr;
+        }
+        location = found->second;
+        TSegment& segment = segments[location.segment];
+        uint64_t end = location.offset + BlockSize + location.payload;
+        if (!segment.mapping || segment.mapping->Size() < end) {
+            std::shared_ptr<TMappedFile> remapped = std::make_shared<TMappedFile>();
+            try {
+                remapped->Open(segment.path, true);
+            } catch (const std::runtime_error&) {
+                remapped.reset();
+            }
+            if (!remapped || remapped->Size() < end) {
+                misses++;
+                DiskMetrics().misses.Add();
+                return nullptr;
+            }
+            segment.mapping = remapped;
+        }
+        mapping = segment.mapping;
+        hits++;
+    }
+
+    TClock::time_point start = TClock::now();
+    const uint8_t* header = mapping->Data() + location.offset;
+    std::shared_ptr<TDecodedImage> image = std::make_shared<TDecodedImage>();
+    image->info.width = GetLE32(header + 40);
+    image->info.height = GetLE32(header + 44);
+    image->info.bitDepth = header[48];
+    image->info.colorType = header[49];
+    image->info.interlace = header[50];
+    image->info.channels = header[51];
+    image->format = static_cast<TImageFormat>(GetLE32(header + 28));
+    const uint8_t* payload = header + BlockSize;
+    size_t colours = GetLE32(header + 56);
+    image->palette.resize(colours);
+    memcpy(image->palette.data(), payload, colours * sizeof(uint32_t));
+    payload += colours * sizeof(uint32_t);
+    image->pixels.assign(payload, header + BlockSize + location.payload);
+    DiskMetrics().read.Record(NanosecondsSince(start));
+    DiskMetrics().hits.Add();
+    return image;
+}
+
+bool TDiskImageCache::Contains(const TDiskImageKey& key) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return index.count(key) != 0;
+}
+
+/*
+ * Store
+ * An image already in the active generation is left alone; one in the
+ * previous generation is written again, which is what keeps it alive past
+ * the next rotation. A failed write leaves a torn tail behind, so the
+ * next store starts a new generation rather than appending after it.
+ */
+bool TDiskImageCache::Store(const TDiskImageKey& key, const TDecodedImage& image)
+{
+    if (!Writable())
+        return false;
+    std::lock_guard<std::mutex> writing(writeLock);
+    bool refresh = false;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        TIndex::const_iterator found = index.find(key);
+        if (found != index.end()) {
+            if (found->second.segment == 1)
+                return true;
+            refresh = true;
+        }
+    }
+
+    uint64_t payload = image.Bytes();
+    uint64_t recordSize = RecordSize(payload);
+    uint64_t generationCap = capBytes / 2;
+    uint64_t expected;
+    if (image.format != key.format ||
+        !PayloadSize(image.format, image.info.width, image.info.height, image.palette.size(),
+                     expected) ||
+        payload != expected || BlockSize + recordSize > generationCap)
+        return false;
+    if (output == nullptr || segments[1].size + recordSize > generationCap) {
+        if (!StartGeneration(segments[1].generation + 1))
+            return false;
+        std::lock_guard<std::mutex> guard(lock);
+        refresh = refresh && index.count(key) != 0;
+    }
+    if (!Append(key, image)) {
+        fclose(output);
+        output = nullptr;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    TLocation location;
+    location.segment = 1;
+    location.offset = segments[1].size;
+    location.payload = payload;
+    index[key] = location;
+    segments[1].size += recordSize;
+    stores++;
+    if (refresh)
+        refreshed++;
+    DiskMetrics().stores.Add();
+    return true;
+}
+
+TDiskCacheStats TDiskImageCache::Stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    TDiskCacheStats stats;
+    stats.writable = Writable();
+    stats.generation = segments[1].generation;
+    stats.records = index.size();
+    stats.bytes = segments[0].size + segments[1].size;
+    stats.capBytes = capBytes;
+    stats.hits = hits;
+    stats.misses = misses;
+    stats.stores = stores;
+    stats.refreshed = refreshed;
+    stats.rotations = rotations;
+    stats.discarded = discarded;
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+uint64_t PackFingerprint(const TPackVolumeSet& pack)
+{
+    uint64_t hash = 0xCBF29CE484222325ull;     // FNV-1a
+    for (size_t i = 0; i < pack.Count(); i++) {
+        const TPackEntry& entry = pack.Entry(i);
+        uint8_t fields[12];
+        PutLE64(fields, entry.size);
+        PutLE32(fields + 8, entry.crc32);
+        for (size_t c = 0; c < entry.name.size(); c++)
+            hash = (hash ^ static_cast<uint8_t>(entry.name[c])) * 0x100000001B3ull;
+        for (size_t c = 0; c < sizeof(fields); c++)
+            hash = (hash ^ fields[c]) * 0x100000001B3ull;
+    }
+    return hash;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Disk Cache Benchmark
+ * The first pass is a first launch: every PNG entry is decoded and
+ * stored. The cache is then closed and opened again, as the next launch
+ * would, and every entry read back in a random order.
+ */
+static void WriteLatencyRow(std::ostream& out, const char* name, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    out << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(3)
+        << std::setw(10) << samples[samples.size() / 2]
+        << std::setw(10) << samples[std::min(samples.size() - 1, samples.size() * 99 / 100)]
+        << std::setw(10) << samples.back() << std::endl;
+}
+
+void RunDiskCacheBench(const TPackVolumeSet& pack, const std::string& folder, uint64_t capBytes,
+                       std::ostream& out)
+{
+    std::vector<size_t> entries = PngEntries(pack);
+    if (entries.empty()) {
+        out << "No PNG entries\n";
+        return;
+    }
+    TMappedFile::MakeFolders(folder);
+    std::vector<uint64_t> old = ListGenerations(folder);
+    for (size_t i = 0; i < old.size(); i++)
+        RemoveFile(folder + "/" + SegmentPrefix + std::to_string(old[i]) + SegmentSuffix);
+
+    uint64_t fingerprint = PackFingerprint(pack);
+    std::vector<double> decodeMs, storeMs, readMs;
+    uint64_t rawBytes = 0;
+    {
+        TDiskImageCache cache(folder, capBytes);
+        if (!cache.Writable())
+            throw std::runtime_error("Another process is writing to " + folder);
+        for (size_t i = 0; i < entries.size(); i++) {
+            TClock::time_point start = TClock::now();
+            TDecodedImage image;
+            DecodePngEntry(pack, entries[i], image);
+            decodeMs.push_back(NanosecondsSince(start) / 1e6);
+            rawBytes += image.pixels.size();
+            start = TClock::now();
+            cache.Store(TDiskImageKey(fingerprint, entries[i]), image);
+            storeMs.push_back(NanosecondsSince(start) / 1e6);
+        }
+    }
+
+    TClock::time_point start = TClock::now();
+    TDiskImageCache cache(folder, capBytes);
+    double openMs = NanosecondsSince(start) / 1e6;
+    std::mt19937 random(1);
+    std::shuffle(entries.begin(), entries.end(), random);
+    for (size_t i = 0; i < entries.size(); i++) {
+        start = TClock::now();
+        bool found = cache.Find(TDiskImageKey(fingerprint, entries[i])) != nullptr;
+        if (found)
+            readMs.push_back(NanosecondsSince(start) / 1e6);
+    }
+
+    TDiskCacheStats stats = cache.Stats();
+    out << "Images: " << entries.size() << ", " << std::fixed << std::setprecision(1)
+        << rawBytes / 1048576.0 << " MB decoded; cap " << capBytes / 1048576.0 << " MB, "
+        << stats.records << " images kept in " << stats.bytes / 1048576.0
+        << " MB (generation " << stats.generation << ")\n"
+        << "Reopen: " << std::setprecision(2) << openMs << " ms to scan, " << readMs.size()
+        << " of " << entries.size() << " found\n"
+        << std::left << std::setw(10) << "click" << std::right << std::setw(10) << "p50 ms"
+        << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << std::endl;
+    WriteLatencyRow(out, "decode", decodeMs);
+    WriteLatencyRow(out, "store", storeMs);
+    if (!readMs.empty())
+        WriteLatencyRow(out, "disk", readMs);
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,187 @@
+﻿/*
+ * DiskImageCache.h - Persistent Decoded Image Cache
+ *
+ * Declares the on-disk cache that lets a second launch show any flag seen
+ * before at memcpy cost instead of decoding it again. Decoded pixels are
+ * stored raw, keyed by (pack fingerprint, entry, size, pixel format,
+ * matte), and read straight out of a read-only memory mapping.
+ *
+ * Layout: a folder holding two generations of append-only segment files,
+ * "images-<generation>.cache", and a "writer.lock" file. Each segment is
+ * a 64-byte header followed by records:
+ *
+ *   record header  64 bytes: tag, CRC-32 of the rest, key, image size,
+ *                  PNG info, payload size, palette size
+ *   payload        palette (ifIndexed8 only) and raw pixels, padded to
+ *                  64 bytes
+ *   commit         64 bytes: tag, the header's CRC and the record offset
+ *
+ * Crash safety: the payload is flushed to disk before its commit record is
+ * written, and a record only counts once its commit is there and matches.
+ * A torn tail is ignored on open and the writer starts a new generation
+ * rather than appending after it, so nothing is ever rewritten in place.
+ *
+ * Eviction: each generation holds at most half the size cap. When the
+ * active one is full it becomes the previous one, and the old previous one
+ * is deleted. A record found in the previous generation is stored again in
+ * the active one (see Store()), so images in use survive and ones nobody
+ * looked at for a whole generation drop out: a two-generation LRU.
+ *
+ * One process at a time writes: the first to take writer.lock. Others open
+ * the cache read-only and see what was committed when they opened it.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef DiskImageCacheH
+#define DiskImageCacheH
+//---------------------------------------------------------------------------
+
+#include "DecodeScheduler.h"      // TDecodedImage, TPackVolumeSet
+
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+
+//---------------------------------------------------------------------------
+
+class TMappedFile;
+
+/*
+ * TDiskImageKey - What A Record Holds
+ * A size of 0 x 0 means the image's own size; anything else a copy
+ * scaled to that size. BGRA keeps its alpha, so its matte is always 0.
+ */
+struct TDiskImageKey
+{
+    uint64_t pack;                  // PackFingerprint()
+    uint32_t entry;
+    uint32_t width;
+    uint32_t height;
+    uint32_t format;                // TImageFormat
+    uint32_t matte;                 // TImageOutput::matte
+
+    TDiskImageKey() : pack(0), entry(0), width(0), height(0), format(ifBgra32), matte(0) {}
+    TDiskImageKey(uint64_t pack, size_t entry, const TImageOutput& output = TImageOutput())
+        : pack(pack), entry(static_cast<uint32_t>(entry)), width(0), height(0),
+          format(output.format), matte(output.format == ifBgra32 ? 0 : output.matte)
+    {
+    }
+
+    bool operator==(const TDiskImageKey& other) const
+    {
+        return pack == other.pack && entry == other.entry && width == other.width &&
+               height == other.height && format == other.format && matte == other.matte;
+    }
+};
+
+struct TDiskImageKeyHash
+{
+    size_t operator()(const TDiskImageKey& key) const;
+};
+
+/*
+ * TDiskCacheStats - Counters Since Open
+ */
+struct TDiskCacheStats
+{
+    bool writable;                  // This process holds the writer lock
+    uint64_t generation;            // Active segment
+    size_t records;                 // Committed, in both generations
+    uint64_t bytes;                 // Both segment files
+    uint64_t capBytes;
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;                // Records appended
+    uint64_t refreshed;             // Of those, copies out of the previous generation
+    uint64_t rotations;             // Generations started since open
+    uint64_t discarded;             // Torn records found at open
+};
+
+/*
+ * TDiskImageCache - Mapped Two-Generation Segment Files
+ * Thread-safe. Find() never blocks on a Store() in progress; Store()
+ * calls are serialised and flush twice each, so they belong on
+ * background threads.
+ */
+class TDiskImageCache
+{
+  public:
+    // Opens the cache in `folder`, creating it if needed. Throws
+    // std::runtime_error only if the folder cannot be used at all
+    TDiskImageCache(const std::string& folder, uint64_t capBytes);
+    ~TDiskImageCache();
+
+    bool Writable() const { return lockHandle != NoLock; }
+
+    // Copy of the stored image; null if there is none
+    std::shared_ptr<TDecodedImage> Find(const TDiskImageKey& key);
+    bool Contains(const TDiskImageKey& key) const;
+
+    // Appends the image unless the active generation has it already;
+    // false if it was not written (read-only, too large, or I/O error)
+    bool Store(const TDiskImageKey& key, const TDecodedImage& image);
+
+    TDiskCacheStats Stats() const;
+
+  private:
+    struct TLocation
+    {
+        unsigned segment;           // 0 = previous, 1 = active
+        uint64_t offset;            // Of the record header
+        uint64_t payload;           // Palette and pixel bytes
+    };
+    struct TSegment
+    {
+        uint64_t generation;        // 0 = none
+        std::string path;
+        uint64_t size;              // Committed bytes
+        std::shared_ptr<TMappedFile> mapping;
+    };
+    typedef std::unordered_map<TDiskImageKey, TLocation, TDiskImageKeyHash> TIndex;
+
+    static const intptr_t NoLock = -1;
+
+    std::string folder;
+    uint64_t capBytes;
+    intptr_t lockHandle;            // Writer lock file (HANDLE or fd); NoLock when read-only
+
+    mutable std::mutex lock;        // Guards segments, index and counters
+    TSegment segments[2];
+    TIndex index;
+    std::mutex writeLock;           // Serialises Store()
+    FILE* output;                   // Active segment, writer only
+
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t stores;
+    uint64_t refreshed;
+    uint64_t rotations;
+    uint64_t discarded;
+
+    void OpenSegments();
+    void Scan(unsigned segment);
+    bool StartGeneration(uint64_t generation);
+    bool Append(const TDiskImageKey& key, const TDecodedImage& image);
+
+    TDiskImageCache(const TDiskImageCache&);
+    TDiskImageCache& operator=(const TDiskImageCache&);
+};
+
+//---------------------------------------------------------------------------
+
+// Identifies a pack by the name, size and CRC of every entry, so a cache
+// built for one version of a pack is never used for another
+uint64_t PackFingerprint(const TPackVolumeSet& pack);
+
+// Decodes every PNG entry into an empty cache in `folder` (timing the
+// stores), then reads them back the way a second launch would
+void RunDiskCacheBench(const TPackVolumeSet& pack, const std::string& folder, uint64_t capBytes,
+                       std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // DiskImageCacheH
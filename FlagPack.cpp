@@ -0,0 +1,488 @@
+﻿/*
+ * FlagPack.cpp - In-Memory ZIP Archive Reader
+ *
+ * Implements TFlagPack: end-of-central-directory lookup, central directory
+ * parsing, and per-entry sources that read straight from the archive span.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "FlagPack.h"
+#include "Checksum.h"             // Crc32
+#include "MappedFile.h"           // TMappedFile::Prefetch
+#include "Metrics.h"              // MetricCounter, MetricHistogram
+
+#include <cstring>                // memcpy, memcmp, strlen
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+// ZIP record signatures (APPNOTE.TXT, section 4.3)
+static const uint32_t SigLocalHeader = 0x04034B50;
+static const uint32_t SigCentralHeader = 0x02014B50;
+static const uint32_t SigEndOfCentralDir = 0x06054B50;
+static const uint32_t SigZip64EndOfCentralDir = 0x06064B50;
+static const uint32_t SigZip64Locator = 0x07064B50;
+static const uint32_t SigDataDescriptor = 0x08074B50;
+
+static const size_t LocalHeaderSize = 30;
+static const size_t CentralHeaderSize = 46;
+static const size_t EndOfCentralDirSize = 22;
+static const size_t Zip64EndOfCentralDirSize = 56;
+static const size_t Zip64LocatorSize = 20;
+
+static const uint16_t TagZip64 = 0x0001;
+static const uint32_t Max32 = 0xFFFFFFFF;
+static const uint16_t FlagDataDescriptor = 0x0008;
+
+const char* const TFlagPack::IndexSuffix = ".zidx";
+const char* const TFlagPack::HotTag = "flagpack:hot=";
+
+static inline uint16_t ReadLE16(const uint8_t* p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t ReadLE32(const uint8_t* p)
+{
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+
+static inline uint64_t ReadLE64(const uint8_t* p)
+{
+    return static_cast<uint64_t>(ReadLE32(p)) | (static_cast<uint64_t>(ReadLE32(p + 4)) << 32);
+}
+
+/*
+ * ZIP64 Extended Information
+ * The extra field holds 64-bit values for exactly those central header
+ * fields that are 0xFFFFFFFF, in the order size, compressed size, offset.
+ */
+static void ReadZip64Extra(const uint8_t* extra, size_t length, TPackEntry& entry)
+{
+    while (length >= 4) {
+        uint16_t tag = ReadLE16(extra);
+        size_t fieldLength = ReadLE16(extra + 2);
+        if (fieldLength > length - 4)
+            break;
+        if (tag == TagZip64) {
+            const uint8_t* p = extra + 4;
+            const uint8_t* end = p + fieldLength;
+            if (entry.size == Max32 && end - p >= 8) {
+                entry.size = ReadLE64(p);
+                p += 8;
+            }
+            if (entry.compressedSize == Max32 && end - p >= 8) {
+                entry.compressedSize = ReadLE64(p);
+                p += 8;
+            }
+            if (entry.headerOffset == Max32 && end - p >= 8)
+                entry.headerOffset = ReadLE64(p);
+            return;
+        }
+        extra += 4 + fieldLength;
+        length -= 4 + fieldLength;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TEntryInflateSource - Deflated Entry Stream
+ * Owns both the span over the compressed bytes and the inflater reading it.
+ */
+class TEntryInflateSource : public TByteSource
+{
+  public:
+    TEntryInflateSource(const uint8_t* data, size_t size)
+        : span(data, size), inflater(&span) {}
+
+    bool Next(const uint8_t*& data, size_t& size) override
+    {
+        return inflater.Next(data, size);
+    }
+
+  private:
+    TSpanSource span;
+    TInflater inflater;
+};
+//---------------------------------------------------------------------------
+
+TCheckedEntrySource::TCheckedEntrySource(TByteSource* source, const TPackEntry& entry)
+    : source(source), expectedCrc(entry.crc32), expectedSize(entry.size), crc(0), total(0),
+      checked(false)
+{
+}
+
+bool TCheckedEntrySource::Next(const uint8_t*& data, size_t& size)
+{
+    if (source->Next(data, size)) {
+        crc = Crc32(data, size, crc);
+        total += size;
+        return true;
+    }
+    if (!checked) {
+        static TCounter& failures = MetricCounter("zip_entry_crc_failures_total",
+                                                  "Entry streams failing their CRC-32 check");
+        checked = true;
+        if (total != expectedSize || crc != expectedCrc) {
+            failures.Add();
+            throw EDecodeError("Entry CRC-32 mismatch");
+        }
+    }
+    return false;
+}
+//---------------------------------------------------------------------------
+
+TFlagPack::TFlagPack() : data(nullptr), size(0), hotBytes(0), directoryOffset(0)
+{
+}
+
+void TFlagPack::Close()
+{
+    data = nullptr;
+    size = 0;
+    hotBytes = 0;
+    directoryOffset = 0;
+    entries.clear();
+    nameIndex.clear();
+
+    std::lock_guard<std::mutex> lock(indexLock);
+    indexes.clear();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Open Archive
+ */
+void TFlagPack::Open(const void* archive, size_t archiveSize)
+{
+    Close();
+    const uint8_t* base = static_cast<const uint8_t*>(archive);
+    if (base == nullptr || archiveSize < EndOfCentralDirSize)
+        throw EDecodeError("Archive is too small");
+
+    uint64_t needFrom;
+    ParseDirectory(base, archiveSize, archiveSize, needFrom);   // The whole archive: never short
+    data = base;
+    size = archiveSize;
+}
+
+bool TFlagPack::OpenDirectory(const void* tail, size_t tailSize, uint64_t archiveSize,
+                              uint64_t& needFrom)
+{
+    Close();
+    if (tail == nullptr || tailSize < EndOfCentralDirSize || tailSize > archiveSize)
+        throw EDecodeError("Archive is too small");
+    return ParseDirectory(static_cast<const uint8_t*>(tail), tailSize, archiveSize, needFrom);
+}
+
+/*
+ * Parse Directory
+ * Scans backwards for the end-of-central-directory record (it may be
+ * followed by a comment of up to 64 KB), follows the ZIP64 locator when
+ * present, then reads every central directory header into the entry table.
+ * `tail` holds the archive from archiveSize - tailSize on; anything the
+ * walk needs before that is reported through `needFrom` instead.
+ */
+bool TFlagPack::ParseDirectory(const uint8_t* tail, size_t tailSize, uint64_t archiveSize,
+                               uint64_t& needFrom)
+{
+    static TCounter& opens = MetricCounter("zip_archive_opens_total",
+                                           "Archives whose directory was parsed");
+    static TCounter& entriesRead = MetricCounter("zip_archive_entries_total",
+                                                 "Directory entries parsed");
+    static THistogram& openTime = MetricHistogram("zip_archive_open_seconds",
+                                                  "Time to parse an archive directory");
+    THistogram::TClock::time_point start = THistogram::TClock::now();
+    uint64_t tailStart = archiveSize - tailSize;
+
+    // Locate the end of central directory record
+    const uint8_t* eocd = nullptr;
+    uint64_t maxBack = archiveSize < EndOfCentralDirSize + 0xFFFF
+                           ? archiveSize : EndOfCentralDirSize + 0xFFFF;
+    size_t scanLimit = tailSize < maxBack ? tailSize : static_cast<size_t>(maxBack);
+    for (size_t back = EndOfCentralDirSize; back <= scanLimit; back++) {
+        const uint8_t* p = tail + tailSize - back;
+        if (ReadLE32(p) == SigEndOfCentralDir) {
+            eocd = p;
+            break;
+        }
+    }
+    if (eocd == nullptr && scanLimit < maxBack) {
+        needFrom = archiveSize - maxBack;
+        return false;
+    }
+    if (eocd == nullptr)
+        throw EDecodeError("End of central directory not found");
+
+    uint64_t entryCount = ReadLE16(eocd + 10);
+    uint64_t dirSize = ReadLE32(eocd + 12);
+    uint64_t dirOffset = ReadLE32(eocd + 16);
+
+    // ZIP64 archives put the real values in a record found via the locator
+    // that sits directly before the classic end record
+    uint64_t eocdOffset = tailStart + (eocd - tail);
+    if (static_cast<size_t>(eocd - tail) < Zip64LocatorSize && tailStart > 0 &&
+        eocdOffset >= Zip64LocatorSize) {
+        needFrom = eocdOffset - Zip64LocatorSize;
+        return false;
+    }
+    if (static_cast<size_t>(eocd - tail) >= Zip64LocatorSize &&
+        ReadLE32(eocd - Zip64LocatorSize) == SigZip64Locator) {
+        uint64_t recordOffset = ReadLE64(eocd - Zip64LocatorSize + 8);
+        if (recordOffset > archiveSize || archiveSize - recordOffset < Zip64EndOfCentralDirSize)
+            throw EDecodeError("Corrupt ZIP64 end of central directory");
+        if (recordOffset < tailStart) {
+            needFrom = recordOffset;
+            return false;
+        }
+        const uint8_t* record = tail + (recordOffset - tailStart);
+        if (ReadLE32(record) != SigZip64EndOfCentralDir)
+            throw EDecodeError("Corrupt ZIP64 end of central directory");
+        entryCount = ReadLE64(record + 32);
+        dirSize = ReadLE64(record + 40);
+        dirOffset = ReadLE64(record + 48);
+    }
+    if (dirOffset > archiveSize || dirSize > archiveSize - dirOffset ||
+        entryCount > dirSize / CentralHeaderSize)
+        throw EDecodeError("Central directory out of range");
+    if (dirOffset < tailStart) {
+        needFrom = dirOffset;
+        return false;
+    }
+
+    // Walk the central directory
+    entries.reserve(static_cast<size_t>(entryCount));
+    nameIndex.reserve(static_cast<size_t>(entryCount));
+    const uint8_t* p = tail + (dirOffset - tailStart);
+    const uint8_t* dirEnd = p + dirSize;
+    for (uint64_t i = 0; i < entryCount; i++) {
+        if (dirEnd - p < static_cast<ptrdiff_t>(CentralHeaderSize) ||
+            ReadLE32(p) != SigCentralHeader)
+            throw EDecodeError("Corrupt central directory");
+
+        size_t nameLength = ReadLE16(p + 28);
+        size_t extraLength = ReadLE16(p + 30);
+        size_t commentLength = ReadLE16(p + 32);
+        size_t recordSize = CentralHeaderSize + nameLength + extraLength + commentLength;
+        if (static_cast<size_t>(dirEnd - p) < recordSize)
+            throw EDecodeError("Corrupt central directory");
+
+        TPackEntry entry;
+        entry.flags = ReadLE16(p + 8);
+        entry.method = ReadLE16(p + 10);
+        entry.dosTime = ReadLE16(p + 12);
+        entry.dosDate = ReadLE16(p + 14);
+        entry.crc32 = ReadLE32(p + 16);
+        entry.compressedSize = ReadLE32(p + 20);
+        entry.size = ReadLE32(p + 24);
+        entry.headerOffset = ReadLE32(p + 42);
+        entry.name.assign(reinterpret_cast<const char*>(p + CentralHeaderSize), nameLength);
+        if (entry.size == Max32 || entry.compressedSize == Max32 || entry.headerOffset == Max32)
+            ReadZip64Extra(p + CentralHeaderSize + nameLength, extraLength, entry);
+
+        nameIndex[entry.name] = entries.size();
+        entries.push_back(entry);
+        p += recordSize;
+    }
+
+    // Hot region recorded by ReorderPack() in the archive comment
+    size_t commentLength = ReadLE16(eocd + 20);
+    const char* comment = reinterpret_cast<const char*>(eocd + EndOfCentralDirSize);
+    size_t tagLength = strlen(HotTag);
+    if (commentLength > tagLength &&
+        static_cast<size_t>(tail + tailSize - (eocd + EndOfCentralDirSize)) >= commentLength &&
+        memcmp(comment, HotTag, tagLength) == 0) {
+        for (size_t i = tagLength; i < commentLength && comment[i] >= '0' && comment[i] <= '9'; i++)
+            hotBytes = hotBytes * 10 + (comment[i] - '0');
+        if (hotBytes > archiveSize)
+            hotBytes = 0;
+    }
+
+    directoryOffset = dirOffset;
+
+    opens.Add();
+    entriesRead.Add(entries.size());
+    openTime.RecordSince(start);
+    return true;
+}
+
+/*
+ * Prefetch Hot Region
+ * Reordered packs keep every frequently used entry at the front, so one
+ * sequential read brings in the typical session's working set.
+ */
+void TFlagPack::PrefetchHot() const
+{
+    if (hotBytes > 0 && data != nullptr)
+        TMappedFile::Prefetch(data, static_cast<size_t>(hotBytes));
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Find Entry By Name
+ */
+int TFlagPack::Find(const std::string& name) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = nameIndex.find(name);
+    return it == nameIndex.end() ? -1 : static_cast<int>(it->second);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Locate Entry Data
+ * The local header repeats the name and may carry a different extra field,
+ * so the data offset has to be computed from the local header itself.
+ */
+const uint8_t* TFlagPack::EntryData(size_t index) const
+{
+    const TPackEntry& entry = entries[index];
+    if (entry.headerOffset > size || size - entry.headerOffset < LocalHeaderSize)
+        throw EDecodeError("Local header out of range");
+
+    const uint8_t* local = data + entry.headerOffset;
+    if (ReadLE32(local) != SigLocalHeader)
+        throw EDecodeError("Corrupt local header");
+
+    uint64_t dataOffset = entry.headerOffset + LocalHeaderSize +
+                          ReadLE16(local + 26) + ReadLE16(local + 28);
+    if (dataOffset > size || size - dataOffset < entry.compressedSize)
+        throw EDecodeError("Entry data out of range");
+    return data + dataOffset;
+}
+
+/*
+ * Entry Extent
+ * A data descriptor may follow the data when flag bit 3 is set; its
+ * signature is optional, and ZIP64 entries use 8-byte sizes in it.
+ */
+uint64_t TFlagPack::EntryExtent(size_t index) const
+{
+    const TPackEntry& entry = entries[index];
+    const uint8_t* end = EntryData(index) + entry.compressedSize;
+    uint64_t extent = static_cast<uint64_t>(end - (data + entry.headerOffset));
+    if (entry.flags & FlagDataDescriptor) {
+        bool signature = static_cast<size_t>(data + size - end) >= 4 &&
+                         ReadLE32(end) == SigDataDescriptor;
+        bool zip64 = entry.size >= Max32 || entry.compressedSize >= Max32;
+        extent += (signature ? 4 : 0) + 4 + (zip64 ? 16 : 8);
+    }
+    return extent;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Open Entry Stream
+ * Stored entries need no decoding at all: their bytes are handed out as a
+ * single span of the archive. Deflated entries get a streaming inflater.
+ */
+std::unique_ptr<TByteSource> TFlagPack::OpenEntry(size_t index) const
+{
+    const TPackEntry& entry = entries[index];
+    const uint8_t* bytes = EntryData(index);
+    size_t length = static_cast<size_t>(entry.compressedSize);
+
+    TByteSource* source;
+    if (entry.method == MethodStored)
+        source = new TSpanSource(bytes, length);
+    else if (entry.method == MethodDeflated)
+        source = new TEntryInflateSource(bytes, length);
+    else
+        throw EDecodeError("Unsupported compression method");
+    return std::unique_ptr<TByteSource>(new TCheckedEntrySource(source, entry));
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Entry Checkpoint Index
+ * Prefers a prebuilt "<name>.zidx" companion entry; otherwise inflates the
+ * entry once to build the index. Built indexes are cached for the lifetime
+ * of the pack. The lock is not held while building, so two threads may
+ * race to build the same index; the first one stored wins.
+ */
+std::shared_ptr<const TInflateIndex> TFlagPack::EntryIndex(size_t index) const
+{
+    const TPackEntry& entry = entries[index];
+    if (entry.method != MethodDeflated || entry.size < IndexThreshold)
+        return std::shared_ptr<const TInflateIndex>();
+
+    static TCounter& hits = MetricCounter("zip_index_cache_hits_total",
+                                          "Inflate index lookups served from the cache");
+    static TCounter& misses = MetricCounter("zip_index_cache_misses_total",
+                                            "Inflate indexes loaded or built");
+    {
+        std::lock_guard<std::mutex> lock(indexLock);
+        std::unordered_map<size_t, std::shared_ptr<const TInflateIndex> >::const_iterator it =
+            indexes.find(index);
+        if (it != indexes.end()) {
+            hits.Add();
+            return it->second;
+        }
+    }
+    misses.Add();
+
+    std::shared_ptr<TInflateIndex> built(new TInflateIndex());
+    int companion = Find(entry.name + IndexSuffix);
+    if (companion >= 0 && entries[companion].method == MethodStored) {
+        built->Deserialize(EntryData(companion),
+                           static_cast<size_t>(entries[companion].compressedSize));
+    } else {
+        built->Build(EntryData(index), static_cast<size_t>(entry.compressedSize));
+    }
+
+    std::lock_guard<std::mutex> lock(indexLock);
+    std::shared_ptr<const TInflateIndex>& slot = indexes[index];
+    if (!slot)
+        slot = built;
+    return slot;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Random Access Read
+ * Stored entries are a plain copy out of the archive span. Large deflated
+ * entries resume from the nearest checkpoint; small ones are inflated from
+ * the start, which is cheaper than keeping an index for them.
+ */
+size_t TFlagPack::ReadAt(size_t index, uint64_t offset, void* dst, size_t length) const
+{
+    const TPackEntry& entry = entries[index];
+    if (offset >= entry.size)
+        return 0;
+    if (length > entry.size - offset)
+        length = static_cast<size_t>(entry.size - offset);
+
+    if (entry.method == MethodStored) {
+        memcpy(dst, EntryData(index) + offset, length);
+        return length;
+    }
+
+    std::shared_ptr<const TInflateIndex> checkpoints = EntryIndex(index);
+    if (checkpoints)
+        return checkpoints->Read(EntryData(index), static_cast<size_t>(entry.compressedSize),
+                                 offset, dst, length);
+
+    // Small entry: inflate from the start and discard up to the offset
+    std::unique_ptr<TByteSource> source = OpenEntry(index);
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    uint64_t pos = 0;
+    size_t done = 0;
+    const uint8_t* chunk;
+    size_t chunkSize;
+    while (done < length && source->Next(chunk, chunkSize)) {
+        uint64_t chunkEnd = pos + chunkSize;
+        if (chunkEnd > offset + done) {
+            size_t skip = static_cast<size_t>(offset + done - pos);
+            size_t n = chunkSize - skip;
+            if (n > length - done)
+                n = length - done;
+            memcpy(to + done, chunk + skip, n);
+            done += n;
+        }
+        pos = chunkEnd;
+    }
+    return done;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,167 @@
+﻿/*
+ * FlagPack.h - In-Memory ZIP Archive Reader
+ *
+ * Declares TFlagPack, a read-only ZIP reader that works directly on the
+ * archive bytes (e.g. the locked flags.RES resource) without copying them
+ * into a stream first.
+ *
+ * Key Features:
+ * - Parses the central directory once and indexes entries by name
+ * - Reads ZIP64 archives (over 65535 entries or 4 GB) as well as classic ones
+ * - Stored entries are exposed as spans of the archive itself
+ * - Deflated entries are exposed as streaming TInflater sources
+ * - Entry streams read to the end are checked against the entry's CRC-32
+ * - Random access reads into large deflated entries through checkpoint
+ *   indexes (TInflateIndex), built on first access or loaded from a
+ *   "<name>.zidx" companion entry written by the pack builder
+ * - The directory alone can be parsed from the archive's tail, for
+ *   archives whose bytes are fetched elsewhere (RemotePack.h)
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef FlagPackH
+#define FlagPackH
+//---------------------------------------------------------------------------
+
+#include "Inflate.h"              // TByteSource, TInflater, EDecodeError
+#include "InflateIndex.h"         // TInflateIndex checkpoints for random access
+
+#include <cstdint>
+#include <memory>                 // std::unique_ptr, std::shared_ptr
+#include <mutex>                  // Guards the lazily built index cache
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPackEntry - One Central Directory Record
+ */
+struct TPackEntry
+{
+    std::string name;               // UTF-8 path inside the archive
+    uint16_t method;                // 0 = stored, 8 = deflated
+    uint16_t flags;                 // General purpose bit flags
+    uint16_t dosTime;               // Modification time (MS-DOS format)
+    uint16_t dosDate;               // Modification date (MS-DOS format)
+    uint32_t crc32;                 // CRC-32 of the uncompressed data
+    uint64_t compressedSize;
+    uint64_t size;                  // Uncompressed size
+    uint64_t headerOffset;          // Offset of the local file header
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TCheckedEntrySource - CRC-Verified Entry Stream
+ * Passes an entry's bytes through unchanged and, once the stream runs dry,
+ * compares their CRC-32 and length with the directory record, throwing
+ * EDecodeError on a mismatch. Readers that stop early are not checked.
+ */
+class TCheckedEntrySource : public TByteSource
+{
+  public:
+    TCheckedEntrySource(TByteSource* source, const TPackEntry& entry);
+
+    bool Next(const uint8_t*& data, size_t& size) override;
+
+  private:
+    std::unique_ptr<TByteSource> source;
+    uint32_t expectedCrc;
+    uint64_t expectedSize;
+    uint32_t crc;
+    uint64_t total;
+    bool checked;
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TFlagPack - ZIP Archive Over A Memory Span
+ *
+ * The span passed to Open() must stay valid for the lifetime of the pack
+ * and of every source returned by OpenEntry().
+ */
+class TFlagPack
+{
+  public:
+    static const uint16_t MethodStored = 0;
+    static const uint16_t MethodDeflated = 8;
+
+    // Deflated entries at least this large get a checkpoint index
+    static const uint64_t IndexThreshold = 2 * TInflateIndex::DefaultSpan;
+
+    // Name suffix of companion entries holding a serialized TInflateIndex
+    static const char* const IndexSuffix;
+
+    // Archive comment tag written by ReorderPack(): "flagpack:hot=<bytes>"
+    static const char* const HotTag;
+
+    TFlagPack();
+
+    // Parses the archive; throws EDecodeError if it is not a valid ZIP
+    void Open(const void* data, size_t size);
+
+    // Parses only the directory, from the last `tailSize` bytes of an
+    // archive of `archiveSize` bytes. Returns false, with the archive
+    // offset the tail has to start at in `needFrom`, if the tail does not
+    // hold all of it. Entry data cannot be read from a pack opened this way
+    bool OpenDirectory(const void* tail, size_t tailSize, uint64_t archiveSize,
+                       uint64_t& needFrom);
+    void Close();
+
+    size_t Count() const { return entries.size(); }
+    const TPackEntry& Entry(size_t index) const { return entries[index]; }
+
+    // Length of the leading archive region holding the frequently used
+    // entries (0 if the pack was not ordered by access frequency)
+    uint64_t HotBytes() const { return hotBytes; }
+
+    // Hints the OS to read the hot region in one sequential request
+    void PrefetchHot() const;
+
+    // Where the central directory starts; everything before it is entry
+    // data, or dead space left behind by in-place updates
+    uint64_t DirectoryOffset() const { return directoryOffset; }
+
+    // Index of the named entry, or -1 if it does not exist
+    int Find(const std::string& name) const;
+
+    // Compressed bytes of an entry, located through its local header
+    const uint8_t* EntryData(size_t index) const;
+
+    // Bytes the entry occupies in the archive: local header, data and data
+    // descriptor, starting at headerOffset
+    uint64_t EntryExtent(size_t index) const;
+
+    // Stream of the uncompressed entry data: the archive span itself for
+    // stored entries, a streaming inflater for deflated ones
+    std::unique_ptr<TByteSource> OpenEntry(size_t index) const;
+
+    // Reads uncompressed bytes at an arbitrary offset. Large deflated entries
+    // cost at most one checkpoint span of inflate; returns the bytes read
+    size_t ReadAt(size_t index, uint64_t offset, void* dst, size_t length) const;
+
+    // Checkpoint index of a large deflated entry (loaded or built on first
+    // use and cached), or nullptr if the entry is stored or small
+    std::shared_ptr<const TInflateIndex> EntryIndex(size_t index) const;
+
+  private:
+    const uint8_t* data;
+    size_t size;
+    uint64_t hotBytes;
+    uint64_t directoryOffset;
+    std::vector<TPackEntry> entries;
+    std::unordered_map<std::string, size_t> nameIndex;
+
+    mutable std::mutex indexLock;
+    mutable std::unordered_map<size_t, std::shared_ptr<const TInflateIndex> > indexes;
+
+    bool ParseDirectory(const uint8_t* tail, size_t tailSize, uint64_t archiveSize,
+                        uint64_t& needFrom);
+};
+
+//---------------------------------------------------------------------------
+#endif // FlagPackH
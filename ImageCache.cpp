@@ -0,0 +1,568 @@
+﻿/*
+ * ImageCache.cpp - Two-Tier Decoded Image Cache
+ *
+ * Implements the hot and cold tiers, promotion on cold and disk hits, and
+ * the cache benchmarks.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "ImageCache.h"
+#include "DiskImageCache.h"       // TDiskImageCache
+#include "Lz4.h"                  // Lz4Compress, Lz4Decompress
+#include "Metrics.h"              // MetricCounter, MetricGauge, MetricHistogram
+
+#include <algorithm>
+#include <chrono>
+#include <iomanip>
+#include <random>
+#include <string>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static uint64_t NanosecondsSince(TClock::time_point start)
+{
+    return static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - start).count());
+}
+
+/*
+ * Process-Wide Cache Metrics
+ * Summed over every cache; the byte gauges move with each change.
+ */
+struct TImageCacheMetrics
+{
+    TCounter& hotHits;
+    TCounter& coldHits;
+    TCounter& diskHits;
+    TCounter& misses;
+    TCounter& evictions;
+    TGauge& hotBytes;
+    TGauge& coldBytes;
+    THistogram& promote;
+
+    TImageCacheMetrics()
+        : hotHits(MetricCounter("zip_cache_hot_hits_total", "Image cache hits on raw pixels")),
+          coldHits(MetricCounter("zip_cache_cold_hits_total",
+                                 "Image cache hits decompressed from the LZ4 tier")),
+          diskHits(MetricCounter("zip_cache_disk_hits_total",
+                                 "Image cache hits copied out of the disk cache")),
+          misses(MetricCounter("zip_cache_misses_total", "Image cache lookups that found nothing")),
+          evictions(MetricCounter("zip_cache_evictions_total",
+                                  "Images dropped from the compressed tier")),
+          hotBytes(MetricGauge("zip_cache_hot_bytes", "Raw pixel bytes in image cache hot tiers")),
+          coldBytes(MetricGauge("zip_cache_cold_bytes", "Compressed bytes in image cache cold tiers")),
+          promote(MetricHistogram("zip_cache_promote_seconds",
+                                  "Time to decompress a cold hit into the hot tier"))
+    {
+    }
+};
+
+static TImageCacheMetrics& CacheMetrics()
+{
+    static TImageCacheMetrics metrics;
+    return metrics;
+}
+//---------------------------------------------------------------------------
+
+TImageCache::TImageCache(size_t hotBudget, size_t coldBudget, TCachePolicy policy)
+    : hotPolicy(hotBudget, policy), coldPolicy(coldBudget, policy), hotBudget(hotBudget),
+      coldBudget(coldBudget), hotBytes(0), coldBytes(0), coldRawBytes(0), disk(nullptr),
+      diskPack(0), hotHits(0), coldHits(0), diskHits(0), misses(0), inserts(0), evictions(0),
+      compressNs(0), promoteNs(0), maxPromoteNs(0)
+{
+}
+
+TImageCache::~TImageCache()
+{
+    Clear();
+}
+
+/*
+ * Look Up
+ * Every lookup but a FindHot() miss counts towards the frequency of the
+ * entry in both tiers, whether it hits or not: the sketch has to see the
+ * misses to know what is worth admitting.
+ *
+ * Decompression runs outside the lock, so one thread promoting a cold
+ * image does not hold up hot hits on the others. Two threads promoting
+ * the same image both decompress it; the second copy is simply dropped.
+ * The disk cache is read the same way. A disk hit goes to the hot tier
+ * only: compressing it is the inserting thread's job (see Insert()).
+ */
+std::shared_ptr<const TDecodedImage> TImageCache::FindHot(size_t entry)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    THotMap::const_iterator found = hot.find(entry);
+    if (found == hot.end())
+        return nullptr;
+    hotPolicy.Record(entry);
+    coldPolicy.Record(entry);
+    hotPolicy.Touch(entry);
+    hotHits++;
+    CacheMetrics().hotHits.Add();
+    return found->second;
+}
+
+std::shared_ptr<const TDecodedImage> TImageCache::Find(size_t entry, TCacheTier* tier)
+{
+    TColdImage packed;
+    TDiskImageCache* backing;
+    TDiskImageKey key;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        hotPolicy.Record(entry);
+        coldPolicy.Record(entry);
+        THotMap::const_iterator found = hot.find(entry);
+        if (found != hot.end()) {
+            hotPolicy.Touch(entry);
+            hotHits++;
+            CacheMetrics().hotHits.Add();
+            if (tier)
+                *tier = ctHot;
+            return found->second;
+        }
+        TColdMap::const_iterator compressed = cold.find(entry);
+        if (compressed != cold.end()) {
+            coldPolicy.Touch(entry);
+            packed = compressed->second;
+        }
+        backing = disk;
+        key = DiskKey(entry);
+    }
+    if (!packed.packed)
+        return FindOnDisk(entry, backing, key, tier);
+
+    TClock::time_point start = TClock::now();
+    std::shared_ptr<TDecodedImage> image = std::make_shared<TDecodedImage>();
+    image->info = packed.info;
+    image->format = packed.format;
+    image->palette = packed.palette;
+    image->pixels.resize(packed.rawSize);
+    Lz4Decompress(packed.packed->data(), packed.packed->size(), image->pixels.data(), packed.rawSize);
+    uint64_t ns = NanosecondsSince(start);
+    CacheMetrics().promote.Record(ns);
+
+    std::lock_guard<std::mutex> guard(lock);
+    coldHits++;
+    CacheMetrics().coldHits.Add();
+    promoteNs += ns;
+    maxPromoteNs = std::max(maxPromoteNs, ns);
+    if (tier)
+        *tier = ctCold;
+    THotMap::const_iterator raced = hot.find(entry);
+    if (raced != hot.end())
+        return raced->second;
+    AddHot(entry, image);
+    return image;
+}
+
+std::shared_ptr<const TDecodedImage> TImageCache::FindOnDisk(size_t entry,
+                                                             TDiskImageCache* backing,
+                                                             const TDiskImageKey& key,
+                                                             TCacheTier* tier)
+{
+    std::shared_ptr<const TDecodedImage> image;
+    if (backing)
+        image = backing->Find(key);
+
+    std::lock_guard<std::mutex> guard(lock);
+    if (!image) {
+        misses++;
+        CacheMetrics().misses.Add();
+        if (tier)
+            *tier = ctNone;
+        return nullptr;
+    }
+    diskHits++;
+    CacheMetrics().diskHits.Add();
+    if (tier)
+        *tier = ctDisk;
+    THotMap::const_iterator raced = hot.find(entry);
+    if (raced != hot.end())
+        return raced->second;
+    AddHot(entry, image);
+    return image;
+}
+
+bool TImageCache::Contains(size_t entry) const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return hot.count(entry) != 0 || cold.count(entry) != 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Insert
+ * The image is compressed once, before the lock is taken; an image the
+ * cold tier already holds is not compressed again. The disk store comes
+ * first and is not skipped for images already cached: storing an image
+ * the disk cache has in its previous generation is what keeps it there.
+ * The cold tier's policy may turn the image away again at once, if the
+ * window has to give up an image that is used less than the ones in
+ * the main region.
+ */
+void TImageCache::Insert(size_t entry, const std::shared_ptr<const TDecodedImage>& image, bool toHot)
+{
+    TDiskImageCache* backing;
+    TDiskImageKey key;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        inserts++;
+        if (toHot && hot.count(entry) == 0)
+            AddHot(entry, image);
+        backing = disk;
+        key = DiskKey(entry);
+    }
+    if (toHot && backing)
+        backing->Store(key, *image);
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (cold.count(entry) != 0)
+            return;
+    }
+
+    TClock::time_point start = TClock::now();
+    std::shared_ptr<std::vector<uint8_t> > packed = std::make_shared<std::vector<uint8_t> >();
+    Lz4Compress(image->pixels.data(), image->pixels.size(), *packed);
+    packed->shrink_to_fit();
+    uint64_t ns = NanosecondsSince(start);
+
+    std::lock_guard<std::mutex> guard(lock);
+    compressNs += ns;
+    TColdImage added;
+    added.info = image->info;
+    added.format = image->format;
+    added.palette = image->palette;
+    added.rawSize = image->pixels.size();
+    added.packed = packed;
+    if (cold.count(entry) != 0 || added.Bytes() > coldBudget)
+        return;
+    cold[entry] = added;
+    coldBytes += added.Bytes();
+    coldRawBytes += added.RawBytes();
+    CacheMetrics().coldBytes.Add(static_cast<int64_t>(added.Bytes()));
+    std::vector<size_t> evicted;
+    coldPolicy.Add(entry, added.Bytes(), evicted);
+    DropCold(evicted);
+}
+
+bool TImageCache::Restore(size_t entry)
+{
+    TDiskImageCache* backing;
+    TDiskImageKey key;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        backing = disk;
+        key = DiskKey(entry);
+    }
+    std::shared_ptr<const TDecodedImage> image;
+    if (backing)
+        image = backing->Find(key);
+    if (!image)
+        return false;
+    Insert(entry, image, false);
+    return true;
+}
+
+void TImageCache::AttachDisk(TDiskImageCache* newDisk, uint64_t pack, const TImageOutput& output)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    disk = newDisk;
+    diskPack = pack;
+    diskOutput = output;
+}
+
+// Caller holds the lock
+TDiskImageKey TImageCache::DiskKey(size_t entry) const
+{
+    return TDiskImageKey(diskPack, entry, diskOutput);
+}
+
+// Caller holds the lock
+void TImageCache::AddHot(size_t entry, const std::shared_ptr<const TDecodedImage>& image)
+{
+    if (image->Bytes() > hotBudget)
+        return;
+    hot[entry] = image;
+    hotBytes += image->Bytes();
+    CacheMetrics().hotBytes.Add(static_cast<int64_t>(image->Bytes()));
+    std::vector<size_t> evicted;
+    hotPolicy.Add(entry, image->Bytes(), evicted);
+    DropHot(evicted);
+}
+
+/*
+ * Drop Evicted Images
+ * Leaving the hot tier loses nothing while the cold tier has the image;
+ * leaving the cold tier means decoding it again next time.
+ */
+void TImageCache::DropHot(const std::vector<size_t>& entries,
+                          std::vector<THotMap::value_type>* dropped)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        THotMap::iterator found = hot.find(entries[i]);
+        size_t size = found->second->Bytes();
+        hotBytes -= size;
+        CacheMetrics().hotBytes.Add(-static_cast<int64_t>(size));
+        if (dropped)
+            dropped->push_back(*found);
+        hot.erase(found);
+    }
+}
+
+void TImageCache::DropCold(const std::vector<size_t>& entries)
+{
+    for (size_t i = 0; i < entries.size(); i++) {
+        TColdMap::iterator found = cold.find(entries[i]);
+        coldBytes -= found->second.Bytes();
+        coldRawBytes -= found->second.RawBytes();
+        CacheMetrics().coldBytes.Add(-static_cast<int64_t>(found->second.Bytes()));
+        cold.erase(found);
+        evictions++;
+        CacheMetrics().evictions.Add();
+    }
+}
+
+/*
+ * Budgets
+ * The cold tier shrinks first, so images demoted out of the hot tier
+ * compete for what is left of it like any other insert.
+ */
+void TImageCache::SetBudgets(size_t newHotBudget, size_t newColdBudget)
+{
+    std::vector<THotMap::value_type> demoted;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        hotBudget = newHotBudget;
+        coldBudget = newColdBudget;
+        std::vector<size_t> evicted;
+        coldPolicy.SetBudget(coldBudget, evicted);
+        DropCold(evicted);
+        evicted.clear();
+        hotPolicy.SetBudget(hotBudget, evicted);
+        DropHot(evicted, &demoted);
+    }
+    for (size_t i = 0; i < demoted.size(); i++)
+        Insert(demoted[i].first, demoted[i].second, false);
+}
+
+void TImageCache::Clear()
+{
+    std::lock_guard<std::mutex> guard(lock);
+    CacheMetrics().hotBytes.Add(-static_cast<int64_t>(hotBytes));
+    CacheMetrics().coldBytes.Add(-static_cast<int64_t>(coldBytes));
+    hot.clear();
+    hotPolicy.Clear();
+    cold.clear();
+    coldPolicy.Clear();
+    hotBytes = coldBytes = coldRawBytes = 0;
+}
+
+TImageCacheStats TImageCache::Stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    TImageCacheStats stats;
+    stats.hotHits = hotHits;
+    stats.coldHits = coldHits;
+    stats.diskHits = diskHits;
+    stats.misses = misses;
+    stats.inserts = inserts;
+    stats.evictions = evictions;
+    stats.rejections = hotPolicy.Rejections() + coldPolicy.Rejections();
+    stats.hotImages = hot.size();
+    stats.hotBytes = hotBytes;
+    stats.hotBudget = hotBudget;
+    stats.coldImages = cold.size();
+    stats.coldBytes = coldBytes;
+    stats.coldRawBytes = coldRawBytes;
+    stats.coldBudget = coldBudget;
+    stats.compressMs = compressNs / 1e6;
+    stats.promoteMs = promoteNs / 1e6;
+    stats.maxPromoteMs = maxPromoteNs / 1e6;
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Cache Benchmark
+ * Every PNG entry is decoded once (the decode column) and inserted cold
+ * only, as warming would. Each is then clicked in random order: the first
+ * click of an image is a cold hit, an immediate second click a hot one.
+ */
+static void WriteLatencyRow(std::ostream& out, const char* name, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    out << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(3)
+        << std::setw(10) << samples[samples.size() / 2]
+        << std::setw(10) << samples[std::min(samples.size() - 1, samples.size() * 99 / 100)]
+        << std::setw(10) << samples.back() << std::endl;
+}
+
+void RunCacheBench(const TPackVolumeSet& pack, size_t hotBudget, size_t coldBudget,
+                   std::ostream& out)
+{
+    std::vector<size_t> entries = PngEntries(pack);
+    if (entries.empty()) {
+        out << "No PNG entries\n";
+        return;
+    }
+
+    TImageCache cache(hotBudget, coldBudget);
+    std::vector<double> decodeMs, coldMs, hotMs;
+    uint64_t rawBytes = 0;
+    for (size_t i = 0; i < entries.size(); i++) {
+        TClock::time_point start = TClock::now();
+        std::shared_ptr<TDecodedImage> image = std::make_shared<TDecodedImage>();
+        DecodePngEntry(pack, entries[i], *image);
+        decodeMs.push_back(NanosecondsSince(start) / 1e6);
+        rawBytes += image->pixels.size();
+        cache.Insert(entries[i], image, false);
+    }
+
+    std::mt19937 random(1);
+    std::shuffle(entries.begin(), entries.end(), random);
+    for (size_t i = 0; i < entries.size(); i++) {
+        TClock::time_point start = TClock::now();
+        bool found = cache.Find(entries[i]) != nullptr;
+        double ms = NanosecondsSince(start) / 1e6;
+        if (!found)
+            continue;
+        coldMs.push_back(ms);
+        start = TClock::now();
+        cache.Find(entries[i]);
+        hotMs.push_back(NanosecondsSince(start) / 1e6);
+    }
+
+    TImageCacheStats stats = cache.Stats();
+    out << "Images: " << entries.size() << ", " << std::fixed << std::setprecision(1)
+        << rawBytes / 1048576.0 << " MB decoded, cold tier " << stats.coldBytes / 1048576.0
+        << " MB for " << stats.coldImages << " images (" << std::setprecision(1)
+        << (stats.coldBytes > 0 ? static_cast<double>(stats.coldRawBytes) / stats.coldBytes : 0)
+        << "x), compress " << std::setprecision(2) << stats.compressMs / entries.size()
+        << " ms per image\n"
+        << "Budgets: hot " << hotBudget / 1048576.0 << " MB, cold " << coldBudget / 1048576.0
+        << " MB; hot tier now " << stats.hotImages << " images, " << stats.evictions
+        << " cold evictions\n"
+        << std::left << std::setw(10) << "click" << std::right << std::setw(10) << "p50 ms"
+        << std::setw(10) << "p99 ms" << std::setw(10) << "max ms" << std::endl;
+    WriteLatencyRow(out, "decode", decodeMs);
+    if (!coldMs.empty()) {
+        WriteLatencyRow(out, "cold", coldMs);
+        WriteLatencyRow(out, "hot", hotMs);
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Mixed Trace
+ * The favourites are a random order of the entries; a click picks rank r
+ * with probability proportional to 1 / (r + 1), so a dozen flags get half
+ * of the clicks. Sweeps are spread evenly between the clicks.
+ */
+std::vector<size_t> MixedAccessTrace(const TPackVolumeSet& pack, size_t clicks, size_t sweeps)
+{
+    std::vector<size_t> entries = PngEntries(pack);
+    std::vector<size_t> trace;
+    if (entries.empty())
+        return trace;
+    std::mt19937 random(1);
+    std::vector<size_t> favourites = entries;
+    std::shuffle(favourites.begin(), favourites.end(), random);
+    std::vector<double> weights(favourites.size());
+    for (size_t i = 0; i < weights.size(); i++)
+        weights[i] = 1.0 / (i + 1);
+    std::discrete_distribution<size_t> rank(weights.begin(), weights.end());
+
+    for (size_t part = 0; part <= sweeps; part++) {
+        size_t count = clicks / (sweeps + 1) + (part < clicks % (sweeps + 1) ? 1 : 0);
+        for (size_t i = 0; i < count; i++)
+            trace.push_back(favourites[rank(random)]);
+        if (part < sweeps)
+            trace.insert(trace.end(), entries.begin(), entries.end());
+    }
+    return trace;
+}
+
+/*
+ * Trace Replay
+ * Every access is a Find(); a miss inserts the image as a display would,
+ * decompressed from a private LZ4 copy instead of decoded so a long trace
+ * replays in seconds. The decode column prices the misses at the average
+ * decode time measured while making those copies.
+ */
+struct TTraceImage
+{
+    TPngInfo info;
+    size_t rawSize;
+    std::vector<uint8_t> packed;
+};
+
+static void WriteTraceRow(std::ostream& out, const char* name, const uint64_t tiers[4],
+                          size_t accesses, uint64_t rejections, double decodeMs)
+{
+    static const TCacheTier columns[] = {ctHot, ctCold, ctNone};
+    out << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(1);
+    for (unsigned i = 0; i < 3; i++)
+        out << std::setw(9) << 100.0 * tiers[columns[i]] / accesses << "%";
+    out << std::setw(12) << rejections << std::setw(11) << std::setprecision(2)
+        << tiers[ctNone] * decodeMs / 1000 << std::endl;
+}
+
+void RunCacheTraceBench(const TPackVolumeSet& pack, const std::vector<size_t>& trace,
+                        size_t hotBudget, size_t coldBudget, std::ostream& out)
+{
+    if (trace.empty()) {
+        out << "Empty trace\n";
+        return;
+    }
+
+    std::unordered_map<size_t, TTraceImage> images;
+    uint64_t decodeNs = 0;
+    for (size_t i = 0; i < trace.size(); i++) {
+        if (images.count(trace[i]) != 0)
+            continue;
+        TClock::time_point start = TClock::now();
+        TDecodedImage image;
+        DecodePngEntry(pack, trace[i], image);
+        decodeNs += NanosecondsSince(start);
+        TTraceImage& copy = images[trace[i]];
+        copy.info = image.info;
+        copy.rawSize = image.pixels.size();
+        Lz4Compress(image.pixels.data(), image.pixels.size(), copy.packed);
+    }
+    double decodeMs = decodeNs / 1e6 / images.size();
+
+    out << "Trace: " << trace.size() << " accesses to " << images.size()
+        << " images; budgets: hot " << std::fixed << std::setprecision(1)
+        << hotBudget / 1048576.0 << " MB, cold " << coldBudget / 1048576.0 << " MB\n"
+        << std::left << std::setw(10) << "policy" << std::right << std::setw(10) << "hot"
+        << std::setw(10) << "cold" << std::setw(10) << "miss"
+        << std::setw(12) << "rejected" << std::setw(11) << "decode s" << std::endl;
+
+    TCachePolicy policies[] = {cpLru, cpTinyLfu};
+    const char* names[] = {"LRU", "W-TinyLFU"};
+    for (unsigned p = 0; p < 2; p++) {
+        TImageCache cache(hotBudget, coldBudget, policies[p]);
+        uint64_t tiers[4] = {0, 0, 0, 0};
+        for (size_t i = 0; i < trace.size(); i++) {
+            TCacheTier tier = ctNone;
+            if (!cache.Find(trace[i], &tier)) {
+                const TTraceImage& copy = images[trace[i]];
+                std::shared_ptr<TDecodedImage> image = std::make_shared<TDecodedImage>();
+                image->info = copy.info;
+                image->pixels.resize(copy.rawSize);
+                Lz4Decompress(copy.packed.data(), copy.packed.size(), image->pixels.data(),
+                              copy.rawSize);
+                cache.Insert(trace[i], image);
+            }
+            tiers[tier]++;
+        }
+        WriteTraceRow(out, names[p], tiers, trace.size(), cache.Stats().rejections, decodeMs);
+    }
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,190 @@
+﻿/*
+ * ImageCache.h - Two-Tier Decoded Image Cache
+ *
+ * Declares the cache that keeps decoded flags ready for display without
+ * holding every one of them as raw pixels. A decoded flag is about 1 to
+ * 2.5 MB of BGRA, so the whole pack would need hundreds of megabytes;
+ * compressed with LZ4 (Lz4.h) the same pixels shrink 50 to 100 times.
+ *
+ * - Hot tier: raw images, ready to copy to the screen. Small.
+ * - Cold tier: LZ4-compressed copies of every cached image. A cold hit is
+ *   decompressed (well under a millisecond for a typical flag) and
+ *   promoted to the hot tier.
+ *
+ * Each tier evicts by W-TinyLFU (TinyLfu.h), so a sweep through the whole
+ * pack does not flush the flags that are used over and over.
+ *
+ * The tiers are inclusive: an image is compressed once, when it is first
+ * inserted, and stays in the cold tier while it comes and goes in the hot
+ * one, so dropping it from the hot tier costs nothing. Compression runs
+ * on the inserting thread outside the lock; TDecodeScheduler inserts on
+ * the task pool at tpMaintenance, so a click never pays for it.
+ *
+ * With a TDiskImageCache attached (DiskImageCache.h) a miss in both tiers
+ * is looked up on disk before anyone decodes, and every image inserted
+ * for display is stored there too, so the next launch starts warm.
+ *
+ * "Zip.exe --pack cache <pack>" fills a cache with the whole pack and
+ * compares click latency from both tiers with a full decode; "cachetrace"
+ * replays an access trace to compare hit rates by policy.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef ImageCacheH
+#define ImageCacheH
+//---------------------------------------------------------------------------
+
+#include "DecodeScheduler.h"      // TDecodedImage, TPackVolumeSet
+#include "TinyLfu.h"              // TWTinyLfu
+
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+class TDiskImageCache;
+struct TDiskImageKey;
+
+enum TCacheTier { ctNone, ctHot, ctCold, ctDisk };    // Where Find() found an image
+
+/*
+ * TImageCacheStats - Cache Counters And Sizes
+ */
+struct TImageCacheStats
+{
+    uint64_t hotHits;
+    uint64_t coldHits;              // Decompressed and promoted to the hot tier
+    uint64_t diskHits;              // Copied out of the disk cache into the hot tier
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;             // Dropped from the cold tier: must be decoded again
+    uint64_t rejections;            // Kept out of a tier's main region by the frequency filter
+    size_t hotImages;
+    size_t hotBytes;
+    size_t hotBudget;
+    size_t coldImages;
+    size_t coldBytes;               // Compressed
+    size_t coldRawBytes;            // The same images decoded
+    size_t coldBudget;
+    double compressMs;              // Total time spent compressing inserts
+    double promoteMs;               // Total time spent decompressing cold hits
+    double maxPromoteMs;
+};
+
+/*
+ * TImageCache - Raw Hot Tier Over A Compressed Cold Tier
+ * Keyed by pack entry. Budgets are bytes: raw pixels for the hot tier,
+ * compressed bytes for the cold one. Images held elsewhere stay valid
+ * after the cache drops them. cpLru is there for comparison in the
+ * benchmarks. Thread-safe.
+ */
+class TImageCache
+{
+  public:
+    TImageCache(size_t hotBudget, size_t coldBudget, TCachePolicy policy = cpTinyLfu);
+    ~TImageCache();
+
+    // Hot tier only; never decompresses. Misses are not counted
+    std::shared_ptr<const TDecodedImage> FindHot(size_t entry);
+    // Either tier, then the disk cache; a cold or disk hit is promoted to
+    // the hot tier. `tier` receives where the image came from
+    std::shared_ptr<const TDecodedImage> Find(size_t entry, TCacheTier* tier = nullptr);
+    // In either tier; does not count as a use
+    bool Contains(size_t entry) const;
+
+    // Adds a decoded image to both tiers and stores it on disk; `toHot`
+    // false stores only the compressed copy (cache warming, which must not
+    // flush the hot tier, nor fill the disk with flags nobody looked at)
+    void Insert(size_t entry, const std::shared_ptr<const TDecodedImage>& image, bool toHot = true);
+    // Fills the cold tier from the disk cache; false if it has no copy
+    bool Restore(size_t entry);
+
+    // Backs the tiers with `disk`, for the pack with that PackFingerprint()
+    // decoded to `output`; null detaches it. The disk cache must outlive
+    // this one
+    void AttachDisk(TDiskImageCache* disk, uint64_t pack,
+                    const TImageOutput& output = TImageOutput());
+
+    // Images the hot tier gives up are compressed into the cold tier
+    // first, unless it has them already (see TCacheShrinker)
+    void SetBudgets(size_t hotBudget, size_t coldBudget);
+    void Clear();
+
+    TImageCacheStats Stats() const;
+
+  private:
+    struct TColdImage
+    {
+        TPngInfo info;
+        TImageFormat format;
+        std::vector<uint32_t> palette;  // Kept as is: 1 KB at most
+        size_t rawSize;                 // Of the pixels
+        std::shared_ptr<const std::vector<uint8_t> > packed;
+
+        size_t Bytes() const { return packed->size() + palette.size() * sizeof(uint32_t); }
+        size_t RawBytes() const { return rawSize + palette.size() * sizeof(uint32_t); }
+    };
+    typedef std::unordered_map<size_t, std::shared_ptr<const TDecodedImage> > THotMap;
+    typedef std::unordered_map<size_t, TColdImage> TColdMap;
+
+    mutable std::mutex lock;
+    THotMap hot;
+    TWTinyLfu hotPolicy;            // Which images each tier keeps
+    TColdMap cold;
+    TWTinyLfu coldPolicy;
+    size_t hotBudget;
+    size_t coldBudget;
+    size_t hotBytes;
+    size_t coldBytes;
+    size_t coldRawBytes;
+    TDiskImageCache* disk;
+    uint64_t diskPack;
+    TImageOutput diskOutput;
+
+    uint64_t hotHits;
+    uint64_t coldHits;
+    uint64_t diskHits;
+    uint64_t misses;
+    uint64_t inserts;
+    uint64_t evictions;
+    uint64_t compressNs;
+    uint64_t promoteNs;
+    uint64_t maxPromoteNs;
+
+    TDiskImageKey DiskKey(size_t entry) const;
+    std::shared_ptr<const TDecodedImage> FindOnDisk(size_t entry, TDiskImageCache* backing,
+                                                    const TDiskImageKey& key, TCacheTier* tier);
+    void AddHot(size_t entry, const std::shared_ptr<const TDecodedImage>& image);
+    void DropHot(const std::vector<size_t>& entries,
+                 std::vector<THotMap::value_type>* dropped = nullptr);
+    void DropCold(const std::vector<size_t>& entries);
+
+    TImageCache(const TImageCache&);
+    TImageCache& operator=(const TImageCache&);
+};
+
+//---------------------------------------------------------------------------
+
+// Fills a cache with every PNG entry of `pack`, then times clicks served
+// from the hot tier, from the cold tier and by a full decode
+void RunCacheBench(const TPackVolumeSet& pack, size_t hotBudget, size_t coldBudget,
+                   std::ostream& out);
+
+// A mixed workload over the PNG entries of `pack`: `clicks` picks with a
+// Zipf distribution, broken up by `sweeps` passes over all of them in
+// pack order, the way a gallery scroll or a batch export reads the pack
+std::vector<size_t> MixedAccessTrace(const TPackVolumeSet& pack, size_t clicks, size_t sweeps);
+
+// Replays `trace` through an LRU cache and a W-TinyLFU one with the same
+// budgets and compares where the accesses were served from. Misses are
+// filled from copies decoded once up front
+void RunCacheTraceBench(const TPackVolumeSet& pack, const std::vector<size_t>& trace,
+                        size_t hotBudget, size_t coldBudget, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // ImageCacheH
@@ -0,0 +1,618 @@
+﻿/*
+ * Inflate.cpp - Streaming DEFLATE Decoder
+ *
+ * Implements TInflater, a pull-style RFC 1951 decoder. Output is produced
+ * directly inside the history window and handed to the consumer in chunks,
+ * so no additional copy of the decompressed data is ever made.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "Inflate.h"
+#include "CancelToken.h"          // TCancelToken
+#include "Metrics.h"              // MetricCounter
+
+#include <cstring>                // memcpy, memmove
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+/*
+ * DEFLATE Constant Tables (RFC 1951, section 3.2.5)
+ */
+static const uint16_t LengthBase[29] = {
+    3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const uint8_t LengthExtra[29] = {
+    0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+    3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const uint16_t DistBase[30] = {
+    1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+    257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+    8193, 12289, 16385, 24577};
+static const uint8_t DistExtra[30] = {
+    0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+    7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// Order in which code length code lengths are transmitted
+static const uint8_t CodeLengthOrder[19] = {
+    16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+
+// Bytes kept free after the output limit so a whole match always fits
+static const size_t MaxMatch = 258;
+//---------------------------------------------------------------------------
+
+/*
+ * Build Canonical Huffman Table
+ * Fills the fast lookup table and the canonical count/symbol arrays
+ * from a list of code lengths.
+ */
+void THuffmanTable::Build(const uint8_t* lengths, unsigned symbolCount)
+{
+    memset(count, 0, sizeof(count));
+    memset(fast, 0, sizeof(fast));
+
+    for (unsigned s = 0; s < symbolCount; s++)
+        count[lengths[s]]++;
+    count[0] = 0;
+
+    // Reject over-subscribed code sets; incomplete sets are legal (RFC 1951)
+    int left = 1;
+    for (unsigned len = 1; len < 16; len++) {
+        left <<= 1;
+        left -= count[len];
+        if (left < 0)
+            throw EDecodeError("Invalid Huffman code lengths");
+    }
+
+    // Offsets of the first symbol of each length in the sorted table
+    uint16_t offsets[16];
+    offsets[1] = 0;
+    for (unsigned len = 1; len < 15; len++)
+        offsets[len + 1] = offsets[len] + count[len];
+    for (unsigned s = 0; s < symbolCount; s++) {
+        if (lengths[s] != 0)
+            symbol[offsets[lengths[s]]++] = static_cast<uint16_t>(s);
+    }
+
+    // Fill the fast table: DEFLATE codes are stored bit-reversed in the stream
+    unsigned code = 0;
+    unsigned index = 0;
+    for (unsigned len = 1; len <= FastBits; len++) {
+        for (unsigned i = 0; i < count[len]; i++, code++, index++) {
+            unsigned reversed = 0;
+            for (unsigned b = 0; b < len; b++)
+                reversed |= ((code >> b) & 1) << (len - 1 - b);
+
+            uint16_t entry = static_cast<uint16_t>((symbol[index] << 4) | len);
+            for (unsigned fill = reversed; fill < (1u << FastBits); fill += 1u << len)
+                fast[fill] = entry;
+        }
+        code <<= 1;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Fixed Huffman Tables (RFC 1951, section 3.2.6)
+ * Computed by the compiler. No fixed code is longer than 9 bits, so one
+ * 512-entry lookup decodes any literal/length symbol, and a distance code
+ * is just 5 bits in reverse order.
+ */
+static const unsigned FixedLiteralBits = 9;
+static const unsigned FixedDistanceBits = 5;
+
+struct TFixedTables
+{
+    uint16_t literal[1 << FixedLiteralBits];    // (symbol << 4) | length
+    uint8_t distance[1 << FixedDistanceBits];
+};
+
+static constexpr unsigned FixedCodeLength(unsigned symbol)
+{
+    return symbol < 144 ? 8 : symbol < 256 ? 9 : symbol < 280 ? 7 : 8;
+}
+
+static constexpr unsigned ReverseBits(unsigned code, unsigned length)
+{
+    unsigned reversed = 0;
+    for (unsigned b = 0; b < length; b++)
+        reversed |= ((code >> b) & 1) << (length - 1 - b);
+    return reversed;
+}
+
+static constexpr TFixedTables BuildFixedTables()
+{
+    TFixedTables tables = {};
+
+    // Canonical codes: first code of each length, then in symbol order
+    unsigned count[FixedLiteralBits + 1] = {};
+    for (unsigned s = 0; s < 288; s++)
+        count[FixedCodeLength(s)]++;
+    unsigned next[FixedLiteralBits + 1] = {};
+    unsigned code = 0;
+    for (unsigned len = 1; len <= FixedLiteralBits; len++) {
+        code = (code + count[len - 1]) << 1;
+        next[len] = code;
+    }
+
+    for (unsigned s = 0; s < 288; s++) {
+        unsigned len = FixedCodeLength(s);
+        unsigned reversed = ReverseBits(next[len]++, len);
+        for (unsigned fill = reversed; fill < (1u << FixedLiteralBits); fill += 1u << len)
+            tables.literal[fill] = static_cast<uint16_t>((s << 4) | len);
+    }
+    for (unsigned s = 0; s < (1u << FixedDistanceBits); s++)
+        tables.distance[ReverseBits(s, FixedDistanceBits)] = static_cast<uint8_t>(s);
+    return tables;
+}
+
+static constexpr TFixedTables FixedTables = BuildFixedTables();
+//---------------------------------------------------------------------------
+
+/*
+ * Inflater Constructor
+ * The decoder starts idle; nothing is read until the first Next() call.
+ */
+TInflater::TInflater(TByteSource* source, bool zlibWrapper)
+    : source(source), in(nullptr), inEnd(nullptr), spanStart(nullptr),
+      inputBase(0), bitBuffer(0), bitCount(0), overrun(0), cancel(nullptr),
+      state(zlibWrapper ? stZlibHeader : stBlockHeader),
+      zlibWrapper(zlibWrapper), stopAtBlocks(false), lastBlock(false), storedLeft(0),
+      window(ChunkSize + MaxMatch), readPos(0), writePos(0), givenBack(0), totalOut(0)
+{
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Bit Buffer Refill
+ * Keeps at least 56 bits available. The fast path loads eight bytes at once;
+ * near the end of a span the slow path moves to the next span byte by byte.
+ */
+void TInflater::Refill()
+{
+    if (bitCount >= 56)
+        return;
+    if (inEnd - in >= 8) {
+        uint64_t word;
+        memcpy(&word, in, 8); // Little-endian targets only (x86/x64)
+        bitBuffer |= word << bitCount;
+        in += (63 - bitCount) >> 3;
+        bitCount |= 56;
+        return;
+    }
+    RefillSlow();
+}
+
+/*
+ * Advance To The Next Input Span
+ * Keeps inputBase up to date so bit positions stay absolute.
+ */
+bool TInflater::NextInput()
+{
+    inputBase += inEnd - spanStart;
+    size_t size = 0;
+    if (!source->Next(in, size) || size == 0) {
+        in = inEnd = spanStart = nullptr;
+        return false;
+    }
+    spanStart = in;
+    inEnd = in + size;
+    return true;
+}
+
+void TInflater::RefillSlow()
+{
+    while (bitCount <= 56) {
+        if (in == inEnd && !NextInput()) {
+            // Out of input: feed zeros so decoding can finish the last
+            // symbols, and fail if far more than that was consumed
+            if (++overrun > 16)
+                throw EDecodeError("Unexpected end of compressed data");
+            bitCount += 8;
+            continue;
+        }
+        bitBuffer |= static_cast<uint64_t>(*in++) << bitCount;
+        bitCount += 8;
+    }
+}
+
+unsigned TInflater::Bits(unsigned count)
+{
+    Refill();
+    unsigned value = static_cast<unsigned>(bitBuffer & ((1ull << count) - 1));
+    bitBuffer >>= count;
+    bitCount -= count;
+    return value;
+}
+
+void TInflater::AlignToByte()
+{
+    unsigned drop = bitCount & 7;
+    bitBuffer >>= drop;
+    bitCount -= drop;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Decode One Huffman Symbol
+ * Assumes the caller has refilled the bit buffer.
+ */
+unsigned TInflater::DecodeSymbol(const THuffmanTable& table)
+{
+    uint16_t entry = table.fast[bitBuffer & ((1u << THuffmanTable::FastBits) - 1)];
+    if (entry != 0) {
+        unsigned len = entry & 15;
+        bitBuffer >>= len;
+        bitCount -= len;
+        return entry >> 4;
+    }
+
+    // Slow canonical walk for codes longer than FastBits
+    int code = 0;
+    int first = 0;
+    int index = 0;
+    for (unsigned len = 1; len < 16; len++) {
+        code |= static_cast<int>((bitBuffer >> (len - 1)) & 1);
+        int count = table.count[len];
+        if (code - first < count) {
+            bitBuffer >>= len;
+            bitCount -= len;
+            return table.symbol[index + (code - first)];
+        }
+        index += count;
+        first += count;
+        first <<= 1;
+        code <<= 1;
+    }
+    throw EDecodeError("Invalid Huffman code");
+}
+
+/*
+ * Decode Fixed Huffman Symbols
+ * One table lookup each, no slow path. Assume a refilled bit buffer.
+ */
+inline unsigned TInflater::DecodeFixedLiteral()
+{
+    uint16_t entry = FixedTables.literal[bitBuffer & ((1u << FixedLiteralBits) - 1)];
+    unsigned len = entry & 15;
+    bitBuffer >>= len;
+    bitCount -= len;
+    return entry >> 4;
+}
+
+inline unsigned TInflater::DecodeFixedDistance()
+{
+    unsigned symbol = FixedTables.distance[bitBuffer & ((1u << FixedDistanceBits) - 1)];
+    bitBuffer >>= FixedDistanceBits;
+    bitCount -= FixedDistanceBits;
+    return symbol;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Read Block Header
+ * Selects the block type and prepares the tables or the stored length.
+ */
+void TInflater::ReadBlockHeader()
+{
+    lastBlock = Bits(1) != 0;
+    unsigned type = Bits(2);
+
+    if (type == 0) {
+        // Stored block: byte aligned LEN and its one's complement NLEN
+        AlignToByte();
+        unsigned len = Bits(16);
+        unsigned nlen = Bits(16);
+        if ((len ^ 0xFFFF) != nlen)
+            throw EDecodeError("Stored block length mismatch");
+        storedLeft = len;
+        state = stStored;
+    } else if (type == 1) {
+        state = stFixed;                // Tables are compile-time constants
+    } else if (type == 2) {
+        ReadDynamicTables();
+        state = stDynamic;
+    } else {
+        throw EDecodeError("Invalid block type");
+    }
+}
+
+/*
+ * Read Dynamic Huffman Tables
+ * Decodes the code length alphabet, then the literal/length and distance
+ * code lengths, and builds both tables.
+ */
+void TInflater::ReadDynamicTables()
+{
+    unsigned litCount = Bits(5) + 257;
+    unsigned distCount = Bits(5) + 1;
+    unsigned codeCount = Bits(4) + 4;
+    if (litCount > 286 || distCount > 30)
+        throw EDecodeError("Too many length or distance codes");
+
+    uint8_t codeLengths[19] = {0};
+    for (unsigned i = 0; i < codeCount; i++)
+        codeLengths[CodeLengthOrder[i]] = static_cast<uint8_t>(Bits(3));
+
+    THuffmanTable codeTable;
+    codeTable.Build(codeLengths, 19);
+
+    uint8_t lengths[286 + 30];
+    unsigned total = litCount + distCount;
+    for (unsigned i = 0; i < total;) {
+        Refill();
+        unsigned sym = DecodeSymbol(codeTable);
+        if (sym < 16) {
+            lengths[i++] = static_cast<uint8_t>(sym);
+            continue;
+        }
+
+        unsigned repeat;
+        uint8_t value = 0;
+        if (sym == 16) {
+            if (i == 0)
+                throw EDecodeError("Repeat with no previous length");
+            value = lengths[i - 1];
+            repeat = 3 + Bits(2);
+        } else if (sym == 17) {
+            repeat = 3 + Bits(3);
+        } else {
+            repeat = 11 + Bits(7);
+        }
+        if (i + repeat > total)
+            throw EDecodeError("Code lengths overflow");
+        while (repeat--)
+            lengths[i++] = value;
+    }
+
+    if (lengths[256] == 0)
+        throw EDecodeError("Missing end-of-block code");
+
+    litTable.Build(lengths, litCount);
+    distTable.Build(lengths + litCount, distCount);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Decode Stored Block Data
+ * Copies raw bytes first out of the bit buffer, then span by span.
+ */
+void TInflater::DecodeStored(size_t limit)
+{
+    uint8_t* out = window.data();
+
+    // Whole bytes still held in the bit buffer come first; the last
+    // `overrun` of them are padding and never real data
+    while (storedLeft > 0 && bitCount >= 8 && writePos < limit) {
+        if (bitCount <= overrun * 8)
+            throw EDecodeError("Unexpected end of stored block");
+        out[writePos++] = static_cast<uint8_t>(bitBuffer);
+        bitBuffer >>= 8;
+        bitCount -= 8;
+        storedLeft--;
+    }
+    if (bitCount == 0)
+        bitBuffer = 0; // Drop look-ahead bits; the copy below bypasses them
+
+    while (storedLeft > 0 && writePos < limit) {
+        if (in == inEnd && !NextInput())
+            throw EDecodeError("Unexpected end of stored block");
+        size_t n = storedLeft;
+        if (n > static_cast<size_t>(inEnd - in)) n = inEnd - in;
+        if (n > limit - writePos) n = limit - writePos;
+        memcpy(out + writePos, in, n);
+        in += n;
+        writePos += n;
+        storedLeft -= n;
+    }
+
+    if (storedLeft == 0)
+        state = lastBlock ? (zlibWrapper ? stTrailer : stDone) : stBlockHeader;
+}
+
+/*
+ * Decode Huffman Block Data
+ * The hot loop. Stops at the end of the block or once `limit` is reached;
+ * MaxMatch bytes of slack past the limit guarantee every match completes.
+ * Instantiated once per block type, so the symbol decoders are chosen at
+ * compile time rather than per symbol.
+ */
+template <bool Fixed>
+void TInflater::DecodeHuffman(size_t limit)
+{
+    uint8_t* out = window.data();
+
+    while (writePos < limit) {
+        Refill();
+        unsigned sym = Fixed ? DecodeFixedLiteral() : DecodeSymbol(litTable);
+
+        if (sym < 256) {
+            out[writePos++] = static_cast<uint8_t>(sym);
+            continue;
+        }
+        if (sym == 256) {
+            state = lastBlock ? (zlibWrapper ? stTrailer : stDone) : stBlockHeader;
+            return;
+        }
+
+        sym -= 257;
+        if (sym >= 29)
+            throw EDecodeError("Invalid length symbol");
+        unsigned len = LengthBase[sym] + Bits(LengthExtra[sym]);
+
+        Refill();
+        unsigned dsym = Fixed ? DecodeFixedDistance() : DecodeSymbol(distTable);
+        if (dsym >= 30)
+            throw EDecodeError("Invalid distance symbol");
+        size_t dist = DistBase[dsym] + Bits(DistExtra[dsym]);
+        if (dist > writePos)
+            throw EDecodeError("Distance too far back");
+
+        // Copy the match; overlapping copies must proceed byte by byte
+        const uint8_t* from = out + writePos - dist;
+        uint8_t* to = out + writePos;
+        if (dist >= len) {
+            memcpy(to, from, len);
+        } else {
+            for (unsigned i = 0; i < len; i++)
+                to[i] = from[i];
+        }
+        writePos += len;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Grow Output Window
+ * Doubles the buffer until `need` bytes fit, capped at the full size.
+ */
+void TInflater::Reserve(size_t need)
+{
+    if (window.size() >= need)
+        return;
+    size_t grown = window.size() * 2 > need ? window.size() * 2 : need;
+    window.resize(grown < BufferSize + MaxMatch ? grown : BufferSize + MaxMatch);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Next Output Span
+ * Hands out any undelivered output, otherwise decodes up to ChunkSize more
+ * bytes. When the buffer fills up the last 32 KB slide to its front.
+ */
+bool TInflater::Next(const uint8_t*& data, size_t& size)
+{
+    if (readPos == writePos) {
+        if (state == stDone)
+            return false;
+        if (cancel != nullptr)
+            cancel->Check();
+
+        // Make room: keep exactly one history window in front of the output
+        if (writePos + ChunkSize > BufferSize) {
+            size_t keep = writePos < HistorySize ? writePos : HistorySize;
+            memmove(window.data(), window.data() + writePos - keep, keep);
+            writePos = readPos = keep;
+        }
+
+        size_t start = writePos;
+        size_t limit = writePos + ChunkSize;
+        Reserve(limit + MaxMatch);
+        while (writePos < limit && state != stDone) {
+            if (stopAtBlocks && state == stBlockHeader && writePos > start)
+                break; // Let the caller see the block boundary
+            switch (state) {
+                case stZlibHeader: {
+                    unsigned cmf = Bits(8);
+                    unsigned flg = Bits(8);
+                    if ((cmf & 15) != 8 || ((cmf << 8) | flg) % 31 != 0)
+                        throw EDecodeError("Invalid zlib header");
+                    if (flg & 0x20)
+                        throw EDecodeError("Preset dictionary not supported");
+                    state = stBlockHeader;
+                    break;
+                }
+                case stBlockHeader:
+                    ReadBlockHeader();
+                    break;
+                case stStored:
+                    DecodeStored(limit);
+                    break;
+                case stFixed:
+                    DecodeHuffman<true>(limit);
+                    break;
+                case stDynamic:
+                    DecodeHuffman<false>(limit);
+                    break;
+                case stTrailer:
+                    // Adler-32 is not verified; ZIP entries get a CRC-32 check (FlagPack.h)
+                    AlignToByte();
+                    state = stDone;
+                    break;
+                default:
+                    break;
+            }
+        }
+
+        if (readPos == writePos)
+            return false;
+    }
+
+    static TCounter& inflated = MetricCounter("zip_inflate_bytes_total",
+                                              "Bytes produced by DEFLATE decoding");
+    data = window.data() + readPos;
+    size = writePos - readPos;
+    totalOut += size;
+    inflated.Add(size - givenBack); // What Read() gave back was counted the first time
+    givenBack = 0;
+    readPos = writePos;
+    return true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Input Bit Position
+ * Number of compressed bits consumed so far, counted from the first byte
+ * of the first span (padding past the end of input included).
+ */
+uint64_t TInflater::InputBitPosition() const
+{
+    uint64_t bytes = inputBase + (in - spanStart) + overrun;
+    return bytes * 8 - bitCount;
+}
+
+/*
+ * Output History
+ * The last (up to) 32 KB of decoded output, ending at the current position.
+ */
+size_t TInflater::History(const uint8_t*& data) const
+{
+    size_t keep = writePos < HistorySize ? writePos : HistorySize;
+    data = window.data() + writePos - keep;
+    return keep;
+}
+
+/*
+ * Resume From A Checkpoint
+ * Discards the first `skipBits` (0-7) bits of the source and preloads the
+ * history window, after which decoding continues with a block header.
+ */
+void TInflater::Resume(unsigned skipBits, const uint8_t* history, size_t historySize)
+{
+    if (historySize > HistorySize)
+        historySize = HistorySize;
+    Reserve(historySize + ChunkSize + MaxMatch);
+    memcpy(window.data(), history, historySize);
+    readPos = writePos = historySize;
+    state = stBlockHeader;
+    if (skipBits > 0)
+        Bits(skipBits);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Copy-Out Reader
+ * Fills `dst` from successive output spans. Bytes from a partially consumed
+ * span are kept for the next call by rewinding readPos.
+ */
+size_t TInflater::Read(void* dst, size_t size)
+{
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    size_t done = 0;
+    while (done < size) {
+        const uint8_t* data;
+        size_t avail;
+        if (!Next(data, avail))
+            break;
+        size_t n = avail < size - done ? avail : size - done;
+        memcpy(to + done, data, n);
+        done += n;
+        readPos -= avail - n; // Give back what was not taken
+        totalOut -= avail - n;
+        givenBack = avail - n;
+    }
+    return done;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,200 @@
+﻿/*
+ * Inflate.h - Streaming DEFLATE Decoder
+ *
+ * This header declares the byte-source abstraction shared by the archive and
+ * image decoders, and a pull-style DEFLATE (RFC 1951) decoder built on it.
+ *
+ * Key Features:
+ * - Reads compressed input from any TByteSource (memory span, chunk stream, ...)
+ * - Produces output in small chunks straight out of its history window,
+ *   so a consumer can process each chunk while it is still in L1 cache
+ * - Optional zlib (RFC 1950) wrapper handling for PNG IDAT streams
+ * - Fixed Huffman blocks decode from compile-time tables; stored, fixed
+ *   and dynamic blocks each get their own specialized decode loop
+ *
+ * Architecture:
+ * - Decoders are chained: the ZIP entry inflater is itself a TByteSource,
+ *   which feeds the PNG chunk parser, which feeds the IDAT inflater
+ * - No intermediate whole-entry or whole-IDAT buffers are ever allocated
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef InflateH
+#define InflateH
+//---------------------------------------------------------------------------
+
+#include <cstddef>                // size_t
+#include <cstdint>                // Fixed width integer types
+#include <stdexcept>              // std::runtime_error base for decode errors
+#include <vector>                 // History window storage
+
+class TCancelToken;
+
+//---------------------------------------------------------------------------
+
+/*
+ * EDecodeError - Corrupt Or Truncated Input
+ * Thrown by the decoders when the compressed data cannot be decoded.
+ * Callers at the UI boundary catch it next to VCL's Exception.
+ */
+class EDecodeError : public std::runtime_error
+{
+  public:
+    explicit EDecodeError(const char* message) : std::runtime_error(message) {}
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TByteSource - Pull-Style Input Stream
+ *
+ * Hands out the input as a sequence of contiguous read-only spans.
+ * A span stays valid until the next call to Next() on the same source.
+ */
+class TByteSource
+{
+  public:
+    virtual ~TByteSource() {}
+
+    // Returns the next span of input; false once the stream is exhausted
+    virtual bool Next(const uint8_t*& data, size_t& size) = 0;
+};
+
+/*
+ * TSpanSource - A Single Memory Span
+ * Used for stored ZIP entries and for entries read straight from the archive.
+ */
+class TSpanSource : public TByteSource
+{
+  public:
+    TSpanSource(const uint8_t* data, size_t size) : data(data), size(size) {}
+
+    bool Next(const uint8_t*& outData, size_t& outSize) override
+    {
+        if (data == nullptr || size == 0)
+            return false;
+        outData = data;
+        outSize = size;
+        data = nullptr; // The whole span is handed out in one go
+        size = 0;
+        return true;
+    }
+
+  private:
+    const uint8_t* data;
+    size_t size;
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * THuffmanTable - Canonical Huffman Decode Table
+ *
+ * Codes up to FastBits long resolve with a single table lookup; the rare
+ * longer codes fall back to a canonical bit-by-bit walk.
+ */
+struct THuffmanTable
+{
+    static const unsigned FastBits = 10;
+
+    uint16_t fast[1 << FastBits];   // (symbol << 4) | length, 0 = use slow path
+    uint16_t count[16];             // Number of codes of each length
+    uint16_t symbol[288];           // Symbols ordered by code
+
+    void Build(const uint8_t* lengths, unsigned symbolCount);
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TInflater - Streaming DEFLATE Decoder
+ *
+ * Decodes into an internal buffer that doubles as the 32 KB history window
+ * and hands the freshly decoded bytes out through Next(). Each call decodes
+ * at most ChunkSize bytes, which keeps producer and consumer interleaved.
+ */
+class TInflater : public TByteSource
+{
+  public:
+    static const size_t HistorySize = 32768;      // DEFLATE maximum distance
+    static const size_t ChunkSize = 16384;        // Output per Next() call
+    static const size_t BufferSize = 131072;      // History plus output area
+
+    TInflater(TByteSource* source, bool zlibWrapper = false);
+
+    // TByteSource interface: returns the next span of decompressed output
+    bool Next(const uint8_t*& data, size_t& size) override;
+
+    // Convenience copy-out reader; returns fewer bytes only at end of stream
+    size_t Read(void* dst, size_t size);
+
+    bool Finished() const { return state == stDone && readPos == writePos; }
+
+    // Polled before each output chunk; cancelling makes Next() throw ECancelled
+    void SetCancelToken(const TCancelToken* token) { cancel = token; }
+    uint64_t TotalOut() const { return totalOut; }
+
+    /*
+     * Random Access Support (see InflateIndex.h)
+     * With block stops enabled, Next() returns at every DEFLATE block end so
+     * the caller can record a checkpoint: the input bit position plus the
+     * last 32 KB of output. Resume() restarts a fresh decoder from such a
+     * checkpoint; the source must then begin at byte (bitPosition / 8).
+     */
+    void StopAtBlockBoundaries(bool enable) { stopAtBlocks = enable; }
+    bool AtBlockBoundary() const { return state == stBlockHeader; }
+    uint64_t InputBitPosition() const;
+    size_t History(const uint8_t*& data) const;
+    void Resume(unsigned skipBits, const uint8_t* history, size_t historySize);
+
+  private:
+    enum TState { stZlibHeader, stBlockHeader, stStored, stFixed, stDynamic, stTrailer, stDone };
+
+    // Bit reader
+    TByteSource* source;
+    const uint8_t* in;
+    const uint8_t* inEnd;
+    const uint8_t* spanStart;       // Start of the current input span
+    uint64_t inputBase;             // Input bytes in all previous spans
+    uint64_t bitBuffer;
+    unsigned bitCount;
+    unsigned overrun;               // Zero bytes fed past the end of input
+
+    void Refill();
+    void RefillSlow();
+    bool NextInput();
+    unsigned Bits(unsigned count);
+    void AlignToByte();
+
+    const TCancelToken* cancel;
+
+    // Block state
+    TState state;
+    bool zlibWrapper;
+    bool stopAtBlocks;
+    bool lastBlock;
+    size_t storedLeft;
+    THuffmanTable litTable;         // Dynamic blocks only
+    THuffmanTable distTable;
+
+    void ReadBlockHeader();
+    void ReadDynamicTables();
+    unsigned DecodeSymbol(const THuffmanTable& table);
+    unsigned DecodeFixedLiteral();
+    unsigned DecodeFixedDistance();
+    void DecodeStored(size_t limit);
+    template <bool Fixed> void DecodeHuffman(size_t limit);
+    void Reserve(size_t need);
+
+    // Output window; starts at one chunk and grows up to BufferSize, so
+    // small entries never pay for the full buffer
+    std::vector<uint8_t> window;
+    size_t readPos;                 // Start of bytes not yet handed out
+    size_t writePos;                // End of decoded bytes
+    size_t givenBack;               // Bytes Read() returned, already counted
+    uint64_t totalOut;
+};
+
+//---------------------------------------------------------------------------
+#endif // InflateH
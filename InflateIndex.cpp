@@ -0,0 +1,205 @@
+﻿/*
+ * InflateIndex.cpp - Random Access Checkpoints For DEFLATE Streams
+ *
+ * Implements TInflateIndex on top of TInflater's block-stop and resume
+ * support. Points are only taken at block boundaries, where no Huffman
+ * table state has to be saved.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "InflateIndex.h"
+
+#include <cstring>                // memcpy
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const uint32_t IndexMagic = 0x5844495A;    // "ZIDX"
+static const uint32_t IndexVersion = 1;
+
+static void PutLE(std::vector<uint8_t>& out, uint64_t value, unsigned bytes)
+{
+    for (unsigned i = 0; i < bytes; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+static uint64_t GetLE(const uint8_t*& p, const uint8_t* end, unsigned bytes)
+{
+    if (static_cast<size_t>(end - p) < bytes)
+        throw EDecodeError("Truncated inflate index");
+    uint64_t value = 0;
+    for (unsigned i = 0; i < bytes; i++)
+        value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    p += bytes;
+    return value;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Build Index
+ * Runs one full inflate with block stops enabled. Whenever at least `span`
+ * bytes were produced since the last point and the decoder sits on a block
+ * boundary, the bit offset and the 32 KB history are recorded.
+ */
+void TInflateIndex::Build(const uint8_t* data, size_t size, uint64_t spanBytes)
+{
+    TSpanSource source(data, size);
+    Build(&source, spanBytes);
+}
+
+void TInflateIndex::Build(TByteSource* compressed, uint64_t spanBytes)
+{
+    span = spanBytes > 0 ? spanBytes : DefaultSpan;
+    points.clear();
+
+    TInflatePoint first;
+    first.outOffset = 0;
+    first.bitOffset = 0;
+    points.push_back(first);
+
+    TInflater inflater(compressed);
+    inflater.StopAtBlockBoundaries(true);
+
+    uint64_t out = 0;
+    const uint8_t* chunk;
+    size_t chunkSize;
+    while (inflater.Next(chunk, chunkSize)) {
+        out += chunkSize;
+        if (inflater.AtBlockBoundary() && out - points.back().outOffset >= span) {
+            TInflatePoint point;
+            point.outOffset = out;
+            point.bitOffset = inflater.InputBitPosition();
+            const uint8_t* history;
+            size_t historySize = inflater.History(history);
+            point.window.assign(history, history + historySize);
+            points.push_back(point);
+        }
+    }
+    totalOut = out;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Random Access Read
+ * Resumes at the last point at or before `offset`, discards output up to
+ * the requested offset and copies the rest into `dst`.
+ */
+size_t TInflateIndex::Read(const uint8_t* data, size_t size, uint64_t offset,
+                           void* dst, size_t length) const
+{
+    if (points.empty() || offset >= totalOut || length == 0)
+        return 0;
+
+    uint64_t startByte = StartByte(offset);
+    if (startByte > size)
+        throw EDecodeError("Inflate index does not match entry data");
+
+    TSpanSource source(data + startByte, size - static_cast<size_t>(startByte));
+    return Read(&source, offset, dst, length);
+}
+
+// Compressed byte holding the start of the point a read at `offset` resumes from
+uint64_t TInflateIndex::StartByte(uint64_t offset) const
+{
+    return points.empty() ? 0 : PointBefore(offset).bitOffset / 8;
+}
+
+size_t TInflateIndex::Read(TByteSource* compressed, uint64_t offset, void* dst,
+                           size_t length) const
+{
+    if (points.empty() || offset >= totalOut || length == 0)
+        return 0;
+
+    const TInflatePoint& point = PointBefore(offset);
+    TInflater inflater(compressed);
+    inflater.Resume(static_cast<unsigned>(point.bitOffset % 8),
+                    point.window.data(), point.window.size());
+
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    uint64_t pos = point.outOffset;
+    size_t done = 0;
+    const uint8_t* chunk;
+    size_t chunkSize;
+    while (done < length && inflater.Next(chunk, chunkSize)) {
+        uint64_t chunkEnd = pos + chunkSize;
+        if (chunkEnd > offset + done) {
+            size_t skip = static_cast<size_t>(offset + done - pos);
+            size_t n = chunkSize - skip;
+            if (n > length - done)
+                n = length - done;
+            memcpy(to + done, chunk + skip, n);
+            done += n;
+        }
+        pos = chunkEnd;
+    }
+    return done;
+}
+
+// Binary search for the last point at or before `offset`
+const TInflatePoint& TInflateIndex::PointBefore(uint64_t offset) const
+{
+    size_t lo = 0;
+    size_t hi = points.size();
+    while (hi - lo > 1) {
+        size_t mid = (lo + hi) / 2;
+        if (points[mid].outOffset <= offset)
+            lo = mid;
+        else
+            hi = mid;
+    }
+    return points[lo];
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Serialize / Deserialize
+ * Layout (little-endian): magic, version, span, total size, point count,
+ * then per point: output offset, bit offset, window size, window bytes.
+ */
+std::vector<uint8_t> TInflateIndex::Serialize() const
+{
+    std::vector<uint8_t> out;
+    PutLE(out, IndexMagic, 4);
+    PutLE(out, IndexVersion, 4);
+    PutLE(out, span, 8);
+    PutLE(out, totalOut, 8);
+    PutLE(out, points.size(), 4);
+    for (size_t i = 0; i < points.size(); i++) {
+        const TInflatePoint& point = points[i];
+        PutLE(out, point.outOffset, 8);
+        PutLE(out, point.bitOffset, 8);
+        PutLE(out, point.window.size(), 4);
+        out.insert(out.end(), point.window.begin(), point.window.end());
+    }
+    return out;
+}
+
+void TInflateIndex::Deserialize(const uint8_t* bytes, size_t size)
+{
+    const uint8_t* p = bytes;
+    const uint8_t* end = bytes + size;
+    if (GetLE(p, end, 4) != IndexMagic || GetLE(p, end, 4) != IndexVersion)
+        throw EDecodeError("Not an inflate index");
+
+    span = GetLE(p, end, 8);
+    totalOut = GetLE(p, end, 8);
+    size_t count = static_cast<size_t>(GetLE(p, end, 4));
+
+    points.clear();
+    points.resize(count);
+    for (size_t i = 0; i < count; i++) {
+        TInflatePoint& point = points[i];
+        point.outOffset = GetLE(p, end, 8);
+        point.bitOffset = GetLE(p, end, 8);
+        size_t windowSize = static_cast<size_t>(GetLE(p, end, 4));
+        if (windowSize > TInflater::HistorySize || static_cast<size_t>(end - p) < windowSize)
+            throw EDecodeError("Truncated inflate index");
+        point.window.assign(p, p + windowSize);
+        p += windowSize;
+    }
+    if (points.empty() || points[0].outOffset != 0)
+        throw EDecodeError("Inflate index has no start point");
+}
+//---------------------------------------------------------------------------
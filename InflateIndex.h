@@ -0,0 +1,81 @@
+﻿/*
+ * InflateIndex.h - Random Access Checkpoints For DEFLATE Streams
+ *
+ * Declares TInflateIndex, a zran-style access point list for one deflated
+ * entry. Every `span` bytes of output (at the next block boundary) the index
+ * stores the compressed bit offset and the preceding 32 KB of output, which
+ * is all a decoder needs to restart there. A read at any offset then costs
+ * at most one span of inflate instead of inflating from the entry start.
+ *
+ * Indexes are built on first access by TFlagPack and TRemotePack (which
+ * feed the compressed bytes through a TByteSource), or ahead of time by the
+ * pack builder and stored next to the entry as "<name>.zidx" (see
+ * Serialize()).
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef InflateIndexH
+#define InflateIndexH
+//---------------------------------------------------------------------------
+
+#include "Inflate.h"              // TInflater, EDecodeError
+
+#include <cstdint>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TInflatePoint - One Access Point
+ */
+struct TInflatePoint
+{
+    uint64_t outOffset;             // Uncompressed offset of the point
+    uint64_t bitOffset;             // Compressed bit offset of the block header
+    std::vector<uint8_t> window;    // Output preceding outOffset (up to 32 KB)
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TInflateIndex - Access Point List For One Raw DEFLATE Stream
+ */
+class TInflateIndex
+{
+  public:
+    static const uint64_t DefaultSpan = 1 << 20;  // 1 MB between points
+
+    TInflateIndex() : span(DefaultSpan), totalOut(0) {}
+
+    // Inflates the whole stream once, recording a point about every `span` bytes
+    void Build(const uint8_t* data, size_t size, uint64_t span = DefaultSpan);
+    void Build(TByteSource* compressed, uint64_t span = DefaultSpan);
+
+    // Reads `length` uncompressed bytes at `offset`; returns the bytes read
+    size_t Read(const uint8_t* data, size_t size, uint64_t offset,
+                void* dst, size_t length) const;
+
+    // The same with the compressed bytes from StartByte(offset) on coming
+    // from `compressed`, for streams that are not in memory
+    uint64_t StartByte(uint64_t offset) const;
+    size_t Read(TByteSource* compressed, uint64_t offset, void* dst, size_t length) const;
+
+    // Compact binary form for storing alongside the entry
+    std::vector<uint8_t> Serialize() const;
+    void Deserialize(const uint8_t* bytes, size_t size);
+
+    uint64_t Span() const { return span; }
+    uint64_t TotalOut() const { return totalOut; }
+    size_t PointCount() const { return points.size(); }
+
+  private:
+    uint64_t span;
+    uint64_t totalOut;
+    std::vector<TInflatePoint> points;  // Sorted by outOffset, first at 0
+
+    const TInflatePoint& PointBefore(uint64_t offset) const;
+};
+
+//---------------------------------------------------------------------------
+#endif // InflateIndexH
@@ -0,0 +1,195 @@
+﻿/*
+ * Lz4.cpp - LZ4 Block Compression
+ *
+ * Implements the greedy hash-table compressor and the bounds-checked
+ * decompressor of the LZ4 block format.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "Lz4.h"
+#include "Inflate.h"              // EDecodeError
+
+#include <algorithm>
+#include <cstring>                // memcpy
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const unsigned HashBits = 16;
+static const size_t MinMatch = 4;
+static const size_t LastLiterals = 5;       // A block ends with at least this many literals
+static const size_t MatchLimit = 12;        // No match starts in the last 12 bytes
+static const size_t MaxOffset = 65535;
+
+static inline uint32_t Read32(const uint8_t* p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline unsigned Hash(uint32_t sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HashBits);
+}
+
+size_t Lz4Bound(size_t size)
+{
+    return size + size / 255 + 16;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Sequence Encoding
+ * Token: literal count (high nibble) and match length - 4 (low nibble);
+ * a nibble of 15 continues in bytes of 255 and a final remainder.
+ */
+static uint8_t* WriteLength(uint8_t* out, size_t length)
+{
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = static_cast<uint8_t>(length);
+    return out;
+}
+
+static uint8_t* WriteSequence(uint8_t* out, const uint8_t* literals, size_t literalCount,
+                              size_t offset, size_t matchLength)
+{
+    uint8_t* token = out++;
+    *token = static_cast<uint8_t>(std::min<size_t>(literalCount, 15) << 4);
+    if (literalCount >= 15)
+        out = WriteLength(out, literalCount - 15);
+    memcpy(out, literals, literalCount);
+    out += literalCount;
+    if (offset == 0)
+        return out;                 // Last sequence: literals only
+
+    *out++ = static_cast<uint8_t>(offset);
+    *out++ = static_cast<uint8_t>(offset >> 8);
+    size_t extra = matchLength - MinMatch;
+    *token |= static_cast<uint8_t>(std::min<size_t>(extra, 15));
+    if (extra >= 15)
+        out = WriteLength(out, extra - 15);
+    return out;
+}
+
+/*
+ * Compress
+ * One hash probe per position, extended both ways on a hit. Positions
+ * without a match are skipped faster the longer the literal run gets, so
+ * incompressible data costs little time.
+ */
+void Lz4Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out)
+{
+    out.resize(Lz4Bound(size));
+    uint8_t* op = out.data();
+    const uint8_t* end = data + size;
+    const uint8_t* anchor = data;
+
+    if (size > MatchLimit) {
+        std::vector<uint32_t> table(size_t(1) << HashBits, 0);
+        const uint8_t* limit = end - MatchLimit;
+        const uint8_t* matchEnd = end - LastLiterals;
+        const uint8_t* ip = data + 1;
+        while (ip < limit) {
+            uint32_t sequence = Read32(ip);
+            unsigned slot = Hash(sequence);
+            const uint8_t* ref = data + table[slot];
+            table[slot] = static_cast<uint32_t>(ip - data);
+            if (ref >= ip || static_cast<size_t>(ip - ref) > MaxOffset || Read32(ref) != sequence) {
+                ip += 1 + ((ip - anchor) >> 6);
+                continue;
+            }
+
+            while (ip > anchor && ref > data && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* matched = ip + MinMatch;
+            const uint8_t* from = ref + MinMatch;
+            while (matched < matchEnd && *matched == *from) {
+                matched++;
+                from++;
+            }
+            op = WriteSequence(op, anchor, ip - anchor, ip - ref, matched - ip);
+            ip = anchor = matched;
+            if (ip < limit)
+                table[Hash(Read32(ip - 2))] = static_cast<uint32_t>(ip - 2 - data);
+        }
+    }
+    op = WriteSequence(op, anchor, end - anchor, 0, 0);
+    out.resize(op - out.data());
+}
+//---------------------------------------------------------------------------
+
+static size_t ReadLength(const uint8_t*& in, const uint8_t* end)
+{
+    size_t length = 0;
+    uint8_t byte;
+    do {
+        if (in >= end)
+            throw EDecodeError("Truncated LZ4 block");
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+    return length;
+}
+
+/*
+ * Decompress
+ * Overlapping matches (offset < length) repeat the last `offset` bytes;
+ * they are copied in doubling chunks so a run of one repeated pixel takes
+ * a handful of memcpy calls rather than one per byte.
+ */
+void Lz4Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t rawSize)
+{
+    const uint8_t* in = data;
+    const uint8_t* inEnd = data + size;
+    uint8_t* op = out;
+    uint8_t* opEnd = out + rawSize;
+
+    for (;;) {
+        if (in >= inEnd)
+            throw EDecodeError("Truncated LZ4 block");
+        unsigned token = *in++;
+        size_t literals = token >> 4;
+        if (literals == 15)
+            literals += ReadLength(in, inEnd);
+        if (literals > static_cast<size_t>(inEnd - in) || literals > static_cast<size_t>(opEnd - op))
+            throw EDecodeError("LZ4 literals overrun");
+        memcpy(op, in, literals);
+        op += literals;
+        in += literals;
+        if (in == inEnd)
+            break;
+
+        if (inEnd - in < 2)
+            throw EDecodeError("Truncated LZ4 block");
+        size_t offset = in[0] | (static_cast<size_t>(in[1]) << 8);
+        in += 2;
+        size_t length = token & 15;
+        if (length == 15)
+            length += ReadLength(in, inEnd);
+        length += MinMatch;
+        if (offset == 0 || offset > static_cast<size_t>(op - out) ||
+            length > static_cast<size_t>(opEnd - op))
+            throw EDecodeError("Invalid LZ4 match");
+
+        if (offset >= length) {
+            memcpy(op, op - offset, length);
+            op += length;
+            continue;
+        }
+        for (size_t period = offset; length > 0; period *= 2) {
+            size_t chunk = std::min(period, length);
+            memcpy(op, op - period, chunk);
+            op += chunk;
+            length -= chunk;
+        }
+    }
+    if (op != opEnd)
+        throw EDecodeError("LZ4 block size mismatch");
+}
+//---------------------------------------------------------------------------
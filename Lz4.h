@@ -0,0 +1,36 @@
+﻿/*
+ * Lz4.h - LZ4 Block Compression
+ *
+ * Declares a self-contained LZ4 block codec (the raw block format, no
+ * frame header) for the compressed tier of the image cache. It trades
+ * ratio for speed: decoded flag pixels are long runs of identical BGRA
+ * values and compress 20 to 100 times even with a greedy single-probe
+ * matcher, and a whole 1 MB image decompresses in a fraction of a
+ * millisecond. Nothing here is meant for data stored on disk by other
+ * programs; DEFLATE (Deflate.h) stays the pack format.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef Lz4H
+#define Lz4H
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+// Largest compressed size of `size` input bytes
+size_t Lz4Bound(size_t size);
+
+// Compresses `size` bytes into `out`, replacing its contents
+void Lz4Compress(const uint8_t* data, size_t size, std::vector<uint8_t>& out);
+
+// Decompresses a block into exactly `rawSize` bytes at `out`; throws
+// EDecodeError if the block is corrupt or does not fill `out` exactly
+void Lz4Decompress(const uint8_t* data, size_t size, uint8_t* out, size_t rawSize);
+
+//---------------------------------------------------------------------------
+#endif // Lz4H
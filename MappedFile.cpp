@@ -0,0 +1,255 @@
+﻿/*
+ * MappedFile.cpp - Read-Only Memory-Mapped File
+ *
+ * Win32 file mapping on Windows; mmap() on POSIX systems so the same
+ * archive code can run in command-line tools on other platforms.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "MappedFile.h"
+
+#include <cstdio>                 // rename, remove
+#include <stdexcept>              // std::runtime_error
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+#ifdef _WIN32
+/*
+ * UTF-8 To UTF-16 Path Conversion
+ */
+static std::wstring WidePath(const std::string& path)
+{
+    int length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, NULL, 0);
+    std::wstring wide(length > 0 ? length - 1 : 0, L'\0');
+    if (length > 1)
+        MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], length);
+    return wide;
+}
+#endif
+//---------------------------------------------------------------------------
+
+#ifdef _WIN32
+TMappedFile::TMappedFile() : data(nullptr), size(0), fileHandle(NULL), mappingHandle(NULL)
+{
+}
+#else
+TMappedFile::TMappedFile() : data(nullptr), size(0)
+{
+}
+#endif
+
+TMappedFile::~TMappedFile()
+{
+    Close();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Open And Map File
+ * Empty files are valid and yield an empty span.
+ */
+void TMappedFile::Open(const std::string& path, bool shared)
+{
+    Close();
+
+#ifdef _WIN32
+    DWORD share = shared ? FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE : FILE_SHARE_READ;
+    HANDLE file = CreateFileW(WidePath(path).c_str(), GENERIC_READ, share, NULL,
+                              OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Unable to open " + path);
+
+    LARGE_INTEGER fileSize;
+    if (!GetFileSizeEx(file, &fileSize)) {
+        CloseHandle(file);
+        throw std::runtime_error("Unable to query size of " + path);
+    }
+    fileHandle = file;
+    size = static_cast<size_t>(fileSize.QuadPart);
+    if (size == 0)
+        return;
+
+    mappingHandle = CreateFileMappingW(file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (mappingHandle == NULL) {
+        Close();
+        throw std::runtime_error("Unable to map " + path);
+    }
+    data = static_cast<const uint8_t*>(MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, 0));
+    if (data == nullptr) {
+        Close();
+        throw std::runtime_error("Unable to map " + path);
+    }
+#else
+    (void)shared;                           // POSIX never locks mapped files
+    int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Unable to open " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        throw std::runtime_error("Unable to query size of " + path);
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size > 0) {
+        void* view = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (view == MAP_FAILED) {
+            close(fd);
+            size = 0;
+            throw std::runtime_error("Unable to map " + path);
+        }
+        data = static_cast<const uint8_t*>(view);
+    }
+    close(fd); // The mapping keeps the file referenced
+#endif
+}
+
+void TMappedFile::Close()
+{
+#ifdef _WIN32
+    if (data != nullptr)
+        UnmapViewOfFile(data);
+    if (mappingHandle != NULL)
+        CloseHandle(mappingHandle);
+    if (fileHandle != NULL)
+        CloseHandle(fileHandle);
+    mappingHandle = NULL;
+    fileHandle = NULL;
+#else
+    if (data != nullptr)
+        munmap(const_cast<uint8_t*>(data), size);
+#endif
+    data = nullptr;
+    size = 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Prefetch Memory Range
+ * Windows 8+: PrefetchVirtualMemory, looked up at run time so the program
+ * still starts on older systems. POSIX: madvise(MADV_WILLNEED). Otherwise
+ * every page is touched in ascending order, which the pager turns into
+ * clustered sequential reads.
+ */
+void TMappedFile::Prefetch(const void* address, size_t length)
+{
+    if (address == nullptr || length == 0)
+        return;
+
+#ifdef _WIN32
+    struct TRangeEntry
+    {
+        void* VirtualAddress;
+        SIZE_T NumberOfBytes;
+    };
+    typedef BOOL(WINAPI * TPrefetchFn)(HANDLE, ULONG_PTR, TRangeEntry*, ULONG);
+    static TPrefetchFn prefetch = reinterpret_cast<TPrefetchFn>(
+        GetProcAddress(GetModuleHandleW(L"kernel32.dll"), "PrefetchVirtualMemory"));
+    if (prefetch != NULL) {
+        TRangeEntry range = {const_cast<void*>(address), length};
+        if (prefetch(GetCurrentProcess(), 1, &range, 0))
+            return;
+    }
+#else
+    const size_t pageSize = 4096;
+    uintptr_t start = reinterpret_cast<uintptr_t>(address) & ~(pageSize - 1);
+    uintptr_t end = reinterpret_cast<uintptr_t>(address) + length;
+    if (madvise(reinterpret_cast<void*>(start), end - start, MADV_WILLNEED) == 0)
+        return;
+#endif
+
+    const volatile uint8_t* bytes = static_cast<const volatile uint8_t*>(address);
+    uint8_t sink = 0;
+    for (size_t offset = 0; offset < length; offset += 4096)
+        sink ^= bytes[offset];
+    (void)sink;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Storage Device Identifier
+ * Windows: the volume GUID path of the volume holding the file.
+ * POSIX: the st_dev number. Unknown devices map to the path itself, which
+ * errs on the side of treating them as independent.
+ */
+std::string TMappedFile::DeviceId(const std::string& path)
+{
+#ifdef _WIN32
+    wchar_t root[MAX_PATH];
+    wchar_t volume[MAX_PATH];
+    if (GetVolumePathNameW(WidePath(path).c_str(), root, MAX_PATH) &&
+        GetVolumeNameForVolumeMountPointW(root, volume, MAX_PATH)) {
+        int length = WideCharToMultiByte(CP_UTF8, 0, volume, -1, NULL, 0, NULL, NULL);
+        std::string id(length > 0 ? length - 1 : 0, '\0');
+        if (length > 1)
+            WideCharToMultiByte(CP_UTF8, 0, volume, -1, &id[0], length, NULL, NULL);
+        return id;
+    }
+    return path;
+#else
+    struct stat st;
+    if (stat(path.c_str(), &st) != 0)
+        return path;
+    return "dev:" + std::to_string(static_cast<unsigned long long>(st.st_dev));
+#endif
+}
+//---------------------------------------------------------------------------
+
+bool TMappedFile::IsFolder(const std::string& path)
+{
+#ifdef _WIN32
+    DWORD attributes = GetFileAttributesW(WidePath(path).c_str());
+    return attributes != INVALID_FILE_ATTRIBUTES && (attributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+#else
+    struct stat info;
+    return stat(path.c_str(), &info) == 0 && S_ISDIR(info.st_mode);
+#endif
+}
+
+void TMappedFile::MakeFolders(const std::string& path)
+{
+    if (path.empty() || IsFolder(path))
+        return;
+    size_t slash = path.find_last_of("/\\");
+    if (slash != std::string::npos && slash > 0)
+        MakeFolders(path.substr(0, slash));
+#ifdef _WIN32
+    CreateDirectoryW(WidePath(path).c_str(), NULL);
+#else
+    mkdir(path.c_str(), 0777);
+#endif
+}
+
+void TMappedFile::ReplaceFile(const std::string& source, const std::string& target)
+{
+#ifdef _WIN32
+    bool moved = MoveFileExW(WidePath(source).c_str(), WidePath(target).c_str(),
+                             MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    bool moved = rename(source.c_str(), target.c_str()) == 0;
+#endif
+    if (!moved)
+        throw std::runtime_error("Unable to replace " + target + " with " + source);
+}
+
+void TMappedFile::RemoveFile(const std::string& path)
+{
+#ifdef _WIN32
+    DeleteFileW(WidePath(path).c_str());
+#else
+    remove(path.c_str());
+#endif
+}
+//---------------------------------------------------------------------------
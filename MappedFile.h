@@ -0,0 +1,73 @@
+﻿/*
+ * MappedFile.h - Read-Only Memory-Mapped File
+ *
+ * Declares TMappedFile, which maps a whole file read-only so archive
+ * readers can work on it as one memory span, exactly like the embedded
+ * resource. Pages are only read from disk when first touched.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef MappedFileH
+#define MappedFileH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TMappedFile - Whole-File Read-Only Mapping
+ * Paths are UTF-8. Open() throws std::runtime_error on failure. A shared
+ * mapping lets other handles append to, rename or delete the file while
+ * it is mapped (Windows denies that by default); the view keeps the size
+ * the file had when it was opened.
+ */
+class TMappedFile
+{
+  public:
+    TMappedFile();
+    ~TMappedFile();
+
+    void Open(const std::string& path, bool shared = false);
+    void Close();
+
+    const uint8_t* Data() const { return data; }
+    size_t Size() const { return size; }
+
+    // Asks the OS to read a range of mapped (or resource) memory ahead in
+    // one request; falls back to touching each page in order
+    static void Prefetch(const void* address, size_t length);
+
+    // Identifier of the storage device holding the file; files with equal
+    // ids share a disk and gain nothing from being read concurrently
+    static std::string DeviceId(const std::string& path);
+
+    static bool IsFolder(const std::string& path);
+
+    // Creates the folder `path` and any missing parents; existing ones are
+    // fine. Check the result with IsFolder()
+    static void MakeFolders(const std::string& path);
+
+    // Moves `source` over `target`, replacing it; throws std::runtime_error
+    static void ReplaceFile(const std::string& source, const std::string& target);
+
+    // Deletes a file if it exists (best effort, for clean-up paths)
+    static void RemoveFile(const std::string& path);
+
+  private:
+    TMappedFile(const TMappedFile&);            // Not copyable
+    TMappedFile& operator=(const TMappedFile&);
+
+    const uint8_t* data;
+    size_t size;
+#ifdef _WIN32
+    void* fileHandle;
+    void* mappingHandle;
+#endif
+};
+
+//---------------------------------------------------------------------------
+#endif // MappedFileH
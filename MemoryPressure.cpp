@@ -0,0 +1,454 @@
+﻿/*
+ * MemoryPressure.cpp - Memory Pressure Watcher And Cache Shrinking
+ *
+ * Implements the pressure sources for Linux and Windows, the watcher
+ * thread, the shrinking stages and the pressure benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "MemoryPressure.h"
+#include "DecodeScheduler.h"      // DecodePngEntry
+#include "ImageCache.h"           // TImageCache
+#include "Metrics.h"              // MetricCounter, MetricGauge
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>                // atof
+#include <cstring>                // strlen
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#endif
+#ifdef __GLIBC__
+#include <malloc.h>               // malloc_trim
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+// PSI trigger: 150 ms of stall within a 2 s window, the shortest window
+// an unprivileged process may ask for
+static const char* const PsiTrigger = "some 150000 2000000";
+static const double PsiModerate = 10;           // % of time some task stalled
+static const double PsiCritical = 40;
+static const double PsiFullCritical = 10;       // % of time every task stalled
+static const double AvailableModerate = 10;     // % of memory still available
+static const double AvailableCritical = 5;
+
+static const unsigned StageCount = 4;
+
+const char* PressureLevelName(TPressureLevel level)
+{
+    switch (level) {
+    case plModerate:
+        return "moderate";
+    case plCritical:
+        return "critical";
+    default:
+        return "none";
+    }
+}
+
+/*
+ * Pressure Metrics
+ */
+struct TPressureMetrics
+{
+    TCounter& moderate;
+    TCounter& critical;
+    TGauge& stage;
+
+    TPressureMetrics()
+        : moderate(MetricCounter("zip_memory_pressure_moderate_total",
+                                 "Pressure samples rated moderate")),
+          critical(MetricCounter("zip_memory_pressure_critical_total",
+                                 "Pressure samples rated critical")),
+          stage(MetricGauge("zip_cache_shrink_stage", "Image cache shrink stage, 0 = full size"))
+    {
+    }
+};
+
+static TPressureMetrics& PressureMetrics()
+{
+    static TPressureMetrics metrics;
+    return metrics;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Linux Sources
+ * Each reader leaves its fields alone if its file is missing, so the
+ * reading says which sources were there.
+ */
+#ifndef _WIN32
+static std::string ReadSmallFile(const std::string& path)
+{
+    std::ifstream file(path.c_str(), std::ios::binary);
+    std::ostringstream text;
+    text << file.rdbuf();
+    return text.str();
+}
+
+// "some avg10=1.23 avg60=... total=..." and the same for "full"
+static void ReadPsi(TPressureReading& reading)
+{
+    std::istringstream lines(ReadSmallFile("/proc/pressure/memory"));
+    std::string kind, average;
+    while (lines >> kind >> average) {
+        std::string rest;
+        std::getline(lines, rest);
+        if (average.compare(0, 6, "avg10=") != 0)
+            continue;
+        double value = atof(average.c_str() + 6);
+        if (kind == "some")
+            reading.someAvg10 = value;
+        else if (kind == "full")
+            reading.fullAvg10 = value;
+    }
+}
+
+// The cgroup v2 folder of this process: the "0::" line of /proc/self/cgroup
+static std::string CgroupFolder()
+{
+    std::istringstream lines(ReadSmallFile("/proc/self/cgroup"));
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.compare(0, 3, "0::") == 0)
+            return "/sys/fs/cgroup" + (line.size() > 4 ? line.substr(3) : std::string());
+    }
+    return std::string();
+}
+
+static void ParseCgroupEvents(const std::string& text, TPressureReading& reading)
+{
+    std::istringstream lines(text);
+    std::string name;
+    uint64_t value;
+    while (lines >> name >> value) {
+        if (name == "high")
+            reading.cgroupHigh = value;
+        else if (name == "max")
+            reading.cgroupMax = value;
+        else if (name == "oom")
+            reading.cgroupOom = value;
+    }
+}
+
+static void ReadMemInfo(TPressureReading& reading)
+{
+    std::istringstream lines(ReadSmallFile("/proc/meminfo"));
+    std::string name;
+    uint64_t value, total = 0, available = 0;
+    while (lines >> name >> value) {
+        std::string unit;
+        std::getline(lines, unit);
+        if (name == "MemTotal:")
+            total = value;
+        else if (name == "MemAvailable:")
+            available = value;
+    }
+    if (total > 0 && available > 0)
+        reading.availablePercent = 100.0 * available / total;
+}
+#endif
+
+static TPressureReading EmptyReading()
+{
+    TPressureReading reading;
+    reading.level = plNone;
+    reading.someAvg10 = reading.fullAvg10 = -1;
+    reading.cgroupHigh = reading.cgroupMax = reading.cgroupOom = 0;
+    reading.availablePercent = -1;
+    reading.lowMemory = false;
+    return reading;
+}
+
+/*
+ * Rating
+ * Counters of memory.events only say something by rising, so the first
+ * reading never rates them.
+ */
+static TPressureLevel Rate(const TPressureReading& reading, const TPressureReading* previous)
+{
+    TPressureLevel level = plNone;
+    if (reading.someAvg10 >= PsiModerate)
+        level = plModerate;
+    if (reading.someAvg10 >= PsiCritical || reading.fullAvg10 >= PsiFullCritical)
+        level = plCritical;
+    if (previous) {
+        if (reading.cgroupHigh > previous->cgroupHigh)
+            level = std::max(level, plModerate);
+        if (reading.cgroupMax > previous->cgroupMax || reading.cgroupOom > previous->cgroupOom)
+            level = plCritical;
+    }
+    if (reading.availablePercent >= 0 && reading.availablePercent < AvailableModerate)
+        level = std::max(level, reading.availablePercent < AvailableCritical ? plCritical
+                                                                             : plModerate);
+    if (reading.lowMemory)
+        level = plCritical;
+    return level;
+}
+
+TPressureReading TMemoryPressureMonitor::Sample(const TPressureReading* previous)
+{
+    TPressureReading reading = EmptyReading();
+#ifdef _WIN32
+    MEMORYSTATUSEX status;
+    status.dwLength = sizeof(status);
+    if (GlobalMemoryStatusEx(&status))
+        reading.availablePercent = 100.0 - status.dwMemoryLoad;
+    HANDLE notification = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    BOOL low = FALSE;
+    if (notification != NULL) {
+        QueryMemoryResourceNotification(notification, &low);
+        CloseHandle(notification);
+    }
+    reading.lowMemory = low != FALSE;
+#else
+    ReadPsi(reading);
+    std::string folder = CgroupFolder();
+    if (!folder.empty())
+        ParseCgroupEvents(ReadSmallFile(folder + "/memory.events"), reading);
+    ReadMemInfo(reading);
+#endif
+    reading.level = Rate(reading, previous);
+    return reading;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Monitor
+ * Linux: poll() on the PSI trigger, on memory.events (which signals a
+ * change with POLLPRI) and on a pipe the destructor writes to. Windows:
+ * the low-memory notification is a level-triggered handle that stays
+ * signalled while memory is low, so it is queried on every poll rather
+ * than waited on.
+ */
+TMemoryPressureMonitor::TMemoryPressureMonitor(const TSampleCallback& onSample, unsigned pollMs)
+    : onSample(onSample), pollMs(std::max(1u, pollMs)), psiTrigger(-1), cgroupEvents(-1),
+      lowMemory(nullptr), stopEvent(nullptr)
+{
+    stopPipe[0] = stopPipe[1] = -1;
+#ifdef _WIN32
+    lowMemory = CreateMemoryResourceNotification(LowMemoryResourceNotification);
+    stopEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+    sources = lowMemory != NULL ? "low-memory-notification memory-load" : "memory-load";
+#else
+    if (pipe(stopPipe) != 0)
+        stopPipe[0] = stopPipe[1] = -1;
+    psiTrigger = open("/proc/pressure/memory", O_RDWR | O_NONBLOCK | O_CLOEXEC);
+    if (psiTrigger >= 0 && write(psiTrigger, PsiTrigger, strlen(PsiTrigger) + 1) < 0) {
+        close(psiTrigger);
+        psiTrigger = -1;
+    }
+    if (psiTrigger >= 0)
+        sources = "psi-trigger";
+    else if (!ReadSmallFile("/proc/pressure/memory").empty())
+        sources = "psi";
+    std::string folder = CgroupFolder();
+    if (!folder.empty())
+        cgroupEvents = open((folder + "/memory.events").c_str(), O_RDONLY | O_CLOEXEC);
+    if (cgroupEvents >= 0)
+        sources += sources.empty() ? "cgroup" : " cgroup";
+    sources += sources.empty() ? "meminfo" : " meminfo";
+#endif
+    thread = std::thread(&TMemoryPressureMonitor::Loop, this);
+}
+
+TMemoryPressureMonitor::~TMemoryPressureMonitor()
+{
+#ifdef _WIN32
+    if (stopEvent != NULL)
+        SetEvent(stopEvent);
+#else
+    if (stopPipe[1] >= 0) {
+        char stop = 1;
+        ssize_t written = write(stopPipe[1], &stop, 1);
+        (void)written;
+    }
+#endif
+    thread.join();
+#ifdef _WIN32
+    if (lowMemory != NULL)
+        CloseHandle(lowMemory);
+    if (stopEvent != NULL)
+        CloseHandle(stopEvent);
+#else
+    int fds[] = {psiTrigger, cgroupEvents, stopPipe[0], stopPipe[1]};
+    for (unsigned i = 0; i < 4; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+#endif
+}
+
+bool TMemoryPressureMonitor::Wait()
+{
+#ifdef _WIN32
+    return WaitForSingleObject(stopEvent, pollMs) == WAIT_TIMEOUT;
+#else
+    pollfd fds[3];
+    nfds_t count = 0;
+    fds[count].fd = stopPipe[0];
+    fds[count++].events = POLLIN;
+    if (psiTrigger >= 0) {
+        fds[count].fd = psiTrigger;
+        fds[count++].events = POLLPRI;
+    }
+    if (cgroupEvents >= 0) {
+        fds[count].fd = cgroupEvents;
+        fds[count++].events = POLLPRI;
+    }
+    if (stopPipe[0] < 0) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(pollMs));
+        return true;
+    }
+    int ready = poll(fds, count, static_cast<int>(pollMs));
+    if (ready > 0 && (fds[0].revents & POLLIN) != 0)
+        return false;
+    // memory.events stays readable-with-priority until read again
+    if (cgroupEvents >= 0) {
+        char buffer[512];
+        ssize_t bytes = pread(cgroupEvents, buffer, sizeof(buffer), 0);
+        (void)bytes;
+    }
+    return true;
+#endif
+}
+
+void TMemoryPressureMonitor::Loop()
+{
+    TPressureReading previous = Sample();
+    do {
+        TPressureReading reading = Sample(&previous);
+        previous = reading;
+        if (reading.level == plModerate)
+            PressureMetrics().moderate.Add();
+        else if (reading.level == plCritical)
+            PressureMetrics().critical.Add();
+        onSample(reading);
+    } while (Wait());
+}
+//---------------------------------------------------------------------------
+
+TCacheShrinker::TCacheShrinker(TImageCache& cache, size_t hotBudget, size_t coldBudget,
+                               unsigned calmSamples)
+    : cache(cache), hotBudget(hotBudget), coldBudget(coldBudget),
+      calmSamples(std::max(1u, calmSamples)), stage(0), calm(0)
+{
+}
+
+void TCacheShrinker::Sample(TPressureLevel level)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    if (level == plNone) {
+        if (stage > 0 && ++calm >= calmSamples) {
+            calm = 0;
+            Apply(stage - 1);
+        }
+        return;
+    }
+    calm = 0;
+    if (level == plModerate)
+        Apply(std::max(stage, 1u));
+    else
+        Apply(std::min(StageCount - 1, std::max(stage + 1, 2u)));
+}
+
+unsigned TCacheShrinker::Stage() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    return stage;
+}
+
+/*
+ * Apply A Stage
+ * Caller holds the lock, which also keeps two samples from resizing the
+ * cache at once. Shrinking hands the freed pages back to the system
+ * where the allocator keeps them otherwise.
+ */
+void TCacheShrinker::Apply(unsigned newStage)
+{
+    if (newStage == stage)
+        return;
+    static const size_t coldDivisors[StageCount] = {1, 1, 2, 8};
+    bool shrinking = newStage > stage;
+    stage = newStage;
+    cache.SetBudgets(stage == 0 ? hotBudget : 0, coldBudget / coldDivisors[stage]);
+    PressureMetrics().stage.Set(static_cast<int64_t>(stage));
+#ifdef __GLIBC__
+    if (shrinking)
+        malloc_trim(0);
+#else
+    (void)shrinking;
+#endif
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Pressure Benchmark
+ * Scripted first, so the stages show on any machine: every PNG entry is
+ * decoded into the cold tier and the first ones clicked into the hot
+ * tier, then the shrinker is fed an episode of pressure followed by calm.
+ * The live part prints the real readings once a second.
+ */
+void RunPressureBench(const TPackVolumeSet& pack, unsigned watchSeconds, std::ostream& out)
+{
+    const size_t hotBudget = 32 << 20;
+    const size_t coldBudget = 24 << 20;
+    TImageCache cache(hotBudget, coldBudget);
+    std::vector<size_t> entries = PngEntries(pack);
+    for (size_t k = 0; k < entries.size(); k++) {
+        std::shared_ptr<TDecodedImage> image = std::make_shared<TDecodedImage>();
+        DecodePngEntry(pack, entries[k], *image);
+        cache.Insert(entries[k], image, k < 16);
+    }
+
+    const unsigned calmSamples = 3;
+    TCacheShrinker shrinker(cache, hotBudget, coldBudget, calmSamples);
+    TPressureLevel episode[] = {plNone,     plModerate, plModerate, plCritical, plCritical,
+                                plCritical, plNone,     plNone,     plNone,     plNone,
+                                plNone,     plNone,     plNone,     plNone,     plNone};
+    out << "Scripted episode (" << entries.size() << " images, grow back after " << calmSamples
+        << " calm samples)\n"
+        << std::left << std::setw(8) << "sample" << std::setw(10) << "pressure" << std::right
+        << std::setw(6) << "stage" << std::setw(12) << "hot MB" << std::setw(12) << "cold MB"
+        << std::setw(10) << "images" << std::endl;
+    for (size_t i = 0; i < sizeof(episode) / sizeof(episode[0]); i++) {
+        shrinker.Sample(episode[i]);
+        TImageCacheStats stats = cache.Stats();
+        out << std::left << std::setw(8) << i << std::setw(10) << PressureLevelName(episode[i])
+            << std::right << std::setw(6) << shrinker.Stage() << std::fixed << std::setprecision(1)
+            << std::setw(12) << stats.hotBytes / 1048576.0 << std::setw(12)
+            << stats.coldBytes / 1048576.0 << std::setw(10) << stats.coldImages << std::endl;
+    }
+    if (watchSeconds == 0)
+        return;
+
+    std::mutex outputLock;
+    TMemoryPressureMonitor monitor([&](const TPressureReading& reading) {
+        std::lock_guard<std::mutex> guard(outputLock);
+        out << "  " << std::left << std::setw(10) << PressureLevelName(reading.level) << std::right
+            << std::fixed << std::setprecision(2) << "psi some " << reading.someAvg10 << " full "
+            << reading.fullAvg10 << ", cgroup high " << reading.cgroupHigh << " max "
+            << reading.cgroupMax << " oom " << reading.cgroupOom << ", available "
+            << std::setprecision(1) << reading.availablePercent << "%" << std::endl;
+    });
+    {
+        std::lock_guard<std::mutex> guard(outputLock);
+        out << "Watching for " << watchSeconds << " s, sources: " << monitor.Sources() << std::endl;
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(watchSeconds));
+}
+//---------------------------------------------------------------------------
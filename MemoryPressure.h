@@ -0,0 +1,155 @@
+﻿/*
+ * MemoryPressure.h - Memory Pressure Watcher And Cache Shrinking
+ *
+ * Declares a background watcher that rates the system's memory pressure,
+ * and the policy that shrinks the image cache while it lasts. On a shared
+ * kiosk another program may need memory urgently; the viewer gives back
+ * what it only keeps for speed instead of getting the whole machine into
+ * paging, or itself OOM-killed.
+ *
+ * Sources, all of those available are combined (the worst one counts):
+ * - Linux PSI, /proc/pressure/memory: a trigger wakes the watcher when
+ *   tasks stall on memory for 150 ms within 2 s, and the 10-second
+ *   averages rate it
+ * - Linux cgroup v2 memory.events of the process's own cgroup: a rise in
+ *   "high" means reclaim is throttling the group, "max" or "oom" that it
+ *   hit its limit
+ * - Windows: the low-memory resource notification, and the system memory
+ *   load
+ * - Anywhere else, and as a fallback: the share of memory still available
+ *   (/proc/meminfo), polled
+ *
+ * Sampling is cheap (a few small reads), so the watcher also polls every
+ * second whether or not a trigger fired.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef MemoryPressureH
+#define MemoryPressureH
+//---------------------------------------------------------------------------
+
+#include "PackVolumes.h"          // TPackVolumeSet
+
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+
+//---------------------------------------------------------------------------
+
+class TImageCache;
+
+enum TPressureLevel
+{
+    plNone,                         // Plenty of memory
+    plModerate,                     // Reclaim has started: caches should give back
+    plCritical                      // Close to the limit, or past it
+};
+
+const char* PressureLevelName(TPressureLevel level);
+
+/*
+ * TPressureReading - One Sample Of Every Source
+ */
+struct TPressureReading
+{
+    TPressureLevel level;           // The worst of the sources below
+    double someAvg10;               // PSI: % of time some task stalled; -1 without PSI
+    double fullAvg10;               // PSI: % of time all tasks stalled
+    uint64_t cgroupHigh;            // cgroup memory.events counters; 0 without a cgroup
+    uint64_t cgroupMax;
+    uint64_t cgroupOom;
+    double availablePercent;        // Available memory / total; -1 if unknown
+    bool lowMemory;                 // Windows low-memory notification signalled
+};
+
+/*
+ * TMemoryPressureMonitor - Background Pressure Watcher
+ * Calls `onSample` on its own thread after every sample, roughly once a
+ * `pollMs`, and at once when a trigger fires. Stopping (destruction) does
+ * not wait for the poll interval to run out.
+ */
+class TMemoryPressureMonitor
+{
+  public:
+    typedef std::function<void(const TPressureReading& reading)> TSampleCallback;
+
+    explicit TMemoryPressureMonitor(const TSampleCallback& onSample, unsigned pollMs = 1000);
+    ~TMemoryPressureMonitor();
+
+    // The sources in use, e.g. "psi-trigger cgroup meminfo"
+    const std::string& Sources() const { return sources; }
+
+    // One reading without a monitor thread; tracks cgroup counters between
+    // calls through `previous`
+    static TPressureReading Sample(const TPressureReading* previous = nullptr);
+
+  private:
+    TSampleCallback onSample;
+    unsigned pollMs;
+    std::string sources;
+    int psiTrigger;                 // Linux: PSI trigger fd, -1 if none
+    int cgroupEvents;               // Linux: memory.events fd, -1 if none
+    int stopPipe[2];                // Linux: written to wake the thread up
+    void* lowMemory;                // Windows: memory resource notification handle
+    void* stopEvent;                // Windows: set to wake the thread up
+    std::thread thread;
+
+    void Loop();
+    bool Wait();                    // False when stopping
+
+    TMemoryPressureMonitor(const TMemoryPressureMonitor&);
+    TMemoryPressureMonitor& operator=(const TMemoryPressureMonitor&);
+};
+
+/*
+ * TCacheShrinker - Image Cache Budgets That Follow Memory Pressure
+ *
+ * Stages, one step at a time:
+ *   0  full budgets
+ *   1  no raw pixels: the hot tier is emptied into the compressed tier
+ *   2  the compressed tier at half its budget
+ *   3  the compressed tier at an eighth
+ *
+ * Moderate pressure goes to stage 1 at once; each critical sample goes one
+ * stage further, at least to 2. After `calmSamples` samples in a row
+ * without pressure the cache grows back one stage, so a brief lull does
+ * not refill it only to empty it again. Thread-safe; meant to be fed by
+ * a TMemoryPressureMonitor.
+ */
+class TCacheShrinker
+{
+  public:
+    TCacheShrinker(TImageCache& cache, size_t hotBudget, size_t coldBudget,
+                   unsigned calmSamples = 30);
+
+    void Sample(TPressureLevel level);
+    unsigned Stage() const;
+
+  private:
+    TImageCache& cache;
+    size_t hotBudget;
+    size_t coldBudget;
+    unsigned calmSamples;
+    mutable std::mutex lock;
+    unsigned stage;
+    unsigned calm;
+
+    void Apply(unsigned newStage);
+
+    TCacheShrinker(const TCacheShrinker&);
+    TCacheShrinker& operator=(const TCacheShrinker&);
+};
+
+//---------------------------------------------------------------------------
+
+// Fills a cache with the PNG entries of `pack`, steps the shrinker
+// through a pressure episode and prints what each stage keeps; then
+// watches the real system for `watchSeconds`
+void RunPressureBench(const TPackVolumeSet& pack, unsigned watchSeconds, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // MemoryPressureH
@@ -0,0 +1,522 @@
+﻿/*
+ * Metrics.cpp - Process-Wide Counters, Gauges And Histograms
+ *
+ * Implements shard assignment, histogram bucketing, the registry, both
+ * exporters, the periodic dump thread and the update cost benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "Metrics.h"
+#include "TaskPool.h"             // TTaskPool::Shared (benchmark)
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdio>                 // snprintf, std::remove, std::rename
+#include <cstdlib>                // getenv, atoi
+#include <fstream>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+
+#ifdef _MSC_VER
+#include <intrin.h>               // _BitScanReverse64
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const unsigned DefaultDumpInterval = 10;    // Seconds
+
+/*
+ * Shard Assignment
+ * A thread takes a free shard for itself and keeps adding to what the
+ * previous owner left in it; the lock hands the cells over between the
+ * two. The free list is never destroyed, so threads exiting during
+ * static destruction can still return theirs.
+ */
+thread_local unsigned MetricShardIndex = MetricShards;
+
+struct TShardPool
+{
+    std::mutex lock;
+    std::vector<unsigned> free;
+
+    TShardPool()
+    {
+        for (unsigned s = MetricSharedShard; s > 0; s--)
+            free.push_back(s - 1);
+    }
+};
+
+static TShardPool& ShardPool()
+{
+    static TShardPool* pool = new TShardPool();
+    return *pool;
+}
+
+// Hands the thread's shard back when the thread exits
+struct TShardOwner
+{
+    ~TShardOwner()
+    {
+        unsigned shard = MetricShardIndex;
+        MetricShardIndex = MetricSharedShard;   // Updates from later destructors
+        if (shard < MetricSharedShard) {
+            std::lock_guard<std::mutex> guard(ShardPool().lock);
+            ShardPool().free.push_back(shard);
+        }
+    }
+};
+
+unsigned AssignMetricShard()
+{
+    TShardPool& pool = ShardPool();
+    unsigned shard = MetricSharedShard;
+    {
+        std::lock_guard<std::mutex> guard(pool.lock);
+        if (!pool.free.empty()) {
+            shard = pool.free.back();
+            pool.free.pop_back();
+        }
+    }
+    MetricShardIndex = shard;
+    static thread_local TShardOwner owner;
+    (void)owner;
+    return shard;
+}
+//---------------------------------------------------------------------------
+
+TCounter::TCounter()
+{
+    for (unsigned s = 0; s < MetricShards; s++)
+        cells[s].value.store(0, std::memory_order_relaxed);
+}
+
+uint64_t TCounter::Value() const
+{
+    uint64_t total = 0;
+    for (unsigned s = 0; s < MetricShards; s++)
+        total += cells[s].value.load(std::memory_order_relaxed);
+    return total;
+}
+//---------------------------------------------------------------------------
+
+static unsigned HighestBit(uint64_t value)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    return 63 - static_cast<unsigned>(__builtin_clzll(value));
+#elif defined(_MSC_VER) && defined(_WIN64)
+    unsigned long index;
+    _BitScanReverse64(&index, value);
+    return static_cast<unsigned>(index);
+#else
+    unsigned bit = 0;
+    while (value >>= 1)
+        bit++;
+    return bit;
+#endif
+}
+
+/*
+ * Histogram Buckets
+ * Values below SubBuckets get a bucket each. Above that, a value with its
+ * highest bit at e falls in group e - SubBits + 1, and the SubBits bits
+ * below the highest one pick the bucket within the group.
+ */
+THistogram::THistogram()
+{
+    for (unsigned s = 0; s < MetricShards; s++) {
+        shards[s].sum.store(0, std::memory_order_relaxed);
+        for (unsigned b = 0; b < BucketCount; b++)
+            shards[s].buckets[b].store(0, std::memory_order_relaxed);
+    }
+}
+
+unsigned THistogram::Bucket(uint64_t value)
+{
+    if (value < SubBuckets)
+        return static_cast<unsigned>(value);
+    unsigned exponent = HighestBit(value);
+    if (exponent > MaxExponent)
+        return BucketCount - 1;
+    unsigned sub = static_cast<unsigned>(value >> (exponent - SubBits)) & (SubBuckets - 1);
+    return (exponent - SubBits + 1) * SubBuckets + sub;
+}
+
+uint64_t THistogram::BucketLimit(unsigned bucket)
+{
+    if (bucket < SubBuckets)
+        return bucket + 1;
+    unsigned group = bucket / SubBuckets;
+    uint64_t sub = bucket % SubBuckets;
+    return (SubBuckets + sub + 1) << (group - 1);
+}
+
+THistogramSnapshot THistogram::Snapshot() const
+{
+    THistogramSnapshot snapshot;
+    snapshot.count = 0;
+    snapshot.sum = 0;
+    snapshot.buckets.assign(BucketCount, 0);
+    for (unsigned s = 0; s < MetricShards; s++) {
+        snapshot.sum += shards[s].sum.load(std::memory_order_relaxed);
+        for (unsigned b = 0; b < BucketCount; b++) {
+            uint64_t count = shards[s].buckets[b].load(std::memory_order_relaxed);
+            snapshot.buckets[b] += count;
+            snapshot.count += count;
+        }
+    }
+    return snapshot;
+}
+
+uint64_t THistogramSnapshot::Percentile(double fraction) const
+{
+    if (count == 0)
+        return 0;
+    uint64_t rank = static_cast<uint64_t>(fraction * count);
+    if (rank >= count)
+        rank = count - 1;
+    uint64_t seen = 0;
+    for (unsigned b = 0; b < buckets.size(); b++) {
+        seen += buckets[b];
+        if (seen > rank)
+            return THistogram::BucketLimit(b);
+    }
+    return THistogram::BucketLimit(static_cast<unsigned>(buckets.size()) - 1);
+}
+
+double SamplePercentile(std::vector<double> samples, double fraction)
+{
+    if (samples.empty())
+        return 0;
+    std::sort(samples.begin(), samples.end());
+    size_t index = std::min(samples.size() - 1, static_cast<size_t>(fraction * samples.size()));
+    return samples[index];
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Registry
+ * Metrics are never destroyed, so the references handed out stay valid
+ * for the whole process, including threads still running at exit.
+ */
+struct TMetricEntry
+{
+    TMetricKind kind;
+    std::string help;
+    TCounter* counter;
+    TGauge* gauge;
+    THistogram* histogram;
+    std::function<double()> probe;
+
+    TMetricEntry() : kind(mkCounter), counter(nullptr), gauge(nullptr), histogram(nullptr) {}
+};
+
+struct TMetricRegistry
+{
+    std::mutex lock;
+    std::map<std::string, TMetricEntry> entries;   // Sorted for stable output
+};
+
+static TMetricRegistry& Registry()
+{
+    static TMetricRegistry* registry = new TMetricRegistry;
+    return *registry;
+}
+
+// The entry for `name`, created with `kind`; an existing one of another
+// kind is an error in the caller
+static TMetricEntry& Register(const std::string& name, const std::string& help, TMetricKind kind)
+{
+    TMetricEntry& entry = Registry().entries[name];
+    if (entry.help.empty()) {
+        entry.kind = kind;
+        entry.help = help;
+    } else if (entry.kind != kind) {
+        throw std::logic_error("Metric registered twice with different types: " + name);
+    }
+    return entry;
+}
+
+TCounter& MetricCounter(const std::string& name, const std::string& help)
+{
+    std::lock_guard<std::mutex> guard(Registry().lock);
+    TMetricEntry& entry = Register(name, help, mkCounter);
+    if (entry.counter == nullptr && !entry.probe)
+        entry.counter = new TCounter;
+    if (entry.counter == nullptr)
+        throw std::logic_error("Metric is a probe: " + name);
+    return *entry.counter;
+}
+
+TGauge& MetricGauge(const std::string& name, const std::string& help)
+{
+    std::lock_guard<std::mutex> guard(Registry().lock);
+    TMetricEntry& entry = Register(name, help, mkGauge);
+    if (entry.gauge == nullptr && !entry.probe)
+        entry.gauge = new TGauge;
+    if (entry.gauge == nullptr)
+        throw std::logic_error("Metric is a probe: " + name);
+    return *entry.gauge;
+}
+
+THistogram& MetricHistogram(const std::string& name, const std::string& help)
+{
+    std::lock_guard<std::mutex> guard(Registry().lock);
+    TMetricEntry& entry = Register(name, help, mkHistogram);
+    if (entry.histogram == nullptr)
+        entry.histogram = new THistogram;
+    return *entry.histogram;
+}
+
+void MetricProbe(const std::string& name, const std::string& help, TMetricKind kind,
+                 const std::function<double()>& sample)
+{
+    if (kind == mkHistogram)
+        throw std::logic_error("Histograms cannot be probes: " + name);
+    std::lock_guard<std::mutex> guard(Registry().lock);
+    TMetricEntry& entry = Register(name, help, kind);
+    if (entry.counter != nullptr || entry.gauge != nullptr)
+        throw std::logic_error("Metric is not a probe: " + name);
+    entry.probe = sample;
+}
+//---------------------------------------------------------------------------
+
+static std::string Number(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.9g", value);
+    return text;
+}
+
+static double EntryValue(const TMetricEntry& entry)
+{
+    if (entry.probe)
+        return entry.probe();
+    if (entry.counter != nullptr)
+        return static_cast<double>(entry.counter->Value());
+    return static_cast<double>(entry.gauge->Value());
+}
+
+/*
+ * Prometheus Text Exposition
+ * Histogram buckets are emitted at every power of two from 1 us on, in
+ * seconds, so the series stay the same from one scrape to the next.
+ */
+static const unsigned FirstExportGroup = 9;       // Buckets below 2^10 ns merge into 1 us
+
+static void WritePrometheus(std::ostream& out, const std::string& name, const TMetricEntry& entry)
+{
+    static const char* const types[] = {"counter", "gauge", "histogram"};
+    out << "# HELP " << name << " " << entry.help << "\n"
+        << "# TYPE " << name << " " << types[entry.kind] << "\n";
+    if (entry.kind != mkHistogram) {
+        out << name << " " << Number(EntryValue(entry)) << "\n";
+        return;
+    }
+
+    THistogramSnapshot snapshot = entry.histogram->Snapshot();
+    uint64_t cumulative = 0;
+    for (unsigned b = 0; b < THistogram::BucketCount; b++) {
+        cumulative += snapshot.buckets[b];
+        unsigned group = b / THistogram::SubBuckets;
+        if (b % THistogram::SubBuckets != THistogram::SubBuckets - 1 || group < FirstExportGroup)
+            continue;
+        if (b + 1 == THistogram::BucketCount)
+            break;
+        out << name << "_bucket{le=\"" << Number(THistogram::BucketLimit(b) / 1e9) << "\"} "
+            << cumulative << "\n";
+    }
+    out << name << "_bucket{le=\"+Inf\"} " << snapshot.count << "\n"
+        << name << "_sum " << Number(snapshot.sum / 1e9) << "\n"
+        << name << "_count " << snapshot.count << "\n";
+}
+
+static void WriteJson(std::ostream& out, const std::string& name, const TMetricEntry& entry)
+{
+    out << "\"" << name << "\": ";
+    if (entry.kind != mkHistogram) {
+        out << Number(EntryValue(entry));
+        return;
+    }
+    THistogramSnapshot snapshot = entry.histogram->Snapshot();
+    out << "{\"count\": " << snapshot.count << ", \"sum_s\": " << Number(snapshot.sum / 1e9)
+        << ", \"p50_s\": " << Number(snapshot.Percentile(0.50) / 1e9)
+        << ", \"p90_s\": " << Number(snapshot.Percentile(0.90) / 1e9)
+        << ", \"p99_s\": " << Number(snapshot.Percentile(0.99) / 1e9)
+        << ", \"max_s\": " << Number(snapshot.Percentile(1.0) / 1e9) << "}";
+}
+
+/*
+ * Export
+ * The registry lock is held throughout, so probes must not register
+ * metrics themselves.
+ */
+void WriteMetrics(std::ostream& out, TMetricsFormat format)
+{
+    TMetricRegistry& registry = Registry();
+    std::lock_guard<std::mutex> guard(registry.lock);
+    if (format == mfPrometheus) {
+        for (std::map<std::string, TMetricEntry>::const_iterator it = registry.entries.begin();
+             it != registry.entries.end(); ++it)
+            WritePrometheus(out, it->first, it->second);
+        return;
+    }
+
+    static const char* const sections[] = {"counters", "gauges", "histograms"};
+    out << "{";
+    for (unsigned kind = mkCounter; kind <= mkHistogram; kind++) {
+        out << (kind == mkCounter ? "\n" : ",\n") << "  \"" << sections[kind] << "\": {";
+        bool first = true;
+        for (std::map<std::string, TMetricEntry>::const_iterator it = registry.entries.begin();
+             it != registry.entries.end(); ++it) {
+            if (it->second.kind != static_cast<TMetricKind>(kind))
+                continue;
+            out << (first ? "\n    " : ",\n    ");
+            WriteJson(out, it->first, it->second);
+            first = false;
+        }
+        out << (first ? "}" : "\n  }");
+    }
+    out << "\n}\n";
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Periodic Dump
+ */
+class TMetricsDumper
+{
+  public:
+    TMetricsDumper(const std::string& path, unsigned intervalSeconds, TMetricsFormat format)
+        : path(path), interval(std::max(1u, intervalSeconds)), format(format), stopping(false)
+    {
+        thread = std::thread(&TMetricsDumper::Loop, this);
+    }
+
+    ~TMetricsDumper()
+    {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+            wake.notify_all();
+        }
+        thread.join();
+        Write();
+    }
+
+  private:
+    std::string path;
+    std::chrono::seconds interval;
+    TMetricsFormat format;
+    std::mutex lock;
+    std::condition_variable wake;
+    bool stopping;
+    std::thread thread;
+
+    void Loop()
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        while (!wake.wait_for(guard, interval, [this]() { return stopping; })) {
+            guard.unlock();
+            Write();
+            guard.lock();
+        }
+    }
+
+    // Through a temporary file so a collector never reads a torn one
+    void Write()
+    {
+        std::string temp = path + ".tmp";
+        {
+            std::ofstream file(temp.c_str(), std::ios::binary | std::ios::trunc);
+            WriteMetrics(file, format);
+            if (!file)
+                return;
+        }
+        std::remove(path.c_str());
+        std::rename(temp.c_str(), path.c_str());
+    }
+};
+
+static std::mutex DumperLock;
+static std::unique_ptr<TMetricsDumper> Dumper;
+
+void StartMetricsDump(const std::string& path, unsigned intervalSeconds, TMetricsFormat format)
+{
+    std::lock_guard<std::mutex> guard(DumperLock);
+    Dumper.reset();
+    Dumper.reset(new TMetricsDumper(path, intervalSeconds, format));
+}
+
+void StartMetricsFromEnvironment()
+{
+    const char* path = getenv("ZIP_METRICS");
+    if (path == nullptr || *path == '\0')
+        return;
+    const char* interval = getenv("ZIP_METRICS_INTERVAL");
+    std::string name(path);
+    bool prometheus = name.size() >= 5 && name.compare(name.size() - 5, 5, ".prom") == 0;
+    StartMetricsDump(name, interval != nullptr ? static_cast<unsigned>(std::max(1, atoi(interval)))
+                                               : DefaultDumpInterval,
+                     prometheus ? mfPrometheus : mfJson);
+}
+
+void StopMetricsDump()
+{
+    std::lock_guard<std::mutex> guard(DumperLock);
+    Dumper.reset();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Update Cost Benchmark
+ * Every runner of the shared pool updates the same metric in a loop; with
+ * one runner that is the plain cost, with all of them it shows that the
+ * shards keep threads from fighting over one cache line.
+ */
+static const unsigned BenchUpdates = 1 << 24;
+
+static double TimeUpdates(unsigned runners, const std::function<void(unsigned)>& loop)
+{
+    TClock::time_point start = TClock::now();
+    TTaskPool::Shared().Run(runners, [&loop](unsigned) { loop(BenchUpdates); });
+    return std::chrono::duration<double, std::nano>(TClock::now() - start).count() / BenchUpdates;
+}
+
+void RunMetricsBench(std::ostream& out)
+{
+    TCounter counter;
+    TGauge gauge;
+    std::unique_ptr<THistogram> histogram(new THistogram);
+    unsigned all = TTaskPool::Shared().Concurrency(0);
+
+    struct TBenchCase
+    {
+        const char* name;
+        std::function<void(unsigned)> loop;
+    } cases[] = {
+        {"counter", [&counter](unsigned n) { for (unsigned i = 0; i < n; i++) counter.Add(); }},
+        {"gauge", [&gauge](unsigned n) { for (unsigned i = 0; i < n; i++) gauge.Add(1); }},
+        {"histogram", [&histogram](unsigned n) {
+             for (unsigned i = 0; i < n; i++) histogram->Record(i & 0xFFFFF);
+         }},
+    };
+
+    out << std::left << std::setw(12) << "metric" << std::right << std::setw(12) << "1 thread"
+        << std::setw(8) << all << " threads (ns per update, per thread)\n"
+        << std::fixed << std::setprecision(2);
+    for (size_t c = 0; c < sizeof(cases) / sizeof(cases[0]); c++) {
+        double single = TimeUpdates(1, cases[c].loop);
+        double shared = TimeUpdates(all, cases[c].loop);
+        out << std::left << std::setw(12) << cases[c].name << std::right << std::setw(12) << single
+            << std::setw(16) << shared << "\n";
+    }
+}
+//---------------------------------------------------------------------------
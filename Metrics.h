@@ -0,0 +1,210 @@
+﻿/*
+ * Metrics.h - Process-Wide Counters, Gauges And Histograms
+ *
+ * Declares the metrics registry the engine reports into: archive opens,
+ * inflated bytes, decode times, index cache hits and misses, task pool
+ * queue depth and decode request latency. Metrics are registered once by
+ * name, usually into a function-local static at the place they are
+ * updated, and live until the process exits.
+ *
+ * Updates are cheap enough for inner loops. Counters and histograms are
+ * sharded onto separate cache lines, and each thread owns a shard while
+ * it runs, so an update is a plain relaxed load and store with no locked
+ * instruction; shards are only summed when the registry is exported.
+ * Threads beyond the owned shards share the last one with atomic adds. Probes cost nothing at all until then: they are callbacks
+ * sampled at export time, used for values another object already keeps.
+ *
+ * Export formats:
+ * - Prometheus text exposition (version 0.0.4), for a scrape endpoint or
+ *   the node exporter's textfile collector
+ * - JSON with histogram percentiles, for logs and quick inspection
+ * ZIP_METRICS=<file> in the environment rewrites the file every
+ * ZIP_METRICS_INTERVAL seconds (default 10) and once more at exit; a
+ * ".prom" file gets the Prometheus format, anything else JSON.
+ * "Zip.exe --pack metrics <command>" runs a command and prints the result.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef MetricsH
+#define MetricsH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+enum TMetricKind { mkCounter, mkGauge, mkHistogram };
+enum TMetricsFormat { mfPrometheus, mfJson };
+
+const unsigned MetricShards = 32;           // Cache lines per sharded metric
+const unsigned MetricSharedShard = MetricShards - 1;
+
+// Shard of the calling thread, taken on first use and handed back when the
+// thread exits. Once the others are all taken threads get MetricSharedShard
+extern thread_local unsigned MetricShardIndex;     // MetricShards until assigned
+unsigned AssignMetricShard();
+
+inline unsigned MetricShard()
+{
+    unsigned shard = MetricShardIndex;
+    return shard < MetricShards ? shard : AssignMetricShard();
+}
+
+// Adds to a cell of `shard`: only the shared shard needs an atomic add
+inline void MetricAdd(std::atomic<uint64_t>& cell, unsigned shard, uint64_t amount)
+{
+    if (shard != MetricSharedShard)
+        cell.store(cell.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    else
+        cell.fetch_add(amount, std::memory_order_relaxed);
+}
+
+/*
+ * TCounter - Monotonic Count
+ */
+class TCounter
+{
+  public:
+    TCounter();
+
+    void Add(uint64_t amount = 1)
+    {
+        unsigned shard = MetricShard();
+        MetricAdd(cells[shard].value, shard, amount);
+    }
+    uint64_t Value() const;
+
+  private:
+    struct alignas(64) TCell
+    {
+        std::atomic<uint64_t> value;
+    };
+    TCell cells[MetricShards];
+
+    TCounter(const TCounter&);
+    TCounter& operator=(const TCounter&);
+};
+
+/*
+ * TGauge - Value That Goes Up And Down
+ * Not sharded: meant for values set now and then, not per item.
+ */
+class TGauge
+{
+  public:
+    TGauge() : value(0) {}
+
+    void Set(int64_t to) { value.store(to, std::memory_order_relaxed); }
+    void Add(int64_t amount) { value.fetch_add(amount, std::memory_order_relaxed); }
+    int64_t Value() const { return value.load(std::memory_order_relaxed); }
+
+  private:
+    std::atomic<int64_t> value;
+
+    TGauge(const TGauge&);
+    TGauge& operator=(const TGauge&);
+};
+
+/*
+ * THistogramSnapshot - Summed Histogram Shards
+ */
+struct THistogramSnapshot
+{
+    uint64_t count;
+    uint64_t sum;                   // Nanoseconds
+    std::vector<uint64_t> buckets;  // Per THistogram bucket
+
+    // Upper bound of the bucket holding the given fraction, in nanoseconds
+    uint64_t Percentile(double fraction) const;
+};
+
+/*
+ * THistogram - Log-Linear Duration Histogram
+ * Values are nanoseconds. Each power of two is split into four linear
+ * buckets, so any recorded value is known to within 25%; everything from
+ * 1 ns up to about five hours has its own bucket.
+ */
+class THistogram
+{
+  public:
+    typedef std::chrono::steady_clock TClock;
+
+    static const unsigned SubBits = 2;
+    static const unsigned SubBuckets = 1u << SubBits;
+    static const unsigned MaxExponent = 43;
+    static const unsigned BucketCount = (MaxExponent - SubBits + 2) * SubBuckets;
+
+    THistogram();
+
+    void Record(uint64_t nanoseconds)
+    {
+        unsigned index = MetricShard();
+        TShard& shard = shards[index];
+        MetricAdd(shard.buckets[Bucket(nanoseconds)], index, 1);
+        MetricAdd(shard.sum, index, nanoseconds);
+    }
+    void RecordSince(TClock::time_point start)
+    {
+        Record(static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - start).count()));
+    }
+
+    THistogramSnapshot Snapshot() const;
+
+    static unsigned Bucket(uint64_t value);
+    static uint64_t BucketLimit(unsigned bucket);   // Exclusive upper bound
+
+  private:
+    struct alignas(64) TShard
+    {
+        std::atomic<uint64_t> sum;
+        std::atomic<uint64_t> buckets[BucketCount];
+    };
+    TShard shards[MetricShards];
+
+    THistogram(const THistogram&);
+    THistogram& operator=(const THistogram&);
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * Registration
+ * Registering a name twice returns the first metric; a probe registered
+ * again replaces the old callback. Names follow Prometheus conventions:
+ * "zip_" prefix, counters end in "_total", durations in "_seconds".
+ */
+TCounter& MetricCounter(const std::string& name, const std::string& help);
+TGauge& MetricGauge(const std::string& name, const std::string& help);
+THistogram& MetricHistogram(const std::string& name, const std::string& help);
+void MetricProbe(const std::string& name, const std::string& help, TMetricKind kind,
+                 const std::function<double()>& sample);
+
+void WriteMetrics(std::ostream& out, TMetricsFormat format);
+
+/*
+ * Periodic Dump
+ * One background thread rewrites `path` every `intervalSeconds`, through a
+ * temporary file so a reader never sees a torn one. StopMetricsDump()
+ * writes the final state and must be called before the process exits.
+ */
+void StartMetricsDump(const std::string& path, unsigned intervalSeconds, TMetricsFormat format);
+void StartMetricsFromEnvironment();
+void StopMetricsDump();
+
+// The `fraction` percentile (0.5 the median, 1.0 the maximum) of raw
+// benchmark samples, exact rather than bucketed; 0 without samples
+double SamplePercentile(std::vector<double> samples, double fraction);
+
+// Nanoseconds per update of each metric type, one thread and all threads
+void RunMetricsBench(std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // MetricsH
@@ -0,0 +1,337 @@
+﻿/*
+ * PackAnalyzer.cpp - Per-Entry Decode Cost Profiling
+ *
+ * Implements the parallel entry profiler and the JSON report. Runners on
+ * the shared task pool pull entry indices from a shared counter, so one
+ * huge entry never leaves the other threads idle behind a fixed partition.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackAnalyzer.h"
+#include "TaskPool.h"             // TTaskPool::Shared
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>                 // snprintf
+#include <cstring>                // memcmp
+#include <map>
+#include <memory>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const uint8_t PngSignature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+
+static double MillisecondsSince(TClock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(TClock::now() - start).count();
+}
+
+/*
+ * TProfileSink - Discards Decoded Rows
+ * One reused row buffer keeps bitmap allocation out of the decode time.
+ */
+class TProfileSink : public TImageSink
+{
+  public:
+    void Begin(const TPngInfo& info) override { row.resize(static_cast<size_t>(info.width) * 4); }
+    uint8_t* Row(uint32_t) override { return row.data(); }
+
+  private:
+    std::vector<uint8_t> row;
+};
+//---------------------------------------------------------------------------
+
+/*
+ * Profile One Entry
+ * The decode time covers the whole fused pipeline, including the entry
+ * inflate that feeds it; inflateMs isolates that first stage.
+ */
+static TEntryProfile ProfileEntry(const TPackVolumeSet& pack, size_t entry, unsigned repeat,
+                                  TProfileSink& sink)
+{
+    TEntryProfile profile;
+    profile.entry = entry;
+    profile.png = false;
+    profile.info = TPngInfo();
+    profile.inflateMs = 0;
+    profile.decodeMs = 0;
+
+    try {
+        uint8_t signature[8];
+        profile.png = pack.ReadAt(entry, 0, signature, sizeof(signature)) == sizeof(signature) &&
+                      memcmp(signature, PngSignature, sizeof(signature)) == 0;
+
+        for (unsigned r = 0; r < repeat; r++) {
+            TClock::time_point start = TClock::now();
+            std::unique_ptr<TByteSource> source = pack.OpenEntry(entry);
+            const uint8_t* chunk;
+            size_t size;
+            while (source->Next(chunk, size)) {
+            }
+            double ms = MillisecondsSince(start);
+            profile.inflateMs = r == 0 ? ms : std::min(profile.inflateMs, ms);
+        }
+
+        if (profile.png) {
+            for (unsigned r = 0; r < repeat; r++) {
+                TClock::time_point start = TClock::now();
+                std::unique_ptr<TByteSource> source = pack.OpenEntry(entry);
+                TPngDecoder decoder(source.get());
+                profile.info = decoder.ReadHeader();
+                decoder.Decode(&sink);
+                double ms = MillisecondsSince(start);
+                profile.decodeMs = r == 0 ? ms : std::min(profile.decodeMs, ms);
+            }
+        }
+    } catch (std::exception& e) {
+        profile.error = e.what();
+    }
+    return profile;
+}
+
+/*
+ * Analyze Pack
+ */
+std::vector<TEntryProfile> AnalyzePack(const TPackVolumeSet& pack, const TAnalyzeOptions& options)
+{
+    unsigned repeat = std::max(1u, options.repeat);
+
+    std::vector<TEntryProfile> profiles(pack.Count());
+    std::atomic<size_t> cursor(0);
+    TTaskPool::Shared().Run(options.threads, [&](unsigned) {
+        TProfileSink sink;
+        for (size_t i = cursor.fetch_add(1); i < profiles.size(); i = cursor.fetch_add(1))
+            profiles[i] = ProfileEntry(pack, i, repeat, sink);
+    });
+    return profiles;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * JSON Helpers
+ */
+static void WriteJsonString(std::ostream& out, const std::string& text)
+{
+    out << '"';
+    for (size_t i = 0; i < text.size(); i++) {
+        unsigned char c = static_cast<unsigned char>(text[i]);
+        if (c == '"' || c == '\\') {
+            out << '\\' << c;
+        } else if (c < 0x20) {
+            char escape[8];
+            snprintf(escape, sizeof(escape), "\\u%04x", c);
+            out << escape;
+        } else {
+            out << c; // UTF-8 passes through unchanged
+        }
+    }
+    out << '"';
+}
+
+static std::string JsonNumber(double value)
+{
+    char text[32];
+    snprintf(text, sizeof(text), "%.4f", value);
+    return text;
+}
+
+static double Ratio(const TPackEntry& info)
+{
+    return info.size > 0 ? static_cast<double>(info.compressedSize) / info.size : 1.0;
+}
+
+// What the entry costs the viewer: the decode for images, else the inflate
+static double Cost(const TEntryProfile& profile)
+{
+    return profile.png ? profile.decodeMs : profile.inflateMs;
+}
+
+static double NsPerPixel(const TEntryProfile& profile)
+{
+    uint64_t pixels = static_cast<uint64_t>(profile.info.width) * profile.info.height;
+    return pixels > 0 ? profile.decodeMs * 1e6 / pixels : 0;
+}
+
+static const char* MethodName(uint16_t method)
+{
+    return method == TFlagPack::MethodStored ? "stored"
+           : method == TFlagPack::MethodDeflated ? "deflated" : "other";
+}
+
+static void WriteEntryJson(std::ostream& out, const TPackVolumeSet& pack, const TEntryProfile& profile)
+{
+    const TPackEntry& info = pack.Entry(profile.entry);
+    out << "{\"name\": ";
+    WriteJsonString(out, info.name);
+    out << ", \"method\": \"" << MethodName(info.method) << "\""
+        << ", \"compressedSize\": " << info.compressedSize << ", \"size\": " << info.size
+        << ", \"ratio\": " << JsonNumber(Ratio(info))
+        << ", \"inflateMs\": " << JsonNumber(profile.inflateMs);
+    if (profile.png) {
+        out << ", \"png\": {\"width\": " << profile.info.width << ", \"height\": " << profile.info.height
+            << ", \"colorType\": " << unsigned(profile.info.colorType)
+            << ", \"bitDepth\": " << unsigned(profile.info.bitDepth)
+            << ", \"interlaced\": " << (profile.info.interlace != 0 ? "true" : "false") << "}"
+            << ", \"decodeMs\": " << JsonNumber(profile.decodeMs)
+            << ", \"nsPerPixel\": " << JsonNumber(NsPerPixel(profile));
+    }
+    if (!profile.error.empty()) {
+        out << ", \"error\": ";
+        WriteJsonString(out, profile.error);
+    }
+    out << "}";
+}
+
+static void WriteEntryList(std::ostream& out, const TPackVolumeSet& pack,
+                           const std::vector<TEntryProfile>& profiles,
+                           const std::vector<size_t>& order, size_t count)
+{
+    out << "[";
+    for (size_t k = 0; k < order.size() && k < count; k++) {
+        out << (k == 0 ? "\n    " : ",\n    ");
+        WriteEntryJson(out, pack, profiles[order[k]]);
+    }
+    out << "\n  ]";
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Aggregates
+ */
+struct TGroupTotals
+{
+    uint64_t entries;
+    uint64_t compressedBytes;
+    uint64_t bytes;
+    uint64_t pixels;
+    double inflateMs;
+    double decodeMs;
+
+    TGroupTotals() : entries(0), compressedBytes(0), bytes(0), pixels(0), inflateMs(0), decodeMs(0) {}
+
+    void Add(const TPackEntry& info, const TEntryProfile& profile)
+    {
+        entries++;
+        compressedBytes += info.compressedSize;
+        bytes += info.size;
+        if (profile.png)
+            pixels += static_cast<uint64_t>(profile.info.width) * profile.info.height;
+        inflateMs += profile.inflateMs;
+        decodeMs += profile.decodeMs;
+    }
+};
+
+static void WriteTotalsJson(std::ostream& out, const TGroupTotals& totals)
+{
+    out << "\"entries\": " << totals.entries << ", \"compressedBytes\": " << totals.compressedBytes
+        << ", \"bytes\": " << totals.bytes
+        << ", \"ratio\": " << JsonNumber(totals.bytes > 0 ? double(totals.compressedBytes) / totals.bytes : 1.0)
+        << ", \"inflateMs\": " << JsonNumber(totals.inflateMs)
+        << ", \"decodeMs\": " << JsonNumber(totals.decodeMs);
+    if (totals.pixels > 0)
+        out << ", \"pixels\": " << totals.pixels << ", \"megapixelsPerSecond\": "
+            << JsonNumber(totals.decodeMs > 0 ? totals.pixels / (totals.decodeMs * 1000.0) : 0);
+}
+
+/*
+ * Write Report
+ */
+void WriteAnalysisJson(const TPackVolumeSet& pack, const std::string& packName,
+                       const std::vector<TEntryProfile>& profiles,
+                       const TAnalyzeOptions& options, std::ostream& out)
+{
+    TGroupTotals all;
+    std::map<std::string, TGroupTotals> methods;
+    std::map<std::string, TGroupTotals> formats;
+    std::vector<double> decodeTimes;
+    size_t errors = 0;
+    for (size_t i = 0; i < profiles.size(); i++) {
+        const TEntryProfile& profile = profiles[i];
+        const TPackEntry& info = pack.Entry(profile.entry);
+        all.Add(info, profile);
+        methods[MethodName(info.method)].Add(info, profile);
+        if (profile.png && profile.error.empty()) {
+            char format[64];
+            snprintf(format, sizeof(format), "colorType %u, bitDepth %u%s",
+                     unsigned(profile.info.colorType), unsigned(profile.info.bitDepth),
+                     profile.info.interlace != 0 ? ", interlaced" : "");
+            formats[format].Add(info, profile);
+            decodeTimes.push_back(profile.decodeMs);
+        }
+        if (!profile.error.empty())
+            errors++;
+    }
+    std::sort(decodeTimes.begin(), decodeTimes.end());
+
+    // Rankings
+    std::vector<size_t> byCost(profiles.size());
+    for (size_t i = 0; i < byCost.size(); i++)
+        byCost[i] = i;
+    std::vector<size_t> byPixel;
+    std::vector<size_t> byRatio;
+    for (size_t i = 0; i < profiles.size(); i++) {
+        if (profiles[i].png && profiles[i].error.empty())
+            byPixel.push_back(i);
+        if (pack.Entry(profiles[i].entry).method == TFlagPack::MethodDeflated)
+            byRatio.push_back(i);
+    }
+    std::stable_sort(byCost.begin(), byCost.end(), [&profiles](size_t a, size_t b) {
+        return Cost(profiles[a]) > Cost(profiles[b]);
+    });
+    std::stable_sort(byPixel.begin(), byPixel.end(), [&profiles](size_t a, size_t b) {
+        return NsPerPixel(profiles[a]) > NsPerPixel(profiles[b]);
+    });
+    std::stable_sort(byRatio.begin(), byRatio.end(), [&profiles, &pack](size_t a, size_t b) {
+        return Ratio(pack.Entry(profiles[a].entry)) > Ratio(pack.Entry(profiles[b].entry));
+    });
+
+    out << "{\n  \"pack\": ";
+    WriteJsonString(out, packName);
+    out << ",\n  \"threads\": " << TTaskPool::Shared().Concurrency(options.threads)
+        << ", \"repeat\": " << options.repeat << ", \"errors\": " << errors << ",\n  \"totals\": {";
+    WriteTotalsJson(out, all);
+    out << "},\n  \"methods\": {";
+    for (std::map<std::string, TGroupTotals>::const_iterator it = methods.begin(); it != methods.end(); ++it) {
+        out << (it == methods.begin() ? "\n    " : ",\n    ");
+        WriteJsonString(out, it->first);
+        out << ": {";
+        WriteTotalsJson(out, it->second);
+        out << "}";
+    }
+    out << "\n  },\n  \"pngFormats\": {";
+    for (std::map<std::string, TGroupTotals>::const_iterator it = formats.begin(); it != formats.end(); ++it) {
+        out << (it == formats.begin() ? "\n    " : ",\n    ");
+        WriteJsonString(out, it->first);
+        out << ": {";
+        WriteTotalsJson(out, it->second);
+        out << "}";
+    }
+    out << "\n  },\n  \"decodeMsPercentiles\": {";
+    if (!decodeTimes.empty()) {
+        static const double Points[] = {50, 90, 99, 100};
+        static const char* const Names[] = {"p50", "p90", "p99", "max"};
+        for (int p = 0; p < 4; p++) {
+            size_t index = static_cast<size_t>(Points[p] / 100 * (decodeTimes.size() - 1) + 0.5);
+            out << (p == 0 ? "" : ", ") << "\"" << Names[p] << "\": " << JsonNumber(decodeTimes[index]);
+        }
+    }
+    out << "},\n  \"worstByTime\": ";
+    WriteEntryList(out, pack, profiles, byCost, options.top);
+    out << ",\n  \"worstByNsPerPixel\": ";
+    WriteEntryList(out, pack, profiles, byPixel, options.top);
+    out << ",\n  \"worstRatio\": ";
+    WriteEntryList(out, pack, profiles, byRatio, options.top);
+    out << ",\n  \"entries\": ";
+    std::vector<size_t> inOrder(profiles.size());
+    for (size_t i = 0; i < inOrder.size(); i++)
+        inOrder[i] = i;
+    WriteEntryList(out, pack, profiles, inOrder, inOrder.size());
+    out << "\n}\n";
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,66 @@
+﻿/*
+ * PackAnalyzer.h - Per-Entry Decode Cost Profiling
+ *
+ * Declares the pack analyzer behind "Zip.exe --pack analyze". It walks
+ * every entry of a pack, measures what it really costs to inflate and, for
+ * PNG entries, to decode, and reports the results as JSON: one record per
+ * entry, aggregates by method and by PNG format, and ranked lists of the
+ * worst offenders.
+ *
+ * Ratios are compressed size over uncompressed size (0.25 means 4:1).
+ * Entries are spread over all cores, so per-entry times reflect a loaded
+ * machine; use threads=1 for the quietest numbers.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackAnalyzerH
+#define PackAnalyzerH
+//---------------------------------------------------------------------------
+
+#include "PackVolumes.h"          // TPackVolumeSet
+#include "PngDecode.h"            // TPngInfo
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TEntryProfile - Measurements For One Entry
+ * Times are the best of the repeated runs, in milliseconds.
+ */
+struct TEntryProfile
+{
+    size_t entry;
+    bool png;                       // Starts with the PNG signature
+    TPngInfo info;                  // Valid if png
+    double inflateMs;               // Entry data: inflate (or copy) only
+    double decodeMs;                // PNG: full fused decode to BGRA rows
+    std::string error;              // Non-empty if the entry failed to decode
+};
+
+/*
+ * TAnalyzeOptions - Analyzer Settings
+ */
+struct TAnalyzeOptions
+{
+    unsigned threads;               // Pool runners (0 = the whole task pool)
+    unsigned repeat;                // Runs per entry; the fastest counts
+    size_t top;                     // Length of the worst offender lists
+
+    TAnalyzeOptions() : threads(0), repeat(3), top(20) {}
+};
+
+// Profiles every entry; entries are spread over the worker threads
+std::vector<TEntryProfile> AnalyzePack(const TPackVolumeSet& pack, const TAnalyzeOptions& options);
+
+// Writes the profiles, aggregates and worst offender lists as JSON
+void WriteAnalysisJson(const TPackVolumeSet& pack, const std::string& packName,
+                       const std::vector<TEntryProfile>& profiles,
+                       const TAnalyzeOptions& options, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // PackAnalyzerH
@@ -0,0 +1,393 @@
+﻿/*
+ * PackBench.cpp - Pack Scaling Benchmarks
+ *
+ * Implements the scenario table and the per-case measurements. Cases run
+ * one after another so each one has the machine to itself.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackBench.h"
+#include "PackVolumes.h"          // TPackVolumeSet: map, parse, unified index
+#include "PerfCounters.h"         // TPerfCounters for the perf tables
+#include "PngDecode.h"            // TPngDecoder for png content
+#include "SynthPack.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>                 // std::remove
+#include <iomanip>
+#include <memory>
+#include <random>
+#include <stdexcept>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const size_t FindSamples = 200000;
+static const size_t ReadSamples = 2000;
+static const size_t ReadLength = 4096;
+static const size_t LatencySamples = 20000;
+static const uint64_t LatencyBudget = 64 << 20; // Bytes decoded for the latency column
+static const size_t DecodeSamples = 200;
+static const uint64_t SizeBudget = 64 << 20;    // Data per case in the sizes scenario
+
+/*
+ * TBenchCase - One Point Of A Sweep
+ */
+struct TBenchCase
+{
+    std::string scenario;
+    std::string label;
+    TSynthSpec spec;
+};
+
+/*
+ * TBenchCounters - Hardware Counts Of One Case
+ */
+struct TBenchCounters
+{
+    std::string scenario;
+    std::string label;
+    TPerfSample entry;
+    uint64_t entryBytes;
+    TPerfSample decode;
+    uint64_t decodePixels;
+
+    TBenchCounters() : entryBytes(0), decodePixels(0) {}
+};
+
+static double SecondsSince(TClock::time_point start)
+{
+    return std::chrono::duration<double>(TClock::now() - start).count();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Scenario Table
+ * Each scenario starts from a small baseline spec and varies one thing.
+ */
+static std::vector<TBenchCase> BuildCases()
+{
+    std::vector<TBenchCase> cases;
+    TBenchCase c;
+
+    // entries: catalog and index growth, tiny entries
+    static const uint64_t Counts[] = {1000, 10000, 100000, 1000000, 10000000};
+    static const char* const CountLabels[] = {"1k", "10k", "100k", "1M", "10M"};
+    for (int i = 0; i < 5; i++) {
+        c = TBenchCase();
+        c.scenario = "entries";
+        c.label = CountLabels[i];
+        c.spec.entries = Counts[i];
+        c.spec.sizeModel = smFixed;
+        c.spec.medianSize = 512;
+        cases.push_back(c);
+    }
+
+    // sizes: per-entry overheads vs. streaming and checkpoint indexes
+    static const uint64_t Sizes[] = {256, 1 << 10, 16 << 10, 256 << 10, 4 << 20};
+    static const char* const SizeLabels[] = {"256", "1k", "16k", "256k", "4M"};
+    for (int i = 0; i < 5; i++) {
+        c = TBenchCase();
+        c.scenario = "sizes";
+        c.label = SizeLabels[i];
+        c.spec.entries = std::min<uint64_t>(std::max<uint64_t>(SizeBudget / Sizes[i], 16), 1000);
+        c.spec.sizeModel = smFixed;
+        c.spec.minSize = c.spec.medianSize = c.spec.maxSize = Sizes[i];
+        cases.push_back(c);
+    }
+
+    // methods: stored vs. deflated at several levels
+    static const unsigned Percents[] = {0, 50, 100, 100, 100};
+    static const int Levels[] = {6, 6, 1, 6, 9};
+    static const char* const MethodLabels[] = {"stored", "mixed", "deflate-1", "deflate-6", "deflate-9"};
+    for (int i = 0; i < 5; i++) {
+        c = TBenchCase();
+        c.scenario = "methods";
+        c.label = MethodLabels[i];
+        c.spec.entries = 2000;
+        c.spec.deflatePercent = Percents[i];
+        c.spec.level = Levels[i];
+        cases.push_back(c);
+    }
+
+    // names: hashing and directory size vs. name length
+    static const unsigned NameLengths[] = {8, 64, 200};
+    static const char* const NameLabels[] = {"8", "64", "200"};
+    for (int i = 0; i < 3; i++) {
+        c = TBenchCase();
+        c.scenario = "names";
+        c.label = NameLabels[i];
+        c.spec.entries = 100000;
+        c.spec.sizeModel = smFixed;
+        c.spec.medianSize = 256;
+        c.spec.minNameLength = c.spec.maxNameLength = NameLengths[i];
+        cases.push_back(c);
+    }
+
+    // depth: folder nesting (longer shared prefixes)
+    static const unsigned Depths[] = {0, 3, 8};
+    static const char* const DepthLabels[] = {"0", "3", "8"};
+    for (int i = 0; i < 3; i++) {
+        c = TBenchCase();
+        c.scenario = "depth";
+        c.label = DepthLabels[i];
+        c.spec.entries = 100000;
+        c.spec.sizeModel = smFixed;
+        c.spec.medianSize = 256;
+        c.spec.depth = Depths[i];
+        cases.push_back(c);
+    }
+
+    // content: incompressible, text and PNG images
+    static const TSynthContent Contents[] = {scRandom, scText, scPng};
+    static const char* const ContentLabels[] = {"random", "text", "png"};
+    for (int i = 0; i < 3; i++) {
+        c = TBenchCase();
+        c.scenario = "content";
+        c.label = ContentLabels[i];
+        c.spec.entries = 1000;
+        c.spec.medianSize = 64 << 10;
+        c.spec.maxSize = 1 << 20;
+        c.spec.content = Contents[i];
+        cases.push_back(c);
+    }
+
+    // formats: PNG decode per pixel format, every row filter in turn
+    for (int i = pfRgb8; i <= pfPalette8; i++) {
+        c = TBenchCase();
+        c.scenario = "formats";
+        c.label = SynthPngFormatName(static_cast<TSynthPngFormat>(i));
+        c.spec.entries = DecodeSamples;
+        c.spec.sizeModel = smFixed;
+        c.spec.medianSize = 64 << 10;
+        c.spec.content = scPng;
+        c.spec.pngFormat = static_cast<TSynthPngFormat>(i);
+        c.spec.pngFilter = sfMixed;
+        cases.push_back(c);
+    }
+    return cases;
+}
+
+std::vector<std::string> BenchScenarioNames()
+{
+    std::vector<std::string> names;
+    std::vector<TBenchCase> cases = BuildCases();
+    for (size_t i = 0; i < cases.size(); i++) {
+        if (names.empty() || names.back() != cases[i].scenario)
+            names.push_back(cases[i].scenario);
+    }
+    return names;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TBenchSink - Discards Decoded Rows
+ * Every row lands in the same buffer, so decode cost is measured without
+ * the cost of a full-size bitmap.
+ */
+class TBenchSink : public TImageSink
+{
+  public:
+    uint64_t pixels;
+
+    TBenchSink() : pixels(0) {}
+
+    void Begin(const TPngInfo& info) override
+    {
+        row.resize(static_cast<size_t>(info.width) * 4);
+        pixels += static_cast<uint64_t>(info.width) * info.height;
+    }
+
+    uint8_t* Row(uint32_t) override { return row.data(); }
+
+  private:
+    std::vector<uint8_t> row;
+};
+//---------------------------------------------------------------------------
+
+/*
+ * Run One Case
+ */
+static void RunCase(const TBenchCase& bench, const TBenchOptions& options, TPerfCounters* perf,
+                    std::vector<TBenchCounters>& counters, std::ostream& out)
+{
+    std::string path = options.folder + "/bench-" + bench.scenario + "-" + bench.label + ".zip";
+    std::mt19937_64 random(bench.spec.seed);
+
+    TClock::time_point start = TClock::now();
+    TSynthResult written = WriteSynthPack(bench.spec, path, options.threads);
+    double genSeconds = SecondsSince(start);
+
+    double openMs, findNs, scanMBps, entryUs, readUs, decodeMpps = 0;
+    TBenchCounters counted;
+    counted.scenario = bench.scenario;
+    counted.label = bench.label;
+    {
+        TPackVolumeSet pack;
+        start = TClock::now();
+        pack.AddVolumeFile(path);
+        openMs = SecondsSince(start) * 1000;
+
+        // Lookups of existing names, prepared outside the timed loop
+        std::vector<std::string> names(std::min<uint64_t>(4096, bench.spec.entries));
+        for (size_t i = 0; i < names.size(); i++)
+            names[i] = SynthEntryName(bench.spec, random() % bench.spec.entries);
+        size_t found = 0;
+        start = TClock::now();
+        for (size_t i = 0; i < FindSamples; i++)
+            found += pack.Find(names[i % names.size()]) >= 0;
+        findNs = SecondsSince(start) * 1e9 / FindSamples;
+        if (found != FindSamples)
+            throw std::runtime_error("Benchmark pack is missing entries: " + path);
+
+        std::atomic<uint64_t> scanned(0);
+        start = TClock::now();
+        pack.ExtractAll([&scanned](size_t, const TPackEntry&, TByteSource& data) {
+            const uint8_t* chunk;
+            size_t size;
+            uint64_t total = 0;
+            while (data.Next(chunk, size))
+                total += size;
+            scanned += total;
+        });
+        scanMBps = scanned / 1048576.0 / SecondsSince(start);
+
+        size_t opened = 0;
+        uint64_t decoded = 0;
+        if (perf != nullptr)
+            perf->Start();
+        start = TClock::now();
+        while (opened < LatencySamples && decoded < LatencyBudget) {
+            std::unique_ptr<TByteSource> source = pack.OpenEntry(static_cast<size_t>(random() % pack.Count()));
+            const uint8_t* chunk;
+            size_t size;
+            while (source->Next(chunk, size))
+                decoded += size;
+            opened++;
+        }
+        entryUs = SecondsSince(start) * 1e6 / opened;
+        if (perf != nullptr) {
+            counted.entry = perf->Stop();
+            counted.entryBytes = decoded;
+        }
+
+        std::vector<uint8_t> buffer(ReadLength);
+        start = TClock::now();
+        for (size_t i = 0; i < ReadSamples; i++) {
+            size_t entry = static_cast<size_t>(random() % pack.Count());
+            uint64_t size = pack.Entry(entry).size;
+            pack.ReadAt(entry, size > 0 ? random() % size : 0, buffer.data(), buffer.size());
+        }
+        readUs = SecondsSince(start) * 1e6 / ReadSamples;
+
+        if (bench.spec.content == scPng) {
+            TBenchSink sink;
+            if (perf != nullptr)
+                perf->Start();
+            start = TClock::now();
+            for (size_t i = 0; i < DecodeSamples && i < pack.Count(); i++) {
+                std::unique_ptr<TByteSource> source = pack.OpenEntry(i);
+                TPngDecoder decoder(source.get());
+                decoder.Decode(&sink);
+            }
+            decodeMpps = sink.pixels / 1e6 / SecondsSince(start);
+            if (perf != nullptr) {
+                counted.decode = perf->Stop();
+                counted.decodePixels = sink.pixels;
+            }
+        }
+    }
+    std::remove(path.c_str());
+    if (perf != nullptr)
+        counters.push_back(counted);
+
+    out << std::left << std::setw(9) << bench.scenario << std::setw(11) << bench.label << std::right
+        << std::fixed << std::setw(10) << written.entries
+        << std::setprecision(1) << std::setw(10) << written.archiveBytes / 1048576.0
+        << std::setprecision(2) << std::setw(9) << genSeconds
+        << std::setprecision(1) << std::setw(10) << openMs
+        << std::setw(9) << findNs
+        << std::setw(10) << scanMBps
+        << std::setw(10) << entryUs
+        << std::setw(9) << readUs;
+    if (decodeMpps > 0)
+        out << std::setw(9) << decodeMpps;
+    else
+        out << std::setw(9) << "-";
+    out << std::endl;
+}
+
+/*
+ * Hardware Counter Tables
+ * Entry counts are per decoded byte (mostly inflate), decode counts per
+ * pixel (inflate, unfilter and pixel conversion together).
+ */
+static void WriteCounterTables(const std::vector<TBenchCounters>& counters, std::ostream& out)
+{
+    out << "\nHardware counters, entry phase (per byte)\n"
+        << std::left << std::setw(9) << "scenario" << std::setw(11) << "case" << std::right;
+    WritePerfHeader(out, "B");
+    out << std::endl;
+    for (size_t i = 0; i < counters.size(); i++) {
+        out << std::left << std::setw(9) << counters[i].scenario << std::setw(11) << counters[i].label
+            << std::right;
+        WritePerfColumns(out, counters[i].entry, static_cast<double>(counters[i].entryBytes));
+        out << std::endl;
+    }
+
+    out << "\nHardware counters, decode phase (per pixel)\n"
+        << std::left << std::setw(9) << "scenario" << std::setw(11) << "case" << std::right;
+    WritePerfHeader(out, "px");
+    out << std::endl;
+    for (size_t i = 0; i < counters.size(); i++) {
+        if (counters[i].decodePixels == 0)
+            continue;
+        out << std::left << std::setw(9) << counters[i].scenario << std::setw(11) << counters[i].label
+            << std::right;
+        WritePerfColumns(out, counters[i].decode, static_cast<double>(counters[i].decodePixels));
+        out << std::endl;
+    }
+}
+
+/*
+ * Run Sweep
+ */
+void RunPackBench(const TBenchOptions& options, std::ostream& out)
+{
+    std::vector<TBenchCase> cases = BuildCases();
+
+    std::unique_ptr<TPerfCounters> perf;
+    if (options.perf) {
+        perf.reset(new TPerfCounters());
+        if (!perf->Available()) {
+            out << "Hardware counters unavailable: " << perf->Error() << "\n";
+            perf.reset();
+        }
+    }
+    std::vector<TBenchCounters> counters;
+
+    out << std::left << std::setw(9) << "scenario" << std::setw(11) << "case" << std::right
+        << std::setw(10) << "entries" << std::setw(10) << "pack MB" << std::setw(9) << "gen s"
+        << std::setw(10) << "open ms" << std::setw(9) << "find ns" << std::setw(10) << "scan MB/s"
+        << std::setw(10) << "entry us" << std::setw(9) << "read us" << std::setw(9) << "MP/s" << std::endl;
+
+    for (size_t i = 0; i < cases.size(); i++) {
+        const TBenchCase& bench = cases[i];
+        if (bench.spec.entries > options.maxEntries)
+            continue;
+        if (!options.scenarios.empty() &&
+            std::find(options.scenarios.begin(), options.scenarios.end(), bench.scenario) ==
+                options.scenarios.end())
+            continue;
+        RunCase(bench, options, perf.get(), counters, out);
+    }
+    if (perf)
+        WriteCounterTables(counters, out);
+}
+//---------------------------------------------------------------------------
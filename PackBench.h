@@ -0,0 +1,59 @@
+﻿/*
+ * PackBench.h - Pack Scaling Benchmarks
+ *
+ * Declares the benchmark sweep run by "Zip.exe --pack bench". Each scenario
+ * varies one synthetic pack parameter (see SynthPack.h) over a range of
+ * values; every case generates its pack, measures the reader on it and
+ * deletes it again.
+ *
+ * Measured per case:
+ * - gen     time to generate and write the pack
+ * - open    map + central directory parse + unified name index
+ * - find    name lookup through the index
+ * - scan    decode throughput over every entry, all cores (ExtractAll)
+ * - entry   latency to open and fully decode one random entry on one
+ *           thread; with tiny entries this is table setup, not data
+ * - read    4 KB random reads at random offsets (ReadAt)
+ * - decode  PNG decode rate (png content only); the formats scenario
+ *           repeats it for every PNG pixel format with all row filters
+ *
+ * With perf set, the single-threaded entry and decode phases also run
+ * under hardware counters (see PerfCounters.h), reported per byte and per
+ * pixel in two tables after the sweep.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackBenchH
+#define PackBenchH
+//---------------------------------------------------------------------------
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TBenchOptions - Sweep Settings
+ */
+struct TBenchOptions
+{
+    std::string folder;             // Where the temporary packs are written
+    uint64_t maxEntries;            // Cases with more entries are skipped
+    unsigned threads;               // Generator threads (0 = one per core)
+    std::vector<std::string> scenarios; // Empty = all
+    bool perf;                      // Hardware counters for entry and decode
+
+    TBenchOptions() : folder("."), maxEntries(1000000), threads(0), perf(false) {}
+};
+
+// Names of the built-in scenarios, in run order
+std::vector<std::string> BenchScenarioNames();
+
+// Runs the sweep and writes one result row per case to `out`
+void RunPackBench(const TBenchOptions& options, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // PackBenchH
@@ -0,0 +1,545 @@
+﻿/*
+ * PackBuilder.cpp - Flag Pack Writer
+ *
+ * Implements TPackBuilder (local headers, central directory, end record)
+ * and the access-frequency reordering on top of it.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackBuilder.h"
+#include "Checksum.h"             // Crc32
+#include "MappedFile.h"           // TMappedFile
+
+#include <algorithm>              // std::stable_sort
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>                   // _chsize_s
+#else
+#include <unistd.h>               // ftruncate
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const uint32_t SigLocalHeader = 0x04034B50;
+static const uint32_t SigCentralHeader = 0x02014B50;
+static const uint32_t SigEndOfCentralDir = 0x06054B50;
+static const uint32_t SigZip64EndOfCentralDir = 0x06064B50;
+static const uint32_t SigZip64Locator = 0x07064B50;
+
+static const uint16_t VersionNeeded = 20;       // 2.0: deflate, folders
+static const uint16_t VersionZip64 = 45;        // 4.5: ZIP64 extensions
+static const uint16_t TagZip64 = 0x0001;        // ZIP64 extended information
+static const uint32_t Max32 = 0xFFFFFFFF;       // Field value meaning "see ZIP64"
+static const uint16_t Max16 = 0xFFFF;
+static const uint16_t DefaultDosDate = (0 << 9) | (1 << 5) | 1; // 1980-01-01
+static const uint16_t FlagDataDescriptor = 0x0008;
+static const uint32_t AttrDirectory = 0x10;     // MS-DOS directory attribute
+
+static void PutLE16(uint8_t* p, uint16_t value)
+{
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+static void PutLE32(uint8_t* p, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; i++)
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+static void PutLE64(uint8_t* p, uint64_t value)
+{
+    for (unsigned i = 0; i < 8; i++)
+        p[i] = static_cast<uint8_t>(value >> (8 * i));
+}
+
+static uint32_t Field32(uint64_t value)
+{
+    return value >= Max32 ? Max32 : static_cast<uint32_t>(value);
+}
+//---------------------------------------------------------------------------
+
+#ifdef _WIN32
+static std::wstring WidePath(const std::string& path)
+{
+    int length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, NULL, 0);
+    std::wstring wide(length > 0 ? length : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], length);
+    return wide;
+}
+#endif
+
+/*
+ * Open Output File
+ * UTF-8 path; converted to UTF-16 on Windows. Append mode writes after the
+ * existing end of file.
+ */
+static FILE* OpenOutput(const std::string& path, bool append = false)
+{
+#ifdef _WIN32
+    return _wfopen(WidePath(path).c_str(), append ? L"ab" : L"wb");
+#else
+    return fopen(path.c_str(), append ? "ab" : "wb");
+#endif
+}
+//---------------------------------------------------------------------------
+
+TPackBuilder::TPackBuilder()
+    : file(nullptr), offset(0), updating(false), originalSize(0), deadBytes(0), hotBytes(0),
+      dosTime(0), dosDate(DefaultDosDate), threads(0), deflaterLevel(0)
+{
+}
+
+TPackBuilder::~TPackBuilder()
+{
+    if (file == nullptr)
+        return;
+
+    // Abandoned build: the partial file is left for inspection. Abandoned
+    // update: cut back to the original pack (best effort, no way to report)
+    if (updating) {
+        fflush(file);
+#ifdef _WIN32
+        _chsize_s(_fileno(file), static_cast<__int64>(originalSize));
+#else
+        int result = ftruncate(fileno(file), static_cast<off_t>(originalSize));
+        (void)result;
+#endif
+    }
+    fclose(file);
+}
+
+void TPackBuilder::Create(const std::string& outputPath)
+{
+    file = OpenOutput(outputPath);
+    if (file == nullptr)
+        throw std::runtime_error("Unable to create " + outputPath);
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    path = outputPath;
+    offset = 0;
+    written.clear();
+    updating = false;
+    deadBytes = 0;
+}
+
+/*
+ * Open Pack For Update
+ * Everything in the file that is not a live entry - including the current
+ * directory, which the update supersedes - counts as dead space.
+ */
+void TPackBuilder::OpenForUpdate(const std::string& packPath)
+{
+    written.clear();
+    extents.clear();
+    names.clear();
+
+    uint64_t live = 0;
+    {
+        TMappedFile mapped;
+        mapped.Open(packPath);
+        TFlagPack pack;
+        pack.Open(mapped.Data(), mapped.Size());
+
+        written.reserve(pack.Count());
+        extents.reserve(pack.Count());
+        names.reserve(pack.Count());
+        for (size_t i = 0; i < pack.Count(); i++) {
+            names[pack.Entry(i).name] = written.size();
+            written.push_back(pack.Entry(i));
+            extents.push_back(pack.EntryExtent(i));
+            live += extents.back();
+        }
+        originalSize = mapped.Size();
+        hotBytes = pack.HotBytes();
+    }
+
+    file = OpenOutput(packPath, true);
+    if (file == nullptr)
+        throw std::runtime_error("Unable to update " + packPath);
+    setvbuf(file, nullptr, _IOFBF, 1 << 20);
+    path = packPath;
+    offset = originalSize;
+    deadBytes = originalSize - live;
+    updating = true;
+}
+
+void TPackBuilder::Write(const void* bytes, size_t length)
+{
+    if (length > 0 && fwrite(bytes, 1, length, file) != length)
+        throw std::runtime_error("Write failed on " + path);
+    offset += length;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Add Pre-Compressed Entry
+ * Sizes are always known up front, so the data descriptor flag is cleared
+ * and the local header carries the final CRC and sizes (in a ZIP64 extra
+ * field when either one does not fit 32 bits).
+ */
+bool TPackBuilder::AddRaw(const TPackEntry& info, const uint8_t* compressed)
+{
+    if (info.name.size() > Max16)
+        throw std::runtime_error("Entry name too long: " + info.name.substr(0, 64));
+    if (updating && Unchanged(info.name, info.crc32, info.size))
+        return false;
+
+    TPackEntry entry = info;
+    entry.flags &= ~FlagDataDescriptor;
+    entry.headerOffset = offset;
+    bool zip64 = entry.size >= Max32 || entry.compressedSize >= Max32;
+
+    uint8_t header[30 + 20];
+    PutLE32(header, SigLocalHeader);
+    PutLE16(header + 4, zip64 ? VersionZip64 : VersionNeeded);
+    PutLE16(header + 6, entry.flags);
+    PutLE16(header + 8, entry.method);
+    PutLE16(header + 10, entry.dosTime);
+    PutLE16(header + 12, entry.dosDate);
+    PutLE32(header + 14, entry.crc32);
+    PutLE32(header + 18, zip64 ? Max32 : static_cast<uint32_t>(entry.compressedSize));
+    PutLE32(header + 22, zip64 ? Max32 : static_cast<uint32_t>(entry.size));
+    PutLE16(header + 26, static_cast<uint16_t>(entry.name.size()));
+    PutLE16(header + 28, zip64 ? 20 : 0);
+    if (zip64) {
+        // The local ZIP64 field must hold both sizes, uncompressed first
+        PutLE16(header + 30, TagZip64);
+        PutLE16(header + 32, 16);
+        PutLE64(header + 34, entry.size);
+        PutLE64(header + 42, entry.compressedSize);
+    }
+    Write(header, 30);
+    Write(entry.name.data(), entry.name.size());
+    if (zip64)
+        Write(header + 30, 20);
+    Write(compressed, static_cast<size_t>(entry.compressedSize));
+
+    if (!updating) {
+        written.push_back(entry);
+        return true;
+    }
+
+    uint64_t extent = offset - entry.headerOffset;
+    std::unordered_map<std::string, size_t>::const_iterator it = names.find(entry.name);
+    if (it == names.end()) {
+        names[entry.name] = written.size();
+        written.push_back(entry);
+        extents.push_back(extent);
+    } else {
+        deadBytes += extents[it->second];
+        written[it->second] = entry;
+        extents[it->second] = extent;
+        Remove(entry.name + TFlagPack::IndexSuffix);
+    }
+    return true;
+}
+
+/*
+ * Unchanged Entry Check
+ * CRC and size both matching is taken as identical content.
+ */
+bool TPackBuilder::Unchanged(const std::string& name, uint32_t crc32, uint64_t size) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = names.find(name);
+    return it != names.end() && written[it->second].crc32 == crc32 &&
+           written[it->second].size == size;
+}
+
+/*
+ * Remove Entry
+ * Later entries move up one place, so their name slots are renumbered.
+ */
+bool TPackBuilder::Remove(const std::string& name)
+{
+    std::unordered_map<std::string, size_t>::iterator it = names.find(name);
+    if (!updating || it == names.end())
+        return false;
+
+    size_t index = it->second;
+    deadBytes += extents[index];
+    names.erase(it);
+    written.erase(written.begin() + index);
+    extents.erase(extents.begin() + index);
+    for (size_t i = index; i < written.size(); i++)
+        names[written[i].name] = i;
+
+    Remove(name + TFlagPack::IndexSuffix);
+    return true;
+}
+
+/*
+ * Add Entry From Uncompressed Data
+ */
+bool TPackBuilder::AddFile(const std::string& name, const uint8_t* data, size_t size,
+                           uint16_t method, int level)
+{
+    if (updating && Unchanged(name, Crc32(data, size), size))
+        return false;
+
+    if (!deflater || deflaterLevel != level) {
+        deflater.reset(new TDeflater(level));
+        deflaterLevel = level;
+    }
+
+    TPackEntry info;
+    info.name = name;
+    info.flags = 0;
+    info.dosTime = dosTime;
+    info.dosDate = dosDate;
+    const uint8_t* bytes = CompressEntry(*deflater, data, size, method, info, buffer, threads);
+    return AddRaw(info, bytes);
+}
+
+void TPackBuilder::AddFolder(const std::string& name)
+{
+    TPackEntry info;
+    info.name = name.empty() || name[name.size() - 1] != '/' ? name + "/" : name;
+    info.method = TFlagPack::MethodStored;
+    info.flags = 0;
+    info.dosTime = dosTime;
+    info.dosDate = dosDate;
+    info.crc32 = 0;
+    info.compressedSize = 0;
+    info.size = 0;
+    AddRaw(info, nullptr);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Finish Archive
+ * Writes the central directory in entry order and the end record. Central
+ * headers get a ZIP64 field holding exactly the values that overflowed;
+ * the ZIP64 end record and locator precede the classic end record when
+ * the entry count or the directory position needs them.
+ */
+void TPackBuilder::Finish(const std::string& archiveComment)
+{
+    std::string comment = archiveComment;
+    if (comment.empty() && updating && hotBytes > 0)
+        comment = TFlagPack::HotTag + std::to_string(hotBytes);
+    if (comment.size() > Max16)
+        throw std::runtime_error("Archive comment too long: " + path);
+
+    uint64_t dirOffset = offset;
+    for (size_t i = 0; i < written.size(); i++) {
+        const TPackEntry& entry = written[i];
+        bool folder = !entry.name.empty() && entry.name[entry.name.size() - 1] == '/';
+
+        uint8_t header[46 + 28];
+        uint8_t* extra = header + 46;
+        size_t extraSize = 0;
+        if (entry.size >= Max32) {
+            PutLE64(extra + 4 + extraSize, entry.size);
+            extraSize += 8;
+        }
+        if (entry.compressedSize >= Max32) {
+            PutLE64(extra + 4 + extraSize, entry.compressedSize);
+            extraSize += 8;
+        }
+        if (entry.headerOffset >= Max32) {
+            PutLE64(extra + 4 + extraSize, entry.headerOffset);
+            extraSize += 8;
+        }
+        if (extraSize > 0) {
+            PutLE16(extra, TagZip64);
+            PutLE16(extra + 2, static_cast<uint16_t>(extraSize));
+            extraSize += 4;
+        }
+        uint16_t version = extraSize > 0 ? VersionZip64 : VersionNeeded;
+
+        PutLE32(header, SigCentralHeader);
+        PutLE16(header + 4, version);                   // Made by: MS-DOS
+        PutLE16(header + 6, version);
+        PutLE16(header + 8, entry.flags);
+        PutLE16(header + 10, entry.method);
+        PutLE16(header + 12, entry.dosTime);
+        PutLE16(header + 14, entry.dosDate);
+        PutLE32(header + 16, entry.crc32);
+        PutLE32(header + 20, Field32(entry.compressedSize));
+        PutLE32(header + 24, Field32(entry.size));
+        PutLE16(header + 28, static_cast<uint16_t>(entry.name.size()));
+        PutLE16(header + 30, static_cast<uint16_t>(extraSize));
+        PutLE16(header + 32, 0);                        // Comment length
+        PutLE16(header + 34, 0);                        // Disk number
+        PutLE16(header + 36, 0);                        // Internal attributes
+        PutLE32(header + 38, folder ? AttrDirectory : 0);
+        PutLE32(header + 42, Field32(entry.headerOffset));
+        Write(header, 46);
+        Write(entry.name.data(), entry.name.size());
+        Write(extra, extraSize);
+    }
+    uint64_t dirSize = offset - dirOffset;
+    uint64_t count = written.size();
+
+    if (count >= Max16 || dirSize >= Max32 || dirOffset >= Max32) {
+        uint64_t recordOffset = offset;
+        uint8_t record[56 + 20];
+        PutLE32(record, SigZip64EndOfCentralDir);
+        PutLE64(record + 4, 44);                        // Size of the rest of the record
+        PutLE16(record + 12, VersionZip64);
+        PutLE16(record + 14, VersionZip64);
+        PutLE32(record + 16, 0);                        // This disk
+        PutLE32(record + 20, 0);                        // Directory start disk
+        PutLE64(record + 24, count);
+        PutLE64(record + 32, count);
+        PutLE64(record + 40, dirSize);
+        PutLE64(record + 48, dirOffset);
+
+        uint8_t* locator = record + 56;
+        PutLE32(locator, SigZip64Locator);
+        PutLE32(locator + 4, 0);
+        PutLE64(locator + 8, recordOffset);
+        PutLE32(locator + 16, 1);                       // Total disks
+        Write(record, sizeof(record));
+    }
+
+    uint8_t end[22];
+    PutLE32(end, SigEndOfCentralDir);
+    PutLE16(end + 4, 0);
+    PutLE16(end + 6, 0);
+    PutLE16(end + 8, count >= Max16 ? Max16 : static_cast<uint16_t>(count));
+    PutLE16(end + 10, count >= Max16 ? Max16 : static_cast<uint16_t>(count));
+    PutLE32(end + 12, Field32(dirSize));
+    PutLE32(end + 16, Field32(dirOffset));
+    PutLE16(end + 20, static_cast<uint16_t>(comment.size()));
+    Write(end, sizeof(end));
+    Write(comment.data(), comment.size());
+
+    FILE* closing = file;
+    file = nullptr;
+    updating = false;
+    if (fclose(closing) != 0)
+        throw std::runtime_error("Write failed on " + path);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Compress Entry Data
+ */
+const uint8_t* CompressEntry(TDeflater& deflater, const uint8_t* data, size_t size,
+                             uint16_t method, TPackEntry& info, std::vector<uint8_t>& compressed,
+                             unsigned threads)
+{
+    info.size = size;
+    bool parallel = method == TFlagPack::MethodDeflated && threads != 1 &&
+                    size >= ParallelDeflateThreshold;
+    if (parallel) {
+        // The workers checksum their own parts
+        compressed.clear();
+        info.crc32 = DeflateParallel(data, size, deflater.Level(), compressed, threads);
+    } else {
+        info.crc32 = Crc32(data, size);
+    }
+
+    if (method == TFlagPack::MethodDeflated && size > 0) {
+        if (!parallel) {
+            compressed.clear();
+            deflater.Compress(data, size, compressed);
+        }
+        if (compressed.size() < size) {
+            info.method = TFlagPack::MethodDeflated;
+            info.compressedSize = compressed.size();
+            return compressed.data();
+        }
+    }
+    info.method = TFlagPack::MethodStored;
+    info.compressedSize = size;
+    return data;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Reorder Pack By Access Frequency
+ */
+uint64_t ReorderPack(const TFlagPack& source, const TAccessCounts& counts,
+                     const std::string& outputPath)
+{
+    std::vector<size_t> order(source.Count());
+    std::vector<uint64_t> hits(source.Count(), 0);
+    for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+        TAccessCounts::const_iterator it = counts.find(source.Entry(i).name);
+        if (it != counts.end())
+            hits[i] = it->second;
+    }
+
+    // Hottest first; stable so cold entries keep their original order
+    std::stable_sort(order.begin(), order.end(),
+                     [&hits](size_t a, size_t b) { return hits[a] > hits[b]; });
+
+    TPackBuilder builder;
+    builder.Create(outputPath);
+    uint64_t hotBytes = 0;
+    for (size_t k = 0; k < order.size(); k++) {
+        size_t i = order[k];
+        builder.AddRaw(source.Entry(i), source.EntryData(i));
+        if (hits[i] > 0)
+            hotBytes = builder.Offset();
+    }
+    builder.Finish(hotBytes > 0 ? TFlagPack::HotTag + std::to_string(hotBytes) : std::string());
+    return hotBytes;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Dead Space
+ */
+uint64_t PackDeadBytes(const TFlagPack& pack)
+{
+    uint64_t live = 0;
+    for (size_t i = 0; i < pack.Count(); i++)
+        live += pack.EntryExtent(i);
+    return pack.DirectoryOffset() > live ? pack.DirectoryOffset() - live : 0;
+}
+
+/*
+ * Compact Pack
+ * File order is kept, so entries inside the old hot region are still the
+ * leading ones and the region just ends earlier.
+ */
+uint64_t CompactPack(const std::string& path, double threshold)
+{
+    const std::string temporary = path + ".compact";
+    uint64_t before = 0;
+    uint64_t after = 0;
+    {
+        TMappedFile mapped;
+        mapped.Open(path);
+        TFlagPack pack;
+        pack.Open(mapped.Data(), mapped.Size());
+
+        uint64_t dead = PackDeadBytes(pack);
+        if (dead == 0 || static_cast<double>(dead) < threshold * mapped.Size())
+            return 0;
+
+        std::vector<size_t> order(pack.Count());
+        for (size_t i = 0; i < order.size(); i++)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&pack](size_t a, size_t b) {
+            return pack.Entry(a).headerOffset < pack.Entry(b).headerOffset;
+        });
+
+        TPackBuilder builder;
+        builder.Create(temporary);
+        uint64_t hotBytes = 0;
+        for (size_t k = 0; k < order.size(); k++) {
+            size_t i = order[k];
+            builder.AddRaw(pack.Entry(i), pack.EntryData(i));
+            if (pack.Entry(i).headerOffset < pack.HotBytes())
+                hotBytes = builder.Offset();
+        }
+        builder.Finish(hotBytes > 0 ? TFlagPack::HotTag + std::to_string(hotBytes) : std::string());
+        before = mapped.Size();
+        after = builder.Offset();
+    }
+
+    // The mapping is closed now, which Windows needs before the file can go
+    TMappedFile::ReplaceFile(temporary, path);
+    return before > after ? before - after : 0;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,177 @@
+﻿/*
+ * PackBuilder.h - Flag Pack Writer
+ *
+ * Declares TPackBuilder, a sequential ZIP writer used by the pack tools,
+ * and ReorderPack(), which rewrites a pack so its most frequently used
+ * entries sit together at the front of the file. Archives switch to ZIP64
+ * records only when a count, size or offset needs them.
+ *
+ * Existing packs can be updated in place: changed entries are appended and
+ * only the central directory is rewritten, so an update costs the changed
+ * bytes rather than the whole pack. Superseded data stays behind as dead
+ * space until CompactPack() rewrites the file.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackBuilderH
+#define PackBuilderH
+//---------------------------------------------------------------------------
+
+#include "AccessStats.h"          // TAccessCounts
+#include "Deflate.h"              // TDeflater
+#include "FlagPack.h"             // TFlagPack, TPackEntry
+
+#include <cstdint>
+#include <cstdio>                 // FILE
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPackBuilder - Sequential ZIP Writer
+ *
+ * Entries are written in the order they are added; the central directory
+ * and end record follow in Finish(). Throws std::runtime_error on I/O errors.
+ *
+ * After OpenForUpdate() the builder starts from the entries of an existing
+ * pack. Adding a name that already exists replaces that entry (keeping its
+ * place in the directory) unless CRC and size show it is unchanged, in
+ * which case nothing is written. The original bytes are never overwritten:
+ * new data and the new directory go after the old end of file, and an
+ * update abandoned before Finish() is cut back to the original length.
+ * That takes the destructor running: a process killed part way through
+ * leaves the old end record buried under the appended data, and the pack
+ * may no longer open.
+ */
+class TPackBuilder
+{
+  public:
+    TPackBuilder();
+    ~TPackBuilder();
+
+    void Create(const std::string& path);
+
+    // Reopens an existing pack for an append-only update
+    void OpenForUpdate(const std::string& path);
+
+    // Adds an entry whose data is already compressed with `info.method`.
+    // Name, method, flags, time, CRC and both sizes are taken from `info`.
+    // Returns false if an update found the entry unchanged
+    bool AddRaw(const TPackEntry& info, const uint8_t* compressed);
+
+    // Compresses and adds an entry (see CompressEntry), stamped with the
+    // time set by SetDosTime(). Returns false if an update found the entry
+    // unchanged; the data is then only checksummed, not compressed
+    bool AddFile(const std::string& name, const uint8_t* data, size_t size,
+                 uint16_t method = TFlagPack::MethodDeflated, int level = TDeflater::DefaultLevel);
+
+    // Drops an entry from an updated pack; returns false if there is none.
+    // Replacing or removing an entry also drops its ".zidx" companion, so
+    // add a fresh companion after its entry
+    bool Remove(const std::string& name);
+
+    // Adds a folder entry ("name/")
+    void AddFolder(const std::string& name);
+
+    // Timestamp for entries added by AddFile(); defaults to 1980-01-01 so
+    // identical input always produces an identical pack
+    void SetDosTime(uint16_t time, uint16_t date) { dosTime = time; dosDate = date; }
+
+    // Compression threads AddFile() may use for large entries (0 = one per core)
+    void SetThreads(unsigned count) { threads = count; }
+
+    // Writes the central directory with an optional archive comment. An
+    // update without a comment keeps the hot region tag of the original
+    void Finish(const std::string& comment = std::string());
+
+    // Bytes written so far (the offset of the next local header)
+    uint64_t Offset() const { return offset; }
+
+    // Bytes before the directory that belong to no live entry (updates only)
+    uint64_t DeadBytes() const { return deadBytes; }
+
+  private:
+    TPackBuilder(const TPackBuilder&);
+    TPackBuilder& operator=(const TPackBuilder&);
+
+    void Write(const void* bytes, size_t length);
+    bool Unchanged(const std::string& name, uint32_t crc32, uint64_t size) const;
+
+    FILE* file;
+    std::string path;
+    uint64_t offset;
+    std::vector<TPackEntry> written;    // headerOffset = where it went
+
+    // Update mode
+    bool updating;
+    uint64_t originalSize;              // Restored if the update is abandoned
+    uint64_t deadBytes;
+    uint64_t hotBytes;                  // Hot region of the original pack
+    std::vector<uint64_t> extents;      // Archive bytes of each written entry
+    std::unordered_map<std::string, size_t> names;
+
+    uint16_t dosTime;
+    uint16_t dosDate;
+    unsigned threads;
+    std::unique_ptr<TDeflater> deflater;
+    int deflaterLevel;
+    std::vector<uint8_t> buffer;
+};
+
+//---------------------------------------------------------------------------
+
+// Entries at least this large are compressed in parallel parts
+static const size_t ParallelDeflateThreshold = 1 << 20;
+
+/*
+ * Compress Entry Data
+ *
+ * Fills method, CRC and both sizes of `info` for `data`. Deflated output
+ * goes into `compressed`; if it would not be smaller the entry falls back
+ * to stored. Returns the bytes to write (either `data` or `compressed`).
+ *
+ * Entries of ParallelDeflateThreshold bytes or more are split over
+ * `threads` workers (0 = one per core, see DeflateParallel). The default
+ * of 1 keeps all work on the calling thread, for callers that already
+ * compress several entries concurrently.
+ */
+const uint8_t* CompressEntry(TDeflater& deflater, const uint8_t* data, size_t size,
+                             uint16_t method, TPackEntry& info, std::vector<uint8_t>& compressed,
+                             unsigned threads = 1);
+
+//---------------------------------------------------------------------------
+
+/*
+ * Reorder Pack By Access Frequency
+ *
+ * Copies every entry of `source` (compressed data untouched) into a new
+ * pack at `outputPath`. Entries with a non-zero count come first, hottest
+ * first; all others follow in their original order. The end of the hot
+ * region is recorded in the archive comment (TFlagPack::HotTag) so readers
+ * can prefetch it with one request. Returns the hot region length.
+ */
+uint64_t ReorderPack(const TFlagPack& source, const TAccessCounts& counts,
+                     const std::string& outputPath);
+
+//---------------------------------------------------------------------------
+
+// Bytes before the central directory that belong to no entry
+uint64_t PackDeadBytes(const TFlagPack& pack);
+
+/*
+ * Compact Pack
+ *
+ * Rewrites the pack at `path` with its live entries only, in their current
+ * file order, if dead space makes up at least `threshold` (0..1) of the
+ * file. The new pack is written next to the old one and then moved over
+ * it; the hot region tag is carried over. Returns the bytes reclaimed, or
+ * 0 if the pack was left alone.
+ */
+uint64_t CompactPack(const std::string& path, double threshold);
+
+//---------------------------------------------------------------------------
+#endif // PackBuilderH
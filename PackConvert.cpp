@@ -0,0 +1,251 @@
+﻿/*
+ * PackConvert.cpp - Batch Conversion Of Pack Entries
+ *
+ * Implements the converter stages: entry inflate into memory, the fused PNG
+ * decode to BGRA, BMP encoding and the file writer.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackConvert.h"
+#include "MappedFile.h"           // TMappedFile::MakeFolders
+#include "PngDecode.h"            // TPngDecoder, TImageSink
+
+#include <atomic>
+#include <cstdio>                 // FILE, fwrite
+#include <cstring>                // memcmp, memcpy
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+
+#ifdef _WIN32
+#include <windows.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const uint8_t PngSignature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+static const size_t BmpHeaderSize = 14 + 40;   // BITMAPFILEHEADER + BITMAPINFOHEADER
+
+/*
+ * TConvertItem - One Entry On Its Way Through The Stages
+ */
+struct TConvertItem
+{
+    size_t entry;
+    std::string path;               // Output path; empty for folder entries
+    std::vector<uint8_t> data;      // Entry bytes, then the output file
+    TPngInfo info;
+    std::vector<uint8_t> pixels;    // BGRA, top-down
+    bool image;
+    std::string error;
+
+    TConvertItem() : entry(0), info(), image(false) {}
+};
+//---------------------------------------------------------------------------
+
+#ifdef _WIN32
+static std::wstring WidePath(const std::string& path)
+{
+    int length = MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, NULL, 0);
+    std::wstring wide(length > 0 ? length : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, path.c_str(), -1, &wide[0], length);
+    return wide;
+}
+#endif
+
+/*
+ * Output Path For An Entry
+ * Backslashes count as separators; absolute names and ".." segments are
+ * refused, so no entry can write outside the output folder.
+ */
+static bool OutputPath(const std::string& root, std::string name, std::string& path)
+{
+    for (size_t i = 0; i < name.size(); i++) {
+        if (name[i] == '\\')
+            name[i] = '/';
+    }
+    if (name.empty() || name[0] == '/' || name.find(':') != std::string::npos)
+        return false;
+    for (size_t begin = 0; begin <= name.size();) {
+        size_t end = name.find('/', begin);
+        if (end == std::string::npos)
+            end = name.size();
+        if (name.compare(begin, end - begin, "..") == 0)
+            return false;
+        begin = end + 1;
+    }
+    path = root + "/" + name;
+    return true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TPixelSink - Decodes Into One BGRA Buffer
+ */
+class TPixelSink : public TImageSink
+{
+  public:
+    explicit TPixelSink(std::vector<uint8_t>& pixels) : pixels(pixels), stride(0) {}
+
+    void Begin(const TPngInfo& info) override
+    {
+        stride = static_cast<size_t>(info.width) * 4;
+        pixels.resize(stride * info.height);
+    }
+    uint8_t* Row(uint32_t y) override { return pixels.data() + y * stride; }
+
+  private:
+    std::vector<uint8_t>& pixels;
+    size_t stride;
+};
+
+static void Put16(uint8_t* p, uint32_t value)
+{
+    p[0] = static_cast<uint8_t>(value);
+    p[1] = static_cast<uint8_t>(value >> 8);
+}
+
+static void Put32(uint8_t* p, uint32_t value)
+{
+    Put16(p, value);
+    Put16(p + 2, value >> 16);
+}
+
+/*
+ * Encode BMP
+ * 32 bits per pixel, uncompressed, rows bottom-up; the alpha byte is kept
+ * in the fourth channel as most readers expect.
+ */
+static void EncodeBmp(const TPngInfo& info, const std::vector<uint8_t>& pixels,
+                      std::vector<uint8_t>& out)
+{
+    size_t stride = static_cast<size_t>(info.width) * 4;
+    size_t imageSize = stride * info.height;
+    if (BmpHeaderSize + imageSize > 0xFFFFFFFFu)
+        throw std::runtime_error("Image too large for BMP");
+
+    out.assign(BmpHeaderSize + imageSize, 0);
+    uint8_t* header = out.data();
+    header[0] = 'B';
+    header[1] = 'M';
+    Put32(header + 2, static_cast<uint32_t>(out.size()));
+    Put32(header + 10, static_cast<uint32_t>(BmpHeaderSize));
+    Put32(header + 14, 40);
+    Put32(header + 18, info.width);
+    Put32(header + 22, info.height);
+    Put16(header + 26, 1);                          // Planes
+    Put16(header + 28, 32);                         // Bits per pixel
+    Put32(header + 34, static_cast<uint32_t>(imageSize));
+    Put32(header + 38, 2835);                       // 72 dpi
+    Put32(header + 42, 2835);
+
+    for (uint32_t y = 0; y < info.height; y++)
+        memcpy(out.data() + BmpHeaderSize + (info.height - 1 - y) * stride,
+               pixels.data() + y * stride, stride);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Convert Pack
+ */
+TConvertResult ConvertPack(const TPackVolumeSet& pack, const std::string& outputFolder,
+                           const TConvertOptions& options)
+{
+    std::string root = outputFolder;
+    while (root.size() > 1 && (root[root.size() - 1] == '/' || root[root.size() - 1] == '\\'))
+        root.erase(root.size() - 1);
+    TMappedFile::MakeFolders(root);
+
+    std::atomic<size_t> images(0), copied(0);
+    std::atomic<uint64_t> written(0);
+    std::mutex errorLock;
+    std::vector<std::string> errors;
+    size_t next = 0;
+
+    TPipeline pipeline(options.queue);
+    pipeline.Source<TConvertItem>("list", [&](TConvertItem& item) {
+        if (next >= pack.Count())
+            return false;
+        item.entry = next++;
+        return true;
+    })
+    .Then<TConvertItem>("inflate", 0, [&](TConvertItem& item) {
+        const std::string& name = pack.Entry(item.entry).name;
+        if (!name.empty() && name[name.size() - 1] == '/')
+            return std::move(item);     // Folder entry: nothing to write
+        if (!OutputPath(root, name, item.path)) {
+            item.error = "unsafe name";
+            return std::move(item);
+        }
+        std::unique_ptr<TByteSource> source = pack.OpenEntry(item.entry);
+        const uint8_t* chunk;
+        size_t size;
+        while (source->Next(chunk, size))
+            item.data.insert(item.data.end(), chunk, chunk + size);
+        return std::move(item);
+    })
+    .Then<TConvertItem>("decode", 0, [](TConvertItem& item) {
+        item.image = item.error.empty() && item.data.size() >= sizeof(PngSignature) &&
+                     memcmp(item.data.data(), PngSignature, sizeof(PngSignature)) == 0;
+        if (item.image) {
+            try {
+                TSpanSource source(item.data.data(), item.data.size());
+                TPngDecoder decoder(&source);
+                item.info = decoder.ReadHeader();
+                TPixelSink sink(item.pixels);
+                decoder.Decode(&sink);
+            } catch (std::exception& e) {
+                item.error = e.what();
+            }
+        }
+        return std::move(item);
+    })
+    .Then<TConvertItem>("encode", 0, [](TConvertItem& item) {
+        if (item.image && item.error.empty()) {
+            size_t dot = item.path.rfind('.');
+            if (dot != std::string::npos && item.path.find('/', dot) == std::string::npos)
+                item.path.erase(dot);
+            item.path += ".bmp";
+            EncodeBmp(item.info, item.pixels, item.data);
+            std::vector<uint8_t>().swap(item.pixels);
+        }
+        return std::move(item);
+    })
+    .Sink("write", options.writers, [&](TConvertItem& item) {
+        if (!item.error.empty()) {
+            std::lock_guard<std::mutex> guard(errorLock);
+            errors.push_back(pack.Entry(item.entry).name + ": " + item.error);
+            return;
+        }
+        if (item.path.empty())
+            return;
+        TMappedFile::MakeFolders(item.path.substr(0, item.path.find_last_of('/')));
+#ifdef _WIN32
+        FILE* file = _wfopen(WidePath(item.path).c_str(), L"wb");
+#else
+        FILE* file = fopen(item.path.c_str(), "wb");
+#endif
+        if (file == nullptr)
+            throw std::runtime_error("Unable to create " + item.path);
+        bool ok = item.data.empty() || fwrite(item.data.data(), 1, item.data.size(), file) == item.data.size();
+        ok = fclose(file) == 0 && ok;
+        if (!ok)
+            throw std::runtime_error("Write failed on " + item.path);
+
+        (item.image ? images : copied).fetch_add(1);
+        written.fetch_add(item.data.size());
+    });
+
+    TConvertResult result;
+    result.pipeline = pipeline.Run(options.threads);
+    result.images = images.load();
+    result.copied = copied.load();
+    result.bytesWritten = written.load();
+    result.errors.swap(errors);
+    return result;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,60 @@
+﻿/*
+ * PackConvert.h - Batch Conversion Of Pack Entries
+ *
+ * Declares the bulk converter behind "Zip.exe --pack convert". Every PNG
+ * entry of a pack is decoded and written as a 32-bit BMP; other entries
+ * are extracted as they are. Directory structure inside the pack is kept.
+ *
+ * The job runs as a TPipeline with five stages:
+ *   list -> inflate -> decode -> encode -> write
+ * so the slowest stage (usually decode, or write on a slow disk) sets the
+ * pace while the queues bound how much decoded data is held at once. An
+ * entry that fails to decode is reported and skipped; entry names that
+ * would leave the output folder are refused.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackConvertH
+#define PackConvertH
+//---------------------------------------------------------------------------
+
+#include "PackVolumes.h"          // TPackVolumeSet
+#include "Pipeline.h"             // TPipelineStats
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TConvertOptions - Converter Settings
+ */
+struct TConvertOptions
+{
+    unsigned threads;               // Pool runners (0 = the whole task pool)
+    size_t queue;                   // Items between two stages
+    unsigned writers;               // Files written at once
+
+    TConvertOptions() : threads(0), queue(16), writers(2) {}
+};
+
+/*
+ * TConvertResult - What Was Written
+ */
+struct TConvertResult
+{
+    size_t images;                  // PNG entries written as BMP
+    size_t copied;                  // Other entries written unchanged
+    uint64_t bytesWritten;
+    std::vector<std::string> errors;   // "name: reason" per skipped entry
+    TPipelineStats pipeline;
+};
+
+// Converts every entry of `pack` into `outputFolder` (created if missing)
+TConvertResult ConvertPack(const TPackVolumeSet& pack, const std::string& outputFolder,
+                           const TConvertOptions& options);
+
+//---------------------------------------------------------------------------
+#endif // PackConvertH
@@ -0,0 +1,819 @@
+﻿/*
+ * PackPatch.cpp - Binary Delta Patches Between Pack Versions
+ *
+ * Implements the patch generator and applier declared in PackPatch.h. The
+ * delta encoder follows Colin Percival's bsdiff: a Larsson-Sadakane suffix
+ * sort of the old entry, then a scan of the new entry that extends each
+ * suffix array match forwards and backwards into an approximate match.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackPatch.h"
+#include "Checksum.h"             // Crc32, Crc32Combine
+#include "Deflate.h"              // TDeflater
+#include "FlagPack.h"             // TFlagPack
+#include "Inflate.h"              // TInflater, EDecodeError
+#include "MappedFile.h"           // TMappedFile
+#include "PackBuilder.h"          // TPackBuilder
+#include "TaskPool.h"             // TTaskPool::Shared
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>                // memcmp, memcpy
+#include <fstream>
+#include <memory>                 // std::unique_ptr
+#include <stdexcept>
+#include <unordered_map>
+#include <vector>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const char PatchMagic[4] = { 'F', 'P', 'A', 'T' };
+static const uint16_t PatchVersion = 1;
+
+static const uint8_t KindCopy = 0;
+static const uint8_t KindLiteral = 1;
+static const uint8_t KindDelta = 2;
+static const uint8_t KindHot = 0x80;            // Entry lies in the hot region
+
+static const int PatchLevel = 9;                // Patches are built once, sent often
+static const size_t ApplyRoundEntries = 4096;   // Entries rebuilt per round
+static const size_t ApplyRoundBytes = 16 << 20; // Or this much output, whichever first
+static const int64_t SeekLimit = int64_t(1) << 40;
+
+//---------------------------------------------------------------------------
+
+/*
+ * Little-Endian Record Encoding
+ */
+static void Put16(std::vector<uint8_t>& out, uint16_t value)
+{
+    out.push_back(static_cast<uint8_t>(value));
+    out.push_back(static_cast<uint8_t>(value >> 8));
+}
+
+static void Put32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (unsigned i = 0; i < 4; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+static void Put64(std::vector<uint8_t>& out, uint64_t value)
+{
+    for (unsigned i = 0; i < 8; i++)
+        out.push_back(static_cast<uint8_t>(value >> (8 * i)));
+}
+
+static uint64_t GetLE64(const uint8_t* p)
+{
+    uint64_t value = 0;
+    for (unsigned i = 0; i < 8; i++)
+        value |= static_cast<uint64_t>(p[i]) << (8 * i);
+    return value;
+}
+
+/*
+ * TPatchReader - Bounds-Checked Cursor Over The Patch
+ */
+class TPatchReader
+{
+  public:
+    TPatchReader(const uint8_t* data, size_t size) : p(data), end(data + size) {}
+
+    const uint8_t* Bytes(uint64_t count)
+    {
+        if (count > static_cast<uint64_t>(end - p))
+            throw EDecodeError("Truncated patch");
+        const uint8_t* bytes = p;
+        p += count;
+        return bytes;
+    }
+
+    uint8_t Get8() { return *Bytes(1); }
+    uint16_t Get16() { const uint8_t* b = Bytes(2); return static_cast<uint16_t>(b[0] | (b[1] << 8)); }
+    uint32_t Get32()
+    {
+        const uint8_t* b = Bytes(4);
+        return static_cast<uint32_t>(b[0]) | (static_cast<uint32_t>(b[1]) << 8) |
+               (static_cast<uint32_t>(b[2]) << 16) | (static_cast<uint32_t>(b[3]) << 24);
+    }
+    uint64_t Get64() { return GetLE64(Bytes(8)); }
+
+  private:
+    const uint8_t* p;
+    const uint8_t* end;
+};
+//---------------------------------------------------------------------------
+
+/*
+ * Suffix Sort (Larsson-Sadakane)
+ * Ternary split of one bucket on the rank at offset h; sorted singletons
+ * are marked with negative run lengths so later passes skip them.
+ */
+static void SplitBucket(int64_t* I, int64_t* V, int64_t start, int64_t length, int64_t h)
+{
+    if (length < 16) {
+        for (int64_t k = start, j; k < start + length; k += j) {
+            j = 1;
+            int64_t x = V[I[k] + h];
+            for (int64_t i = 1; k + i < start + length; i++) {
+                if (V[I[k + i] + h] < x) {
+                    x = V[I[k + i] + h];
+                    j = 0;
+                }
+                if (V[I[k + i] + h] == x) {
+                    std::swap(I[k + j], I[k + i]);
+                    j++;
+                }
+            }
+            for (int64_t i = 0; i < j; i++)
+                V[I[k + i]] = k + j - 1;
+            if (j == 1)
+                I[k] = -1;
+        }
+        return;
+    }
+
+    int64_t x = V[I[start + length / 2] + h];
+    int64_t jj = 0, kk = 0;
+    for (int64_t i = start; i < start + length; i++) {
+        if (V[I[i] + h] < x)
+            jj++;
+        if (V[I[i] + h] == x)
+            kk++;
+    }
+    jj += start;
+    kk += jj;
+
+    int64_t i = start, j = 0, k = 0;
+    while (i < jj) {
+        if (V[I[i] + h] < x) {
+            i++;
+        } else if (V[I[i] + h] == x) {
+            std::swap(I[i], I[jj + j]);
+            j++;
+        } else {
+            std::swap(I[i], I[kk + k]);
+            k++;
+        }
+    }
+    while (jj + j < kk) {
+        if (V[I[jj + j] + h] == x) {
+            j++;
+        } else {
+            std::swap(I[jj + j], I[kk + k]);
+            k++;
+        }
+    }
+
+    if (jj > start)
+        SplitBucket(I, V, start, jj - start, h);
+    for (i = 0; i < kk - jj; i++)
+        V[I[jj + i]] = kk - 1;
+    if (jj == kk - 1)
+        I[jj] = -1;
+    if (start + length > kk)
+        SplitBucket(I, V, kk, start + length - kk, h);
+}
+
+/*
+ * Build Suffix Array
+ * Fills I (size + 1 entries, I[0] = the empty suffix) with the sorted
+ * suffixes of `old`, doubling the compared prefix length every pass.
+ */
+static void SuffixSort(std::vector<int64_t>& I, const uint8_t* old, int64_t size)
+{
+    std::vector<int64_t> V(static_cast<size_t>(size + 1));
+    I.assign(static_cast<size_t>(size + 1), 0);
+
+    int64_t buckets[256] = { 0 };
+    for (int64_t i = 0; i < size; i++)
+        buckets[old[i]]++;
+    for (int i = 1; i < 256; i++)
+        buckets[i] += buckets[i - 1];
+    for (int i = 255; i > 0; i--)
+        buckets[i] = buckets[i - 1];
+    buckets[0] = 0;
+
+    for (int64_t i = 0; i < size; i++)
+        I[++buckets[old[i]]] = i;
+    I[0] = size;
+    for (int64_t i = 0; i < size; i++)
+        V[i] = buckets[old[i]];
+    V[size] = 0;
+    for (int i = 1; i < 256; i++) {
+        if (buckets[i] == buckets[i - 1] + 1)
+            I[buckets[i]] = -1;
+    }
+    I[0] = -1;
+
+    for (int64_t h = 1; I[0] != -(size + 1); h += h) {
+        int64_t length = 0;
+        int64_t i = 0;
+        while (i < size + 1) {
+            if (I[i] < 0) {
+                length -= I[i];
+                i -= I[i];
+            } else {
+                if (length)
+                    I[i - length] = -length;
+                length = V[I[i]] + 1 - i;
+                SplitBucket(&I[0], &V[0], i, length, h);
+                i += length;
+                length = 0;
+            }
+        }
+        if (length)
+            I[i - length] = -length;
+    }
+
+    for (int64_t i = 0; i < size + 1; i++)
+        I[V[i]] = i;
+}
+//---------------------------------------------------------------------------
+
+static int64_t MatchLength(const uint8_t* a, int64_t aSize, const uint8_t* b, int64_t bSize)
+{
+    int64_t i = 0;
+    while (i < aSize && i < bSize && a[i] == b[i])
+        i++;
+    return i;
+}
+
+/*
+ * Longest Match
+ * Binary search of the suffix array for the suffix sharing the longest
+ * prefix with `target`; returns its length and stores its position.
+ */
+static int64_t SearchMatch(const std::vector<int64_t>& I, const uint8_t* old, int64_t oldSize,
+                           const uint8_t* target, int64_t targetSize,
+                           int64_t first, int64_t last, int64_t& position)
+{
+    while (last - first >= 2) {
+        int64_t middle = first + (last - first) / 2;
+        int64_t compare = std::min(oldSize - I[middle], targetSize);
+        if (memcmp(old + I[middle], target, static_cast<size_t>(compare)) < 0)
+            first = middle;
+        else
+            last = middle;
+    }
+
+    int64_t x = MatchLength(old + I[first], oldSize - I[first], target, targetSize);
+    int64_t y = MatchLength(old + I[last], oldSize - I[last], target, targetSize);
+    position = x > y ? I[first] : I[last];
+    return x > y ? x : y;
+}
+
+/*
+ * TDeltaStreams - Raw bsdiff Output
+ */
+struct TDeltaStreams
+{
+    std::vector<uint8_t> control;   // (diff length, extra length, seek) triples
+    std::vector<uint8_t> diff;      // new - old over each approximate match
+    std::vector<uint8_t> extra;     // Bytes with no match in the old data
+};
+
+/*
+ * Diff Two Buffers (bsdiff)
+ * A match is taken once it beats the byte-wise agreement of simply
+ * continuing the previous alignment by more than 8 bytes. Between two
+ * matches the previous one is extended forwards and the new one
+ * backwards while at least half the bytes agree; the rest is extra data.
+ */
+static void DiffBuffers(const uint8_t* old, int64_t oldSize, const uint8_t* target, int64_t targetSize,
+                        TDeltaStreams& out)
+{
+    std::vector<int64_t> I;
+    SuffixSort(I, old, oldSize);
+
+    int64_t scan = 0, length = 0, position = 0;
+    int64_t lastScan = 0, lastPosition = 0, lastOffset = 0;
+    while (scan < targetSize) {
+        int64_t oldScore = 0;
+        int64_t scoreScan = scan += length;
+        for (; scan < targetSize; scan++) {
+            length = SearchMatch(I, old, oldSize, target + scan, targetSize - scan, 0, oldSize, position);
+            for (; scoreScan < scan + length; scoreScan++) {
+                if (scoreScan + lastOffset < oldSize && old[scoreScan + lastOffset] == target[scoreScan])
+                    oldScore++;
+            }
+            if ((length == oldScore && length != 0) || length > oldScore + 8)
+                break;
+            if (scan + lastOffset < oldSize && old[scan + lastOffset] == target[scan])
+                oldScore--;
+        }
+
+        if (length == oldScore && scan != targetSize)
+            continue;
+
+        // Extend the previous match forwards
+        int64_t lengthForward = 0;
+        for (int64_t i = 0, score = 0, best = 0; lastScan + i < scan && lastPosition + i < oldSize; ) {
+            if (old[lastPosition + i] == target[lastScan + i])
+                score++;
+            i++;
+            if (score * 2 - i > best * 2 - lengthForward) {
+                best = score;
+                lengthForward = i;
+            }
+        }
+
+        // Extend the new match backwards
+        int64_t lengthBack = 0;
+        if (scan < targetSize) {
+            for (int64_t i = 1, score = 0, best = 0; scan >= lastScan + i && position >= i; i++) {
+                if (old[position - i] == target[scan - i])
+                    score++;
+                if (score * 2 - i > best * 2 - lengthBack) {
+                    best = score;
+                    lengthBack = i;
+                }
+            }
+        }
+
+        // Split an overlap where it loses the fewest matching bytes
+        if (lastScan + lengthForward > scan - lengthBack) {
+            int64_t overlap = (lastScan + lengthForward) - (scan - lengthBack);
+            int64_t score = 0, best = 0, split = 0;
+            for (int64_t i = 0; i < overlap; i++) {
+                if (target[lastScan + lengthForward - overlap + i] ==
+                    old[lastPosition + lengthForward - overlap + i])
+                    score++;
+                if (target[scan - lengthBack + i] == old[position - lengthBack + i])
+                    score--;
+                if (score > best) {
+                    best = score;
+                    split = i + 1;
+                }
+            }
+            lengthForward += split - overlap;
+            lengthBack -= split;
+        }
+
+        int64_t extraLength = (scan - lengthBack) - (lastScan + lengthForward);
+        for (int64_t i = 0; i < lengthForward; i++)
+            out.diff.push_back(static_cast<uint8_t>(target[lastScan + i] - old[lastPosition + i]));
+        out.extra.insert(out.extra.end(), target + lastScan + lengthForward,
+                         target + lastScan + lengthForward + extraLength);
+        Put64(out.control, static_cast<uint64_t>(lengthForward));
+        Put64(out.control, static_cast<uint64_t>(extraLength));
+        Put64(out.control, static_cast<uint64_t>((position - lengthBack) - (lastPosition + lengthForward)));
+
+        lastScan = scan - lengthBack;
+        lastPosition = position - lengthBack;
+        lastOffset = position - scan;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Whole-File CRC On All Cores
+ * Slices are checksummed independently and joined with Crc32Combine.
+ */
+static uint32_t ParallelCrc32(const uint8_t* data, size_t size, unsigned threads)
+{
+    const size_t minSlice = 1 << 20;
+    size_t slices = std::max<size_t>(1, std::min<size_t>(threads, size / minSlice));
+    size_t sliceSize = (size + slices - 1) / std::max<size_t>(slices, 1);
+
+    std::vector<uint32_t> crcs(slices, 0);
+    TTaskPool::Shared().Run(static_cast<unsigned>(slices), [&](unsigned s) {
+        size_t begin = s * sliceSize;
+        crcs[s] = Crc32(data + begin, std::min(sliceSize, size - begin));
+    });
+
+    uint32_t crc = crcs[0];
+    for (size_t s = 1; s < slices; s++) {
+        size_t begin = s * sliceSize;
+        crc = Crc32Combine(crc, crcs[s], std::min(sliceSize, size - begin));
+    }
+    return crc;
+}
+
+static unsigned WorkerCount(unsigned threads)
+{
+    return TTaskPool::Shared().Concurrency(threads);
+}
+
+/*
+ * Run Workers
+ * Calls work(i) for every i below `count` on up to `threads` runners of
+ * the shared task pool and rethrows the first failure once all of them
+ * have finished.
+ */
+template <class TWork>
+static void RunWorkers(size_t count, unsigned threads, TWork work)
+{
+    std::atomic<size_t> cursor(0);
+    TTaskPool::Shared().Run(threads, [&cursor, count, &work](unsigned) {
+        for (size_t i = cursor.fetch_add(1); i < count; i = cursor.fetch_add(1))
+            work(i);
+    });
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Read Whole Entry
+ * Uncompressed content of an old or new entry, for diffing.
+ */
+static void ReadEntry(const TFlagPack& pack, size_t index, std::vector<uint8_t>& data)
+{
+    data.resize(static_cast<size_t>(pack.Entry(index).size));
+    std::unique_ptr<TByteSource> source = pack.OpenEntry(index);
+    size_t filled = 0;
+    const uint8_t* span;
+    size_t length;
+    while (source->Next(span, length)) {
+        if (length > data.size() - filled)
+            throw EDecodeError("Entry is larger than its directory record");
+        memcpy(data.data() + filled, span, length);
+        filled += length;
+    }
+    if (filled != data.size() || Crc32(data.data(), data.size()) != pack.Entry(index).crc32)
+        throw EDecodeError("Entry fails its CRC check");
+}
+
+/*
+ * Encode One Entry Record
+ * Tries, in order: a copy of an identical old entry, a delta against the
+ * old entry of the same name, a literal. A delta is kept only if it is
+ * smaller than the entry as stored in the new pack.
+ */
+static uint8_t EncodeRecord(const TFlagPack& oldPack, const TFlagPack& newPack, size_t index,
+                            const std::unordered_map<uint64_t, size_t>& byContent,
+                            std::vector<uint8_t>& record)
+{
+    TPackEntry info = newPack.Entry(index);
+    const uint64_t contentKey = (info.size << 32) ^ info.crc32;
+
+    int same = oldPack.Find(info.name);
+    int copy = -1;
+    if (same >= 0 && oldPack.Entry(same).crc32 == info.crc32 && oldPack.Entry(same).size == info.size) {
+        copy = same;
+    } else {
+        std::unordered_map<uint64_t, size_t>::const_iterator it = byContent.find(contentKey);
+        if (it != byContent.end() && oldPack.Entry(it->second).crc32 == info.crc32 &&
+            oldPack.Entry(it->second).size == info.size)
+            copy = static_cast<int>(it->second);
+    }
+
+    uint8_t kind = KindLiteral;
+    std::vector<uint8_t> control, diff, extra;
+    if (copy >= 0) {
+        // The old bytes are reused as they are, method and all
+        kind = KindCopy;
+        info.method = oldPack.Entry(copy).method;
+        info.compressedSize = oldPack.Entry(copy).compressedSize;
+    } else if (same >= 0 && oldPack.Entry(same).size > 0 && info.size > 0 &&
+               (info.method == TFlagPack::MethodStored || info.method == TFlagPack::MethodDeflated)) {
+        std::vector<uint8_t> oldData, newData;
+        ReadEntry(oldPack, static_cast<size_t>(same), oldData);
+        ReadEntry(newPack, index, newData);
+
+        TDeltaStreams streams;
+        DiffBuffers(oldData.data(), static_cast<int64_t>(oldData.size()),
+                    newData.data(), static_cast<int64_t>(newData.size()), streams);
+        TDeflater deflater(PatchLevel);
+        deflater.Compress(streams.control.data(), streams.control.size(), control);
+        deflater.Compress(streams.diff.data(), streams.diff.size(), diff);
+        deflater.Compress(streams.extra.data(), streams.extra.size(), extra);
+        if (8 + 1 + 24 + control.size() + diff.size() + extra.size() < info.compressedSize)
+            kind = KindDelta;
+    }
+
+    bool hot = newPack.Entry(index).headerOffset < newPack.HotBytes();
+    record.clear();
+    record.push_back(static_cast<uint8_t>(kind | (hot ? KindHot : 0)));
+    Put16(record, static_cast<uint16_t>(info.name.size()));
+    record.insert(record.end(), info.name.begin(), info.name.end());
+    Put16(record, info.method);
+    Put16(record, info.flags);
+    Put16(record, info.dosTime);
+    Put16(record, info.dosDate);
+    Put32(record, info.crc32);
+    Put64(record, info.compressedSize);
+    Put64(record, info.size);
+
+    if (kind == KindCopy) {
+        Put64(record, static_cast<uint64_t>(copy));
+    } else if (kind == KindLiteral) {
+        const uint8_t* data = newPack.EntryData(index);
+        record.insert(record.end(), data, data + info.compressedSize);
+    } else {
+        Put64(record, static_cast<uint64_t>(same));
+        record.push_back(static_cast<uint8_t>(TDeflater::DefaultLevel));  // Device-side recompression
+        Put64(record, control.size());
+        Put64(record, diff.size());
+        Put64(record, extra.size());
+        record.insert(record.end(), control.begin(), control.end());
+        record.insert(record.end(), diff.begin(), diff.end());
+        record.insert(record.end(), extra.begin(), extra.end());
+    }
+    return kind;
+}
+
+/*
+ * Write Pack Patch
+ * Records are encoded in parallel, then written in new pack order.
+ */
+TPatchStats WritePackPatch(const std::string& oldPath, const std::string& newPath,
+                           const std::string& patchPath, unsigned threads)
+{
+    threads = WorkerCount(threads);
+
+    TMappedFile oldFile, newFile;
+    oldFile.Open(oldPath);
+    newFile.Open(newPath);
+    TFlagPack oldPack, newPack;
+    oldPack.Open(oldFile.Data(), oldFile.Size());
+    newPack.Open(newFile.Data(), newFile.Size());
+
+    // Identical content under another name is still a copy
+    std::unordered_map<uint64_t, size_t> byContent;
+    for (size_t i = 0; i < oldPack.Count(); i++)
+        byContent.insert(std::make_pair((oldPack.Entry(i).size << 32) ^ oldPack.Entry(i).crc32, i));
+
+    std::vector<std::vector<uint8_t> > records(newPack.Count());
+    std::vector<uint8_t> kinds(newPack.Count());
+    RunWorkers(records.size(), threads, [&](size_t i) {
+        kinds[i] = EncodeRecord(oldPack, newPack, i, byContent, records[i]);
+    });
+
+    std::vector<uint8_t> header(PatchMagic, PatchMagic + 4);
+    Put16(header, PatchVersion);
+    Put16(header, 0);
+    Put64(header, oldFile.Size());
+    Put32(header, ParallelCrc32(oldFile.Data(), oldFile.Size(), threads));
+    Put64(header, newPack.Count());
+
+    TPatchStats stats = { 0, 0, 0, 0, newFile.Size() };
+    std::ofstream file(patchPath.c_str(), std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(header.data()), header.size());
+    stats.patchBytes = header.size();
+    for (size_t i = 0; i < records.size(); i++) {
+        file.write(reinterpret_cast<const char*>(records[i].data()), records[i].size());
+        stats.patchBytes += records[i].size();
+        if (kinds[i] == KindCopy)
+            stats.copied++;
+        else if (kinds[i] == KindLiteral)
+            stats.literal++;
+        else
+            stats.delta++;
+    }
+    file.close();
+    if (!file)
+        throw std::runtime_error("Write failed on " + patchPath);
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TApplyItem - One Parsed Record
+ */
+struct TApplyItem
+{
+    uint8_t kind;
+    bool hot;
+    TPackEntry info;
+    uint64_t oldIndex;
+    int level;                      // Delta: recompression level
+    const uint8_t* streams[3];      // Literal: entry data; delta: control, diff, extra
+    size_t streamSizes[3];
+    const uint8_t* bytes;           // What to write: old pack, patch or compressed
+    std::vector<uint8_t> compressed;
+};
+
+static void ReadExact(TInflater& stream, uint8_t* dst, uint64_t length)
+{
+    if (stream.Read(dst, static_cast<size_t>(length)) != length)
+        throw EDecodeError("Truncated patch stream");
+}
+
+/*
+ * Parse One Record
+ * Only the record header is decoded here; payloads stay in the mapping.
+ */
+static void ParseRecord(TPatchReader& reader, const TFlagPack& oldPack, TApplyItem& item)
+{
+    uint8_t kind = reader.Get8();
+    item.kind = kind & ~KindHot;
+    item.hot = (kind & KindHot) != 0;
+    uint16_t nameLength = reader.Get16();
+    item.info.name.assign(reinterpret_cast<const char*>(reader.Bytes(nameLength)), nameLength);
+    item.info.method = reader.Get16();
+    item.info.flags = reader.Get16();
+    item.info.dosTime = reader.Get16();
+    item.info.dosDate = reader.Get16();
+    item.info.crc32 = reader.Get32();
+    item.info.compressedSize = reader.Get64();
+    item.info.size = reader.Get64();
+    item.info.headerOffset = 0;
+    item.oldIndex = 0;
+    item.level = 0;
+    item.bytes = nullptr;
+
+    if (item.kind == KindCopy) {
+        item.oldIndex = reader.Get64();
+        if (item.oldIndex >= oldPack.Count() ||
+            oldPack.Entry(static_cast<size_t>(item.oldIndex)).compressedSize != item.info.compressedSize)
+            throw EDecodeError("Patch copies a missing old entry");
+        item.bytes = oldPack.EntryData(static_cast<size_t>(item.oldIndex));
+    } else if (item.kind == KindLiteral) {
+        item.streamSizes[0] = static_cast<size_t>(item.info.compressedSize);
+        item.streams[0] = reader.Bytes(item.info.compressedSize);
+        item.bytes = item.streams[0];
+    } else if (item.kind == KindDelta) {
+        item.oldIndex = reader.Get64();
+        if (item.oldIndex >= oldPack.Count())
+            throw EDecodeError("Patch refers to a missing old entry");
+        item.level = reader.Get8();
+        for (int s = 0; s < 3; s++)
+            item.streamSizes[s] = static_cast<size_t>(reader.Get64());
+        for (int s = 0; s < 3; s++)
+            item.streams[s] = reader.Bytes(item.streamSizes[s]);
+    } else {
+        throw EDecodeError("Unknown patch record");
+    }
+}
+
+/*
+ * Check Literal
+ * Literals are the new pack's own entry bytes; decoding them once in the
+ * worker proves they arrived intact.
+ */
+static void CheckLiteral(const TApplyItem& item)
+{
+    uint32_t crc = 0;
+    uint64_t total = 0;
+    TSpanSource span(item.streams[0], item.streamSizes[0]);
+    const uint8_t* data;
+    size_t length;
+    if (item.info.method == TFlagPack::MethodStored) {
+        while (span.Next(data, length)) {
+            crc = Crc32(data, length, crc);
+            total += length;
+        }
+    } else if (item.info.method == TFlagPack::MethodDeflated) {
+        TInflater stream(&span);
+        while (stream.Next(data, length)) {
+            crc = Crc32(data, length, crc);
+            total += length;
+        }
+    } else {
+        return;                                 // Passed through unchecked
+    }
+    if (crc != item.info.crc32 || total != item.info.size)
+        throw EDecodeError("Patched entry fails its CRC check");
+}
+
+/*
+ * Rebuild Delta Entry
+ * The delta streams are inflated side by side, one control triple at a
+ * time, against the uncompressed old entry; the result is checked against
+ * the entry CRC and compressed again.
+ */
+static void RebuildDelta(const TFlagPack& oldPack, TApplyItem& item)
+{
+    std::vector<uint8_t> old;
+    ReadEntry(oldPack, static_cast<size_t>(item.oldIndex), old);
+    const int64_t oldSize = static_cast<int64_t>(old.size());
+    const uint64_t size = item.info.size;
+
+    TSpanSource controlSpan(item.streams[0], item.streamSizes[0]);
+    TSpanSource diffSpan(item.streams[1], item.streamSizes[1]);
+    TSpanSource extraSpan(item.streams[2], item.streamSizes[2]);
+    TInflater control(&controlSpan), diff(&diffSpan), extra(&extraSpan);
+
+    std::vector<uint8_t> data(static_cast<size_t>(size));
+    uint8_t* out = data.data();
+    uint64_t newPosition = 0;
+    int64_t oldPosition = 0;
+    while (newPosition < size) {
+        uint8_t triple[24];
+        ReadExact(control, triple, sizeof(triple));
+        uint64_t diffLength = GetLE64(triple);
+        uint64_t extraLength = GetLE64(triple + 8);
+        int64_t seek = static_cast<int64_t>(GetLE64(triple + 16));
+        if (diffLength > size - newPosition || seek > SeekLimit || seek < -SeekLimit)
+            throw EDecodeError("Corrupt patch control");
+
+        ReadExact(diff, out + newPosition, diffLength);
+        for (uint64_t i = 0; i < diffLength; i++) {
+            int64_t from = oldPosition + static_cast<int64_t>(i);
+            if (from >= 0 && from < oldSize)
+                out[newPosition + i] = static_cast<uint8_t>(out[newPosition + i] + old[static_cast<size_t>(from)]);
+        }
+        newPosition += diffLength;
+        oldPosition += static_cast<int64_t>(diffLength);
+
+        if (extraLength > size - newPosition)
+            throw EDecodeError("Corrupt patch control");
+        ReadExact(extra, out + newPosition, extraLength);
+        newPosition += extraLength;
+        oldPosition += seek;
+        if (oldPosition > SeekLimit || oldPosition < -SeekLimit)
+            throw EDecodeError("Corrupt patch control");
+    }
+    if (Crc32(data.data(), data.size()) != item.info.crc32)
+        throw EDecodeError("Patched entry fails its CRC check");
+
+    TDeflater deflater(item.level);
+    const uint8_t* bytes = CompressEntry(deflater, data.data(), data.size(), item.info.method,
+                                         item.info, item.compressed);
+    if (bytes == data.data())
+        item.compressed.swap(data);             // Stored: keep the rebuilt bytes alive
+    item.bytes = item.compressed.data();
+}
+
+/*
+ * Apply Pack Patch
+ * Records are parsed in rounds capped by entry count and rebuilt bytes;
+ * each round is rebuilt in parallel and written in order before the next
+ * one is parsed, which bounds memory use independently of the pack size.
+ */
+TPatchStats ApplyPackPatch(const std::string& oldPath, const std::string& patchPath,
+                           const std::string& outputPath, unsigned threads)
+{
+    threads = WorkerCount(threads);
+
+    TMappedFile oldFile, patchFile;
+    oldFile.Open(oldPath);
+    patchFile.Open(patchPath);
+
+    TPatchReader reader(patchFile.Data(), patchFile.Size());
+    if (memcmp(reader.Bytes(4), PatchMagic, 4) != 0)
+        throw EDecodeError("Not a pack patch");
+    if (reader.Get16() != PatchVersion)
+        throw EDecodeError("Unsupported pack patch version");
+    reader.Get16();
+    uint64_t oldSize = reader.Get64();
+    uint32_t oldCrc = reader.Get32();
+    uint64_t count = reader.Get64();
+    if (oldSize != oldFile.Size() || oldCrc != ParallelCrc32(oldFile.Data(), oldFile.Size(), threads))
+        throw EDecodeError("Patch was made for a different pack");
+
+    TFlagPack oldPack;
+    oldPack.Open(oldFile.Data(), oldFile.Size());
+
+    // Built next to the output and moved over it only once it is complete,
+    // so a corrupt patch leaves no partial pack behind (nor destroys one)
+    const std::string temporary = outputPath + ".patching";
+    TPatchStats stats = { 0, 0, 0, patchFile.Size(), 0 };
+    try {
+        TPackBuilder builder;
+        builder.Create(temporary);
+        uint64_t hotBytes = 0;
+
+        uint64_t parsed = 0;
+        std::vector<TApplyItem> round;
+        while (parsed < count) {
+            round.clear();
+            uint64_t roundBytes = 0;
+            while (parsed < count && round.size() < ApplyRoundEntries &&
+                   roundBytes < ApplyRoundBytes) {
+                round.push_back(TApplyItem());
+                ParseRecord(reader, oldPack, round.back());
+                if (round.back().kind == KindDelta)
+                    roundBytes += round.back().info.size;
+                parsed++;
+            }
+
+            RunWorkers(round.size(), threads, [&oldPack, &round](size_t i) {
+                if (round[i].kind == KindLiteral)
+                    CheckLiteral(round[i]);
+                else if (round[i].kind == KindDelta)
+                    RebuildDelta(oldPack, round[i]);
+            });
+
+            for (size_t i = 0; i < round.size(); i++) {
+                const TApplyItem& item = round[i];
+                builder.AddRaw(item.info, item.bytes);
+                if (item.kind == KindCopy)
+                    stats.copied++;
+                else if (item.kind == KindLiteral)
+                    stats.literal++;
+                else
+                    stats.delta++;
+                if (item.hot)
+                    hotBytes = builder.Offset();
+            }
+        }
+
+        builder.Finish(hotBytes > 0 ? TFlagPack::HotTag + std::to_string(hotBytes) : std::string());
+        stats.packBytes = builder.Offset();
+    } catch (...) {
+        TMappedFile::RemoveFile(temporary);     // The builder has closed it
+        throw;
+    }
+
+    // The mappings go first, which Windows needs if the output is the old pack
+    oldFile.Close();
+    patchFile.Close();
+    TMappedFile::ReplaceFile(temporary, outputPath);
+    return stats;
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,86 @@
+﻿/*
+ * PackPatch.h - Binary Delta Patches Between Pack Versions
+ *
+ * Declares the patch generator and applier behind "Zip.exe --pack diff"
+ * and "--pack patch". A patch turns one exact version of a pack into the
+ * next one entry by entry, so a device only downloads what changed:
+ *
+ * - Entries whose CRC and size match an old entry (under any name) are
+ *   copied from the old pack; the patch holds just their directory record
+ * - Changed entries are bsdiff-style deltas against the old entry of the
+ *   same name: a suffix array of the old content finds approximate
+ *   matches, and the patch stores control triples, byte-wise differences
+ *   (mostly zeros) and unmatched extra bytes as three deflate streams
+ * - Everything else is a literal: the entry data exactly as stored in
+ *   the new pack
+ *
+ * Deltas work on uncompressed content, since one changed byte scrambles a
+ * deflate stream from that point on. The applier compresses a rebuilt
+ * entry again, so it matches the new pack in content and CRC but not
+ * necessarily in compressed bytes. The patch records the size and CRC of
+ * the whole old pack and refuses any other base.
+ *
+ * Patch layout (little-endian):
+ *   "FPAT" u16 version, u16 reserved, u64 old pack size, u32 old pack CRC,
+ *   u64 entry count, then one record per entry of the new pack, in order:
+ *     u8 kind (| 0x80 inside the hot region), u16 name length, name,
+ *     u16 method, u16 flags, u16 time, u16 date, u32 CRC,
+ *     u64 compressed size, u64 size, then by kind
+ *     copy:    u64 old index
+ *     literal: the entry data (compressed size bytes)
+ *     delta:   u64 old index, u8 deflate level, u64 control/diff/extra
+ *              lengths, the three deflated streams
+ *   Control triples are (diff length, extra length, old seek) as LE64,
+ *   the seek in two's complement.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackPatchH
+#define PackPatchH
+//---------------------------------------------------------------------------
+
+#include <cstdint>
+#include <string>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPatchStats - Record Counts And Sizes
+ */
+struct TPatchStats
+{
+    size_t copied;
+    size_t literal;
+    size_t delta;
+    uint64_t patchBytes;            // Size of the patch file
+    uint64_t packBytes;             // Size of the new pack
+};
+
+/*
+ * Write Pack Patch
+ *
+ * Diffs `oldPath` against `newPath` and writes the patch. Entries are
+ * diffed on `threads` workers (0 = one per core). Throws EDecodeError for
+ * an invalid pack and std::runtime_error on I/O errors.
+ */
+TPatchStats WritePackPatch(const std::string& oldPath, const std::string& newPath,
+                           const std::string& patchPath, unsigned threads = 0);
+
+/*
+ * Apply Pack Patch
+ *
+ * Rebuilds the new pack at `outputPath` from the old pack and the patch.
+ * Both inputs are mapped and read front to back; changed entries are
+ * rebuilt on `threads` workers in rounds of bounded size, while copied
+ * and literal entries go straight from the mappings to the output. Every
+ * rebuilt or literal entry is checked against its CRC. The pack is built
+ * in "<outputPath>.patching" and only replaces `outputPath` once complete.
+ * Throws EDecodeError if the patch is corrupt or was made for a different
+ * old pack.
+ */
+TPatchStats ApplyPackPatch(const std::string& oldPath, const std::string& patchPath,
+                           const std::string& outputPath, unsigned threads = 0);
+
+//---------------------------------------------------------------------------
+#endif // PackPatchH
@@ -0,0 +1,961 @@
+﻿/*
+ * PackTool.cpp - Command-Line Pack Tools
+ *
+ * Implements the "--pack" commands. Each command is a small function that
+ * validates its arguments and reports progress on stdout and problems on
+ * stderr; all errors surface as exceptions caught in RunPackTool().
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackTool.h"
+#include "CpuDispatch.h"          // PrintKernels, RunKernelBench, LimitCpuLevel
+#include "PackBuilder.h"          // TPackBuilder, ReorderPack, CompactPack
+#include "MappedFile.h"           // TMappedFile
+#include "Metrics.h"              // WriteMetrics, RunMetricsBench
+#include "PackAnalyzer.h"         // AnalyzePack, WriteAnalysisJson
+#include "PackBench.h"            // RunPackBench
+#include "PackConvert.h"          // ConvertPack, PrintPipelineStats
+#include "DecodeScheduler.h"      // RunLatencyBench
+#include "ImageCache.h"           // RunCacheBench, RunCacheTraceBench
+#include "AccessStats.h"          // ReadAccessTrace, WriteAccessTrace
+#include "DiskImageCache.h"       // RunDiskCacheBench
+#include "MemoryPressure.h"       // RunPressureBench
+#include "PixelFormat.h"          // RunFormatBench
+#include "RemotePack.h"           // RunRemoteBench
+#include "PackPatch.h"            // WritePackPatch, ApplyPackPatch
+#include "SynthPack.h"            // WriteSynthPack
+#include "TaskPool.h"             // TTaskPool, RunPoolBench
+#include "TiledImage.h"           // RunTileBench
+
+#include <algorithm>              // std::sort
+#include <cstdlib>                // strtoul
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <thread>                 // hardware_concurrency
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#include <sys/stat.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+/*
+ * Usage Text
+ */
+static void PrintUsage()
+{
+    std::cerr << "Usage: Zip.exe --pack <command> [arguments]\n"
+                 "\n"
+                 "Commands:\n"
+                 "  build <output.zip> <folder> [level=N] [threads=N]\n"
+                 "      Pack a folder tree; large files are deflated on all cores\n"
+                 "  update <pack.zip> [folder] [remove=NAME...] [level=N] [threads=N]\n"
+                 "      Append new and changed files, rewrite only the directory\n"
+                 "  compact <pack.zip> [threshold=PCT]\n"
+                 "      Reclaim dead space left by updates once it reaches PCT% (default 25)\n"
+                 "  diff <old.zip> <new.zip> <patch> [threads=N]\n"
+                 "      Write a binary delta patch from one pack version to the next\n"
+                 "  patch <old.zip> <patch> <output.zip> [threads=N]\n"
+                 "      Rebuild the new pack from the old one and a patch\n"
+                 "  reorder <input.zip> <stats file> <output.zip>\n"
+                 "      Put the most used entries first for one-read prefetch\n"
+                 "  synth <output.zip> [key=value...]\n"
+                 "      Write a synthetic pack. Keys: entries seed sizes=fixed|uniform|lognormal\n"
+                 "      min median max content=random|text|png deflate=PCT level names=MIN-MAX\n"
+                 "      depth fanout png=rgb8|rgba8|gray8|pal4|... filter=none|sub|up|average|paeth|mixed\n"
+                 "  bench [folder=DIR] [max=ENTRIES] [threads=N] [perf] [scenario...]\n"
+                 "      Scaling sweep over synthetic packs; perf adds hardware counters. Scenarios:";
+    std::vector<std::string> scenarios = BenchScenarioNames();
+    for (size_t i = 0; i < scenarios.size(); i++)
+        std::cerr << " " << scenarios[i];
+    std::cerr << "\n"
+                 "  analyze <pack.zip | manifest.volumes> [threads=N] [repeat=N] [top=N] [out=FILE]\n"
+                 "      Per-entry inflate/decode cost profile as JSON (stdout by default)\n"
+                 "  convert <pack.zip | manifest.volumes> <folder> [threads=N] [queue=N] [writers=N]\n"
+                 "      Write every PNG entry as a BMP (others unchanged); prints stage timings\n"
+                 "  kernels [bench [perf]] [level=scalar|sse2|ssse3|sse41|avx2]\n"
+                 "      Show the SIMD kernel variants in use, or time all of them side by side\n"
+                 "  tasks [bench] [workers=N] [pin]\n"
+                 "      Show the shared task pool, or time task spawn and steal overhead\n"
+                 "  latency <pack.zip | manifest.volumes> [clicks=N]\n"
+                 "      Click-to-pixels latency, idle and under a full background decode load\n"
+                 "  cache <pack.zip | manifest.volumes> [hot=MB] [cold=MB]\n"
+                 "      Compressed size of the whole pack in the image cache, click latency per tier\n"
+                 "  cachetrace <pack.zip | manifest.volumes> <trace.txt | mixed> [hot=MB] [cold=MB]\n"
+                 "             [clicks=N] [sweeps=N] [save=trace.txt]\n"
+                 "      Replay an access trace through LRU and W-TinyLFU caches, compare hit rates\n"
+                 "  diskcache <pack.zip | manifest.volumes> <folder> [cap=MB]\n"
+                 "      Fill a persistent image cache in an emptied folder, reopen it, time reads\n"
+                 "  pressure <pack.zip | manifest.volumes> [watch=SECONDS]\n"
+                 "      Shrink and regrow an image cache through a pressure episode, then watch\n"
+                 "      the system's memory pressure\n"
+                 "  formats <pack.zip | manifest.volumes>\n"
+                 "      Compare decoding every PNG to BGRA, RGB565 and indexed 8-bit pixels\n"
+                 "  tiles <pack.zip | manifest.volumes> [name=ENTRY] [view=WxH] [cache=MB]\n"
+                 "      Pan and zoom through the largest PNG as tiles, compare a whole decode\n"
+                 "  remote <pack.zip | http://url> [latency=MS] [views=N]\n"
+                 "      Serve a pack over loopback HTTP and measure what viewing flags fetches\n"
+                 "  metrics [json] [command [arguments...]] | metrics bench\n"
+                 "      Run a command, then print the metrics registry (Prometheus text by default)\n";
+}
+//---------------------------------------------------------------------------
+
+/*
+ * List Folder
+ * Files and subfolders of `folder`, sorted by name so a build is repeatable.
+ */
+struct TFolderItem
+{
+    std::string name;
+    bool folder;
+
+    bool operator<(const TFolderItem& other) const { return name < other.name; }
+};
+
+static std::vector<TFolderItem> ListFolder(const std::string& folder)
+{
+    std::vector<TFolderItem> items;
+#ifdef _WIN32
+    std::string pattern = folder + "\\*";
+    int length = MultiByteToWideChar(CP_UTF8, 0, pattern.c_str(), -1, NULL, 0);
+    std::wstring wide(length > 0 ? length : 1, L'\0');
+    MultiByteToWideChar(CP_UTF8, 0, pattern.c_str(), -1, &wide[0], length);
+
+    WIN32_FIND_DATAW found;
+    HANDLE search = FindFirstFileW(wide.c_str(), &found);
+    if (search == INVALID_HANDLE_VALUE)
+        throw std::runtime_error("Unable to list " + folder);
+    do {
+        if (wcscmp(found.cFileName, L".") == 0 || wcscmp(found.cFileName, L"..") == 0)
+            continue;
+        TFolderItem item;
+        int size = WideCharToMultiByte(CP_UTF8, 0, found.cFileName, -1, NULL, 0, NULL, NULL);
+        item.name.assign(size > 0 ? size - 1 : 0, '\0');
+        if (size > 1)
+            WideCharToMultiByte(CP_UTF8, 0, found.cFileName, -1, &item.name[0], size, NULL, NULL);
+        item.folder = (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+        items.push_back(item);
+    } while (FindNextFileW(search, &found));
+    FindClose(search);
+#else
+    DIR* dir = opendir(folder.c_str());
+    if (dir == nullptr)
+        throw std::runtime_error("Unable to list " + folder);
+    while (dirent* found = readdir(dir)) {
+        std::string name = found->d_name;
+        if (name == "." || name == "..")
+            continue;
+        struct stat info;
+        if (stat((folder + "/" + name).c_str(), &info) != 0)
+            continue;
+        TFolderItem item;
+        item.name = name;
+        item.folder = S_ISDIR(info.st_mode);
+        items.push_back(item);
+    }
+    closedir(dir);
+#endif
+    std::sort(items.begin(), items.end());
+    return items;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Add Folder Tree
+ * Entry names use '/' and start with `prefix` (the folder's own name).
+ * Returns the number of files written (unchanged files in an update are
+ * skipped by the builder).
+ */
+static size_t AddFolderTree(TPackBuilder& builder, const std::string& folder,
+                            const std::string& prefix, int level)
+{
+    builder.AddFolder(prefix);
+
+    size_t files = 0;
+    std::vector<TFolderItem> items = ListFolder(folder);
+    for (size_t i = 0; i < items.size(); i++) {
+        std::string path = folder + "/" + items[i].name;
+        std::string name = prefix + "/" + items[i].name;
+        if (items[i].folder) {
+            files += AddFolderTree(builder, path, name, level);
+        } else {
+            TMappedFile input;
+            input.Open(path);
+            if (builder.AddFile(name, input.Data(), input.Size(), TFlagPack::MethodDeflated, level))
+                files++;
+        }
+    }
+    return files;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Folder Entry Prefix
+ * Strips trailing separators from `folder` and returns its last component.
+ */
+static std::string FolderPrefix(std::string& folder)
+{
+    while (folder.size() > 1 && (folder[folder.size() - 1] == '/' || folder[folder.size() - 1] == '\\'))
+        folder.erase(folder.size() - 1);
+    std::string::size_type slash = folder.find_last_of("/\\");
+    return slash == std::string::npos ? folder : folder.substr(slash + 1);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * build - Pack A Folder
+ */
+static int CommandBuild(const std::vector<std::string>& args)
+{
+    if (args.size() < 3) {
+        PrintUsage();
+        return 2;
+    }
+
+    int level = TDeflater::DefaultLevel;
+    unsigned threads = 0;
+    for (size_t i = 3; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 6, "level=") == 0)
+            level = static_cast<int>(strtoul(arg.c_str() + 6, nullptr, 10));
+        else if (arg.compare(0, 8, "threads=") == 0)
+            threads = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    std::string folder = args[2];
+    std::string prefix = FolderPrefix(folder);
+
+    TPackBuilder builder;
+    builder.SetThreads(threads);
+    builder.Create(args[1]);
+    size_t files = AddFolderTree(builder, folder, prefix, level);
+    builder.Finish();
+
+    std::cout << "Wrote " << args[1] << ": " << files << " files from " << folder
+              << " at level " << level << "\n";
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * update - In-Place Incremental Update
+ */
+static int CommandUpdate(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    int level = TDeflater::DefaultLevel;
+    unsigned threads = 0;
+    std::string folder;
+    std::vector<std::string> removals;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 6, "level=") == 0)
+            level = static_cast<int>(strtoul(arg.c_str() + 6, nullptr, 10));
+        else if (arg.compare(0, 8, "threads=") == 0)
+            threads = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        else if (arg.compare(0, 7, "remove=") == 0)
+            removals.push_back(arg.substr(7));
+        else if (folder.empty())
+            folder = arg;
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackBuilder builder;
+    builder.SetThreads(threads);
+    builder.OpenForUpdate(args[1]);
+
+    size_t removed = 0;
+    for (size_t i = 0; i < removals.size(); i++) {
+        if (builder.Remove(removals[i]))
+            removed++;
+        else
+            std::cerr << "Not in pack: " << removals[i] << "\n";
+    }
+    size_t files = folder.empty() ? 0 : AddFolderTree(builder, folder, FolderPrefix(folder), level);
+    builder.Finish();
+
+    uint64_t total = builder.Offset();
+    std::cout << "Updated " << args[1] << ": " << files << " files written, " << removed
+              << " removed; dead space " << builder.DeadBytes() << " of " << total << " bytes ("
+              << (total > 0 ? builder.DeadBytes() * 100 / total : 0) << "%)\n";
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * compact - Reclaim Dead Space
+ */
+static int CommandCompact(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    unsigned percent = 25;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 10, "threshold=") == 0)
+            percent = static_cast<unsigned>(strtoul(arg.c_str() + 10, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    uint64_t reclaimed = CompactPack(args[1], percent / 100.0);
+    if (reclaimed > 0)
+        std::cout << "Compacted " << args[1] << ": " << reclaimed << " bytes reclaimed\n";
+    else
+        std::cout << "Left " << args[1] << " alone: dead space below " << percent << "%\n";
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Thread Count Option
+ * Parses the optional trailing "threads=N" shared by several commands.
+ */
+static unsigned ThreadsOption(const std::vector<std::string>& args, size_t first)
+{
+    unsigned threads = 0;
+    for (size_t i = first; i < args.size(); i++) {
+        if (args[i].compare(0, 8, "threads=") == 0)
+            threads = static_cast<unsigned>(strtoul(args[i].c_str() + 8, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + args[i]);
+    }
+    return threads;
+}
+
+static void PrintPatchStats(const TPatchStats& stats)
+{
+    std::cout << "  " << stats.copied << " copied, " << stats.delta << " delta, " << stats.literal
+              << " literal; patch " << stats.patchBytes << " bytes for a " << stats.packBytes
+              << " byte pack\n";
+}
+//---------------------------------------------------------------------------
+
+/*
+ * diff - Delta Patch Between Pack Versions
+ */
+static int CommandDiff(const std::vector<std::string>& args)
+{
+    if (args.size() < 4) {
+        PrintUsage();
+        return 2;
+    }
+
+    TPatchStats stats = WritePackPatch(args[1], args[2], args[3], ThreadsOption(args, 4));
+    std::cout << "Wrote " << args[3] << "\n";
+    PrintPatchStats(stats);
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * patch - Apply A Delta Patch
+ */
+static int CommandPatch(const std::vector<std::string>& args)
+{
+    if (args.size() < 4) {
+        PrintUsage();
+        return 2;
+    }
+
+    TPatchStats stats = ApplyPackPatch(args[1], args[2], args[3], ThreadsOption(args, 4));
+    std::cout << "Wrote " << args[3] << "\n";
+    PrintPatchStats(stats);
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * reorder - Locality-Optimized Entry Order
+ */
+static int CommandReorder(const std::vector<std::string>& args)
+{
+    if (args.size() != 4) {
+        PrintUsage();
+        return 2;
+    }
+
+    TMappedFile input;
+    input.Open(args[1]);
+    TFlagPack pack;
+    pack.Open(input.Data(), input.Size());
+
+    TAccessCounts counts = TAccessStats::ReadFile(args[2]);
+    uint64_t hotBytes = ReorderPack(pack, counts, args[3]);
+
+    size_t hot = 0;
+    for (size_t i = 0; i < pack.Count(); i++) {
+        TAccessCounts::const_iterator it = counts.find(pack.Entry(i).name);
+        if (it != counts.end() && it->second > 0)
+            hot++;
+    }
+    std::cout << "Wrote " << args[3] << ": " << pack.Count() << " entries, " << hot
+              << " hot in the first " << hotBytes << " bytes\n";
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * synth - Synthetic Pack
+ */
+static int CommandSynth(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    TSynthSpec spec;
+    for (size_t i = 2; i < args.size(); i++)
+        ParseSynthOption(spec, args[i]);
+
+    TSynthResult result = WriteSynthPack(spec, args[1]);
+    std::cout << "Wrote " << args[1] << ": " << result.entries << " entries, " << result.bytes
+              << " bytes of data in " << result.archiveBytes << " bytes\n"
+              << "  " << DescribeSynthSpec(spec) << "\n";
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * bench - Scaling Sweep
+ */
+static int CommandBench(const std::vector<std::string>& args)
+{
+    TBenchOptions options;
+    for (size_t i = 1; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 7, "folder=") == 0) {
+            options.folder = arg.substr(7);
+        } else if (arg.compare(0, 4, "max=") == 0) {
+            TSynthSpec limit;
+            ParseSynthOption(limit, "entries=" + arg.substr(4));
+            options.maxEntries = limit.entries;
+        } else if (arg.compare(0, 8, "threads=") == 0) {
+            options.threads = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        } else if (arg == "perf") {
+            options.perf = true;
+        } else {
+            options.scenarios.push_back(arg);
+        }
+    }
+
+    RunPackBench(options, std::cout);
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Open Pack Argument
+ * A ".volumes" path is a manifest; anything else a single ZIP file.
+ */
+static void OpenPackArgument(TPackVolumeSet& pack, const std::string& path)
+{
+    const std::string suffix = ".volumes";
+    if (path.size() > suffix.size() && path.compare(path.size() - suffix.size(), suffix.size(), suffix) == 0)
+        pack.OpenManifest(path);
+    else if (path.compare(0, 7, "http://") == 0)
+        pack.AddVolumeUrl(path);
+    else
+        pack.AddVolumeFile(path);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * analyze - Per-Entry Cost Profile
+ */
+static int CommandAnalyze(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    TAnalyzeOptions options;
+    std::string outputPath;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 8, "threads=") == 0)
+            options.threads = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        else if (arg.compare(0, 7, "repeat=") == 0)
+            options.repeat = static_cast<unsigned>(strtoul(arg.c_str() + 7, nullptr, 10));
+        else if (arg.compare(0, 4, "top=") == 0)
+            options.top = static_cast<size_t>(strtoul(arg.c_str() + 4, nullptr, 10));
+        else if (arg.compare(0, 4, "out=") == 0)
+            outputPath = arg.substr(4);
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    std::vector<TEntryProfile> profiles = AnalyzePack(pack, options);
+
+    if (outputPath.empty()) {
+        WriteAnalysisJson(pack, args[1], profiles, options, std::cout);
+    } else {
+        std::ofstream file(outputPath.c_str(), std::ios::binary | std::ios::trunc);
+        WriteAnalysisJson(pack, args[1], profiles, options, file);
+        if (!file)
+            throw std::runtime_error("Write failed on " + outputPath);
+        std::cout << "Wrote " << outputPath << ": " << profiles.size() << " entries\n";
+    }
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * convert - Batch PNG To BMP
+ */
+static int CommandConvert(const std::vector<std::string>& args)
+{
+    if (args.size() < 3) {
+        PrintUsage();
+        return 2;
+    }
+
+    TConvertOptions options;
+    for (size_t i = 3; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 8, "threads=") == 0)
+            options.threads = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        else if (arg.compare(0, 6, "queue=") == 0)
+            options.queue = static_cast<size_t>(strtoul(arg.c_str() + 6, nullptr, 10));
+        else if (arg.compare(0, 8, "writers=") == 0)
+            options.writers = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    TConvertResult result = ConvertPack(pack, args[2], options);
+
+    for (size_t i = 0; i < result.errors.size(); i++)
+        std::cerr << "Skipped " << result.errors[i] << "\n";
+    std::cout << "Wrote " << args[2] << ": " << result.images << " images, " << result.copied
+              << " other files, " << result.bytesWritten << " bytes\n";
+    PrintPipelineStats(result.pipeline, std::cout);
+    return result.errors.empty() ? 0 : 1;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * kernels - SIMD Kernel Variants
+ * level= caps the tier before anything else runs, like ZIP_SIMD.
+ */
+static int CommandKernels(const std::vector<std::string>& args)
+{
+    bool bench = false;
+    bool perf = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        TCpuLevel level;
+        if (arg == "bench")
+            bench = true;
+        else if (arg == "perf")
+            perf = true;
+        else if (arg.compare(0, 6, "level=") == 0 && ParseCpuLevel(arg.substr(6), level))
+            LimitCpuLevel(level);
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    if (!bench) {
+        PrintKernels(std::cout);
+        return 0;
+    }
+    return RunKernelBench(std::cout, perf) ? 0 : 1;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * tasks - Shared Task Pool
+ * workers= and pin size the pool before its first use, like ZIP_THREADS
+ * and ZIP_PIN.
+ */
+static int CommandTasks(const std::vector<std::string>& args)
+{
+    bool bench = false;
+    unsigned workers = 0;
+    bool pin = false;
+    for (size_t i = 1; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg == "bench")
+            bench = true;
+        else if (arg == "pin")
+            pin = true;
+        else if (arg.compare(0, 8, "workers=") == 0)
+            workers = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+    if (workers != 0 || pin)
+        TTaskPool::ConfigureShared(workers, pin);
+
+    TTaskPool& pool = TTaskPool::Shared();
+    if (bench) {
+        RunPoolBench(pool, std::cout);
+        return 0;
+    }
+    std::cout << "Hardware threads: " << std::thread::hardware_concurrency() << "\n"
+              << "Pool workers: " << pool.Workers() << (pool.Pinned() ? " (pinned)" : "")
+              << ", runners per job: " << pool.Concurrency(0) << ", background limit: "
+              << pool.BackgroundLimit() << "\n";
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * latency - Interactive Decode Latency
+ */
+static int CommandLatency(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    unsigned clicks = 50;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 7, "clicks=") == 0)
+            clicks = static_cast<unsigned>(strtoul(arg.c_str() + 7, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    RunLatencyBench(pack, clicks, std::cout);
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * cache - Two-Tier Image Cache
+ */
+static int CommandCache(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    size_t hotMB = 32;
+    size_t coldMB = 32;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 4, "hot=") == 0)
+            hotMB = strtoul(arg.c_str() + 4, nullptr, 10);
+        else if (arg.compare(0, 5, "cold=") == 0)
+            coldMB = strtoul(arg.c_str() + 5, nullptr, 10);
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    RunCacheBench(pack, hotMB << 20, coldMB << 20, std::cout);
+    return 0;
+}
+
+/*
+ * cachetrace - Replay An Access Trace
+ * "mixed" makes a synthetic trace instead of reading one; clicks= and
+ * sweeps= shape it and save= writes it out for replaying later.
+ */
+static int CommandCacheTrace(const std::vector<std::string>& args)
+{
+    if (args.size() < 3) {
+        PrintUsage();
+        return 2;
+    }
+
+    size_t hotMB = 16;
+    size_t coldMB = 2;
+    size_t clicks = 5000;
+    size_t sweeps = 4;
+    std::string savePath;
+    for (size_t i = 3; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 4, "hot=") == 0)
+            hotMB = strtoul(arg.c_str() + 4, nullptr, 10);
+        else if (arg.compare(0, 5, "cold=") == 0)
+            coldMB = strtoul(arg.c_str() + 5, nullptr, 10);
+        else if (arg.compare(0, 7, "clicks=") == 0)
+            clicks = strtoul(arg.c_str() + 7, nullptr, 10);
+        else if (arg.compare(0, 7, "sweeps=") == 0)
+            sweeps = strtoul(arg.c_str() + 7, nullptr, 10);
+        else if (arg.compare(0, 5, "save=") == 0)
+            savePath = arg.substr(5);
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    std::vector<size_t> trace;
+    if (args[2] == "mixed") {
+        trace = MixedAccessTrace(pack, clicks, sweeps);
+    } else {
+        TAccessTrace names = ReadAccessTrace(args[2]);
+        for (size_t i = 0; i < names.size(); i++) {
+            int entry = pack.Find(names[i]);
+            if (entry < 0)
+                throw std::runtime_error("Not in the pack: " + names[i]);
+            trace.push_back(entry);
+        }
+    }
+    if (!savePath.empty()) {
+        TAccessTrace names;
+        for (size_t i = 0; i < trace.size(); i++)
+            names.push_back(pack.Entry(trace[i]).name);
+        WriteAccessTrace(savePath, names);
+    }
+    RunCacheTraceBench(pack, trace, hotMB << 20, coldMB << 20, std::cout);
+    return 0;
+}
+
+/*
+ * diskcache - Persistent Image Cache
+ */
+static int CommandDiskCache(const std::vector<std::string>& args)
+{
+    if (args.size() < 3) {
+        PrintUsage();
+        return 2;
+    }
+
+    uint64_t capMB = 1024;
+    for (size_t i = 3; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 4, "cap=") == 0)
+            capMB = strtoull(arg.c_str() + 4, nullptr, 10);
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    RunDiskCacheBench(pack, args[2], capMB << 20, std::cout);
+    return 0;
+}
+
+/*
+ * pressure - Memory Pressure Shrinking
+ */
+static int CommandPressure(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    unsigned watchSeconds = 5;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 6, "watch=") == 0)
+            watchSeconds = static_cast<unsigned>(strtoul(arg.c_str() + 6, nullptr, 10));
+        else
+            throw std::invalid_argument("Unknown option: " + arg);
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    RunPressureBench(pack, watchSeconds, std::cout);
+    return 0;
+}
+
+/*
+ * formats - Decoded Pixel Formats
+ */
+static int CommandFormats(const std::vector<std::string>& args)
+{
+    if (args.size() != 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    RunFormatBench(pack, std::cout);
+    return 0;
+}
+
+/*
+ * tiles - Tiled Pan/Zoom
+ */
+static int CommandTiles(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    std::string name;
+    unsigned viewWidth = 700;
+    unsigned viewHeight = 400;
+    uint64_t cacheMB = TTiledImage::DefaultCacheBytes >> 20;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        char* end = nullptr;
+        if (arg.compare(0, 5, "name=") == 0) {
+            name = arg.substr(5);
+        } else if (arg.compare(0, 5, "view=") == 0) {
+            viewWidth = static_cast<unsigned>(strtoul(arg.c_str() + 5, &end, 10));
+            if (*end != 'x' || viewWidth == 0)
+                throw std::invalid_argument("Bad viewport: " + arg);
+            viewHeight = static_cast<unsigned>(strtoul(end + 1, &end, 10));
+            if (*end != 0 || viewHeight == 0)
+                throw std::invalid_argument("Bad viewport: " + arg);
+        } else if (arg.compare(0, 6, "cache=") == 0) {
+            cacheMB = strtoull(arg.c_str() + 6, nullptr, 10);
+        } else {
+            throw std::invalid_argument("Unknown option: " + arg);
+        }
+    }
+
+    TPackVolumeSet pack;
+    OpenPackArgument(pack, args[1]);
+    RunTileBench(pack, name, viewWidth, viewHeight, cacheMB << 20, std::cout);
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * remote - Pack Over HTTP Range Requests
+ */
+static int CommandRemote(const std::vector<std::string>& args)
+{
+    if (args.size() < 2) {
+        PrintUsage();
+        return 2;
+    }
+
+    unsigned latencyMs = 20;
+    unsigned views = 50;
+    for (size_t i = 2; i < args.size(); i++) {
+        const std::string& arg = args[i];
+        if (arg.compare(0, 8, "latency=") == 0) {
+            latencyMs = static_cast<unsigned>(strtoul(arg.c_str() + 8, nullptr, 10));
+        } else if (arg.compare(0, 6, "views=") == 0) {
+            views = static_cast<unsigned>(strtoul(arg.c_str() + 6, nullptr, 10));
+            if (views == 0)
+                throw std::invalid_argument("Bad view count: " + arg);
+        } else {
+            throw std::invalid_argument("Unknown option: " + arg);
+        }
+    }
+
+    RunRemoteBench(args[1], latencyMs, views, std::cout);
+    return 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * metrics - Metrics Registry
+ * Wraps another command and prints what it recorded; the command's own
+ * exit code is kept.
+ */
+static int CommandMetrics(const std::vector<std::string>& args)
+{
+    if (args.size() == 2 && args[1] == "bench") {
+        RunMetricsBench(std::cout);
+        return 0;
+    }
+
+    size_t first = 1;
+    TMetricsFormat format = mfPrometheus;
+    if (args.size() > 1 && args[1] == "json") {
+        format = mfJson;
+        first = 2;
+    }
+    int result = 0;
+    if (first < args.size())
+        result = RunPackTool(std::vector<std::string>(args.begin() + first, args.end()));
+    WriteMetrics(std::cout, format);
+    return result;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Command Dispatch
+ */
+int RunPackTool(const std::vector<std::string>& args)
+{
+    if (args.empty()) {
+        PrintUsage();
+        return 2;
+    }
+
+    try {
+        if (args[0] == "build")
+            return CommandBuild(args);
+        if (args[0] == "update")
+            return CommandUpdate(args);
+        if (args[0] == "compact")
+            return CommandCompact(args);
+        if (args[0] == "diff")
+            return CommandDiff(args);
+        if (args[0] == "patch")
+            return CommandPatch(args);
+        if (args[0] == "reorder")
+            return CommandReorder(args);
+        if (args[0] == "synth")
+            return CommandSynth(args);
+        if (args[0] == "bench")
+            return CommandBench(args);
+        if (args[0] == "analyze")
+            return CommandAnalyze(args);
+        if (args[0] == "convert")
+            return CommandConvert(args);
+        if (args[0] == "kernels")
+            return CommandKernels(args);
+        if (args[0] == "tasks")
+            return CommandTasks(args);
+        if (args[0] == "latency")
+            return CommandLatency(args);
+        if (args[0] == "cache")
+            return CommandCache(args);
+        if (args[0] == "cachetrace")
+            return CommandCacheTrace(args);
+        if (args[0] == "diskcache")
+            return CommandDiskCache(args);
+        if (args[0] == "pressure")
+            return CommandPressure(args);
+        if (args[0] == "formats")
+            return CommandFormats(args);
+        if (args[0] == "tiles")
+            return CommandTiles(args);
+        if (args[0] == "remote")
+            return CommandRemote(args);
+        if (args[0] == "metrics")
+            return CommandMetrics(args);
+
+        std::cerr << "Unknown command: " << args[0] << "\n";
+        PrintUsage();
+        return 2;
+    } catch (std::exception& e) {
+        std::cerr << "Error: " << e.what() << "\n";
+        return 1;
+    }
+}
+//---------------------------------------------------------------------------
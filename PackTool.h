@@ -0,0 +1,72 @@
+﻿/*
+ * PackTool.h - Command-Line Pack Tools
+ *
+ * Declares the entry point of the pack maintenance commands. They run
+ * instead of the GUI when the executable is started as:
+ *
+ *   Zip.exe --pack <command> [arguments...]
+ *
+ * Commands:
+ *   build <output.zip> <folder> [level=N] [threads=N]
+ *       Pack a folder tree; large entries are deflated in parallel parts
+ *   update <pack.zip> [folder] [remove=NAME...] [level=N] [threads=N]
+ *       Append new and changed files in place (see TPackBuilder::OpenForUpdate)
+ *   compact <pack.zip> [threshold=PCT]
+ *       Rewrite a pack without dead space once it reaches PCT% (see CompactPack)
+ *   diff <old.zip> <new.zip> <patch> [threads=N]
+ *       Write a binary delta patch between pack versions (see PackPatch.h)
+ *   patch <old.zip> <patch> <output.zip> [threads=N]
+ *       Rebuild the new pack version from the old one and a patch
+ *   reorder <input.zip> <stats file> <output.zip>
+ *       Rewrite a pack with its most used entries first (see ReorderPack)
+ *   synth <output.zip> [key=value...]
+ *       Write a deterministic synthetic pack (options in SynthPack.h)
+ *   bench [folder=DIR] [max=N] [threads=N] [perf] [scenario...]
+ *       Run the scaling benchmark sweep (see PackBench.h)
+ *   analyze <pack.zip | manifest.volumes> [threads=N] [repeat=N] [top=N] [out=FILE]
+ *       Profile every entry and report JSON (see PackAnalyzer.h)
+ *   convert <pack.zip | manifest.volumes> <folder> [threads=N] [queue=N] [writers=N]
+ *       Decode every PNG entry to a BMP file through a staged pipeline (see PackConvert.h)
+ *   kernels [bench [perf]] [level=TIER]
+ *       List or benchmark the SIMD kernel variants (see CpuDispatch.h)
+ *   tasks [bench] [workers=N] [pin]
+ *       Show or benchmark the shared task pool (see TaskPool.h)
+ *   latency <pack.zip | manifest.volumes> [clicks=N]
+ *       Measure click latency under background load (see DecodeScheduler.h)
+ *   cache <pack.zip | manifest.volumes> [hot=MB] [cold=MB]
+ *       Measure the two-tier decoded image cache (see ImageCache.h)
+ *   cachetrace <pack.zip | manifest.volumes> <trace.txt | mixed> [hot=MB] [cold=MB] ...
+ *       Compare LRU and W-TinyLFU image caches on an access trace
+ *   diskcache <pack.zip | manifest.volumes> <folder> [cap=MB]
+ *       Measure the persistent image cache (see DiskImageCache.h)
+ *   pressure <pack.zip | manifest.volumes> [watch=SECONDS]
+ *       Shrink the image cache through a pressure episode (see MemoryPressure.h)
+ *   formats <pack.zip | manifest.volumes>
+ *       Compare BGRA, RGB565 and indexed decodes (see PixelFormat.h)
+ *   tiles <pack.zip | manifest.volumes> [name=ENTRY] [view=WxH] [cache=MB]
+ *       Pan and zoom through a large PNG as tiles (see TiledImage.h)
+ *   remote <pack.zip | http://url> [latency=MS] [views=N]
+ *       Measure what viewing flags fetches over HTTP (see RemotePack.h)
+ *   metrics [json] [command [arguments...]] | metrics bench
+ *       Run a command and print the metrics registry (see Metrics.h)
+ *
+ * Wherever a pack.zip is read, an http:// URL of one works too.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackToolH
+#define PackToolH
+//---------------------------------------------------------------------------
+
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+// Runs one pack command; arguments are UTF-8 and exclude "--pack".
+// Returns the process exit code (0 on success)
+int RunPackTool(const std::vector<std::string>& args);
+
+//---------------------------------------------------------------------------
+#endif // PackToolH
@@ -0,0 +1,287 @@
+﻿/*
+ * PackVolumes.cpp - Multi-Volume Flag Packs
+ *
+ * Implements TPackVolumeSet: manifest parsing, per-volume mapping, the
+ * unified name index, dispatch to remote volumes and device-parallel
+ * extraction.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PackVolumes.h"
+#include "TaskPool.h"             // TTaskPool::Shared for ExtractAll
+
+#include <algorithm>              // std::sort
+#include <atomic>
+#include <cctype>                 // tolower
+#include <fstream>                // Manifest reading
+#include <map>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const size_t ExtractBatch = 64;         // Remote entries prefetched together
+
+/*
+ * Add Memory Volume
+ */
+void TPackVolumeSet::AddVolume(const void* data, size_t size, const std::string& label)
+{
+    std::unique_ptr<TVolume> volume(new TVolume());
+    volume->label = label;
+    volume->pack.Open(data, size);
+    volumes.push_back(std::move(volume));
+    IndexVolume(volumes.size() - 1);
+}
+
+/*
+ * Add File Volume
+ * The file stays mapped until Close(); its pack reads straight from the view.
+ */
+void TPackVolumeSet::AddVolumeFile(const std::string& path)
+{
+    std::unique_ptr<TVolume> volume(new TVolume());
+    volume->label = path;
+    volume->device = TMappedFile::DeviceId(path);
+    volume->file.reset(new TMappedFile());
+    volume->file->Open(path);
+    volume->pack.Open(volume->file->Data(), volume->file->Size());
+    volumes.push_back(std::move(volume));
+    IndexVolume(volumes.size() - 1);
+}
+
+/*
+ * Add Remote Volume
+ * Volumes on one server count as one device, like files on one disk.
+ */
+void TPackVolumeSet::AddVolumeUrl(const std::string& url)
+{
+    std::unique_ptr<TVolume> volume(new TVolume());
+    volume->label = url;
+    volume->device = url.substr(0, url.find('/', 7));
+    volume->remote.reset(new TRemotePack(url));
+    volumes.push_back(std::move(volume));
+    IndexVolume(volumes.size() - 1);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Open Volume Manifest
+ * Relative volume paths are resolved against the manifest's folder;
+ * http:// lines are remote volumes.
+ */
+void TPackVolumeSet::OpenManifest(const std::string& manifestPath)
+{
+    std::ifstream manifest(manifestPath.c_str());
+    if (!manifest)
+        throw std::runtime_error("Unable to open volume manifest " + manifestPath);
+
+    std::string folder;
+    size_t slash = manifestPath.find_last_of("/\\");
+    if (slash != std::string::npos)
+        folder = manifestPath.substr(0, slash + 1);
+
+    std::string line;
+    while (std::getline(manifest, line)) {
+        // Trim comments and surrounding whitespace (including a CR from CRLF files)
+        size_t hash = line.find('#');
+        if (hash != std::string::npos)
+            line.erase(hash);
+        size_t first = line.find_first_not_of(" \t\r\n");
+        if (first == std::string::npos)
+            continue;
+        size_t last = line.find_last_not_of(" \t\r\n");
+        line = line.substr(first, last - first + 1);
+
+        if (line.compare(0, 7, "http://") == 0) {
+            AddVolumeUrl(line);
+            continue;
+        }
+        bool absolute = line[0] == '/' || line[0] == '\\' ||
+                        (line.size() > 1 && line[1] == ':');
+        AddVolumeFile(absolute ? line : folder + line);
+    }
+}
+
+void TPackVolumeSet::Close()
+{
+    nameIndex.clear();
+    slots.clear();
+    volumes.clear(); // Packs close before their mappings (member order)
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Index Volume Entries
+ * Appends new names to the unified index; a name that already exists is
+ * redirected to this volume so later volumes override earlier ones.
+ */
+void TPackVolumeSet::IndexVolume(size_t volume)
+{
+    const TFlagPack& pack = volumes[volume]->Directory();
+    slots.reserve(slots.size() + pack.Count());
+    nameIndex.reserve(nameIndex.size() + pack.Count());
+
+    for (size_t i = 0; i < pack.Count(); i++) {
+        TSlot slot;
+        slot.volume = static_cast<uint32_t>(volume);
+        slot.entry = static_cast<uint32_t>(i);
+
+        std::pair<std::unordered_map<std::string, size_t>::iterator, bool> added =
+            nameIndex.insert(std::make_pair(pack.Entry(i).name, slots.size()));
+        if (added.second)
+            slots.push_back(slot);
+        else
+            slots[added.first->second] = slot;
+    }
+}
+//---------------------------------------------------------------------------
+
+const TPackEntry& TPackVolumeSet::Entry(size_t entry) const
+{
+    const TSlot& slot = slots[entry];
+    return volumes[slot.volume]->Directory().Entry(slot.entry);
+}
+
+int TPackVolumeSet::Find(const std::string& name) const
+{
+    std::unordered_map<std::string, size_t>::const_iterator it = nameIndex.find(name);
+    return it == nameIndex.end() ? -1 : static_cast<int>(it->second);
+}
+
+std::unique_ptr<TByteSource> TPackVolumeSet::OpenEntry(size_t entry) const
+{
+    const TSlot& slot = slots[entry];
+    const TVolume& volume = *volumes[slot.volume];
+    if (volume.remote)
+        return volume.remote->OpenEntry(slot.entry);
+    return volume.pack.OpenEntry(slot.entry);
+}
+
+size_t TPackVolumeSet::ReadAt(size_t entry, uint64_t offset, void* dst, size_t length) const
+{
+    const TSlot& slot = slots[entry];
+    const TVolume& volume = *volumes[slot.volume];
+    if (volume.remote)
+        return volume.remote->ReadAt(slot.entry, offset, dst, length);
+    return volume.pack.ReadAt(slot.entry, offset, dst, length);
+}
+//---------------------------------------------------------------------------
+
+void TPackVolumeSet::PrefetchHot() const
+{
+    for (size_t i = 0; i < volumes.size(); i++) {
+        if (!volumes[i]->remote)
+            volumes[i]->pack.PrefetchHot();
+    }
+}
+
+void TPackVolumeSet::Prefetch(const std::vector<size_t>& entries) const
+{
+    std::map<uint32_t, std::vector<size_t> > byVolume;
+    for (size_t i = 0; i < entries.size(); i++) {
+        const TSlot& slot = slots[entries[i]];
+        if (volumes[slot.volume]->remote)
+            byVolume[slot.volume].push_back(slot.entry);
+    }
+    for (std::map<uint32_t, std::vector<size_t> >::const_iterator it = byVolume.begin();
+         it != byVolume.end(); ++it)
+        volumes[it->first]->remote->Prefetch(it->second);
+}
+
+bool TPackVolumeSet::IsRemote() const
+{
+    for (size_t i = 0; i < volumes.size(); i++) {
+        if (volumes[i]->remote)
+            return true;
+    }
+    return false;
+}
+
+TRemoteStats TPackVolumeSet::RemoteStats() const
+{
+    TRemoteStats total = TRemoteStats();
+    for (size_t i = 0; i < volumes.size(); i++) {
+        if (!volumes[i]->remote)
+            continue;
+        TRemoteStats stats = volumes[i]->remote->Stats();
+        total.archiveBytes += stats.archiveBytes;
+        total.requests += stats.requests;
+        total.bytes += stats.bytes;
+        total.blockHits += stats.blockHits;
+        total.blockMisses += stats.blockMisses;
+        total.blockWaits += stats.blockWaits;
+        total.reconnects += stats.reconnects;
+        total.cachedBlocks += stats.cachedBlocks;
+        total.cachedBytes += stats.cachedBytes;
+    }
+    return total;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Extract All Entries
+ * Entries are grouped by storage device, and each group is one runner on
+ * the shared task pool. Within a group entries are visited in archive
+ * order, so every device sees a sequential read pattern while all devices
+ * are busy at once. Memory volumes count as one device. With more devices
+ * than pool threads, runners take the next group when one is done. The
+ * first exception thrown by a runner is rethrown here after all of them
+ * have finished. Remote entries are prefetched ExtractBatch at a time.
+ */
+void TPackVolumeSet::ExtractAll(const TEntryVisitor& visit) const
+{
+    std::map<std::string, std::vector<size_t> > groups;
+    for (size_t i = 0; i < slots.size(); i++)
+        groups[volumes[slots[i].volume]->device].push_back(i);
+
+    // Overridden names leave gaps; restore (volume, archive) order
+    for (std::map<std::string, std::vector<size_t> >::iterator it = groups.begin();
+         it != groups.end(); ++it) {
+        std::sort(it->second.begin(), it->second.end(), [this](size_t a, size_t b) {
+            const TSlot& x = slots[a];
+            const TSlot& y = slots[b];
+            return x.volume != y.volume ? x.volume < y.volume : x.entry < y.entry;
+        });
+    }
+
+    std::vector<const std::vector<size_t>*> lists;
+    for (std::map<std::string, std::vector<size_t> >::const_iterator it = groups.begin();
+         it != groups.end(); ++it)
+        lists.push_back(&it->second);
+
+    std::atomic<size_t> cursor(0);
+    TTaskPool::Shared().Run(static_cast<unsigned>(lists.size()), [&](unsigned) {
+        for (size_t g = cursor.fetch_add(1); g < lists.size(); g = cursor.fetch_add(1)) {
+            const std::vector<size_t>& list = *lists[g];
+            for (size_t k = 0; k < list.size(); k++) {
+                if (k % ExtractBatch == 0 && volumes[slots[list[k]].volume]->remote) {
+                    size_t end = std::min(list.size(), k + ExtractBatch);
+                    Prefetch(std::vector<size_t>(list.begin() + k, list.begin() + end));
+                }
+                size_t entry = list[k];
+                std::unique_ptr<TByteSource> data = OpenEntry(entry);
+                visit(entry, Entry(entry), *data);
+            }
+        }
+    });
+}
+//---------------------------------------------------------------------------
+
+std::vector<size_t> PngEntries(const TPackVolumeSet& pack)
+{
+    std::vector<size_t> entries;
+    for (size_t i = 0; i < pack.Count(); i++) {
+        const std::string& name = pack.Entry(i).name;
+        if (name.size() < 4)
+            continue;
+        std::string tail = name.substr(name.size() - 4);
+        for (size_t k = 0; k < tail.size(); k++)
+            tail[k] = static_cast<char>(tolower(static_cast<unsigned char>(tail[k])));
+        if (tail == ".png")
+            entries.push_back(i);
+    }
+    return entries;
+}
+//---------------------------------------------------------------------------
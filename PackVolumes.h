@@ -0,0 +1,130 @@
+﻿/*
+ * PackVolumes.h - Multi-Volume Flag Packs
+ *
+ * Declares TPackVolumeSet, which presents one or more ZIP volumes as a
+ * single pack with a unified entry index. Volumes come from memory (the
+ * embedded resource), from files listed in a volume manifest, or from a
+ * web server (RemotePack.h); each file volume is memory-mapped on its own.
+ *
+ * Manifest format (UTF-8 text, one volume per line, paths relative to the
+ * manifest's folder, '#' starts a comment):
+ *
+ *   # flags.volumes
+ *   flags.001.zip
+ *   flags.002.zip
+ *   http://flags.example.org/packs/flags.003.zip
+ *
+ * Every volume is a complete ZIP archive, so standard tools can open any
+ * of them. When a name appears in several volumes the last one wins.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PackVolumesH
+#define PackVolumesH
+//---------------------------------------------------------------------------
+
+#include "FlagPack.h"             // TFlagPack, TPackEntry
+#include "MappedFile.h"           // TMappedFile
+#include "RemotePack.h"           // TRemotePack, TRemoteStats
+
+#include <functional>             // std::function
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPackVolumeSet - Unified Index Over Several ZIP Volumes
+ *
+ * Entry ids are dense indices over all volumes, so lookups and reads cost
+ * the same as with a single TFlagPack.
+ */
+class TPackVolumeSet
+{
+  public:
+    // Called for every entry by ExtractAll(); invoked concurrently from
+    // one worker thread per storage device
+    typedef std::function<void(size_t entry, const TPackEntry& info, TByteSource& data)>
+        TEntryVisitor;
+
+    TPackVolumeSet() {}
+
+    // Adds a volume backed by caller-owned memory (e.g. the resource)
+    void AddVolume(const void* data, size_t size, const std::string& label);
+
+    // Maps a ZIP file and adds it as a volume
+    void AddVolumeFile(const std::string& path);
+
+    // Opens an http:// URL as a volume read through range requests
+    void AddVolumeUrl(const std::string& url);
+
+    // Adds every volume listed in a manifest file
+    void OpenManifest(const std::string& manifestPath);
+
+    void Close();
+
+    size_t VolumeCount() const { return volumes.size(); }
+    size_t Count() const { return slots.size(); }
+    const TPackEntry& Entry(size_t entry) const;
+    size_t VolumeOf(size_t entry) const { return slots[entry].volume; }
+    int Find(const std::string& name) const;
+
+    // Same contracts as the TFlagPack methods of the same name
+    std::unique_ptr<TByteSource> OpenEntry(size_t entry) const;
+    size_t ReadAt(size_t entry, uint64_t offset, void* dst, size_t length) const;
+
+    // Prefetches the hot region of every volume (see TFlagPack::PrefetchHot).
+    // Remote volumes are left alone: only the flags viewed are fetched
+    void PrefetchHot() const;
+
+    // Fetches the given entries of remote volumes ahead of reading them,
+    // in parallel (see TRemotePack::Prefetch); a no-op for local ones
+    void Prefetch(const std::vector<size_t>& entries) const;
+
+    bool IsRemote() const;
+
+    // Traffic of all remote volumes together
+    TRemoteStats RemoteStats() const;
+
+    // Streams every entry through `visit`. Volumes on different storage
+    // devices are read in parallel; volumes on one device are read in turn
+    void ExtractAll(const TEntryVisitor& visit) const;
+
+  private:
+    TPackVolumeSet(const TPackVolumeSet&);
+    TPackVolumeSet& operator=(const TPackVolumeSet&);
+
+    struct TVolume
+    {
+        std::string label;          // File path or caller supplied label
+        std::string device;         // TMappedFile::DeviceId(), "" for memory, host for URLs
+        std::unique_ptr<TMappedFile> file;
+        TFlagPack pack;
+        std::unique_ptr<TRemotePack> remote;    // Instead of `pack` for URLs
+
+        const TFlagPack& Directory() const { return remote ? remote->Directory() : pack; }
+    };
+
+    struct TSlot
+    {
+        uint32_t volume;
+        uint32_t entry;             // Index inside the volume's pack
+    };
+
+    std::vector<std::unique_ptr<TVolume> > volumes;
+    std::vector<TSlot> slots;
+    std::unordered_map<std::string, size_t> nameIndex;
+
+    void IndexVolume(size_t volume);
+};
+
+//---------------------------------------------------------------------------
+
+// Ids of the entries of `pack` named *.png (any case), in id order
+std::vector<size_t> PngEntries(const TPackVolumeSet& pack);
+
+//---------------------------------------------------------------------------
+#endif // PackVolumesH
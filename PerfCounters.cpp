@@ -0,0 +1,212 @@
+﻿/*
+ * PerfCounters.cpp - Hardware Performance Counters For Benchmarks
+ *
+ * perf_event_open on Linux; an always-unavailable stub everywhere else.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PerfCounters.h"
+
+#include <iomanip>
+
+#ifdef __linux__
+#include <cerrno>
+#include <cstring>                // memset, strerror
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const char* const EventNames[PerfEventCount] = {
+    "cycles", "instructions", "L1D misses", "LLC misses", "branch misses"};
+
+const char* PerfEventName(TPerfEvent event)
+{
+    return EventNames[event];
+}
+
+TPerfSample::TPerfSample()
+{
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        counts[i] = 0;
+        valid[i] = false;
+    }
+}
+//---------------------------------------------------------------------------
+
+#ifdef __linux__
+/*
+ * Event Encoding
+ * L1D misses are read misses of the data cache; "LLC misses" is the
+ * generic cache-miss event, which the kernel maps to last-level misses.
+ */
+static void DescribeEvent(TPerfEvent event, perf_event_attr& attr)
+{
+    attr.type = PERF_TYPE_HARDWARE;
+    switch (event) {
+    case peCycles:
+        attr.config = PERF_COUNT_HW_CPU_CYCLES;
+        break;
+    case peInstructions:
+        attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+        break;
+    case peL1Misses:
+        attr.type = PERF_TYPE_HW_CACHE;
+        attr.config = PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                      (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+        break;
+    case peLlcMisses:
+        attr.config = PERF_COUNT_HW_CACHE_MISSES;
+        break;
+    case peBranchMisses:
+        attr.config = PERF_COUNT_HW_BRANCH_MISSES;
+        break;
+    }
+}
+
+TPerfCounters::TPerfCounters()
+{
+    int firstError = 0;
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        DescribeEvent(static_cast<TPerfEvent>(i), attr);
+        attr.disabled = 1;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+        fds[i] = static_cast<int>(syscall(__NR_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC));
+        if (fds[i] < 0 && firstError == 0)
+            firstError = errno;
+    }
+    if (!Available()) {
+        error = std::string("perf_event_open: ") + strerror(firstError);
+        if (firstError == ENOENT)
+            error += " (no hardware counters, e.g. in a virtual machine)";
+        else if (firstError == EACCES || firstError == EPERM)
+            error += " (check /proc/sys/kernel/perf_event_paranoid)";
+    }
+}
+
+TPerfCounters::~TPerfCounters()
+{
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+}
+
+void TPerfCounters::Start()
+{
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        if (fds[i] >= 0) {
+            ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+}
+
+/*
+ * Read Counts
+ * An event that never got a hardware counter (running time 0) is not
+ * valid; one that only had it part of the time is scaled to the whole.
+ */
+TPerfSample TPerfCounters::Stop()
+{
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        if (fds[i] >= 0)
+            ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+
+    TPerfSample sample;
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        uint64_t data[3];           // value, time enabled, time running
+        if (fds[i] < 0 || read(fds[i], data, sizeof(data)) != static_cast<ssize_t>(sizeof(data)) ||
+            data[2] == 0)
+            continue;
+        sample.counts[i] = data[2] < data[1]
+            ? static_cast<uint64_t>(static_cast<double>(data[0]) * data[1] / data[2])
+            : data[0];
+        sample.valid[i] = true;
+    }
+    return sample;
+}
+#else
+TPerfCounters::TPerfCounters() : error("Hardware counters need Linux perf_event_open")
+{
+    for (unsigned i = 0; i < PerfEventCount; i++)
+        fds[i] = -1;
+}
+
+TPerfCounters::~TPerfCounters()
+{
+}
+
+void TPerfCounters::Start()
+{
+}
+
+TPerfSample TPerfCounters::Stop()
+{
+    return TPerfSample();
+}
+#endif
+
+bool TPerfCounters::Available() const
+{
+    for (unsigned i = 0; i < PerfEventCount; i++) {
+        if (fds[i] >= 0)
+            return true;
+    }
+    return false;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Report Columns
+ */
+void WritePerfHeader(std::ostream& out, const std::string& unit)
+{
+    out << std::setw(9) << ("cyc/" + unit) << std::setw(9) << ("ins/" + unit) << std::setw(6) << "IPC"
+        << std::setw(10) << ("L1/k" + unit) << std::setw(10) << ("LLC/k" + unit)
+        << std::setw(10) << ("br/k" + unit);
+}
+
+void WritePerfColumns(std::ostream& out, const TPerfSample& sample, double units)
+{
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::fixed;
+
+    static const TPerfEvent PerUnit[] = {peCycles, peInstructions};
+    for (unsigned i = 0; i < 2; i++) {
+        if (sample.Has(PerUnit[i]) && units > 0)
+            out << std::setprecision(2) << std::setw(9) << sample.Count(PerUnit[i]) / units;
+        else
+            out << std::setw(9) << "-";
+    }
+    if (sample.Has(peCycles) && sample.Has(peInstructions) && sample.Count(peCycles) > 0)
+        out << std::setprecision(2) << std::setw(6)
+            << static_cast<double>(sample.Count(peInstructions)) / sample.Count(peCycles);
+    else
+        out << std::setw(6) << "-";
+
+    static const TPerfEvent PerThousand[] = {peL1Misses, peLlcMisses, peBranchMisses};
+    for (unsigned i = 0; i < 3; i++) {
+        if (sample.Has(PerThousand[i]) && units > 0)
+            out << std::setprecision(3) << std::setw(10) << sample.Count(PerThousand[i]) * 1000.0 / units;
+        else
+            out << std::setw(10) << "-";
+    }
+
+    out.flags(flags);
+    out.precision(precision);
+}
+//---------------------------------------------------------------------------
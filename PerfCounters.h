@@ -0,0 +1,87 @@
+﻿/*
+ * PerfCounters.h - Hardware Performance Counters For Benchmarks
+ *
+ * Declares a small wrapper around Linux perf_event_open for the benchmark
+ * commands. Wall-clock throughput says how fast a kernel is; the counters
+ * say why: cycles and instructions per byte (and their ratio, IPC) show
+ * how much work each byte costs, and L1/LLC misses and branch mispredicts
+ * per byte show whether that work waits on memory or on the front end.
+ * A memory-bound kernel has low IPC and many misses per byte; a layout
+ * change that helps it shows up as fewer misses, not just as a faster run.
+ *
+ * Counters follow the calling thread only and count user space only, so
+ * they work with the default perf_event_paranoid setting and measure the
+ * single-threaded benchmark phases exactly. Each event is opened on its
+ * own; one the CPU or the hypervisor does not expose is reported as
+ * missing while the others still count. Elsewhere than on Linux nothing
+ * is available and the benchmarks print their usual columns only.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PerfCountersH
+#define PerfCountersH
+//---------------------------------------------------------------------------
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+
+//---------------------------------------------------------------------------
+
+enum TPerfEvent { peCycles, peInstructions, peL1Misses, peLlcMisses, peBranchMisses };
+const unsigned PerfEventCount = 5;
+
+const char* PerfEventName(TPerfEvent event);
+
+/*
+ * TPerfSample - Counts Of One Measured Interval
+ * Counts are scaled up when the kernel had to multiplex the counters.
+ */
+struct TPerfSample
+{
+    uint64_t counts[PerfEventCount];
+    bool valid[PerfEventCount];     // False if the event was not counted
+
+    TPerfSample();
+
+    bool Has(TPerfEvent event) const { return valid[event]; }
+    uint64_t Count(TPerfEvent event) const { return counts[event]; }
+};
+
+/*
+ * TPerfCounters - Event Set Of The Calling Thread
+ * Construct, Start() and Stop() on the thread being measured.
+ */
+class TPerfCounters
+{
+  public:
+    TPerfCounters();
+    ~TPerfCounters();
+
+    // True if at least one event could be opened
+    bool Available() const;
+    // Why nothing is available, for the benchmark header
+    const std::string& Error() const { return error; }
+
+    void Start();
+    TPerfSample Stop();
+
+  private:
+    int fds[PerfEventCount];
+    std::string error;
+
+    TPerfCounters(const TPerfCounters&);
+    TPerfCounters& operator=(const TPerfCounters&);
+};
+
+/*
+ * Report Columns
+ * Cycles and instructions per unit, IPC, and misses per 1000 units (per
+ * unit they would mostly print as zero). "-" marks a missing event.
+ */
+void WritePerfHeader(std::ostream& out, const std::string& unit);
+void WritePerfColumns(std::ostream& out, const TPerfSample& sample, double units);
+
+//---------------------------------------------------------------------------
+#endif // PerfCountersH
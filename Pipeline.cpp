@@ -0,0 +1,254 @@
+﻿/*
+ * Pipeline.cpp - Staged Bulk Processing With Backpressure
+ *
+ * Implements the queue bookkeeping, stage completion, the runner loop that
+ * drives a pipeline on the shared task pool, and the stage report.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "Pipeline.h"
+#include "TaskPool.h"             // TTaskPool::Shared
+
+#include <algorithm>
+#include <iomanip>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const unsigned IdleSpins = 64;          // Empty scans before a runner naps
+static const std::chrono::microseconds IdleNap(50);
+//---------------------------------------------------------------------------
+
+/*
+ * Queue Bookkeeping
+ * The capacity is rounded up to a power of two for the ring index.
+ */
+TPipeQueueBase::TPipeQueueBase(size_t requested)
+    : capacity(2), enqueuePos(0), dequeuePos(0), freeSlots(0), maxDepth(0), depthSum(0), pushes(0)
+{
+    while (capacity < requested)
+        capacity *= 2;
+    mask = capacity - 1;
+    freeSlots.store(static_cast<ptrdiff_t>(capacity));
+}
+
+// Dequeue first: the enqueue position read after it can only be larger
+size_t TPipeQueueBase::Size() const
+{
+    size_t head = dequeuePos.load(std::memory_order_seq_cst);
+    size_t tail = enqueuePos.load(std::memory_order_seq_cst);
+    return tail - head;
+}
+
+bool TPipeQueueBase::TryReserve()
+{
+    ptrdiff_t free = freeSlots.load(std::memory_order_relaxed);
+    while (free > 0) {
+        if (freeSlots.compare_exchange_weak(free, free - 1, std::memory_order_acq_rel))
+            return true;
+    }
+    return false;
+}
+
+void TPipeQueueBase::RecordDepth()
+{
+    size_t depth = Size();
+    size_t seen = maxDepth.load(std::memory_order_relaxed);
+    while (depth > seen && !maxDepth.compare_exchange_weak(seen, depth, std::memory_order_relaxed)) {
+    }
+    depthSum.fetch_add(depth, std::memory_order_relaxed);
+    pushes.fetch_add(1, std::memory_order_relaxed);
+}
+
+double TPipeQueueBase::MeanDepth() const
+{
+    uint64_t count = pushes.load(std::memory_order_relaxed);
+    return count == 0 ? 0 : static_cast<double>(depthSum.load(std::memory_order_relaxed)) / count;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Stage Bookkeeping
+ */
+TPipelineStage::TPipelineStage(const char* name, unsigned parallelism, TPipelineStage* upstream,
+                               TPipeQueueBase* input)
+    : name(name), parallelism(parallelism), upstream(upstream), input(input), active(0),
+      exhausted(false), finished(false), items(0), busyNs(0), fullWaits(0)
+{
+}
+
+// Takes one of the stage's slots; false if all are in use
+bool TPipelineStage::Claim()
+{
+    unsigned count = active.load(std::memory_order_relaxed);
+    do {
+        if (parallelism != 0 && count >= parallelism)
+            return false;
+    } while (!active.compare_exchange_weak(count, count + 1, std::memory_order_seq_cst));
+    return true;
+}
+
+void TPipelineStage::Account(TClock::time_point start)
+{
+    uint64_t ns = static_cast<uint64_t>(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(TClock::now() - start).count());
+    busyNs.fetch_add(ns, std::memory_order_relaxed);
+    items.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Stage Completion
+ * A stage is done when the one before it is done, its input queue is empty
+ * and nothing is in progress. The order of the checks matters: a thread
+ * raises `active` before it pops, and pushes before it lowers `active`,
+ * so an item is always visible in one of the places looked at.
+ */
+bool TPipelineStage::Finished()
+{
+    if (finished.load(std::memory_order_acquire))
+        return true;
+
+    bool done;
+    if (upstream == nullptr)
+        done = exhausted.load(std::memory_order_seq_cst) && active.load(std::memory_order_seq_cst) == 0;
+    else
+        done = upstream->Finished() && input->Size() == 0 && active.load(std::memory_order_seq_cst) == 0;
+    if (done)
+        finished.store(true, std::memory_order_release);
+    return done;
+}
+
+TStageStats TPipelineStage::Stats(double wallMs, unsigned runners) const
+{
+    TStageStats stats;
+    stats.name = name;
+    stats.parallelism = parallelism == 0 ? runners : std::min(parallelism, runners);
+    stats.items = items.load();
+    stats.busyMs = busyNs.load() / 1e6;
+    stats.utilization = wallMs > 0 ? stats.busyMs / (wallMs * stats.parallelism) : 0;
+    stats.queueCapacity = input != nullptr ? input->Capacity() : 0;
+    stats.maxDepth = input != nullptr ? input->MaxDepth() : 0;
+    stats.meanDepth = input != nullptr ? input->MeanDepth() : 0;
+    stats.fullWaits = fullWaits.load();
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Pipeline Assembly
+ */
+TPipeline::TPipeline(size_t queueCapacity)
+    : queueCapacity(std::max<size_t>(queueCapacity, 1)), sealed(false), failed(false)
+{
+}
+
+TPipeline::~TPipeline()
+{
+}
+
+// Takes ownership of `stage` and of its output queue (none for a sink)
+void TPipeline::Add(TPipelineStage* stage, TPipeQueueBase* output)
+{
+    std::unique_ptr<TPipelineStage> ownedStage(stage);
+    std::unique_ptr<TPipeQueueBase> ownedOutput(output);
+    if (sealed)
+        throw std::logic_error("Pipeline already ends in a sink");
+
+    stages.push_back(std::move(ownedStage));
+    if (output != nullptr)
+        queues.push_back(std::move(ownedOutput));
+    else
+        sealed = true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Runner Loop
+ * Scans from the sink back to the source and runs the first stage that
+ * can make progress, so queues drain before new work is let in.
+ */
+void TPipeline::Drive()
+{
+    unsigned idle = 0;
+    while (!failed.load(std::memory_order_relaxed)) {
+        bool worked = false;
+        for (size_t s = stages.size(); s-- > 0;) {
+            if (stages[s]->TryRun()) {
+                worked = true;
+                break;
+            }
+        }
+        if (worked) {
+            idle = 0;
+            continue;
+        }
+        if (stages.back()->Finished())
+            break;
+        if (++idle < IdleSpins)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(IdleNap);
+    }
+}
+
+TPipelineStats TPipeline::Run(unsigned threads)
+{
+    if (!sealed)
+        throw std::logic_error("Pipeline has no sink");
+
+    TTaskPool& pool = TTaskPool::Shared();
+    TPipelineStats stats;
+    stats.runners = pool.Concurrency(threads);
+
+    TClock::time_point start = TClock::now();
+    pool.Run(stats.runners, [this](unsigned) {
+        try {
+            Drive();
+        } catch (...) {
+            failed.store(true);
+            throw;
+        }
+    });
+    stats.wallMs = std::chrono::duration<double, std::milli>(TClock::now() - start).count();
+
+    for (size_t s = 0; s < stages.size(); s++)
+        stats.stages.push_back(stages[s]->Stats(stats.wallMs, stats.runners));
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Stage Report
+ */
+void PrintPipelineStats(const TPipelineStats& stats, std::ostream& out)
+{
+    size_t busiest = 0;
+    for (size_t s = 1; s < stats.stages.size(); s++) {
+        if (stats.stages[s].utilization > stats.stages[busiest].utilization)
+            busiest = s;
+    }
+
+    out << std::fixed << std::setprecision(1) << "Pipeline: " << stats.wallMs << " ms on "
+        << stats.runners << " runners\n"
+        << std::left << std::setw(10) << "stage" << std::right << std::setw(5) << "par"
+        << std::setw(10) << "items" << std::setw(11) << "busy ms" << std::setw(7) << "util"
+        << std::setw(7) << "queue" << std::setw(6) << "max" << std::setw(7) << "mean"
+        << std::setw(10) << "full" << "\n";
+    for (size_t s = 0; s < stats.stages.size(); s++) {
+        const TStageStats& stage = stats.stages[s];
+        out << std::left << std::setw(10) << stage.name << std::right << std::setw(5)
+            << stage.parallelism << std::setw(10) << stage.items << std::setw(11)
+            << stage.busyMs << std::setw(6) << stage.utilization * 100 << "%";
+        if (stage.queueCapacity > 0)
+            out << std::setw(7) << stage.queueCapacity << std::setw(6) << stage.maxDepth
+                << std::setw(7) << stage.meanDepth;
+        else
+            out << std::setw(7) << "-" << std::setw(6) << "-" << std::setw(7) << "-";
+        out << std::setw(10) << stage.fullWaits << (s == busiest ? "  <- bottleneck" : "") << "\n";
+    }
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,447 @@
+﻿/*
+ * Pipeline.h - Staged Bulk Processing With Backpressure
+ *
+ * Declares a small framework for bulk jobs that are naturally a chain of
+ * stages, such as read -> inflate -> decode -> transform -> write. Each
+ * stage is a typed function from the item type of the stage before it to
+ * its own; stages are joined by bounded lock-free queues, and each stage
+ * may run on up to a given number of threads at once.
+ *
+ * Every runner of the shared task pool drives the whole chain: it runs the
+ * furthest downstream stage that has input, room in its output queue and a
+ * free slot. A stage whose output queue is full is not run, which is the
+ * backpressure: the slowest stage sets the pace, and no more than the queue
+ * capacities plus one item per runner is ever in flight, so memory stays
+ * bounded however large the job. Runners never block on a queue, so a
+ * pipeline cannot deadlock the pool whatever its shape.
+ *
+ *   TPipeline pipeline;
+ *   pipeline.Source<size_t>("list", [&](size_t& entry) { ... return more; })
+ *           .Then<TRaw>("inflate", 0, [&](size_t& entry) { ... })
+ *           .Sink("write", 1, [&](TRaw& raw) { ... });
+ *   TPipelineStats stats = pipeline.Run();
+ *
+ * Run() reports per-stage item counts, busy time, utilisation and queue
+ * depths; the stage with the highest utilisation is the bottleneck.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PipelineH
+#define PipelineH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TStageStats - One Stage After A Run
+ */
+struct TStageStats
+{
+    std::string name;
+    unsigned parallelism;           // Slots the stage could use
+    uint64_t items;
+    double busyMs;                  // Summed over all threads
+    double utilization;             // busyMs / (wall time x slots)
+    size_t queueCapacity;           // Input queue; 0 for the source
+    size_t maxDepth;
+    double meanDepth;               // Input queue depth after each push
+    uint64_t fullWaits;             // Times input was ready but the output queue full
+};
+
+struct TPipelineStats
+{
+    double wallMs;
+    unsigned runners;
+    std::vector<TStageStats> stages;
+};
+
+// One line per stage, the busiest one marked as the bottleneck
+void PrintPipelineStats(const TPipelineStats& stats, std::ostream& out);
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPipeQueueBase - Type-Independent Queue State
+ *
+ * Producers reserve a slot before they start on an item, so the push that
+ * follows always finds room; the count of free slots is the backpressure
+ * signal. Depth statistics are kept here for the report.
+ */
+class TPipeQueueBase
+{
+  public:
+    explicit TPipeQueueBase(size_t capacity);
+    virtual ~TPipeQueueBase() {}
+
+    size_t Capacity() const { return capacity; }
+    size_t Size() const;
+
+    bool TryReserve();
+    void Unreserve() { freeSlots.fetch_add(1, std::memory_order_acq_rel); }
+
+    size_t MaxDepth() const { return maxDepth.load(std::memory_order_relaxed); }
+    double MeanDepth() const;
+
+  protected:
+    size_t capacity;
+    size_t mask;
+    alignas(64) std::atomic<size_t> enqueuePos;
+    alignas(64) std::atomic<size_t> dequeuePos;
+    alignas(64) std::atomic<ptrdiff_t> freeSlots;
+    std::atomic<size_t> maxDepth;
+    std::atomic<uint64_t> depthSum;
+    std::atomic<uint64_t> pushes;
+
+    void RecordDepth();
+
+  private:
+    TPipeQueueBase(const TPipeQueueBase&);
+    TPipeQueueBase& operator=(const TPipeQueueBase&);
+};
+
+/*
+ * TPipeQueue - Bounded Lock-Free MPMC Queue
+ * Dmitry Vyukov's ring: every cell carries a sequence number that tells
+ * producers and consumers whose turn it is, so each side needs one CAS.
+ */
+template <typename T>
+class TPipeQueue : public TPipeQueueBase
+{
+  public:
+    explicit TPipeQueue(size_t capacity) : TPipeQueueBase(capacity), cells(new TCell[this->capacity])
+    {
+        for (size_t i = 0; i < this->capacity; i++)
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+    }
+
+    // Needs a slot from TryReserve(). A consumer that has claimed the cell
+    // but not yet released it can make the ring look full for a moment
+    void Push(T&& value)
+    {
+        while (!TryPush(value))
+            std::this_thread::yield();
+        RecordDepth();
+    }
+
+    bool TryPop(T& value)
+    {
+        size_t pos = dequeuePos.load(std::memory_order_relaxed);
+        TCell* cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos + 1);
+            if (diff == 0) {
+                if (dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(cell->value);
+        cell->value = T();
+        cell->sequence.store(pos + mask + 1, std::memory_order_release);
+        Unreserve();
+        return true;
+    }
+
+  private:
+    struct TCell
+    {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+
+    std::unique_ptr<TCell[]> cells;
+
+    bool TryPush(T& value)
+    {
+        size_t pos = enqueuePos.load(std::memory_order_relaxed);
+        TCell* cell;
+        for (;;) {
+            cell = &cells[pos & mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = static_cast<intptr_t>(sequence) - static_cast<intptr_t>(pos);
+            if (diff == 0) {
+                if (enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                    break;
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+        cell->value = std::move(value);
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPipelineStage - Type-Independent Stage
+ */
+class TPipelineStage
+{
+  public:
+    virtual ~TPipelineStage() {}
+
+    // Processes one item if the stage is runnable; false if it was not
+    virtual bool TryRun() = 0;
+
+    // True once no item will ever pass through this stage again
+    bool Finished();
+
+    TStageStats Stats(double wallMs, unsigned runners) const;
+
+  protected:
+    TPipelineStage(const char* name, unsigned parallelism, TPipelineStage* upstream,
+                   TPipeQueueBase* input);
+
+    typedef std::chrono::steady_clock TClock;
+
+    std::string name;
+    unsigned parallelism;           // 0 = no limit
+    TPipelineStage* upstream;
+    TPipeQueueBase* input;
+    std::atomic<unsigned> active;
+    std::atomic<bool> exhausted;    // Source only: produce() returned false
+    std::atomic<bool> finished;
+    std::atomic<uint64_t> items;
+    std::atomic<uint64_t> busyNs;
+    std::atomic<uint64_t> fullWaits;
+
+    bool Claim();
+    void Release() { active.fetch_sub(1, std::memory_order_seq_cst); }
+    void Account(TClock::time_point start);
+
+  private:
+    TPipelineStage(const TPipelineStage&);
+    TPipelineStage& operator=(const TPipelineStage&);
+};
+
+template <typename T> class TPipe;
+
+/*
+ * TPipeline - A Chain Of Stages
+ * Built front to back with Source(), TPipe::Then() and TPipe::Sink(), then
+ * run once. The first exception thrown by a stage stops all runners and is
+ * rethrown by Run(); items still queued are dropped.
+ */
+class TPipeline
+{
+  public:
+    explicit TPipeline(size_t queueCapacity = 16);
+    ~TPipeline();
+
+    // produce() fills in the next item and returns true, or returns false
+    // at the end. It is never called concurrently
+    template <typename Out>
+    TPipe<Out> Source(const char* name, std::function<bool(Out&)> produce);
+
+    // Drives the chain on up to `threads` runners of the shared task pool
+    // (0 = all of it) until the sink has taken the last item
+    TPipelineStats Run(unsigned threads = 0);
+
+  private:
+    template <typename T> friend class TPipe;
+
+    size_t queueCapacity;
+    std::vector<std::unique_ptr<TPipeQueueBase> > queues;
+    std::vector<std::unique_ptr<TPipelineStage> > stages;
+    bool sealed;                    // A sink ends the chain
+    std::atomic<bool> failed;
+
+    void Add(TPipelineStage* stage, TPipeQueueBase* output);
+    void Drive();
+
+    TPipeline(const TPipeline&);
+    TPipeline& operator=(const TPipeline&);
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * Stage Implementations
+ */
+template <typename Out>
+class TSourceStage : public TPipelineStage
+{
+  public:
+    TSourceStage(const char* name, std::function<bool(Out&)> produce, TPipeQueue<Out>* output)
+        : TPipelineStage(name, 1, nullptr, nullptr), produce(produce), output(output) {}
+
+    bool TryRun() override
+    {
+        if (exhausted.load(std::memory_order_acquire) || !Claim())
+            return false;
+        if (exhausted.load(std::memory_order_acquire)) {
+            Release();
+            return false;
+        }
+        if (!output->TryReserve()) {
+            fullWaits.fetch_add(1, std::memory_order_relaxed);
+            Release();
+            return false;
+        }
+        try {
+            TClock::time_point start = TClock::now();
+            Out item = Out();
+            if (produce(item)) {
+                output->Push(std::move(item));
+                Account(start);
+            } else {
+                output->Unreserve();
+                exhausted.store(true, std::memory_order_seq_cst);
+            }
+        } catch (...) {
+            output->Unreserve();
+            Release();
+            throw;
+        }
+        Release();
+        return true;
+    }
+
+  private:
+    std::function<bool(Out&)> produce;
+    TPipeQueue<Out>* output;
+};
+
+template <typename In, typename Out>
+class TTransformStage : public TPipelineStage
+{
+  public:
+    TTransformStage(const char* name, unsigned parallelism, TPipelineStage* upstream,
+                    TPipeQueue<In>* input, std::function<Out(In&)> fn, TPipeQueue<Out>* output)
+        : TPipelineStage(name, parallelism, upstream, input), fn(fn), in(input), output(output) {}
+
+    bool TryRun() override
+    {
+        if (in->Size() == 0 || !Claim())
+            return false;
+        if (!output->TryReserve()) {
+            fullWaits.fetch_add(1, std::memory_order_relaxed);
+            Release();
+            return false;
+        }
+        In item;
+        if (!in->TryPop(item)) {
+            output->Unreserve();
+            Release();
+            return false;
+        }
+        try {
+            TClock::time_point start = TClock::now();
+            output->Push(fn(item));
+            Account(start);
+        } catch (...) {
+            output->Unreserve();
+            Release();
+            throw;
+        }
+        Release();
+        return true;
+    }
+
+  private:
+    std::function<Out(In&)> fn;
+    TPipeQueue<In>* in;
+    TPipeQueue<Out>* output;
+};
+
+template <typename In>
+class TSinkStage : public TPipelineStage
+{
+  public:
+    TSinkStage(const char* name, unsigned parallelism, TPipelineStage* upstream,
+               TPipeQueue<In>* input, std::function<void(In&)> fn)
+        : TPipelineStage(name, parallelism, upstream, input), fn(fn), in(input) {}
+
+    bool TryRun() override
+    {
+        if (in->Size() == 0 || !Claim())
+            return false;
+        In item;
+        if (!in->TryPop(item)) {
+            Release();
+            return false;
+        }
+        try {
+            TClock::time_point start = TClock::now();
+            fn(item);
+            Account(start);
+        } catch (...) {
+            Release();
+            throw;
+        }
+        Release();
+        return true;
+    }
+
+  private:
+    std::function<void(In&)> fn;
+    TPipeQueue<In>* in;
+};
+
+/*
+ * TPipe - Output End Of The Last Stage Added
+ * Parallelism 0 lets a stage run on every runner at once.
+ */
+template <typename T>
+class TPipe
+{
+  public:
+    TPipe(TPipeline* pipeline, TPipelineStage* stage, TPipeQueue<T>* output)
+        : pipeline(pipeline), stage(stage), output(output) {}
+
+    template <typename Out>
+    TPipe<Out> Then(const char* name, unsigned parallelism, std::function<Out(T&)> fn)
+    {
+        TPipeQueue<Out>* next = new TPipeQueue<Out>(pipeline->queueCapacity);
+        TTransformStage<T, Out>* added = new TTransformStage<T, Out>(name, parallelism, stage,
+                                                                     output, fn, next);
+        pipeline->Add(added, next);
+        return TPipe<Out>(pipeline, added, next);
+    }
+
+    void Sink(const char* name, unsigned parallelism, std::function<void(T&)> fn)
+    {
+        pipeline->Add(new TSinkStage<T>(name, parallelism, stage, output, fn), nullptr);
+    }
+
+  private:
+    TPipeline* pipeline;
+    TPipelineStage* stage;
+    TPipeQueue<T>* output;
+};
+
+template <typename Out>
+TPipe<Out> TPipeline::Source(const char* name, std::function<bool(Out&)> produce)
+{
+    if (!stages.empty())
+        throw std::logic_error("Pipeline already has a source");
+    TPipeQueue<Out>* output = new TPipeQueue<Out>(queueCapacity);
+    TSourceStage<Out>* added = new TSourceStage<Out>(name, produce, output);
+    Add(added, output);
+    return TPipe<Out>(this, added, output);
+}
+
+//---------------------------------------------------------------------------
+#endif // PipelineH
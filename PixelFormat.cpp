@@ -0,0 +1,453 @@
+﻿/*
+ * PixelFormat.cpp - Decoded Image Pixel Formats
+ *
+ * Implements the matte blend, the dithered RGB565 and colour cube
+ * converters with their SIMD variants, the expansion back to BGRA and
+ * the format benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PixelFormat.h"
+#include "CpuDispatch.h"          // TKernel, CPU_X86, CPU_TARGET
+#include "DecodeScheduler.h"      // DecodePngEntry, TDecodedImage
+#include "Lz4.h"                  // Lz4Compress
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>                  // log10
+#include <cstring>                // memcpy
+#include <iomanip>
+
+#ifdef CPU_X86
+#include <immintrin.h>            // SSE2 and AVX2 convert kernels
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const char* const FormatNames[ImageFormatCount] = {"bgra32", "rgb565", "indexed8"};
+static const unsigned FormatBytes[ImageFormatCount] = {4, 2, 1};
+
+/*
+ * Dither Thresholds
+ * A 4x4 Bayer matrix: every value 0-15 once, neighbours far apart. It is
+ * scaled to the step of each output level: 8 for 5-bit channels, 4 for
+ * 6-bit ones and 51 for the six levels of the colour cube. A value plus
+ * a threshold uniform over [0, step) rounds down to each level in
+ * proportion to how close it is.
+ */
+static const uint8_t Bayer4[4][4] = {{0, 8, 2, 10}, {12, 4, 14, 6}, {3, 11, 1, 9}, {15, 7, 13, 5}};
+static const unsigned CubeLevels = 6;
+static const unsigned CubeStep = 51;
+// (v * CubeReciprocal) >> 16 == v / 51 for every v up to 255 + 47
+static const unsigned CubeReciprocal = 1286;
+
+unsigned ImageFormatBytes(TImageFormat format)
+{
+    return FormatBytes[format];
+}
+
+const char* ImageFormatName(TImageFormat format)
+{
+    return FormatNames[format];
+}
+
+bool ParseImageFormat(const std::string& name, TImageFormat& format)
+{
+    for (unsigned i = 0; i < ImageFormatCount; i++) {
+        if (name == FormatNames[i]) {
+            format = static_cast<TImageFormat>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+uint32_t BlendOnMatte(uint32_t pixel, uint32_t matte)
+{
+    unsigned alpha = pixel >> 24;
+    if (alpha == 255)
+        return pixel;
+    uint32_t blended = 0xFF000000;
+    for (unsigned shift = 0; shift < 24; shift += 8) {
+        unsigned colour = (pixel >> shift) & 255;
+        unsigned back = (matte >> shift) & 255;
+        blended |= ((colour * alpha + back * (255 - alpha) + 127) / 255) << shift;
+    }
+    return blended;
+}
+
+void CubePalette(std::vector<uint32_t>& palette)
+{
+    palette.resize(CubeLevels * CubeLevels * CubeLevels);
+    for (unsigned r = 0; r < CubeLevels; r++) {
+        for (unsigned g = 0; g < CubeLevels; g++) {
+            for (unsigned b = 0; b < CubeLevels; b++) {
+                palette[r * 36 + g * 6 + b] =
+                    0xFF000000 | (r * CubeStep << 16) | (g * CubeStep << 8) | (b * CubeStep);
+            }
+        }
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Scalar Converters
+ * The reference every SIMD variant has to match bit for bit. Pixels that
+ * are not opaque are blended onto the matte first; the SIMD variants
+ * hand groups holding any such pixel to these.
+ */
+typedef void (*TRgb565Fn)(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                          uint16_t* out);
+typedef void (*TCubeFn)(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                        uint8_t* out);
+
+static inline uint16_t Rgb565(uint32_t pixel, unsigned threshold)
+{
+    unsigned b = std::min(255u, (pixel & 255) + (threshold >> 1));
+    unsigned g = std::min(255u, ((pixel >> 8) & 255) + (threshold >> 2));
+    unsigned r = std::min(255u, ((pixel >> 16) & 255) + (threshold >> 1));
+    return static_cast<uint16_t>(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+}
+
+static inline uint8_t CubeIndex(uint32_t pixel, unsigned threshold)
+{
+    unsigned b = ((pixel & 255) + threshold) / CubeStep;
+    unsigned g = (((pixel >> 8) & 255) + threshold) / CubeStep;
+    unsigned r = (((pixel >> 16) & 255) + threshold) / CubeStep;
+    return static_cast<uint8_t>(r * 36 + g * 6 + b);
+}
+
+static inline unsigned CubeThreshold(unsigned bayer)
+{
+    return bayer * CubeStep / 16;
+}
+
+static void BgraToRgb565Scalar(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                               uint16_t* out)
+{
+    const uint8_t* bayer = Bayer4[y & 3];
+    for (uint32_t x = 0; x < width; x++)
+        out[x] = Rgb565(BlendOnMatte(src[x], matte), bayer[x & 3]);
+}
+
+static void BgraToCubeScalar(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                             uint8_t* out)
+{
+    const uint8_t* bayer = Bayer4[y & 3];
+    for (uint32_t x = 0; x < width; x++)
+        out[x] = CubeIndex(BlendOnMatte(src[x], matte), CubeThreshold(bayer[x & 3]));
+}
+//---------------------------------------------------------------------------
+
+/*
+ * SIMD Converters
+ * Groups start at multiples of 4 pixels, so the four thresholds of a
+ * dither row line up with the lanes once per call. RGB565: a saturating
+ * byte add of the thresholds, then three shift-and-mask steps per 32-bit
+ * pixel; the packs to 16 bits are signed, hence the bias. Colour cube:
+ * channels widened to 16 bits, divided by 51 with a high multiply, and
+ * weighted into an index with two multiply-adds.
+ */
+#ifdef CPU_X86
+CPU_TARGET("sse2")
+static inline __m128i Pack565Sse2(__m128i p)
+{
+    __m128i r = _mm_and_si128(_mm_srli_epi32(p, 8), _mm_set1_epi32(0xF800));
+    __m128i g = _mm_and_si128(_mm_srli_epi32(p, 5), _mm_set1_epi32(0x07E0));
+    __m128i b = _mm_and_si128(_mm_srli_epi32(p, 3), _mm_set1_epi32(0x001F));
+    return _mm_sub_epi32(_mm_or_si128(_mm_or_si128(r, g), b), _mm_set1_epi32(0x8000));
+}
+
+CPU_TARGET("sse2")
+static inline bool OpaqueSse2(__m128i a, __m128i b)
+{
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(_mm_and_si128(a, b), alpha), alpha)) ==
+           0xFFFF;
+}
+
+CPU_TARGET("sse2")
+static void BgraToRgb565Sse2(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                             uint16_t* out)
+{
+    const uint8_t* bayer = Bayer4[y & 3];
+    const __m128i dither = _mm_setr_epi8(
+        bayer[0] >> 1, bayer[0] >> 2, bayer[0] >> 1, 0, bayer[1] >> 1, bayer[1] >> 2,
+        bayer[1] >> 1, 0, bayer[2] >> 1, bayer[2] >> 2, bayer[2] >> 1, 0, bayer[3] >> 1,
+        bayer[3] >> 2, bayer[3] >> 1, 0);
+    const __m128i unbias = _mm_set1_epi16(-32768);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 4));
+        if (!OpaqueSse2(a, b)) {
+            BgraToRgb565Scalar(src + x, 8, y, matte, out + x);
+            continue;
+        }
+        a = Pack565Sse2(_mm_adds_epu8(a, dither));
+        b = Pack565Sse2(_mm_adds_epu8(b, dither));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                         _mm_add_epi16(_mm_packs_epi32(a, b), unbias));
+    }
+    BgraToRgb565Scalar(src + x, width - x, y, matte, out + x);
+}
+
+CPU_TARGET("avx2")
+static inline __m256i Pack565Avx2(__m256i p)
+{
+    __m256i r = _mm256_and_si256(_mm256_srli_epi32(p, 8), _mm256_set1_epi32(0xF800));
+    __m256i g = _mm256_and_si256(_mm256_srli_epi32(p, 5), _mm256_set1_epi32(0x07E0));
+    __m256i b = _mm256_and_si256(_mm256_srli_epi32(p, 3), _mm256_set1_epi32(0x001F));
+    return _mm256_sub_epi32(_mm256_or_si256(_mm256_or_si256(r, g), b), _mm256_set1_epi32(0x8000));
+}
+
+CPU_TARGET("avx2")
+static void BgraToRgb565Avx2(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                             uint16_t* out)
+{
+    const uint8_t* bayer = Bayer4[y & 3];
+    uint8_t pattern[32];
+    for (unsigned i = 0; i < 8; i++) {
+        pattern[i * 4] = pattern[i * 4 + 2] = static_cast<uint8_t>(bayer[i & 3] >> 1);
+        pattern[i * 4 + 1] = static_cast<uint8_t>(bayer[i & 3] >> 2);
+        pattern[i * 4 + 3] = 0;
+    }
+    const __m256i dither = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pattern));
+    const __m256i alpha = _mm256_set1_epi32(static_cast<int>(0xFF000000));
+    const __m256i unbias = _mm256_set1_epi16(-32768);
+    uint32_t x = 0;
+    for (; x + 16 <= width; x += 16) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + x + 8));
+        __m256i opaque = _mm256_cmpeq_epi8(_mm256_and_si256(_mm256_and_si256(a, b), alpha), alpha);
+        if (_mm256_movemask_epi8(opaque) != -1) {
+            BgraToRgb565Scalar(src + x, 16, y, matte, out + x);
+            continue;
+        }
+        a = Pack565Avx2(_mm256_adds_epu8(a, dither));
+        b = Pack565Avx2(_mm256_adds_epu8(b, dither));
+        // The pack works within 128-bit lanes: put the quarters back in order
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_add_epi16(packed, unbias));
+    }
+    BgraToRgb565Scalar(src + x, width - x, y, matte, out + x);
+}
+
+CPU_TARGET("sse2")
+static inline __m128i CubeIndicesSse2(__m128i p, __m128i ditherLo, __m128i ditherHi)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i reciprocal = _mm_set1_epi16(CubeReciprocal);
+    const __m128i weights = _mm_setr_epi16(1, 6, 36, 0, 1, 6, 36, 0);
+    __m128i lo = _mm_mulhi_epu16(_mm_add_epi16(_mm_unpacklo_epi8(p, zero), ditherLo), reciprocal);
+    __m128i hi = _mm_mulhi_epu16(_mm_add_epi16(_mm_unpackhi_epi8(p, zero), ditherHi), reciprocal);
+    // b + 6g and 36r per pixel, then the two halves summed: one index per 32 bits
+    __m128i halves = _mm_packs_epi32(_mm_madd_epi16(lo, weights), _mm_madd_epi16(hi, weights));
+    return _mm_madd_epi16(halves, _mm_set1_epi16(1));
+}
+
+CPU_TARGET("sse2")
+static void BgraToCubeSse2(const uint32_t* src, uint32_t width, uint32_t y, uint32_t matte,
+                           uint8_t* out)
+{
+    const uint8_t* bayer = Bayer4[y & 3];
+    short t[4];
+    for (unsigned i = 0; i < 4; i++)
+        t[i] = static_cast<short>(CubeThreshold(bayer[i]));
+    const __m128i ditherLo = _mm_setr_epi16(t[0], t[0], t[0], 0, t[1], t[1], t[1], 0);
+    const __m128i ditherHi = _mm_setr_epi16(t[2], t[2], t[2], 0, t[3], t[3], t[3], 0);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + x + 4));
+        if (!OpaqueSse2(a, b)) {
+            BgraToCubeScalar(src + x, 8, y, matte, out + x);
+            continue;
+        }
+        __m128i indices = _mm_packs_epi32(CubeIndicesSse2(a, ditherLo, ditherHi),
+                                          CubeIndicesSse2(b, ditherLo, ditherHi));
+        _mm_storel_epi64(reinterpret_cast<__m128i*>(out + x), _mm_packus_epi16(indices, indices));
+    }
+    BgraToCubeScalar(src + x, width - x, y, matte, out + x);
+}
+#endif
+//---------------------------------------------------------------------------
+
+/*
+ * Kernel Benchmark Helpers
+ * Random colours, but opaque apart from one pixel in 509, like the
+ * antialiased edges of a flag; rows of 1024 pixels so every dither row
+ * is used.
+ */
+static const uint32_t BenchRowPixels = 1024;
+
+static uint64_t HashBytes(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++)
+        hash = (hash ^ data[i]) * 1099511628211ull;
+    return hash;
+}
+
+static const std::vector<uint32_t>& BenchPixels(const uint8_t* input, size_t size)
+{
+    static std::vector<uint32_t> pixels;
+    if (pixels.size() != size / 4) {
+        pixels.resize(size / 4);
+        memcpy(pixels.data(), input, pixels.size() * 4);
+        for (size_t i = 0; i < pixels.size(); i++) {
+            if (i % 509 != 0)
+                pixels[i] |= 0xFF000000;
+        }
+    }
+    return pixels;
+}
+
+template <typename Fn, typename T>
+static uint64_t BenchConvert(Fn fn, const uint8_t* input, size_t size, std::vector<uint8_t>& work)
+{
+    const std::vector<uint32_t>& pixels = BenchPixels(input, size);
+    work.resize(pixels.size() * sizeof(T));
+    T* out = reinterpret_cast<T*>(work.data());
+    uint32_t rows = static_cast<uint32_t>(pixels.size() / BenchRowPixels);
+    for (uint32_t y = 0; y < rows; y++) {
+        size_t offset = static_cast<size_t>(y) * BenchRowPixels;
+        // Vary the width so every variant's tail loop runs too
+        fn(pixels.data() + offset, BenchRowPixels - y % 16, y, 0xFFF0F0F0, out + offset);
+    }
+    return HashBytes(work.data(), work.size());
+}
+
+static const TKernel<TRgb565Fn>::TVariant Rgb565Variants[] = {
+    {clScalar, BgraToRgb565Scalar},
+#ifdef CPU_X86
+    {clSse2, BgraToRgb565Sse2},
+    {clAvx2, BgraToRgb565Avx2},
+#endif
+};
+static TKernel<TRgb565Fn> Rgb565Kernel("bgra-to-rgb565", Rgb565Variants,
+                                       BenchConvert<TRgb565Fn, uint16_t>);
+
+static const TKernel<TCubeFn>::TVariant CubeVariants[] = {
+    {clScalar, BgraToCubeScalar},
+#ifdef CPU_X86
+    {clSse2, BgraToCubeSse2},
+#endif
+};
+static TKernel<TCubeFn> CubeKernel("bgra-to-cube", CubeVariants, BenchConvert<TCubeFn, uint8_t>);
+//---------------------------------------------------------------------------
+
+void ConvertBgraRow(TImageFormat format, const uint32_t* src, uint32_t width, uint32_t y,
+                    uint32_t matte, uint8_t* out)
+{
+    if (format == ifRgb565)
+        Rgb565Kernel.Get()(src, width, y, matte, reinterpret_cast<uint16_t*>(out));
+    else if (format == ifIndexed8)
+        CubeKernel.Get()(src, width, y, matte, out);
+    else
+        memcpy(out, src, static_cast<size_t>(width) * 4);
+}
+
+// 5 and 6-bit channels back to 8 bits: the top bits repeated below
+void ExpandToBgra(TImageFormat format, const uint8_t* src, uint32_t width,
+                  const uint32_t* palette, uint32_t* out)
+{
+    if (format == ifBgra32) {
+        memcpy(out, src, static_cast<size_t>(width) * 4);
+    } else if (format == ifIndexed8) {
+        for (uint32_t x = 0; x < width; x++)
+            out[x] = palette[src[x]];
+    } else {
+        const uint16_t* pixels = reinterpret_cast<const uint16_t*>(src);
+        for (uint32_t x = 0; x < width; x++) {
+            unsigned r = pixels[x] >> 11, g = (pixels[x] >> 5) & 63, b = pixels[x] & 31;
+            out[x] = 0xFF000000 | (((r << 3) | (r >> 2)) << 16) | (((g << 2) | (g >> 4)) << 8) |
+                     ((b << 3) | (b >> 2));
+        }
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Format Benchmark
+ * Each PNG entry is decoded once as BGRA for reference, then in every
+ * format. Error is the PSNR of the colour channels against the reference
+ * blended onto the same (white) matte, over the whole pack.
+ */
+void RunFormatBench(const TPackVolumeSet& pack, std::ostream& out)
+{
+    double seconds[ImageFormatCount] = {0};
+    uint64_t rawBytes[ImageFormatCount] = {0};
+    uint64_t packedBytes[ImageFormatCount] = {0};
+    double squaredError[ImageFormatCount] = {0};
+    uint64_t samples = 0;
+    size_t images = 0;
+
+    std::vector<uint8_t> packed;
+    std::vector<uint32_t> row;
+    std::vector<size_t> entries = PngEntries(pack);
+    for (size_t k = 0; k < entries.size(); k++) {
+        size_t i = entries[k];
+        TDecodedImage reference;
+        DecodePngEntry(pack, i, reference);
+        images++;
+        samples += static_cast<uint64_t>(reference.info.width) * reference.info.height * 3;
+        row.resize(reference.info.width);
+
+        for (unsigned f = 0; f < ImageFormatCount; f++) {
+            TImageOutput output(static_cast<TImageFormat>(f));
+            TDecodedImage image;
+            TClock::time_point start = TClock::now();
+            DecodePngEntry(pack, i, image, nullptr, output);
+            seconds[f] += std::chrono::duration<double>(TClock::now() - start).count();
+            rawBytes[f] += image.Bytes();
+            Lz4Compress(image.pixels.data(), image.pixels.size(), packed);
+            packedBytes[f] += packed.size() + image.palette.size() * 4;
+
+            for (uint32_t y = 0; y < image.info.height; y++) {
+                const uint8_t* referenceRow = reference.pixels.data() + y * reference.Stride();
+                const uint32_t* expected = reinterpret_cast<const uint32_t*>(referenceRow);
+                ExpandToBgra(image.format, image.pixels.data() + y * image.Stride(),
+                             image.info.width, image.palette.data(), row.data());
+                for (uint32_t x = 0; x < image.info.width; x++) {
+                    uint32_t want = BlendOnMatte(expected[x], output.matte);
+                    uint32_t got = BlendOnMatte(row[x], output.matte);
+                    for (unsigned shift = 0; shift < 24; shift += 8) {
+                        int delta = static_cast<int>((got >> shift) & 255) -
+                                    static_cast<int>((want >> shift) & 255);
+                        squaredError[f] += delta * delta;
+                    }
+                }
+            }
+        }
+    }
+    if (images == 0) {
+        out << "No PNG entries\n";
+        return;
+    }
+
+    out << images << " PNG images, kernels: " << Rgb565Kernel.Name() << " "
+        << CpuLevelName(Rgb565Kernel.BoundLevel()) << ", " << CubeKernel.Name() << " "
+        << CpuLevelName(CubeKernel.BoundLevel()) << "\n"
+        << std::left << std::setw(10) << "format" << std::right << std::setw(12) << "decode ms"
+        << std::setw(12) << "KB/flag" << std::setw(10) << "vs BGRA" << std::setw(12) << "LZ4 KB"
+        << std::setw(10) << "PSNR dB" << std::endl;
+    for (unsigned f = 0; f < ImageFormatCount; f++) {
+        out << std::left << std::setw(10) << FormatNames[f] << std::right << std::fixed
+            << std::setprecision(2) << std::setw(12) << seconds[f] * 1000 / images
+            << std::setprecision(1) << std::setw(12) << rawBytes[f] / 1024.0 / images
+            << std::setw(9) << static_cast<double>(rawBytes[0]) / rawBytes[f] << "x"
+            << std::setw(12) << packedBytes[f] / 1024.0 / images << std::setw(10);
+        if (squaredError[f] > 0)
+            out << 10 * log10(255.0 * 255.0 * samples / squaredError[f]);
+        else
+            out << "exact";
+        out << std::endl;
+    }
+}
+//---------------------------------------------------------------------------
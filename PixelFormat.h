@@ -0,0 +1,90 @@
+﻿/*
+ * PixelFormat.h - Decoded Image Pixel Formats
+ *
+ * Declares the formats a flag can be decoded into and the row converters
+ * between them. BGRA is what the PNG decoder produces and what a desktop
+ * shows; the cut-down viewer on 64 MB embedded panels keeps its flags in
+ * one of the smaller formats instead, from the decode onwards:
+ *
+ * - ifBgra32: 4 bytes per pixel, straight alpha.
+ * - ifRgb565: 2 bytes per pixel, the native format of most panels. Ordered
+ *   (4x4 Bayer) dithering hides the banding of 5 and 6-bit channels.
+ * - ifIndexed8: 1 byte per pixel plus a palette. Palette PNGs (about half
+ *   the flag set) keep their own palette and indices, losslessly; true
+ *   colour images are dithered onto a fixed 6x6x6 colour cube.
+ *
+ * Neither small format has alpha: transparent and partly transparent
+ * pixels are blended onto a matte colour, the background they will be
+ * shown on. Dithering is ordered rather than error diffusion so every
+ * pixel depends only on its own value and position: rows convert
+ * independently, as the decoder produces them, and SIMD kernels
+ * (registered with CpuDispatch.h) convert 8 or 16 pixels at a time.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PixelFormatH
+#define PixelFormatH
+//---------------------------------------------------------------------------
+
+#include <cstdint>
+#include <ostream>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+class TPackVolumeSet;
+
+enum TImageFormat { ifBgra32, ifRgb565, ifIndexed8 };
+const unsigned ImageFormatCount = 3;
+
+// Bytes per pixel of `format`
+unsigned ImageFormatBytes(TImageFormat format);
+
+// "bgra32", "rgb565", "indexed8"
+const char* ImageFormatName(TImageFormat format);
+bool ParseImageFormat(const std::string& name, TImageFormat& format);
+
+/*
+ * TImageOutput - What Decodes Produce
+ * `matte` is a BGRA word like the pixels (0xAARRGGBB as a number); its
+ * alpha is ignored. ifBgra32 keeps its alpha and has no use for it.
+ */
+struct TImageOutput
+{
+    TImageFormat format;
+    uint32_t matte;
+
+    TImageOutput() : format(ifBgra32), matte(0xFFFFFFFF) {}
+    TImageOutput(TImageFormat format, uint32_t matte = 0xFFFFFFFF) : format(format), matte(matte) {}
+};
+
+//---------------------------------------------------------------------------
+
+// Opaque BGRA of `pixel` blended onto `matte`
+uint32_t BlendOnMatte(uint32_t pixel, uint32_t matte);
+
+// Converts `width` BGRA pixels of row `y` to `format` (not ifBgra32) in
+// `out`: 2 bytes per pixel for ifRgb565, an index into CubePalette() for
+// ifIndexed8
+void ConvertBgraRow(TImageFormat format, const uint32_t* src, uint32_t width, uint32_t y,
+                    uint32_t matte, uint8_t* out);
+
+// The 216 colours ifIndexed8 true colour images index: red * 36 +
+// green * 6 + blue, each in steps of 51
+void CubePalette(std::vector<uint32_t>& palette);
+
+// Converts a row of any format back to BGRA; `palette` is only read for
+// ifIndexed8
+void ExpandToBgra(TImageFormat format, const uint8_t* src, uint32_t width,
+                  const uint32_t* palette, uint32_t* out);
+
+//---------------------------------------------------------------------------
+
+// Decodes every PNG entry of `pack` in each format and compares decode
+// time, raw and compressed size per flag, and error against BGRA
+void RunFormatBench(const TPackVolumeSet& pack, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // PixelFormatH
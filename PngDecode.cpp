@@ -0,0 +1,1049 @@
+﻿/*
+ * PngDecode.cpp - Streaming PNG Decoder
+ *
+ * Implements TPngDecoder. The data flow for one image is:
+ *
+ *   source spans -> chunk parser -> TIdatSource -> TInflater (zlib)
+ *                -> scanline buffer -> unfilter -> convert -> sink row
+ *
+ * Only two scanlines (current and previous) are ever buffered, so the
+ * decoded image is written exactly once, straight into its destination.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "PngDecode.h"
+#include "CpuDispatch.h"          // TKernel, CPU_X86, CPU_TARGET
+#include "Metrics.h"              // MetricCounter, MetricHistogram
+
+#include <cstring>                // memcpy, memset
+#include <cstdlib>                // abs
+#include <utility>                // std::swap
+
+#ifdef CPU_X86
+#include <immintrin.h>            // SSE2 to AVX2 unfilter and convert kernels
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+// Chunk type codes as big-endian four character constants
+static const uint32_t ChunkIHDR = 0x49484452;
+static const uint32_t ChunkPLTE = 0x504C5445;
+static const uint32_t ChunkIDAT = 0x49444154;
+static const uint32_t ChunkIEND = 0x49454E44;
+static const uint32_t ChunkTRNS = 0x74524E53;
+
+static const uint8_t PngSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+
+// Padding after each scanline buffer; unfilter kernels may read and
+// rewrite (unchanged) a few bytes past the end of a row
+static const size_t RowSlack = 8;
+
+/*
+ * Adam7 Interlace Passes
+ * Starting column/row and column/row step of each of the seven passes.
+ */
+static const uint8_t Adam7XStart[7] = {0, 4, 0, 2, 0, 1, 0};
+static const uint8_t Adam7YStart[7] = {0, 0, 4, 0, 2, 0, 1};
+static const uint8_t Adam7XStep[7] = {8, 8, 4, 4, 2, 2, 1};
+static const uint8_t Adam7YStep[7] = {8, 8, 8, 4, 4, 2, 2};
+
+static inline uint32_t ReadBE32(const uint8_t* p)
+{
+    return (static_cast<uint32_t>(p[0]) << 24) | (static_cast<uint32_t>(p[1]) << 16) |
+           (static_cast<uint32_t>(p[2]) << 8) | p[3];
+}
+
+static inline uint32_t PackBGRA(unsigned r, unsigned g, unsigned b, unsigned a)
+{
+    return b | (g << 8) | (r << 16) | (a << 24);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Decoder Constructor
+ * Nothing is read until ReadHeader() or Decode() is called.
+ */
+TPngDecoder::TPngDecoder(TByteSource* source)
+    : source(source), cancel(nullptr), cur(nullptr), end(nullptr), spanStart(nullptr),
+      spanOffset(0), headerRead(false), idatLeft(0), idatEnded(false), idatPayload(0),
+      idatChunks(nullptr), paletteSize(0), hasColorKey(false), indexOutput(false)
+{
+    memset(&info, 0, sizeof(info));
+    memset(colorKey, 0, sizeof(colorKey));
+    for (unsigned i = 0; i < 256; i++)
+        palette[i] = PackBGRA(0, 0, 0, 255);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Chunk Stream Helpers
+ * Fill() moves to the next source span once the current one is used up,
+ * keeping count of the file offset. ReadExact() and Skip() work across
+ * span boundaries and return false if the stream ends first.
+ */
+bool TPngDecoder::Fill()
+{
+    while (cur == end) {
+        spanOffset += static_cast<uint64_t>(end - spanStart);
+        spanStart = end;
+        size_t size = 0;
+        if (!source->Next(cur, size))
+            return false;
+        spanStart = cur;
+        end = cur + size;
+    }
+    return true;
+}
+
+bool TPngDecoder::ReadExact(void* dst, size_t size)
+{
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    while (size > 0) {
+        if (!Fill())
+            return false;
+        size_t n = size < static_cast<size_t>(end - cur) ? size : end - cur;
+        memcpy(to, cur, n);
+        to += n;
+        cur += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool TPngDecoder::Skip(size_t size)
+{
+    while (size > 0) {
+        if (!Fill())
+            return false;
+        size_t n = size < static_cast<size_t>(end - cur) ? size : end - cur;
+        cur += n;
+        size -= n;
+    }
+    return true;
+}
+
+bool TPngDecoder::ReadChunkHeader(uint32_t& length, uint32_t& type)
+{
+    uint8_t header[8];
+    if (!ReadExact(header, 8))
+        return false;
+    length = ReadBE32(header);
+    type = ReadBE32(header + 4);
+    if (length > 0x7FFFFFFF)
+        throw EDecodeError("Invalid PNG chunk length");
+    return true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Read PNG Header
+ * Validates the signature and consumes IHDR, PLTE, tRNS and any ancillary
+ * chunks, stopping at the start of the first IDAT payload.
+ */
+const TPngInfo& TPngDecoder::ReadHeader()
+{
+    if (headerRead)
+        return info;
+
+    uint8_t signature[8];
+    if (!ReadExact(signature, 8) || memcmp(signature, PngSignature, 8) != 0)
+        throw EDecodeError("Not a PNG file");
+
+    bool haveIHDR = false;
+    for (;;) {
+        uint32_t length, type;
+        if (!ReadChunkHeader(length, type))
+            throw EDecodeError("Unexpected end of PNG data");
+
+        if (type == ChunkIHDR) {
+            uint8_t ihdr[13];
+            if (length != 13 || !ReadExact(ihdr, 13))
+                throw EDecodeError("Invalid IHDR chunk");
+            info.width = ReadBE32(ihdr);
+            info.height = ReadBE32(ihdr + 4);
+            info.bitDepth = ihdr[8];
+            info.colorType = ihdr[9];
+            info.interlace = ihdr[12];
+
+            switch (info.colorType) {
+                case 0: info.channels = 1; break;
+                case 2: info.channels = 3; break;
+                case 3: info.channels = 1; break;
+                case 4: info.channels = 2; break;
+                case 6: info.channels = 4; break;
+                default: throw EDecodeError("Invalid PNG colour type");
+            }
+            unsigned depth = info.bitDepth;
+            bool depthOk = (depth == 8 || depth == 16) ||
+                           ((info.colorType == 0 || info.colorType == 3) &&
+                            (depth == 1 || depth == 2 || depth == 4));
+            if (!depthOk || (info.colorType == 3 && depth == 16))
+                throw EDecodeError("Invalid PNG bit depth");
+            if (info.width == 0 || info.height == 0 ||
+                info.width > (1u << 24) || info.height > (1u << 24))
+                throw EDecodeError("Invalid PNG dimensions");
+            if (ihdr[10] != 0 || ihdr[11] != 0 || info.interlace > 1)
+                throw EDecodeError("Unsupported PNG compression or filter method");
+            haveIHDR = true;
+        } else if (!haveIHDR) {
+            throw EDecodeError("PNG does not start with IHDR");
+        } else if (type == ChunkPLTE) {
+            uint8_t rgb[768];
+            if (length % 3 != 0 || length > 768 || !ReadExact(rgb, length))
+                throw EDecodeError("Invalid PLTE chunk");
+            paletteSize = length / 3;
+            for (unsigned i = 0; i < paletteSize; i++)
+                palette[i] = PackBGRA(rgb[i * 3], rgb[i * 3 + 1], rgb[i * 3 + 2], 255);
+        } else if (type == ChunkTRNS) {
+            uint8_t trns[256];
+            if (length > 256 || !ReadExact(trns, length))
+                throw EDecodeError("Invalid tRNS chunk");
+            if (info.colorType == 3) {
+                for (unsigned i = 0; i < length; i++)
+                    palette[i] = (palette[i] & 0x00FFFFFF) | (static_cast<uint32_t>(trns[i]) << 24);
+            } else if (info.colorType == 0 && length >= 2) {
+                colorKey[0] = static_cast<uint16_t>((trns[0] << 8) | trns[1]);
+                hasColorKey = true;
+            } else if (info.colorType == 2 && length >= 6) {
+                for (unsigned c = 0; c < 3; c++)
+                    colorKey[c] = static_cast<uint16_t>((trns[c * 2] << 8) | trns[c * 2 + 1]);
+                hasColorKey = true;
+            }
+        } else if (type == ChunkIDAT) {
+            if (info.colorType == 3 && paletteSize == 0)
+                throw EDecodeError("Palette image without PLTE chunk");
+            idatLeft = length;
+            headerRead = true;
+            return info; // Positioned at the first IDAT payload byte
+        } else if (type == ChunkIEND) {
+            throw EDecodeError("PNG has no image data");
+        } else {
+            if (!Skip(length))
+                throw EDecodeError("Unexpected end of PNG data");
+            if (!Skip(4))
+                throw EDecodeError("Unexpected end of PNG data");
+            continue;
+        }
+
+        if (!Skip(4)) // Chunk CRC
+            throw EDecodeError("Unexpected end of PNG data");
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * IDAT Payload Stream
+ * Hands out IDAT payload bytes directly from the underlying spans. When an
+ * IDAT chunk is used up, its CRC is skipped and the next chunk must be
+ * another IDAT for the stream to continue.
+ */
+bool TPngDecoder::TIdatSource::Next(const uint8_t*& data, size_t& size)
+{
+    TPngDecoder* d = owner;
+    while (d->idatLeft == 0) {
+        if (d->idatEnded)
+            return false;
+        uint32_t length, type;
+        if (!d->Skip(4) || !d->ReadChunkHeader(length, type) || type != ChunkIDAT) {
+            d->idatEnded = true;
+            return false;
+        }
+        d->idatLeft = length;
+        if (d->idatChunks != nullptr) {
+            TIdatChunk chunk = {d->idatPayload, d->FileOffset(), length};
+            d->idatChunks->push_back(chunk);
+        }
+    }
+
+    if (!d->Fill())
+        throw EDecodeError("Unexpected end of PNG data");
+    size_t n = static_cast<size_t>(d->end - d->cur);
+    if (n > d->idatLeft)
+        n = d->idatLeft;
+    data = d->cur;
+    size = n;
+    d->cur += n;
+    d->idatLeft -= n;
+    d->idatPayload += n;
+    return true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Unfilter Kernels (PNG specification, section 9)
+ *
+ * One kernel per (bytes per pixel, filter type). The filter byte distance
+ * `Bpp` (bit depth times channels, in bytes) is a template parameter, so
+ * the scalar loops are unrolled for it and a pixel stays in registers.
+ * Sub-byte formats (1, 2 and 4-bit palette or gray) use Bpp 1 like 8-bit
+ * palette and gray. Up does not depend on Bpp and has a single kernel.
+ */
+typedef void (*TUnfilterFn)(uint8_t* row, const uint8_t* prev, size_t rowBytes);
+
+static inline int PaethPredictor(int a, int b, int c)
+{
+    int pa = abs(b - c);
+    int pb = abs(a - c);
+    int pc = abs(a + b - 2 * c);
+    return (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+}
+
+static void UnfilterNone(uint8_t*, const uint8_t*, size_t)
+{
+}
+
+static void UnfilterUp(uint8_t* row, const uint8_t* prev, size_t rowBytes)
+{
+    for (size_t i = 0; i < rowBytes; i++)
+        row[i] = static_cast<uint8_t>(row[i] + prev[i]);
+}
+
+/*
+ * Scalar Sub, Average And Paeth
+ */
+template <unsigned Bpp>
+struct TUnfilterScalar
+{
+    static void Sub(uint8_t* row, const uint8_t*, size_t rowBytes)
+    {
+        for (size_t i = Bpp; i < rowBytes; i++)
+            row[i] = static_cast<uint8_t>(row[i] + row[i - Bpp]);
+    }
+
+    static void Average(uint8_t* row, const uint8_t* prev, size_t rowBytes)
+    {
+        for (size_t i = 0; i < Bpp && i < rowBytes; i++)
+            row[i] = static_cast<uint8_t>(row[i] + (prev[i] >> 1));
+        for (size_t i = Bpp; i < rowBytes; i++)
+            row[i] = static_cast<uint8_t>(row[i] + ((row[i - Bpp] + prev[i]) >> 1));
+    }
+
+    static void Paeth(uint8_t* row, const uint8_t* prev, size_t rowBytes)
+    {
+        for (size_t i = 0; i < Bpp && i < rowBytes; i++)
+            row[i] = static_cast<uint8_t>(row[i] + prev[i]);
+        for (size_t i = Bpp; i < rowBytes; i++)
+            row[i] = static_cast<uint8_t>(row[i] + PaethPredictor(row[i - Bpp], prev[i], prev[i - Bpp]));
+    }
+};
+
+#ifdef CPU_X86
+/*
+ * SSE2 Unfilter Kernels For 3, 4, 6 And 8 Bytes Per Pixel
+ * Sub, Average and Paeth depend on the pixel to the left, so they cannot
+ * be vectorised along the row; instead every byte of one pixel is handled
+ * in parallel, one pixel per step. Paeth gains the most, as its three-way
+ * branch per byte becomes a handful of compares and masks. With 1 or 2
+ * bytes per pixel there is too little to gain and the scalar code stays.
+ *
+ * Pixels move as whole 4 or 8-byte words: the predictor is masked to the
+ * pixel's own bytes, so the bytes after a 3 or 6-byte pixel are written
+ * back unchanged, and rows need RowSlack bytes of padding. Each pixel is
+ * loaded before the previous one is stored, so a load never waits on an
+ * overlapping store.
+ */
+CPU_TARGET("sse2")
+static inline __m128i Abs16(__m128i x)
+{
+    return _mm_max_epi16(x, _mm_sub_epi16(_mm_setzero_si128(), x));
+}
+
+CPU_TARGET("sse2")
+static inline __m128i Select(__m128i mask, __m128i a, __m128i b)
+{
+    return _mm_or_si128(_mm_and_si128(mask, a), _mm_andnot_si128(mask, b));
+}
+
+template <unsigned Bpp>
+struct TUnfilterSse2
+{
+    CPU_TARGET("sse2")
+    static __m128i Load(const uint8_t* p)
+    {
+        if (Bpp <= 4) {
+            int32_t v;
+            memcpy(&v, p, 4);
+            return _mm_cvtsi32_si128(v);
+        }
+        return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(p));
+    }
+
+    CPU_TARGET("sse2")
+    static void Store(uint8_t* p, __m128i x)
+    {
+        if (Bpp <= 4) {
+            int32_t v = _mm_cvtsi128_si32(x);
+            memcpy(p, &v, 4);
+        } else {
+            _mm_storel_epi64(reinterpret_cast<__m128i*>(p), x);
+        }
+    }
+
+    CPU_TARGET("sse2")
+    static __m128i PixelMask()
+    {
+        uint64_t mask = ~0ull >> (64 - 8 * Bpp);
+        return _mm_loadl_epi64(reinterpret_cast<const __m128i*>(&mask));
+    }
+
+    CPU_TARGET("sse2")
+    static void Sub(uint8_t* row, const uint8_t*, size_t rowBytes)
+    {
+        const __m128i mask = PixelMask();
+        __m128i a = _mm_setzero_si128();
+        __m128i next = Load(row);
+        for (size_t i = 0; i < rowBytes; i += Bpp) {
+            __m128i x = _mm_add_epi8(next, a);
+            next = Load(row + i + Bpp);
+            Store(row + i, x);
+            a = _mm_and_si128(x, mask);
+        }
+    }
+
+    CPU_TARGET("sse2")
+    static void Average(uint8_t* row, const uint8_t* prev, size_t rowBytes)
+    {
+        const __m128i mask = PixelMask();
+        const __m128i one = _mm_set1_epi8(1);
+        __m128i a = _mm_setzero_si128();
+        __m128i next = Load(row);
+        for (size_t i = 0; i < rowBytes; i += Bpp) {
+            __m128i b = _mm_and_si128(Load(prev + i), mask);
+            // (a + b) >> 1 without overflow: pavgb rounds up, so undo that
+            __m128i avg = _mm_sub_epi8(_mm_avg_epu8(a, b), _mm_and_si128(_mm_xor_si128(a, b), one));
+            __m128i x = _mm_add_epi8(next, avg);
+            next = Load(row + i + Bpp);
+            Store(row + i, x);
+            a = _mm_and_si128(x, mask);
+        }
+    }
+
+    CPU_TARGET("sse2")
+    static void Paeth(uint8_t* row, const uint8_t* prev, size_t rowBytes)
+    {
+        const __m128i mask = PixelMask();
+        const __m128i zero = _mm_setzero_si128();
+        __m128i a = zero, c = zero; // 16-bit lanes
+        __m128i next = Load(row);
+        for (size_t i = 0; i < rowBytes; i += Bpp) {
+            __m128i b = _mm_unpacklo_epi8(_mm_and_si128(Load(prev + i), mask), zero);
+            __m128i pa = _mm_sub_epi16(b, c);
+            __m128i pb = _mm_sub_epi16(a, c);
+            __m128i pc = Abs16(_mm_add_epi16(pa, pb));
+            pa = Abs16(pa);
+            pb = Abs16(pb);
+            __m128i smallest = _mm_min_epi16(pc, _mm_min_epi16(pa, pb));
+            // Ties favour a, then b, then c
+            __m128i pred = Select(_mm_cmpeq_epi16(smallest, pa), a,
+                                  Select(_mm_cmpeq_epi16(smallest, pb), b, c));
+            __m128i x = _mm_add_epi8(next, _mm_packus_epi16(pred, pred));
+            next = Load(row + i + Bpp);
+            Store(row + i, x);
+            a = _mm_unpacklo_epi8(_mm_and_si128(x, mask), zero);
+            c = b;
+        }
+    }
+};
+
+CPU_TARGET("sse2")
+static void UnfilterUpSse2(uint8_t* row, const uint8_t* prev, size_t rowBytes)
+{
+    size_t i = 0;
+    for (; i + 16 <= rowBytes; i += 16) {
+        __m128i x = _mm_loadu_si128(reinterpret_cast<const __m128i*>(row + i));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(prev + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(row + i), _mm_add_epi8(x, b));
+    }
+    for (; i < rowBytes; i++)
+        row[i] = static_cast<uint8_t>(row[i] + prev[i]);
+}
+#endif
+
+/*
+ * Unfilter Dispatch Tables
+ * One row of kernels per filter byte distance (1, 2, 3, 4, 6, 8), indexed
+ * by filter type. The whole table is one dispatched kernel, bound once.
+ */
+typedef const TUnfilterFn (*TUnfilterTable)[5];
+
+#define PNG_UNFILTER_ROW(Kernels, up, bpp) \
+    {UnfilterNone, Kernels<bpp>::Sub, up, Kernels<bpp>::Average, Kernels<bpp>::Paeth}
+
+static const TUnfilterFn ScalarUnfilter[6][5] = {
+    PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUp, 1), PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUp, 2),
+    PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUp, 3), PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUp, 4),
+    PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUp, 6), PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUp, 8)};
+
+#ifdef CPU_X86
+static const TUnfilterFn Sse2Unfilter[6][5] = {
+    PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUpSse2, 1), PNG_UNFILTER_ROW(TUnfilterScalar, UnfilterUpSse2, 2),
+    PNG_UNFILTER_ROW(TUnfilterSse2, UnfilterUpSse2, 3), PNG_UNFILTER_ROW(TUnfilterSse2, UnfilterUpSse2, 4),
+    PNG_UNFILTER_ROW(TUnfilterSse2, UnfilterUpSse2, 6), PNG_UNFILTER_ROW(TUnfilterSse2, UnfilterUpSse2, 8)};
+#endif
+#undef PNG_UNFILTER_ROW
+
+/*
+ * Kernel Benchmark Helpers
+ * Rows of 4080 bytes (a multiple of every filter byte distance) at a
+ * stride that leaves RowSlack behind each; the digest is a cheap hash.
+ */
+static const size_t BenchRowBytes = 4080;
+static const size_t BenchStride = 4096;
+
+static uint64_t HashBytes(const uint8_t* data, size_t size)
+{
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i + 8 <= size; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        hash = (hash ^ word) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Every filter type in turn, each at all six distances
+static uint64_t BenchUnfilter(TUnfilterTable table, const uint8_t* input, size_t size,
+                              std::vector<uint8_t>& work)
+{
+    work.assign(input, input + size);
+    size_t rows = size / BenchStride;
+    for (size_t r = 1; r < rows; r++) {
+        uint8_t* row = &work[r * BenchStride];
+        table[(r / 5) % 6][r % 5](row, row - BenchStride, BenchRowBytes);
+    }
+    return HashBytes(work.data(), work.size());
+}
+
+static const TKernel<TUnfilterTable>::TVariant UnfilterVariants[] = {
+    {clScalar, ScalarUnfilter},
+#ifdef CPU_X86
+    {clSse2, Sse2Unfilter},
+#endif
+};
+static TKernel<TUnfilterTable> UnfilterKernel("png-unfilter", UnfilterVariants, BenchUnfilter);
+
+static const TUnfilterFn* SelectUnfilter(unsigned bpp)
+{
+    TUnfilterTable table = UnfilterKernel.Get();
+    switch (bpp) {
+        case 1: return table[0];
+        case 2: return table[1];
+        case 3: return table[2];
+        case 4: return table[3];
+        case 6: return table[4];
+        default: return table[5];
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * RGB8 And RGBA8 To BGRA Kernels
+ * The two byte orders of the flag set (and of most PNGs). RGB gains an
+ * opaque alpha byte, RGBA swaps bytes 0 and 2 of every pixel. PSHUFB does
+ * either in one instruction per 16 output bytes; plain SSE2 has to swap
+ * with masks and 16-bit shuffles, so RGB only gets the SSSE3 variant.
+ */
+typedef void (*TPixelFn)(const uint8_t* src, uint32_t width, uint32_t* out);
+
+static void RgbToBgraScalar(const uint8_t* src, uint32_t width, uint32_t* out)
+{
+    for (uint32_t x = 0; x < width; x++, src += 3)
+        out[x] = PackBGRA(src[0], src[1], src[2], 255);
+}
+
+static void RgbaToBgraScalar(const uint8_t* src, uint32_t width, uint32_t* out)
+{
+    for (uint32_t x = 0; x < width; x++, src += 4)
+        out[x] = PackBGRA(src[0], src[1], src[2], src[3]);
+}
+
+#ifdef CPU_X86
+CPU_TARGET("ssse3")
+static void RgbToBgraSsse3(const uint8_t* src, uint32_t width, uint32_t* out)
+{
+    const __m128i order = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+    const __m128i alpha = _mm_set1_epi32(static_cast<int>(0xFF000000));
+    uint32_t x = 0;
+    // 16-byte loads of 12 bytes of pixels: stop while 4 spare bytes remain
+    for (; x + 6 <= width; x += 4, src += 12) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_or_si128(_mm_shuffle_epi8(p, order), alpha));
+    }
+    RgbToBgraScalar(src, width - x, out + x);
+}
+
+CPU_TARGET("sse2")
+static void RgbaToBgraSse2(const uint8_t* src, uint32_t width, uint32_t* out)
+{
+    const __m128i ga = _mm_set1_epi32(static_cast<int>(0xFF00FF00));
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4, src += 16) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        __m128i rb = _mm_andnot_si128(ga, p);
+        rb = _mm_shufflehi_epi16(_mm_shufflelo_epi16(rb, 0xB1), 0xB1);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_or_si128(_mm_and_si128(ga, p), rb));
+    }
+    RgbaToBgraScalar(src, width - x, out + x);
+}
+
+CPU_TARGET("ssse3")
+static void RgbaToBgraSsse3(const uint8_t* src, uint32_t width, uint32_t* out)
+{
+    const __m128i order = _mm_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t x = 0;
+    for (; x + 4 <= width; x += 4, src += 16) {
+        __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x), _mm_shuffle_epi8(p, order));
+    }
+    RgbaToBgraScalar(src, width - x, out + x);
+}
+
+CPU_TARGET("avx2")
+static void RgbaToBgraAvx2(const uint8_t* src, uint32_t width, uint32_t* out)
+{
+    const __m256i order = _mm256_setr_epi8(2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15,
+                                           2, 1, 0, 3, 6, 5, 4, 7, 10, 9, 8, 11, 14, 13, 12, 15);
+    uint32_t x = 0;
+    for (; x + 8 <= width; x += 8, src += 32) {
+        __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x), _mm256_shuffle_epi8(p, order));
+    }
+    RgbaToBgraScalar(src, width - x, out + x);
+}
+#endif
+
+// Converts as many whole pixels as the input holds; odd widths cover the tails
+template <unsigned BytesPerPixel>
+static uint64_t BenchPixels(TPixelFn fn, const uint8_t* input, size_t size, std::vector<uint8_t>& work)
+{
+    uint32_t width = static_cast<uint32_t>(size / BytesPerPixel);
+    work.resize(static_cast<size_t>(width) * 4);
+    uint32_t* out = reinterpret_cast<uint32_t*>(work.data());
+    uint32_t done = 0;
+    for (uint32_t run = 1; done + run <= width; run = run * 2 + 1) {
+        fn(input + static_cast<size_t>(done) * BytesPerPixel, run, out + done);
+        done += run;
+    }
+    fn(input + static_cast<size_t>(done) * BytesPerPixel, width - done, out + done);
+    return HashBytes(work.data(), work.size());
+}
+
+static const TKernel<TPixelFn>::TVariant RgbVariants[] = {
+    {clScalar, RgbToBgraScalar},
+#ifdef CPU_X86
+    {clSsse3, RgbToBgraSsse3},
+#endif
+};
+static TKernel<TPixelFn> RgbKernel("rgb8-to-bgra", RgbVariants, BenchPixels<3>);
+
+static const TKernel<TPixelFn>::TVariant RgbaVariants[] = {
+    {clScalar, RgbaToBgraScalar},
+#ifdef CPU_X86
+    {clSse2, RgbaToBgraSse2},
+    {clSsse3, RgbaToBgraSsse3},
+    {clAvx2, RgbaToBgraAvx2},
+#endif
+};
+static TKernel<TPixelFn> RgbaKernel("rgba8-to-bgra", RgbaVariants, BenchPixels<4>);
+//---------------------------------------------------------------------------
+
+/*
+ * Expand Packed Samples
+ * Unpacks 1, 2 or 4-bit samples (most significant first) through a lookup
+ * table: BGRA values of the palette or the gray levels of the image, or
+ * the sample values themselves for index output.
+ */
+template <unsigned Depth, typename T>
+static void ExpandPacked(const uint8_t* src, uint32_t width, T* out, const T* lut)
+{
+    const unsigned perByte = 8 / Depth;
+    const unsigned mask = (1u << Depth) - 1;
+    uint32_t x = 0;
+    for (; x + perByte <= width; x += perByte) {
+        unsigned byte = *src++;
+        for (unsigned k = 0; k < perByte; k++)
+            out[x + k] = lut[(byte >> (8 - Depth * (k + 1))) & mask];
+    }
+    for (unsigned k = 0; x < width; x++, k++)
+        out[x] = lut[(*src >> (8 - Depth * (k + 1))) & mask];
+}
+
+/*
+ * Convert Kernels
+ * Convert one unfiltered scanline of `width` pixels in the image's native
+ * format to BGRA. ColorType and Depth are fixed per kernel; Keyed is set
+ * for gray and RGB images with a tRNS colour key.
+ */
+template <unsigned ColorType, unsigned Depth, bool Keyed>
+void TPngDecoder::ConvertRow(const uint8_t* src, uint32_t width, uint8_t* dst) const
+{
+    uint32_t* out = reinterpret_cast<uint32_t*>(dst);
+
+    if (ColorType == 3) { // Palette
+        if (Depth == 8) {
+            for (uint32_t x = 0; x < width; x++)
+                out[x] = palette[src[x]];
+        } else {
+            ExpandPacked<Depth < 8 ? Depth : 1>(src, width, out, palette);
+        }
+    } else if (ColorType == 0 && Depth < 8) { // Grayscale, 1 to 4 bits
+        const unsigned levels = 1u << (Depth < 8 ? Depth : 1);
+        uint32_t lut[16];
+        for (unsigned v = 0; v < levels; v++) {
+            unsigned gray = v * 255 / (levels - 1);
+            lut[v] = PackBGRA(gray, gray, gray, (Keyed && v == colorKey[0]) ? 0 : 255);
+        }
+        ExpandPacked<Depth < 8 ? Depth : 1>(src, width, out, lut);
+    } else if (ColorType == 0) { // Grayscale, 8 or 16 bits
+        const unsigned step = Depth / 8;
+        for (uint32_t x = 0; x < width; x++, src += step) {
+            unsigned raw = Depth == 16 ? (src[0] << 8) | src[1] : src[0];
+            unsigned alpha = (Keyed && raw == colorKey[0]) ? 0 : 255;
+            out[x] = PackBGRA(src[0], src[0], src[0], alpha);
+        }
+    } else if (ColorType == 2 && Depth == 8 && !Keyed) { // RGB8, dispatched
+        RgbKernel.Get()(src, width, out);
+    } else if (ColorType == 2) { // RGB
+        const unsigned step = Depth / 8;
+        for (uint32_t x = 0; x < width; x++, src += 3 * step) {
+            unsigned alpha = 255;
+            if (Keyed) {
+                unsigned r = Depth == 16 ? (src[0] << 8) | src[1] : src[0];
+                unsigned g = Depth == 16 ? (src[2] << 8) | src[3] : src[1];
+                unsigned b = Depth == 16 ? (src[4] << 8) | src[5] : src[2];
+                if (r == colorKey[0] && g == colorKey[1] && b == colorKey[2])
+                    alpha = 0;
+            }
+            out[x] = PackBGRA(src[0], src[step], src[2 * step], alpha);
+        }
+    } else if (ColorType == 4) { // Grayscale + alpha
+        const unsigned step = Depth / 8;
+        for (uint32_t x = 0; x < width; x++, src += 2 * step)
+            out[x] = PackBGRA(src[0], src[0], src[0], src[step]);
+    } else if (Depth == 8) { // RGBA8, dispatched
+        RgbaKernel.Get()(src, width, out);
+    } else { // RGBA16
+        for (uint32_t x = 0; x < width; x++, src += 8)
+            out[x] = PackBGRA(src[0], src[2], src[4], src[6]);
+    }
+}
+
+/*
+ * Index Kernels
+ * Palette images with index output: the samples themselves, one byte each.
+ */
+template <unsigned Depth>
+void TPngDecoder::IndexRow(const uint8_t* src, uint32_t width, uint8_t* dst) const
+{
+    static const uint8_t identity[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    if (Depth == 8)
+        memcpy(dst, src, width);
+    else
+        ExpandPacked<Depth < 8 ? Depth : 1>(src, width, dst, identity);
+}
+
+/*
+ * Select Convert Kernel
+ * Called once per image; every valid colour type and depth has its own
+ * instantiation.
+ */
+TPngDecoder::TConvertFn TPngDecoder::SelectConvert() const
+{
+    unsigned depth = info.bitDepth;
+    if (indexOutput && info.colorType == 3) {
+        return depth == 1 ? &TPngDecoder::IndexRow<1>
+             : depth == 2 ? &TPngDecoder::IndexRow<2>
+             : depth == 4 ? &TPngDecoder::IndexRow<4>
+                          : &TPngDecoder::IndexRow<8>;
+    }
+    switch (info.colorType) {
+        case 3:
+            return depth == 1 ? &TPngDecoder::ConvertRow<3, 1, false>
+                 : depth == 2 ? &TPngDecoder::ConvertRow<3, 2, false>
+                 : depth == 4 ? &TPngDecoder::ConvertRow<3, 4, false>
+                              : &TPngDecoder::ConvertRow<3, 8, false>;
+        case 0:
+            if (hasColorKey) {
+                return depth == 1 ? &TPngDecoder::ConvertRow<0, 1, true>
+                     : depth == 2 ? &TPngDecoder::ConvertRow<0, 2, true>
+                     : depth == 4 ? &TPngDecoder::ConvertRow<0, 4, true>
+                     : depth == 8 ? &TPngDecoder::ConvertRow<0, 8, true>
+                                  : &TPngDecoder::ConvertRow<0, 16, true>;
+            }
+            return depth == 1 ? &TPngDecoder::ConvertRow<0, 1, false>
+                 : depth == 2 ? &TPngDecoder::ConvertRow<0, 2, false>
+                 : depth == 4 ? &TPngDecoder::ConvertRow<0, 4, false>
+                 : depth == 8 ? &TPngDecoder::ConvertRow<0, 8, false>
+                              : &TPngDecoder::ConvertRow<0, 16, false>;
+        case 2:
+            if (hasColorKey)
+                return depth == 8 ? &TPngDecoder::ConvertRow<2, 8, true> : &TPngDecoder::ConvertRow<2, 16, true>;
+            return depth == 8 ? &TPngDecoder::ConvertRow<2, 8, false> : &TPngDecoder::ConvertRow<2, 16, false>;
+        case 4:
+            return depth == 8 ? &TPngDecoder::ConvertRow<4, 8, false> : &TPngDecoder::ConvertRow<4, 16, false>;
+        default:
+            return depth == 8 ? &TPngDecoder::ConvertRow<6, 8, false> : &TPngDecoder::ConvertRow<6, 16, false>;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TBoundaryReader - Scanline Reads That Remember Block Boundaries
+ * Reads like TInflater::Read() while row points are recorded, keeping the
+ * last two DEFLATE block boundaries passed, with their history. The newer
+ * one may lie past the bytes handed out so far, inside the span still
+ * being read; the older one never does.
+ */
+class TBoundaryReader
+{
+  public:
+    struct TBoundary
+    {
+        uint64_t out;               // Inflated bytes before the boundary
+        uint64_t bits;              // Input bit position of the next block header
+        std::vector<uint8_t> history;
+    };
+
+    explicit TBoundaryReader(TInflater& inflater)
+        : inflater(inflater), data(nullptr), avail(0), out(0), newest(0)
+    {
+        // The first block header follows the 2-byte zlib header; PNG
+        // allows no preset dictionary
+        for (unsigned i = 0; i < 2; i++) {
+            boundaries[i].out = 0;
+            boundaries[i].bits = 16;
+        }
+    }
+
+    size_t Read(uint8_t* dst, size_t size)
+    {
+        size_t done = 0;
+        while (done < size) {
+            if (avail == 0) {
+                if (!inflater.Next(data, avail))
+                    break;
+                out += avail;
+                if (inflater.AtBlockBoundary())
+                    Mark();
+                continue;
+            }
+            size_t n = avail < size - done ? avail : size - done;
+            memcpy(dst + done, data, n);
+            data += n;
+            avail -= n;
+            done += n;
+        }
+        return done;
+    }
+
+    // Inflated bytes handed out so far
+    uint64_t Position() const { return out - avail; }
+
+    // The last boundary at or before Position()
+    const TBoundary& Before() const
+    {
+        const TBoundary& boundary = boundaries[newest];
+        return boundary.out <= Position() ? boundary : boundaries[newest ^ 1];
+    }
+
+  private:
+    TInflater& inflater;
+    const uint8_t* data;
+    size_t avail;
+    uint64_t out;
+    TBoundary boundaries[2];
+    unsigned newest;
+
+    void Mark()
+    {
+        newest ^= 1;
+        TBoundary& boundary = boundaries[newest];
+        boundary.out = out;
+        boundary.bits = inflater.InputBitPosition();
+        const uint8_t* history;
+        size_t size = inflater.History(history);
+        boundary.history.assign(history, history + size);
+    }
+};
+
+void TPngDecoder::Decode(TImageSink* sink)
+{
+    std::vector<TPngRowPoint> none;
+    Decode(sink, 0, none);
+}
+
+/*
+ * Decode Image
+ * Pulls exactly one scanline at a time out of the IDAT inflater, unfilters
+ * it against the previous one and converts it into the sink's row. For
+ * interlaced images each pass row is scattered to its final columns.
+ * Recording row points stops the inflater at every block boundary, and
+ * takes a copy of its history there; a point is made of the last
+ * boundary before its row.
+ */
+void TPngDecoder::Decode(TImageSink* sink, uint32_t interval, std::vector<TPngRowPoint>& points)
+{
+    static TCounter& pixels = MetricCounter("zip_png_pixels_total",
+                                            "Pixels of fully decoded PNG images");
+    static THistogram& decodeTime = MetricHistogram("zip_png_decode_seconds",
+                                                    "Time to decode one PNG image");
+    THistogram::TClock::time_point start = THistogram::TClock::now();
+
+    ReadHeader();
+    sink->Begin(info);
+
+    points.clear();
+    bool record = interval > 0 && !info.interlace;
+    std::vector<TIdatChunk> chunks;
+    if (record) {
+        // ReadHeader() stopped at the first IDAT payload byte
+        TIdatChunk first = {idatPayload, FileOffset(), static_cast<uint32_t>(idatLeft)};
+        chunks.push_back(first);
+        idatChunks = &chunks;
+    }
+
+    TIdatSource idat(this);
+    TInflater inflater(&idat, true);
+    inflater.SetCancelToken(cancel);
+    inflater.StopAtBlockBoundaries(record);
+    TBoundaryReader reader(inflater);
+
+    unsigned bitsPerPixel = info.bitDepth * info.channels;
+    unsigned bpp = bitsPerPixel >= 8 ? bitsPerPixel / 8 : 1;
+    const TUnfilterFn* unfilter = SelectUnfilter(bpp);
+    TConvertFn convert = SelectConvert();
+    bool indices = indexOutput && info.colorType == 3;
+    size_t maxRowBytes = (static_cast<size_t>(info.width) * bitsPerPixel + 7) / 8;
+
+    // Filter byte + row data, for the current and the previous scanline
+    std::vector<uint8_t> rowA(maxRowBytes + 1 + RowSlack), rowB(maxRowBytes + 1 + RowSlack);
+    std::vector<uint32_t> scatter(info.interlace ? info.width : 0);
+
+    unsigned passCount = info.interlace ? 7 : 1;
+    for (unsigned pass = 0; pass < passCount; pass++) {
+        uint32_t xStart = info.interlace ? Adam7XStart[pass] : 0;
+        uint32_t yStart = info.interlace ? Adam7YStart[pass] : 0;
+        uint32_t xStep = info.interlace ? Adam7XStep[pass] : 1;
+        uint32_t yStep = info.interlace ? Adam7YStep[pass] : 1;
+        if (xStart >= info.width || yStart >= info.height)
+            continue; // Empty pass for small images
+
+        uint32_t passWidth = (info.width - xStart + xStep - 1) / xStep;
+        size_t rowBytes = (static_cast<size_t>(passWidth) * bitsPerPixel + 7) / 8;
+
+        uint8_t* cur = rowA.data();
+        uint8_t* prev = rowB.data();
+        memset(prev, 0, rowBytes + 1); // First row of a pass sees a zero row above
+
+        for (uint32_t y = yStart; y < info.height; y += yStep) {
+            if (cancel != nullptr)
+                cancel->Check();
+            if (record && y % interval == 0) {
+                const TBoundaryReader::TBoundary& boundary = reader.Before();
+                uint64_t byte = boundary.bits / 8;
+                size_t c = chunks.size() - 1;
+                while (c > 0 && chunks[c].payload > byte)
+                    c--;
+                points.push_back(TPngRowPoint());
+                TPngRowPoint& point = points.back();
+                point.row = y;
+                uint64_t into = byte - chunks[c].payload;
+                point.fileOffset = chunks[c].file + into;
+                point.skipBits = static_cast<unsigned>(boundary.bits % 8);
+                point.idatLeft = static_cast<uint32_t>(chunks[c].length - into);
+                point.skipBytes = reader.Position() - boundary.out;
+                point.history = boundary.history;
+                point.above.assign(prev + 1, prev + 1 + rowBytes);
+            }
+            size_t got = record ? reader.Read(cur, rowBytes + 1) : inflater.Read(cur, rowBytes + 1);
+            if (got != rowBytes + 1)
+                throw EDecodeError("Truncated PNG image data");
+
+            if (cur[0] > 4)
+                throw EDecodeError("Invalid PNG filter type");
+            unfilter[cur[0]](cur + 1, prev + 1, rowBytes);
+
+            if (!info.interlace) {
+                (this->*convert)(cur + 1, info.width, sink->Row(y));
+            } else {
+                (this->*convert)(cur + 1, passWidth, reinterpret_cast<uint8_t*>(scatter.data()));
+                if (indices) {
+                    const uint8_t* index = reinterpret_cast<const uint8_t*>(scatter.data());
+                    uint8_t* out = sink->Row(y);
+                    for (uint32_t i = 0; i < passWidth; i++)
+                        out[xStart + i * xStep] = index[i];
+                } else {
+                    uint32_t* out = reinterpret_cast<uint32_t*>(sink->Row(y));
+                    for (uint32_t i = 0; i < passWidth; i++)
+                        out[xStart + i * xStep] = scatter[i];
+                }
+            }
+            std::swap(cur, prev);
+        }
+    }
+    idatChunks = nullptr;
+
+    pixels.Add(static_cast<uint64_t>(info.width) * info.height);
+    decodeTime.RecordSince(start);
+}
+
+/*
+ * Decode Rows From A Restart Point
+ * The source is swapped for one that starts at the point's file offset,
+ * inside an IDAT payload; the chunk stream carries on from there as in
+ * Decode(). A raw inflater resumes at the block boundary, the bytes up to
+ * the row are skipped, and the stored row above seeds the unfilter.
+ */
+void TPngDecoder::DecodeRows(TByteSource* from, const TPngRowPoint& point, uint32_t count,
+                             TImageSink* sink)
+{
+    if (!headerRead || info.interlace)
+        throw EDecodeError("Row access needs the header of a non-interlaced PNG");
+    unsigned bitsPerPixel = info.bitDepth * info.channels;
+    size_t rowBytes = (static_cast<size_t>(info.width) * bitsPerPixel + 7) / 8;
+    if (point.row >= info.height || point.above.size() != rowBytes)
+        throw EDecodeError("Row point does not match the PNG");
+
+    source = from;
+    cur = end = spanStart = nullptr;
+    spanOffset = point.fileOffset;
+    idatLeft = point.idatLeft;
+    idatEnded = false;
+    idatChunks = nullptr;
+
+    TIdatSource idat(this);
+    TInflater inflater(&idat);
+    inflater.SetCancelToken(cancel);
+    inflater.Resume(point.skipBits, point.history.data(), point.history.size());
+
+    const TUnfilterFn* unfilter = SelectUnfilter(bitsPerPixel >= 8 ? bitsPerPixel / 8 : 1);
+    TConvertFn convert = SelectConvert();
+    std::vector<uint8_t> rowA(rowBytes + 1 + RowSlack), rowB(rowBytes + 1 + RowSlack);
+    uint8_t* line = rowA.data();
+    uint8_t* prev = rowB.data();
+    memcpy(prev + 1, point.above.data(), rowBytes);
+
+    for (uint64_t skip = point.skipBytes; skip > 0;) {
+        size_t n = skip < rowA.size() ? static_cast<size_t>(skip) : rowA.size();
+        if (inflater.Read(line, n) != n)
+            throw EDecodeError("Truncated PNG image data");
+        skip -= n;
+    }
+
+    uint32_t stop = count < info.height - point.row ? point.row + count : info.height;
+    for (uint32_t y = point.row; y < stop; y++) {
+        if (cancel != nullptr)
+            cancel->Check();
+        if (inflater.Read(line, rowBytes + 1) != rowBytes + 1)
+            throw EDecodeError("Truncated PNG image data");
+        if (line[0] > 4)
+            throw EDecodeError("Invalid PNG filter type");
+        unfilter[line[0]](line + 1, prev + 1, rowBytes);
+        (this->*convert)(line + 1, info.width, sink->Row(y));
+        std::swap(line, prev);
+    }
+}
+//---------------------------------------------------------------------------
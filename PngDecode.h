@@ -0,0 +1,185 @@
+﻿/*
+ * PngDecode.h - Streaming PNG Decoder
+ *
+ * Declares a PNG decoder that runs as a single fused pass: chunk parsing,
+ * IDAT inflation, scanline unfiltering and pixel conversion all happen on
+ * one scanline at a time, so every row is converted while it is still hot
+ * in L1 cache. Output is 32-bit BGRA (straight alpha) written directly into
+ * rows supplied by the caller, e.g. the ScanLine[] rows of a VCL TBitmap.
+ *
+ * Supported: all PNG colour types and bit depths, tRNS transparency and
+ * Adam7 interlacing. Ancillary chunks other than tRNS are skipped.
+ *
+ * Rows of a non-interlaced image can also be decoded from the middle:
+ * one full decode records restart points (TPngRowPoint), and a later
+ * DecodeRows() inflates only from the point before the rows it wants.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef PngDecodeH
+#define PngDecodeH
+//---------------------------------------------------------------------------
+
+#include "Inflate.h"              // TByteSource, TInflater, EDecodeError
+#include "CancelToken.h"          // TCancelToken
+
+#include <cstdint>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPngInfo - Image Header (IHDR) Summary
+ */
+struct TPngInfo
+{
+    uint32_t width;
+    uint32_t height;
+    uint8_t bitDepth;               // 1, 2, 4, 8 or 16
+    uint8_t colorType;              // 0 gray, 2 RGB, 3 palette, 4 gray+alpha, 6 RGBA
+    uint8_t interlace;              // 0 none, 1 Adam7
+    unsigned channels;              // Samples per pixel for the colour type
+};
+
+/*
+ * TImageSink - Destination For Decoded Rows
+ *
+ * Begin() is called once the header is known; Row() must then return a
+ * writable row of width * 4 bytes (width bytes with index output) for
+ * every y in [0, height).
+ */
+class TImageSink
+{
+  public:
+    virtual ~TImageSink() {}
+
+    virtual void Begin(const TPngInfo& info) = 0;
+    virtual uint8_t* Row(uint32_t y) = 0;
+};
+
+/*
+ * TPngRowPoint - Restart Point Of A Row
+ * What the decoder needs to carry on at `row` without the rows above it:
+ * the DEFLATE block boundary the IDAT inflater resumes at, with its
+ * history, and the unfiltered row above, which the Up, Average and Paeth
+ * filters read.
+ */
+struct TPngRowPoint
+{
+    uint32_t row;
+    uint64_t fileOffset;            // PNG file byte holding the block boundary
+    unsigned skipBits;              // Bits of that byte before the boundary
+    uint32_t idatLeft;              // IDAT payload bytes from fileOffset to the chunk's end
+    uint64_t skipBytes;             // Inflated bytes from the boundary to the row
+    std::vector<uint8_t> history;   // Up to 32 KB of inflated bytes before the boundary
+    std::vector<uint8_t> above;     // Row row - 1 unfiltered, without filter byte; zeros for row 0
+};
+
+//---------------------------------------------------------------------------
+
+/*
+ * TPngDecoder - Fused Chunk/Inflate/Unfilter/Convert Decoder
+ *
+ * Reads a PNG file from any TByteSource. For stored ZIP entries that source
+ * is the archive span itself, so IDAT payloads are inflated in place without
+ * being copied anywhere first.
+ */
+class TPngDecoder
+{
+  public:
+    explicit TPngDecoder(TByteSource* source);
+
+    // Parses the signature and all chunks up to the first IDAT
+    const TPngInfo& ReadHeader();
+
+    // Decodes the image into the sink (calls ReadHeader() if needed)
+    void Decode(TImageSink* sink);
+
+    // Decode() that also records a restart point every `interval` rows,
+    // from row 0 on. Interlaced images get none: every pass revisits the
+    // whole image
+    void Decode(TImageSink* sink, uint32_t interval, std::vector<TPngRowPoint>& points);
+
+    // Decodes rows [point.row, point.row + count) only, of a non-interlaced
+    // image whose header was read by ReadHeader(). `from` supplies the PNG
+    // file from point.fileOffset on; the sink's Begin() is not called
+    void DecodeRows(TByteSource* from, const TPngRowPoint& point, uint32_t count,
+                    TImageSink* sink);
+
+    // Polled once per scanline and by the IDAT inflater; when it fires,
+    // Decode() throws ECancelled and the sink holds a partial image
+    void SetCancelToken(const TCancelToken* token) { cancel = token; }
+
+    // Palette images only: rows receive the palette index of each pixel,
+    // one byte each, instead of its colour. Set before Decode()
+    void SetIndexOutput(bool on) { indexOutput = on; }
+    // 256 BGRA entries, valid after ReadHeader(); unused ones are opaque black
+    const uint32_t* Palette() const { return palette; }
+
+  private:
+    /*
+     * TIdatSource - IDAT Payload Stream
+     * Presents the payloads of consecutive IDAT chunks as one byte stream
+     * for the zlib inflater, stepping over chunk headers and CRCs.
+     */
+    class TIdatSource : public TByteSource
+    {
+      public:
+        explicit TIdatSource(TPngDecoder* owner) : owner(owner) {}
+        bool Next(const uint8_t*& data, size_t& size) override;
+
+      private:
+        TPngDecoder* owner;
+    };
+    friend class TIdatSource;
+
+    /*
+     * TIdatChunk - Where One IDAT Payload Lies
+     * Recorded while row points are, to turn an inflater bit position into
+     * a file offset.
+     */
+    struct TIdatChunk
+    {
+        uint64_t payload;           // Offset in the concatenated IDAT payloads
+        uint64_t file;              // Offset of the payload in the PNG file
+        uint32_t length;
+    };
+
+    // Chunk stream reader over the source spans
+    TByteSource* source;
+    const TCancelToken* cancel;
+    const uint8_t* cur;
+    const uint8_t* end;
+    const uint8_t* spanStart;       // Start of the current span
+    uint64_t spanOffset;            // File offset of spanStart
+    uint64_t FileOffset() const { return spanOffset + static_cast<uint64_t>(cur - spanStart); }
+    bool Fill();
+    bool ReadExact(void* dst, size_t size);
+    bool Skip(size_t size);
+    bool ReadChunkHeader(uint32_t& length, uint32_t& type);
+
+    // Header state
+    TPngInfo info;
+    bool headerRead;
+    size_t idatLeft;                // Payload bytes left in the current IDAT
+    bool idatEnded;
+    uint64_t idatPayload;           // IDAT payload bytes handed out so far
+    std::vector<TIdatChunk>* idatChunks;    // Non-null while recording row points
+    uint32_t palette[256];          // BGRA lookup for palette images
+    unsigned paletteSize;
+    bool hasColorKey;               // tRNS colour key for gray/RGB images
+    uint16_t colorKey[3];
+    bool indexOutput;
+
+    // Pixel conversion kernels, one per format; chosen once per image
+    typedef void (TPngDecoder::*TConvertFn)(const uint8_t* src, uint32_t width, uint8_t* dst) const;
+    template <unsigned ColorType, unsigned Depth, bool Keyed>
+    void ConvertRow(const uint8_t* src, uint32_t width, uint8_t* dst) const;
+    template <unsigned Depth>
+    void IndexRow(const uint8_t* src, uint32_t width, uint8_t* dst) const;
+    TConvertFn SelectConvert() const;
+};
+
+//---------------------------------------------------------------------------
+#endif // PngDecodeH
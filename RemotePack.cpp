@@ -0,0 +1,1328 @@
+﻿/*
+ * RemotePack.cpp - Flag Packs Read Over HTTP Range Requests
+ *
+ * Implements the HTTP/1.1 client (range GETs over keep-alive sockets),
+ * TRemotePack's tail-first open and block cache with coalesced, parallel
+ * fetches, and the benchmark with its loopback stand-in server.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "RemotePack.h"
+#include "DecodeScheduler.h"      // DecodePngEntry, TDecodedImage
+#include "MappedFile.h"           // TMappedFile for the stand-in server
+#include "Metrics.h"              // MetricCounter, MetricHistogram, SamplePercentile
+#include "PackVolumes.h"          // TPackVolumeSet
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cctype>                 // tolower
+#include <cstdio>                 // sscanf
+#include <cstdlib>                // strtoull
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>          // TCP_NODELAY
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+#ifdef _WIN32
+typedef SOCKET TSocket;
+static const TSocket NoSocket = INVALID_SOCKET;
+#else
+typedef int TSocket;
+static const TSocket NoSocket = -1;
+#endif
+
+static const uint32_t SigLocalHeader = 0x04034B50;
+static const size_t LocalHeaderSize = 30;
+static const size_t LocalExtraSlack = 64;      // Guess at a local extra field
+static const unsigned TimeoutMs = 30000;       // Per send or receive
+static const size_t MaxHeaderBytes = 64 * 1024;
+
+static inline uint16_t ReadLE16(const uint8_t* p)
+{
+    return static_cast<uint16_t>(p[0] | (p[1] << 8));
+}
+
+static inline uint32_t ReadLE32(const uint8_t* p)
+{
+    return static_cast<uint32_t>(p[0]) | (static_cast<uint32_t>(p[1]) << 8) |
+           (static_cast<uint32_t>(p[2]) << 16) | (static_cast<uint32_t>(p[3]) << 24);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Socket Helpers
+ */
+static void StartSockets()
+{
+#ifdef _WIN32
+    static std::once_flag once;
+    std::call_once(once, []() {
+        WSADATA data;
+        if (WSAStartup(MAKEWORD(2, 2), &data) != 0)
+            throw std::runtime_error("Unable to start Windows Sockets");
+    });
+#endif
+}
+
+static void CloseSocket(TSocket socket)
+{
+#ifdef _WIN32
+    closesocket(socket);
+#else
+    close(socket);
+#endif
+}
+
+static void SetTimeouts(TSocket socket, unsigned ms)
+{
+#ifdef _WIN32
+    DWORD value = ms;
+#else
+    timeval value;
+    value.tv_sec = ms / 1000;
+    value.tv_usec = (ms % 1000) * 1000;
+#endif
+    setsockopt(socket, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&value),
+               sizeof(value));
+    setsockopt(socket, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&value),
+               sizeof(value));
+}
+
+// False if the connection failed part way
+static bool SendAll(TSocket socket, const char* data, size_t length)
+{
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL;               // A closed peer is an error, not SIGPIPE
+#else
+    const int flags = 0;
+#endif
+    while (length > 0) {
+        int chunk = static_cast<int>(std::min<size_t>(length, 1 << 30));
+        int sent = send(socket, data, chunk, flags);
+        if (sent <= 0)
+            return false;
+        data += sent;
+        length -= sent;
+    }
+    return true;
+}
+
+// 0 at the end of the stream or on failure
+static size_t ReceiveSome(TSocket socket, char* dst, size_t length)
+{
+    int received = recv(socket, dst, static_cast<int>(std::min<size_t>(length, 1 << 30)), 0);
+    return received > 0 ? static_cast<size_t>(received) : 0;
+}
+
+// Number of sockets with events, 0 on timeout, negative on failure
+static int PollSockets(std::vector<pollfd>& sockets, int timeoutMs)
+{
+#ifdef _WIN32
+    return WSAPoll(sockets.data(), static_cast<ULONG>(sockets.size()), timeoutMs);
+#else
+    return poll(sockets.data(), static_cast<nfds_t>(sockets.size()), timeoutMs);
+#endif
+}
+
+static std::string Lower(std::string text)
+{
+    for (size_t i = 0; i < text.size(); i++)
+        text[i] = static_cast<char>(tolower(static_cast<unsigned char>(text[i])));
+    return text;
+}
+
+static std::string Trim(const std::string& text)
+{
+    size_t first = text.find_first_not_of(" \t");
+    if (first == std::string::npos)
+        return std::string();
+    return text.substr(first, text.find_last_not_of(" \t") - first + 1);
+}
+
+static bool IsHttpUrl(const std::string& text)
+{
+    return Lower(text.substr(0, 7)) == "http://";
+}
+
+/*
+ * Split URL
+ * "http://host[:port]/path"; IPv6 hosts in brackets.
+ */
+static void ParseUrl(const std::string& url, std::string& authority, std::string& host,
+                     std::string& port, std::string& path)
+{
+    if (!IsHttpUrl(url))
+        throw std::invalid_argument("Only http:// URLs are supported: " + url);
+    size_t slash = url.find('/', 7);
+    authority = url.substr(7, slash == std::string::npos ? std::string::npos : slash - 7);
+    path = slash == std::string::npos ? "/" : url.substr(slash);
+
+    port = "80";
+    if (!authority.empty() && authority[0] == '[') {
+        size_t close = authority.find(']');
+        if (close == std::string::npos)
+            throw std::invalid_argument("Bad host in URL: " + url);
+        host = authority.substr(1, close - 1);
+        if (close + 1 < authority.size() && authority[close + 1] == ':')
+            port = authority.substr(close + 2);
+    } else {
+        size_t colon = authority.find(':');
+        host = authority.substr(0, colon);
+        if (colon != std::string::npos)
+            port = authority.substr(colon + 1);
+    }
+    if (host.empty() || port.empty())
+        throw std::invalid_argument("Bad host in URL: " + url);
+}
+
+static std::string RangeHeader(uint64_t offset, uint64_t length)
+{
+    return "bytes=" + std::to_string(offset) + "-" + std::to_string(offset + length - 1);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * THttpConnection - One Keep-Alive Connection
+ * Sends range GETs and reads their answers; only "206 Partial Content"
+ * with a Content-Length or identity body is accepted. Any failure throws
+ * std::runtime_error and leaves the connection unfit for reuse.
+ */
+class THttpConnection
+{
+  public:
+    THttpConnection(const std::string& host, const std::string& port);
+    ~THttpConnection() { CloseSocket(handle); }
+
+    // Requests `range` of `path`; `first` and `total` come from the
+    // answer's Content-Range
+    void Get(const std::string& authority, const std::string& path, const std::string& range,
+             std::vector<uint8_t>& body, uint64_t& first, uint64_t& total);
+
+    bool Used() const { return used; }              // Has answered a request
+    bool Answered() const { return answered; }      // The last request got a status line
+    bool KeepAlive() const { return keepAlive; }
+
+  private:
+    TSocket handle;
+    std::string received;           // Read from the socket, not consumed yet
+    bool used;
+    bool answered;
+    bool keepAlive;
+
+    std::string ReadLine();
+
+    THttpConnection(const THttpConnection&);
+    THttpConnection& operator=(const THttpConnection&);
+};
+
+THttpConnection::THttpConnection(const std::string& host, const std::string& port)
+    : handle(NoSocket), used(false), answered(false), keepAlive(false)
+{
+    addrinfo hints;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addresses = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addresses) != 0 || addresses == nullptr)
+        throw std::runtime_error("Unable to resolve " + host);
+
+    for (addrinfo* address = addresses; address != nullptr && handle == NoSocket;
+         address = address->ai_next) {
+        TSocket candidate = socket(address->ai_family, address->ai_socktype, address->ai_protocol);
+        if (candidate == NoSocket)
+            continue;
+        if (connect(candidate, address->ai_addr, static_cast<int>(address->ai_addrlen)) == 0)
+            handle = candidate;
+        else
+            CloseSocket(candidate);
+    }
+    freeaddrinfo(addresses);
+    if (handle == NoSocket)
+        throw std::runtime_error("Unable to connect to " + host + ":" + port);
+
+    // Requests are small and answered one at a time: no Nagle delay
+    int on = 1;
+    setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+    SetTimeouts(handle, TimeoutMs);
+}
+
+std::string THttpConnection::ReadLine()
+{
+    for (;;) {
+        size_t end = received.find("\r\n");
+        if (end != std::string::npos) {
+            std::string line = received.substr(0, end);
+            received.erase(0, end + 2);
+            return line;
+        }
+        if (received.size() > MaxHeaderBytes)
+            throw std::runtime_error("HTTP response header too long");
+        char chunk[4096];
+        size_t n = ReceiveSome(handle, chunk, sizeof(chunk));
+        if (n == 0)
+            throw std::runtime_error("Connection closed by the server");
+        received.append(chunk, n);
+    }
+}
+
+/*
+ * Range GET
+ * A 200 answer means the server ignored the Range header and is sending
+ * the whole archive: that is refused rather than read.
+ */
+void THttpConnection::Get(const std::string& authority, const std::string& path,
+                          const std::string& range, std::vector<uint8_t>& body,
+                          uint64_t& first, uint64_t& total)
+{
+    answered = false;
+    keepAlive = false;
+    std::string request = "GET " + path + " HTTP/1.1\r\nHost: " + authority + "\r\nRange: " +
+                          range + "\r\nAccept-Encoding: identity\r\n\r\n";
+    if (!SendAll(handle, request.data(), request.size()))
+        throw std::runtime_error("Connection closed by the server");
+
+    // "HTTP/1.1 206 Partial Content"
+    std::string status = ReadLine();
+    answered = true;
+    used = true;
+    if (status.compare(0, 5, "HTTP/") != 0 || status.find(' ') == std::string::npos)
+        throw std::runtime_error("Not an HTTP response: " + status);
+    int code = atoi(status.c_str() + status.find(' ') + 1);
+    bool persistent = status.compare(0, 8, "HTTP/1.1") == 0;
+
+    std::string contentRange;
+    std::string contentLength;
+    bool chunked = false;
+    for (;;) {
+        std::string line = ReadLine();
+        if (line.empty())
+            break;
+        size_t colon = line.find(':');
+        if (colon == std::string::npos)
+            continue;
+        std::string name = Lower(line.substr(0, colon));
+        std::string value = Trim(line.substr(colon + 1));
+        if (name == "content-range")
+            contentRange = value;
+        else if (name == "content-length")
+            contentLength = value;
+        else if (name == "transfer-encoding")
+            chunked = Lower(value) != "identity";
+        else if (name == "connection")
+            persistent = Lower(value) != "close";
+    }
+
+    if (code == 200)
+        throw std::runtime_error("Server does not support range requests");
+    if (code != 206)
+        throw std::runtime_error("HTTP request failed: " + status);
+    if (chunked)
+        throw std::runtime_error("Chunked range responses are not supported");
+
+    // "bytes first-last/total"
+    unsigned long long from, to, of;
+    if (sscanf(contentRange.c_str(), "bytes %llu-%llu/%llu", &from, &to, &of) != 3 || to < from ||
+        to >= of)
+        throw std::runtime_error("Bad Content-Range: " + contentRange);
+    uint64_t length = to - from + 1;
+    if (!contentLength.empty() && strtoull(contentLength.c_str(), nullptr, 10) != length)
+        throw std::runtime_error("Content-Length does not match Content-Range");
+
+    body.resize(static_cast<size_t>(length));
+    size_t have = std::min(received.size(), body.size());
+    memcpy(body.data(), received.data(), have);
+    received.erase(0, have);
+    while (have < body.size()) {
+        size_t n = ReceiveSome(handle, reinterpret_cast<char*>(body.data()) + have,
+                               body.size() - have);
+        if (n == 0)
+            throw std::runtime_error("Connection closed part way through a response");
+        have += n;
+    }
+    first = from;
+    total = of;
+    keepAlive = persistent;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TRemoteRangeSource - Archive Bytes In ChunkBytes Reads
+ */
+class TRemoteRangeSource : public TByteSource
+{
+  public:
+    TRemoteRangeSource(const TRemotePack& pack, uint64_t offset, uint64_t length)
+        : pack(pack), offset(offset), left(length) {}
+
+    bool Next(const uint8_t*& data, size_t& size) override
+    {
+        if (left == 0)
+            return false;
+        const uint64_t chunk = TRemotePack::ChunkBytes;
+        size_t n = static_cast<size_t>(std::min(left, chunk));
+        buffer.resize(n);
+        pack.Read(offset, n, buffer.data());
+        offset += n;
+        left -= n;
+        data = buffer.data();
+        size = n;
+        return true;
+    }
+
+  private:
+    const TRemotePack& pack;
+    uint64_t offset;
+    uint64_t left;
+    std::vector<uint8_t> buffer;
+};
+
+/*
+ * TRemoteInflateSource - Deflated Remote Entry Stream
+ */
+class TRemoteInflateSource : public TByteSource
+{
+  public:
+    TRemoteInflateSource(const TRemotePack& pack, uint64_t offset, uint64_t length)
+        : raw(pack, offset, length), inflater(&raw) {}
+
+    bool Next(const uint8_t*& data, size_t& size) override
+    {
+        return inflater.Next(data, size);
+    }
+
+  private:
+    TRemoteRangeSource raw;
+    TInflater inflater;
+};
+//---------------------------------------------------------------------------
+
+/*
+ * Open Remote Archive
+ * A suffix range fetches the tail and, through its Content-Range, the
+ * archive size. When the directory reaches further back than the tail,
+ * OpenDirectory() says from where, and that part is fetched in one more
+ * request.
+ */
+TRemotePack::TRemotePack(const std::string& url, size_t cacheBytes, unsigned connections)
+    : url(url), size(0), policy(cacheBytes, cpLru), connectionsOpen(0),
+      connectionsMax(std::max(1u, connections)), stats(), stopping(false)
+{
+    ParseUrl(url, authority, host, port, path);
+    StartSockets();
+
+    std::vector<uint8_t> tail;
+    uint64_t first;
+    Get("bytes=-" + std::to_string(TailBytes), tail, first, size);
+    if (first + tail.size() != size)
+        throw std::runtime_error("Unexpected answer to the tail request from " + url);
+
+    uint64_t needFrom;
+    while (!directory.OpenDirectory(tail.data(), tail.size(), size, needFrom)) {
+        uint64_t tailStart = size - tail.size();
+        if (needFrom >= tailStart)
+            throw EDecodeError("Corrupt central directory");
+        std::vector<uint8_t> more;
+        uint64_t total;
+        Get(RangeHeader(needFrom, tailStart - needFrom), more, first, total);
+        if (first != needFrom || more.size() != tailStart - needFrom || total != size)
+            throw std::runtime_error("Unexpected range answer from " + url);
+        more.insert(more.end(), tail.begin(), tail.end());
+        tail.swap(more);
+    }
+    stats.archiveBytes = size;
+
+    try {
+        for (unsigned i = 1; i < connectionsMax; i++)
+            workers.push_back(std::thread(&TRemotePack::Work, this));
+    } catch (...) {
+        StopWorkers();
+        throw;
+    }
+}
+
+TRemotePack::~TRemotePack()
+{
+    StopWorkers();
+}
+
+void TRemotePack::StopWorkers()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    jobAdded.notify_all();
+    for (size_t i = 0; i < workers.size(); i++)
+        workers[i].join();
+    workers.clear();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Range Request
+ * Takes an idle connection, or opens one while fewer than connectionsMax
+ * are, or waits for one to come back. The server may have closed an idle
+ * keep-alive connection: a reused one that fails before any answer is
+ * replaced once and the request sent again.
+ */
+void TRemotePack::Get(const std::string& range, std::vector<uint8_t>& body, uint64_t& first,
+                      uint64_t& total) const
+{
+    static TCounter& requestCount =
+        MetricCounter("zip_remote_requests_total", "HTTP range requests made for remote packs");
+    static TCounter& byteCount =
+        MetricCounter("zip_remote_bytes_total", "Response bytes received for remote packs");
+    static THistogram& requestTime =
+        MetricHistogram("zip_remote_request_seconds", "Time to answer one HTTP range request");
+
+    std::unique_ptr<THttpConnection> connection;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        changed.wait(guard, [this]() { return !idle.empty() || connectionsOpen < connectionsMax; });
+        if (!idle.empty()) {
+            connection = std::move(idle.back());
+            idle.pop_back();
+        } else {
+            connectionsOpen++;
+        }
+    }
+
+    THistogram::TClock::time_point start = THistogram::TClock::now();
+    try {
+        for (unsigned attempt = 0;; attempt++) {
+            if (!connection)
+                connection.reset(new THttpConnection(host, port));
+            bool reused = connection->Used();
+            try {
+                connection->Get(authority, path, range, body, first, total);
+                break;
+            } catch (const std::exception&) {
+                bool retry = reused && !connection->Answered() && attempt == 0;
+                connection.reset();
+                if (!retry)
+                    throw;
+                std::lock_guard<std::mutex> guard(lock);
+                stats.reconnects++;
+            }
+        }
+    } catch (...) {
+        std::lock_guard<std::mutex> guard(lock);
+        connectionsOpen--;
+        changed.notify_all();
+        throw;
+    }
+    requestTime.RecordSince(start);
+    requestCount.Add();
+    byteCount.Add(body.size());
+
+    std::lock_guard<std::mutex> guard(lock);
+    stats.requests++;
+    stats.bytes += body.size();
+    if (connection->KeepAlive())
+        idle.push_back(std::move(connection));
+    else
+        connectionsOpen--;
+    changed.notify_all();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Claim Blocks
+ * Sorts blocks [first, last] into those cached (into `found`, if given),
+ * those another reader is fetching (into `waitFor`, if given) and the
+ * rest, which are marked pending and appended to `runs`, adjacent ones
+ * joined up to ChunkBytes a run. Without `found` (prefetching) cached
+ * blocks are left alone. Called with the lock held.
+ */
+void TRemotePack::Claim(uint64_t first, uint64_t last, std::vector<TBlockRun>& runs,
+                        std::vector<uint64_t>* waitFor,
+                        std::unordered_map<uint64_t, TBlock>* found) const
+{
+    const uint64_t maxRun = ChunkBytes / BlockSize;
+    for (uint64_t block = first; block <= last; block++) {
+        std::unordered_map<uint64_t, TBlock>::const_iterator hit = cache.find(block);
+        if (hit != cache.end()) {
+            if (found != nullptr) {
+                (*found)[block] = hit->second;
+                policy.Touch(static_cast<size_t>(block));
+                stats.blockHits++;
+            }
+            continue;
+        }
+        if (pending.count(block) != 0) {
+            if (waitFor != nullptr) {
+                waitFor->push_back(block);
+                stats.blockWaits++;
+            }
+            continue;
+        }
+        pending.insert(block);
+        stats.blockMisses++;
+        if (!runs.empty() && runs.back().first + runs.back().count == block &&
+            runs.back().count < maxRun) {
+            runs.back().count++;
+        } else {
+            TBlockRun run = {block, 1};
+            runs.push_back(run);
+        }
+    }
+}
+
+/*
+ * Claim Entry Blocks
+ * The local header's name and extra field lengths are not known before
+ * it arrives: the name is taken to repeat the central one and
+ * LocalExtraSlack bytes cover a typical extra field, so header and data
+ * normally come in one request. Called with the lock held.
+ */
+void TRemotePack::ClaimEntry(size_t index, uint64_t limit, std::vector<TBlockRun>& runs) const
+{
+    const TPackEntry& entry = directory.Entry(index);
+    if (entry.headerOffset >= size)
+        return;
+    uint64_t extent = LocalHeaderSize + entry.name.size() + LocalExtraSlack + entry.compressedSize;
+    extent = std::min(std::min(extent, limit), size - entry.headerOffset);
+    Claim(entry.headerOffset / BlockSize, (entry.headerOffset + extent - 1) / BlockSize, runs,
+          nullptr, nullptr);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Fetch Claimed Runs
+ * Runs go out in parallel: the calling thread takes them one by one, and
+ * a job posted to the pack's fetch workers lets them take the others.
+ * The workers live as long as the pack, one per connection beyond the
+ * caller's; they are not task pool workers because they wait on the
+ * network, and pool workers are meant for decoding. The first failure is
+ * rethrown once every run has finished or failed.
+ */
+void TRemotePack::Fetch(const std::vector<TBlockRun>& runs,
+                        std::unordered_map<uint64_t, TBlock>* found) const
+{
+    if (runs.empty())
+        return;
+
+    TFetchJob job = {&runs, found, 0, 0, std::exception_ptr()};
+    if (runs.size() > 1 && !workers.empty()) {
+        std::lock_guard<std::mutex> guard(lock);
+        jobs.push_back(&job);
+        jobAdded.notify_all();
+    }
+    for (;;) {
+        size_t run;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            if (job.next == runs.size())
+                break;
+            run = TakeRun(job);
+        }
+        RunJob(job, run);
+    }
+
+    std::unique_lock<std::mutex> guard(lock);
+    changed.wait(guard, [&job]() { return job.busy == 0; });
+    if (job.failure)
+        std::rethrow_exception(job.failure);
+}
+
+/*
+ * Take A Run
+ * Hands out the job's next run, withdrawing the job from the workers
+ * once it has none left. Called with the lock held.
+ */
+size_t TRemotePack::TakeRun(TFetchJob& job) const
+{
+    size_t run = job.next++;
+    job.busy++;
+    if (job.next == job.runs->size()) {
+        std::deque<TFetchJob*>::iterator posted = std::find(jobs.begin(), jobs.end(), &job);
+        if (posted != jobs.end())
+            jobs.erase(posted);
+    }
+    return run;
+}
+
+// Fetches one run taken from `job` and hands back its share of the job
+void TRemotePack::RunJob(TFetchJob& job, size_t run) const
+{
+    std::exception_ptr failure;
+    try {
+        FetchRun((*job.runs)[run], job.found);
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    std::lock_guard<std::mutex> guard(lock);
+    if (failure && !job.failure)
+        job.failure = failure;
+    job.busy--;
+    changed.notify_all();
+}
+
+/*
+ * Fetch Worker
+ * Takes runs from the oldest posted job until the pack is destroyed.
+ */
+void TRemotePack::Work()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        jobAdded.wait(guard, [this]() { return stopping || !jobs.empty(); });
+        if (stopping)
+            return;
+        TFetchJob& job = *jobs.front();
+        size_t run = TakeRun(job);
+        guard.unlock();
+        RunJob(job, run);
+        guard.lock();
+    }
+}
+
+/*
+ * Fetch One Run
+ * Blocks go into the cache and, for a reader that claimed them, straight
+ * into its `found` too, so a cache smaller than one read cannot make it
+ * fetch forever. A failed run releases its blocks for the next reader.
+ */
+void TRemotePack::FetchRun(const TBlockRun& run,
+                           std::unordered_map<uint64_t, TBlock>* found) const
+{
+    uint64_t offset = run.first * BlockSize;
+    uint64_t length = std::min(run.count * BlockSize, size - offset);
+    std::vector<uint8_t> body;
+    try {
+        uint64_t first, total;
+        Get(RangeHeader(offset, length), body, first, total);
+        if (total != size)
+            throw std::runtime_error("Remote archive changed size: " + url);
+        if (first != offset || body.size() != length)
+            throw std::runtime_error("Unexpected range answer from " + url);
+    } catch (...) {
+        std::lock_guard<std::mutex> guard(lock);
+        for (uint64_t k = 0; k < run.count; k++)
+            pending.erase(run.first + k);
+        changed.notify_all();
+        throw;
+    }
+
+    std::vector<size_t> evicted;
+    std::lock_guard<std::mutex> guard(lock);
+    for (uint64_t k = 0; k < run.count; k++) {
+        size_t from = static_cast<size_t>(k * BlockSize);
+        size_t to = std::min(from + BlockSize, body.size());
+        TBlock block(new std::vector<uint8_t>(body.begin() + from, body.begin() + to));
+        uint64_t number = run.first + k;
+        cache[number] = block;
+        if (found != nullptr)
+            (*found)[number] = block;
+        evicted.clear();
+        policy.Add(static_cast<size_t>(number), BlockSize, evicted);
+        for (size_t i = 0; i < evicted.size(); i++)
+            cache.erase(evicted[i]);
+        pending.erase(number);
+    }
+    changed.notify_all();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Read Archive Bytes
+ * Claims the blocks the range covers and fetches the missing ones; blocks
+ * another reader was fetching are waited for, and fetched here after all
+ * if that fetch failed or they were evicted again in the meantime.
+ */
+void TRemotePack::Read(uint64_t offset, size_t length, void* dst) const
+{
+    if (length == 0)
+        return;
+    if (offset > size || length > size - offset)
+        throw EDecodeError("Read past the end of the remote archive");
+
+    uint64_t firstBlock = offset / BlockSize;
+    uint64_t lastBlock = (offset + length - 1) / BlockSize;
+    std::unordered_map<uint64_t, TBlock> found;
+    std::vector<uint64_t> waitFor;
+    std::vector<TBlockRun> runs;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Claim(firstBlock, lastBlock, runs, &waitFor, &found);
+    }
+    Fetch(runs, &found);
+
+    while (!waitFor.empty()) {
+        std::vector<uint64_t> stillWaiting;
+        runs.clear();
+        {
+            std::unique_lock<std::mutex> guard(lock);
+            for (size_t i = 0; i < waitFor.size(); i++) {
+                uint64_t block = waitFor[i];
+                changed.wait(guard, [&]() { return pending.count(block) == 0; });
+                std::unordered_map<uint64_t, TBlock>::const_iterator hit = cache.find(block);
+                if (hit != cache.end())
+                    found[block] = hit->second;
+                else
+                    Claim(block, block, runs, &stillWaiting, &found);
+            }
+        }
+        Fetch(runs, &found);
+        waitFor.swap(stillWaiting);
+    }
+
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    size_t done = 0;
+    for (uint64_t block = firstBlock; block <= lastBlock; block++) {
+        const std::vector<uint8_t>& bytes = *found[block];
+        size_t skip = block == firstBlock ? static_cast<size_t>(offset - block * BlockSize) : 0;
+        size_t n = std::min(bytes.size() - skip, length - done);
+        memcpy(to + done, bytes.data() + skip, n);
+        done += n;
+    }
+}
+//---------------------------------------------------------------------------
+
+uint64_t TRemotePack::DataOffset(size_t index) const
+{
+    const TPackEntry& entry = directory.Entry(index);
+    if (entry.headerOffset > size || size - entry.headerOffset < LocalHeaderSize)
+        throw EDecodeError("Local header out of range");
+    uint8_t local[LocalHeaderSize];
+    Read(entry.headerOffset, LocalHeaderSize, local);
+    if (ReadLE32(local) != SigLocalHeader)
+        throw EDecodeError("Corrupt local header");
+    uint64_t offset = entry.headerOffset + LocalHeaderSize + ReadLE16(local + 26) +
+                      ReadLE16(local + 28);
+    if (offset > size || size - offset < entry.compressedSize)
+        throw EDecodeError("Entry data out of range");
+    return offset;
+}
+
+/*
+ * Open Entry Stream
+ * Claims the local header and the first ChunkBytes of data together, so a
+ * flag costs one request; what is left of a large entry streams in.
+ */
+std::unique_ptr<TByteSource> TRemotePack::OpenEntry(size_t index) const
+{
+    const TPackEntry& entry = directory.Entry(index);
+    if (entry.method != TFlagPack::MethodStored && entry.method != TFlagPack::MethodDeflated)
+        throw EDecodeError("Unsupported compression method");
+
+    std::vector<TBlockRun> runs;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        ClaimEntry(index, ChunkBytes, runs);
+    }
+    Fetch(runs, nullptr);
+
+    uint64_t offset = DataOffset(index);
+    TByteSource* source;
+    if (entry.method == TFlagPack::MethodStored)
+        source = new TRemoteRangeSource(*this, offset, entry.compressedSize);
+    else
+        source = new TRemoteInflateSource(*this, offset, entry.compressedSize);
+    return std::unique_ptr<TByteSource>(new TCheckedEntrySource(source, entry));
+}
+
+/*
+ * Entry Checkpoint Index
+ * As TFlagPack::EntryIndex(): a stored "<name>.zidx" companion is read
+ * when the pack has one, otherwise the compressed entry is streamed
+ * through the block cache once to build the index. Built indexes are
+ * kept for the lifetime of the pack; two threads may race to build the
+ * same one, and the first one stored wins.
+ */
+std::shared_ptr<const TInflateIndex> TRemotePack::EntryIndex(size_t index) const
+{
+    const TPackEntry& entry = directory.Entry(index);
+    if (entry.method != TFlagPack::MethodDeflated || entry.size < TFlagPack::IndexThreshold)
+        return std::shared_ptr<const TInflateIndex>();
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::unordered_map<size_t, std::shared_ptr<const TInflateIndex> >::const_iterator it =
+            indexes.find(index);
+        if (it != indexes.end())
+            return it->second;
+    }
+
+    std::shared_ptr<TInflateIndex> built(new TInflateIndex());
+    int companion = directory.Find(entry.name + TFlagPack::IndexSuffix);
+    if (companion >= 0 && directory.Entry(companion).method == TFlagPack::MethodStored) {
+        std::vector<uint8_t> bytes(static_cast<size_t>(directory.Entry(companion).size));
+        Read(DataOffset(companion), bytes.size(), bytes.data());
+        built->Deserialize(bytes.data(), bytes.size());
+    } else {
+        TRemoteRangeSource compressed(*this, DataOffset(index), entry.compressedSize);
+        built->Build(&compressed);
+    }
+
+    std::lock_guard<std::mutex> guard(lock);
+    std::shared_ptr<const TInflateIndex>& slot = indexes[index];
+    if (!slot)
+        slot = built;
+    return slot;
+}
+
+/*
+ * Random Access Read
+ * Stored entries fetch only the blocks the range covers. Large deflated
+ * ones resume from the nearest checkpoint, fetching the compressed bytes
+ * from there on; small ones are inflated from the start and discarded up
+ * to the offset.
+ */
+size_t TRemotePack::ReadAt(size_t index, uint64_t offset, void* dst, size_t length) const
+{
+    const TPackEntry& entry = directory.Entry(index);
+    if (offset >= entry.size)
+        return 0;
+    if (length > entry.size - offset)
+        length = static_cast<size_t>(entry.size - offset);
+
+    if (entry.method == TFlagPack::MethodStored) {
+        Read(DataOffset(index) + offset, length, dst);
+        return length;
+    }
+
+    std::shared_ptr<const TInflateIndex> checkpoints = EntryIndex(index);
+    if (checkpoints) {
+        uint64_t start = checkpoints->StartByte(offset);
+        if (start > entry.compressedSize)
+            throw EDecodeError("Inflate index does not match entry data");
+        TRemoteRangeSource compressed(*this, DataOffset(index) + start,
+                                      entry.compressedSize - start);
+        return checkpoints->Read(&compressed, offset, dst, length);
+    }
+
+    std::unique_ptr<TByteSource> source = OpenEntry(index);
+    uint8_t* to = static_cast<uint8_t*>(dst);
+    uint64_t pos = 0;
+    size_t done = 0;
+    const uint8_t* chunk;
+    size_t chunkSize;
+    while (done < length && source->Next(chunk, chunkSize)) {
+        uint64_t chunkEnd = pos + chunkSize;
+        if (chunkEnd > offset + done) {
+            size_t skip = static_cast<size_t>(offset + done - pos);
+            size_t n = chunkSize - skip;
+            if (n > length - done)
+                n = length - done;
+            memcpy(to + done, chunk + skip, n);
+            done += n;
+        }
+        pos = chunkEnd;
+    }
+    return done;
+}
+
+void TRemotePack::Prefetch(const std::vector<size_t>& indexes) const
+{
+    // Archive order, so neighbouring entries join into one run
+    std::vector<size_t> order(indexes);
+    std::sort(order.begin(), order.end(), [this](size_t a, size_t b) {
+        return directory.Entry(a).headerOffset < directory.Entry(b).headerOffset;
+    });
+
+    std::vector<TBlockRun> runs;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        for (size_t i = 0; i < order.size(); i++)
+            ClaimEntry(order[i], ChunkBytes, runs);
+    }
+    Fetch(runs, nullptr);
+}
+
+TRemoteStats TRemotePack::Stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    TRemoteStats copy = stats;
+    copy.cachedBlocks = cache.size();
+    copy.cachedBytes = policy.Bytes();
+    return copy;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TLoopbackServer - Stand-In Range Server
+ * Serves one memory span over HTTP/1.1 on 127.0.0.1 from a single thread
+ * polling every connection, holding each answer back `latencyMs` to play
+ * a distant file server; the waits of different connections overlap.
+ * Knows "bytes=a-b", "bytes=a-" and "bytes=-n" ranges; requests without
+ * one get the whole span with a 200.
+ */
+class TLoopbackServer
+{
+  public:
+    TLoopbackServer(const uint8_t* data, uint64_t size, unsigned latencyMs);
+    ~TLoopbackServer();
+
+    unsigned Port() const { return port; }
+    uint64_t Requests() const { return requests; }
+    uint64_t BytesSent() const { return bytesSent; }
+
+  private:
+    static const int StopCheckMs = 50;  // Longest poll, so stopping is noticed
+
+    struct TClient
+    {
+        TSocket socket;
+        std::string received;       // Bytes after the last request taken
+        std::string header;         // Request waiting for its answer, if any
+        TClock::time_point due;     // When that answer goes out
+    };
+
+    const uint8_t* data;
+    uint64_t size;
+    unsigned latencyMs;
+    TSocket listener;
+    unsigned port;
+    std::atomic<bool> stopping;
+    std::atomic<uint64_t> requests;
+    std::atomic<uint64_t> bytesSent;
+
+    std::vector<TClient> clients;   // Only touched by the server thread
+    std::thread server;
+
+    void Run();
+    void Accept();
+    void TakeRequest(TClient& client);
+    void Drop(size_t client);
+    bool Answer(TSocket client, const std::string& header);
+
+    TLoopbackServer(const TLoopbackServer&);
+    TLoopbackServer& operator=(const TLoopbackServer&);
+};
+
+TLoopbackServer::TLoopbackServer(const uint8_t* data, uint64_t size, unsigned latencyMs)
+    : data(data), size(size), latencyMs(latencyMs), listener(NoSocket), port(0),
+      stopping(false), requests(0), bytesSent(0)
+{
+    StartSockets();
+    listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (listener == NoSocket)
+        throw std::runtime_error("Unable to create the stand-in server socket");
+
+    sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = 0;           // Any free port
+    socklen_t addressSize = sizeof(address);
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+        listen(listener, 16) != 0 ||
+        getsockname(listener, reinterpret_cast<sockaddr*>(&address), &addressSize) != 0) {
+        CloseSocket(listener);
+        throw std::runtime_error("Unable to start the stand-in server");
+    }
+    port = ntohs(address.sin_port);
+    server = std::thread(&TLoopbackServer::Run, this);
+}
+
+TLoopbackServer::~TLoopbackServer()
+{
+    stopping = true;
+    server.join();
+    CloseSocket(listener);
+    for (size_t i = 0; i < clients.size(); i++)
+        CloseSocket(clients[i].socket);
+}
+
+/*
+ * Server Loop
+ * Sends the answers that have fallen due, then polls the listener and
+ * every connection until the next one does. Answers go out with
+ * blocking sends; the clients are reading them.
+ */
+void TLoopbackServer::Run()
+{
+    std::vector<pollfd> sockets;
+    while (!stopping) {
+        TClock::time_point now = TClock::now();
+        int waitMs = StopCheckMs;
+        for (size_t i = 0; i < clients.size();) {
+            TClient& client = clients[i];
+            if (!client.header.empty() && client.due <= now) {
+                if (!Answer(client.socket, client.header)) {
+                    Drop(i);
+                    continue;
+                }
+                client.header.clear();
+                TakeRequest(client);                // One sent behind it
+            }
+            if (!client.header.empty()) {
+                long long ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                                   client.due - now).count() + 1;
+                waitMs = static_cast<int>(std::max(0LL, std::min<long long>(waitMs, ms)));
+            }
+            i++;
+        }
+
+        sockets.clear();
+        pollfd entry = {listener, POLLIN, 0};
+        sockets.push_back(entry);
+        for (size_t i = 0; i < clients.size(); i++) {
+            entry.fd = clients[i].socket;
+            sockets.push_back(entry);
+        }
+        if (PollSockets(sockets, waitMs) <= 0)
+            continue;
+
+        // Backwards, so dropping a client leaves the earlier indexes valid
+        for (size_t i = sockets.size() - 1; i > 0; i--) {
+            if (sockets[i].revents == 0)
+                continue;
+            char chunk[4096];
+            size_t n = ReceiveSome(clients[i - 1].socket, chunk, sizeof(chunk));
+            if (n == 0) {
+                Drop(i - 1);
+                continue;
+            }
+            clients[i - 1].received.append(chunk, n);
+            TakeRequest(clients[i - 1]);
+        }
+        if (sockets[0].revents != 0)
+            Accept();
+    }
+}
+
+void TLoopbackServer::Accept()
+{
+    TSocket socket = accept(listener, nullptr, nullptr);
+    if (socket == NoSocket)
+        return;
+    int on = 1;                                     // Header and body are separate sends
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on),
+               sizeof(on));
+    SetTimeouts(socket, TimeoutMs);                 // A stuck client cannot stall the rest
+    TClient client;
+    client.socket = socket;
+    clients.push_back(client);
+}
+
+// Starts the wait for the client's next complete request, if it has one
+// and is not waiting already
+void TLoopbackServer::TakeRequest(TClient& client)
+{
+    size_t end;
+    if (!client.header.empty() || (end = client.received.find("\r\n\r\n")) == std::string::npos)
+        return;
+    client.header = client.received.substr(0, end + 2);
+    client.received.erase(0, end + 4);
+    client.due = TClock::now() + std::chrono::milliseconds(latencyMs);
+}
+
+void TLoopbackServer::Drop(size_t client)
+{
+    CloseSocket(clients[client].socket);
+    clients.erase(clients.begin() + client);
+}
+
+bool TLoopbackServer::Answer(TSocket client, const std::string& header)
+{
+    uint64_t first = 0;
+    uint64_t last = size - 1;
+    bool ranged = false;
+    bool valid = size > 0;
+
+    std::string lower = Lower(header);
+    size_t at = lower.find("\r\nrange:");
+    if (at != std::string::npos) {
+        ranged = true;
+        at += 8;
+        std::string spec = Trim(lower.substr(at, lower.find("\r\n", at) - at));
+        size_t dash = spec.find('-');
+        if (spec.compare(0, 6, "bytes=") != 0 || dash == std::string::npos ||
+            spec.find(',') != std::string::npos) {
+            valid = false;
+        } else if (dash == 6) {
+            uint64_t count = strtoull(spec.c_str() + 7, nullptr, 10);
+            valid = valid && count > 0;
+            first = count >= size ? 0 : size - count;
+        } else {
+            first = strtoull(spec.c_str() + 6, nullptr, 10);
+            if (dash + 1 < spec.size())
+                last = std::min(last, static_cast<uint64_t>(strtoull(spec.c_str() + dash + 1,
+                                                                    nullptr, 10)));
+            valid = valid && first <= last;
+        }
+    }
+
+    requests++;
+
+    std::ostringstream reply;
+    if (!valid) {
+        reply << "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */" << size
+              << "\r\nContent-Length: 0\r\n\r\n";
+        std::string text = reply.str();
+        return SendAll(client, text.data(), text.size());
+    }
+    uint64_t length = last - first + 1;
+    reply << (ranged ? "HTTP/1.1 206 Partial Content\r\n" : "HTTP/1.1 200 OK\r\n");
+    if (ranged)
+        reply << "Content-Range: bytes " << first << "-" << last << "/" << size << "\r\n";
+    reply << "Content-Length: " << length << "\r\nAccept-Ranges: bytes\r\n\r\n";
+    std::string text = reply.str();
+    if (!SendAll(client, text.data(), text.size()) ||
+        !SendAll(client, reinterpret_cast<const char*>(data + first),
+                 static_cast<size_t>(length)))
+        return false;
+    bytesSent += length;
+    return true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Remote Pack Benchmark
+ */
+
+static double MsSince(TClock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(TClock::now() - start).count();
+}
+
+static double KB(uint64_t bytes)
+{
+    return bytes / 1024.0;
+}
+
+// Reads `page` through a fresh pack, so with a cold cache, and returns
+// the time; `requests` counts what the page took beyond the open
+static double ReadPage(const std::string& url, const std::vector<size_t>& page, bool prefetch,
+                       uint64_t& requests)
+{
+    TPackVolumeSet pack;
+    pack.AddVolumeUrl(url);
+    uint64_t before = pack.RemoteStats().requests;
+
+    TClock::time_point start = TClock::now();
+    if (prefetch)
+        pack.Prefetch(page);
+    for (size_t i = 0; i < page.size(); i++) {
+        std::unique_ptr<TByteSource> source = pack.OpenEntry(page[i]);
+        const uint8_t* chunk;
+        size_t chunkSize;
+        while (source->Next(chunk, chunkSize)) {
+        }
+    }
+    double ms = MsSince(start);
+    requests = pack.RemoteStats().requests - before;
+    return ms;
+}
+
+void RunRemoteBench(const std::string& source, unsigned latencyMs, unsigned views,
+                    std::ostream& out)
+{
+    std::unique_ptr<TMappedFile> file;
+    std::unique_ptr<TLoopbackServer> server;
+    std::string url = source;
+    if (source.find("://") == std::string::npos) {
+        file.reset(new TMappedFile());
+        file->Open(source);
+        server.reset(new TLoopbackServer(file->Data(), file->Size(), latencyMs));
+        size_t slash = source.find_last_of("/\\");
+        url = "http://127.0.0.1:" + std::to_string(server->Port()) + "/" +
+              (slash == std::string::npos ? source : source.substr(slash + 1));
+        out << "Serving " << source << " at " << url << ", " << latencyMs
+            << " ms per request\n";
+    }
+    out << std::fixed << std::setprecision(1);
+
+    TClock::time_point start = TClock::now();
+    TPackVolumeSet pack;
+    pack.AddVolumeUrl(url);
+    double openMs = MsSince(start);
+    TRemoteStats opened = pack.RemoteStats();
+    out << "open        " << std::setw(8) << openMs << " ms, " << std::setw(4) << opened.requests
+        << " requests, " << std::setw(8) << KB(opened.bytes) << " KB of "
+        << opened.archiveBytes / 1024.0 / 1024.0 << " MB, " << pack.Count() << " entries\n";
+
+    std::vector<size_t> pngs = PngEntries(pack);
+    if (pngs.empty()) {
+        out << "No PNG entries\n";
+        return;
+    }
+
+    // Random flags, decoded as the viewer shows them
+    std::vector<size_t> shuffled(pngs);
+    std::mt19937 random(1);
+    std::shuffle(shuffled.begin(), shuffled.end(), random);
+    std::vector<size_t> viewed(shuffled.begin(),
+                               shuffled.begin() + std::min<size_t>(views, shuffled.size()));
+    uint64_t flagBytes = 0;
+    std::vector<double> viewMs;
+    for (size_t i = 0; i < viewed.size(); i++) {
+        TDecodedImage image;
+        TClock::time_point viewStart = TClock::now();
+        DecodePngEntry(pack, viewed[i], image);
+        viewMs.push_back(MsSince(viewStart));
+        flagBytes += pack.Entry(viewed[i]).compressedSize;
+    }
+    TRemoteStats seen = pack.RemoteStats();
+    uint64_t viewBytes = seen.bytes - opened.bytes;
+    out << "view " << std::setw(4) << viewed.size() << "   ms p50 " << std::setw(6)
+        << SamplePercentile(viewMs, 0.5) << " p99 " << std::setw(6)
+        << SamplePercentile(viewMs, 0.99)
+        << ", " << std::setw(4) << seen.requests - opened.requests << " requests, "
+        << std::setw(8) << KB(viewBytes) << " KB for " << KB(flagBytes)
+        << " KB of flag data (" << std::setprecision(2)
+        << 100.0 * viewBytes / seen.archiveBytes << "% of the pack)\n"
+        << std::setprecision(1);
+
+    start = TClock::now();
+    for (size_t i = 0; i < viewed.size(); i++) {
+        TDecodedImage image;
+        DecodePngEntry(pack, viewed[i], image);
+    }
+    double againMs = MsSince(start);
+    TRemoteStats again = pack.RemoteStats();
+    out << "view again  " << std::setw(8) << againMs << " ms, " << std::setw(4)
+        << again.requests - seen.requests << " requests, block cache " << again.cachedBlocks
+        << " blocks, " << KB(again.cachedBytes) << " KB\n";
+
+    // A gallery page: random flags, then neighbours in the archive
+    const size_t PageSize = 16;
+    std::vector<size_t> randomPage(shuffled.end() - std::min(PageSize, shuffled.size()),
+                                   shuffled.end());
+    size_t middle = pngs.size() / 2 - std::min(pngs.size() / 2, PageSize / 2);
+    std::vector<size_t> adjacentPage(pngs.begin() + middle,
+                                     pngs.begin() + std::min(pngs.size(), middle + PageSize));
+    const std::vector<size_t>* pages[] = {&randomPage, &adjacentPage};
+    const char* const names[] = {"random", "adjacent"};
+    for (size_t p = 0; p < 2; p++) {
+        uint64_t oneRequests, prefetchRequests;
+        double oneMs = ReadPage(url, *pages[p], false, oneRequests);
+        double prefetchMs = ReadPage(url, *pages[p], true, prefetchRequests);
+        out << "page of " << pages[p]->size() << " " << std::left << std::setw(9) << names[p]
+            << std::right << "one by one " << std::setw(7) << oneMs << " ms, " << std::setw(3)
+            << oneRequests << " requests; prefetched " << std::setw(7) << prefetchMs << " ms, "
+            << std::setw(3) << prefetchRequests << " requests\n";
+    }
+
+    if (server)
+        out << "server      " << server->Requests() << " requests, "
+            << KB(server->BytesSent()) << " KB sent\n";
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,184 @@
+﻿/*
+ * RemotePack.h - Flag Packs Read Over HTTP Range Requests
+ *
+ * Declares TRemotePack, a ZIP archive on a web server read through HTTP/1.1
+ * "Range" requests, so sites can mount one central pack instead of
+ * embedding it in every copy of flags.RES. Nothing is downloaded up front:
+ *
+ * - Opening fetches the archive's tail (a suffix range, which also tells
+ *   the archive size) and parses the central directory from it; a
+ *   directory larger than the tail costs one more request for the rest.
+ * - Entry data is read through a cache of BlockSize blocks evicted least
+ *   recently used. Blocks missing from a read are fetched together:
+ *   adjacent ones in a single request, separate runs in parallel over a
+ *   small pool of keep-alive connections, by the reader and fetch workers
+ *   the pack starts with. Two readers wanting the same block share one
+ *   fetch.
+ * - Opening an entry fetches its local header and data in one request;
+ *   large entries stream in ChunkBytes requests, and ReadAt() of a stored
+ *   entry fetches just the blocks it covers (the tiled viewer's bands).
+ *   Large deflated entries get checkpoint indexes as in TFlagPack, so
+ *   ReadAt() resumes near the offset instead of inflating from the start.
+ *
+ * So only the flags actually viewed cross the wire, rounded out to whole
+ * blocks. Only plain http:// URLs are supported, and the server has to
+ * answer ranges with "206 Partial Content".
+ *
+ * "Zip.exe --pack remote <pack>" serves a local pack from a loopback
+ * stand-in server with simulated latency and measures what the viewer
+ * would fetch.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef RemotePackH
+#define RemotePackH
+//---------------------------------------------------------------------------
+
+#include "FlagPack.h"             // TFlagPack, TPackEntry, TByteSource, TInflateIndex
+#include "TinyLfu.h"              // TWTinyLfu
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>              // std::exception_ptr
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+class THttpConnection;
+
+/*
+ * TRemoteStats - Traffic And Block Cache Counters
+ */
+struct TRemoteStats
+{
+    uint64_t archiveBytes;          // Size of the remote archive
+    uint64_t requests;              // Range requests answered
+    uint64_t bytes;                 // Response body bytes received
+    uint64_t blockHits;
+    uint64_t blockMisses;           // Blocks fetched
+    uint64_t blockWaits;            // Blocks another reader was already fetching
+    uint64_t reconnects;            // Keep-alive connections the server had closed
+    size_t cachedBlocks;
+    size_t cachedBytes;
+};
+
+/*
+ * TRemotePack - ZIP Archive Behind An HTTP URL
+ * Entry access has the contracts of the TFlagPack methods of the same
+ * name. Network failures throw std::runtime_error. Thread-safe.
+ */
+class TRemotePack
+{
+  public:
+    static const size_t BlockSize = 4096;
+    static const size_t TailBytes = 16 * 1024;          // First fetch when opening
+    static const size_t ChunkBytes = 1024 * 1024;       // Largest single request
+    static const size_t DefaultCacheBytes = 32 << 20;
+    static const unsigned DefaultConnections = 4;
+
+    // Fetches the tail and parses the directory; throws EDecodeError if
+    // the URL is not a ZIP archive
+    explicit TRemotePack(const std::string& url, size_t cacheBytes = DefaultCacheBytes,
+                         unsigned connections = DefaultConnections);
+    ~TRemotePack();
+
+    const std::string& Url() const { return url; }
+    uint64_t Size() const { return size; }
+    const TFlagPack& Directory() const { return directory; }
+
+    std::unique_ptr<TByteSource> OpenEntry(size_t index) const;
+    size_t ReadAt(size_t index, uint64_t offset, void* dst, size_t length) const;
+
+    // Fetches the local headers and data (up to ChunkBytes of it) of
+    // `indexes` into the block cache ahead of reading them: one request
+    // per run of adjacent entries, the runs in parallel
+    void Prefetch(const std::vector<size_t>& indexes) const;
+
+    // Archive bytes [offset, offset + length), through the block cache
+    void Read(uint64_t offset, size_t length, void* dst) const;
+
+    TRemoteStats Stats() const;
+
+  private:
+    struct TBlockRun
+    {
+        uint64_t first;             // Block numbers [first, first + count)
+        uint64_t count;
+    };
+
+    typedef std::shared_ptr<const std::vector<uint8_t> > TBlock;
+
+    // The runs of one Fetch() call, shared out between the caller and the
+    // workers. Guarded by `lock`
+    struct TFetchJob
+    {
+        const std::vector<TBlockRun>* runs;
+        std::unordered_map<uint64_t, TBlock>* found;
+        size_t next;                // First run nobody has taken yet
+        size_t busy;                // Runs being fetched
+        std::exception_ptr failure; // The first one
+    };
+
+    std::string url;
+    std::string authority;          // "host[:port]", the Host header
+    std::string host;
+    std::string port;
+    std::string path;
+    uint64_t size;
+    TFlagPack directory;
+
+    mutable std::mutex lock;                    // Guards everything below
+    mutable std::condition_variable changed;    // A fetch finished, or a connection came back
+    mutable std::unordered_map<uint64_t, TBlock> cache;
+    mutable TWTinyLfu policy;
+    mutable std::unordered_set<uint64_t> pending;   // Blocks being fetched
+    mutable std::vector<std::unique_ptr<THttpConnection> > idle;
+    mutable unsigned connectionsOpen;
+    unsigned connectionsMax;
+    mutable TRemoteStats stats;
+    mutable std::unordered_map<size_t, std::shared_ptr<const TInflateIndex> > indexes;
+    mutable std::deque<TFetchJob*> jobs;        // Jobs with runs left to take
+    mutable std::condition_variable jobAdded;
+    bool stopping;
+    std::vector<std::thread> workers;           // connectionsMax - 1 of them
+
+    void Get(const std::string& range, std::vector<uint8_t>& body, uint64_t& first,
+             uint64_t& total) const;
+    void Claim(uint64_t first, uint64_t last, std::vector<TBlockRun>& runs,
+               std::vector<uint64_t>* waitFor, std::unordered_map<uint64_t, TBlock>* found) const;
+    void ClaimEntry(size_t index, uint64_t limit, std::vector<TBlockRun>& runs) const;
+    void Fetch(const std::vector<TBlockRun>& runs,
+               std::unordered_map<uint64_t, TBlock>* found) const;
+    void FetchRun(const TBlockRun& run, std::unordered_map<uint64_t, TBlock>* found) const;
+    size_t TakeRun(TFetchJob& job) const;
+    void RunJob(TFetchJob& job, size_t run) const;
+    void Work();
+    void StopWorkers();
+    uint64_t DataOffset(size_t index) const;
+    std::shared_ptr<const TInflateIndex> EntryIndex(size_t index) const;
+
+    TRemotePack(const TRemotePack&);
+    TRemotePack& operator=(const TRemotePack&);
+};
+
+//---------------------------------------------------------------------------
+
+// Serves the pack file `source` from a loopback stand-in server that
+// waits `latencyMs` per request (an http:// `source` is used as is),
+// views `views` random flags through it and compares the bytes fetched
+// with the pack size and the flags' own sizes; then times pages of flags
+// prefetched against read one by one
+void RunRemoteBench(const std::string& source, unsigned latencyMs, unsigned views,
+                    std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // RemotePackH
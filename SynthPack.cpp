@@ -0,0 +1,552 @@
+﻿/*
+ * SynthPack.cpp - Synthetic Pack Generator
+ *
+ * Implements the synthetic pack options, the per-entry generators and the
+ * parallel writer. Entries are produced in rounds: pool runners generate and
+ * compress one round of entries, then the round is written in order.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "SynthPack.h"
+#include "Checksum.h"             // Crc32 for PNG chunks
+#include "Deflate.h"              // TDeflater
+#include "PackBuilder.h"          // TPackBuilder, CompressEntry
+#include "TaskPool.h"             // TTaskPool::Shared
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>                  // exp, log, sqrt, cos for the size model
+#include <cstdlib>                // strtoull, abs
+#include <sstream>
+#include <stdexcept>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const uint64_t RoundEntries = 65536;         // Entries generated per round
+static const uint64_t RoundBytes = 64 << 20;        // Or this much data, whichever first
+static const double LogNormalSigma = 1.0;
+static const double Pi = 3.14159265358979323846;
+
+static const char* const PngFormatNames[] = {
+    "rgb8", "rgba8", "rgb16", "rgba16", "gray8", "gray16", "graya8", "graya16",
+    "pal1", "pal2", "pal4", "pal8"};
+static const char* const PngFilterNames[] = {"none", "sub", "up", "average", "paeth", "mixed"};
+
+/*
+ * TSynthRandom - SplitMix64
+ * Small, fast and fully specified, so every platform and compiler yields
+ * the same sequence (the std:: distributions are implementation defined).
+ */
+class TSynthRandom
+{
+  public:
+    TSynthRandom(uint64_t seed, uint64_t index, uint64_t stream)
+        : state(seed * 0x9E3779B97F4A7C15ull ^ (index + 1) * 0xBF58476D1CE4E5B9ull ^ stream)
+    {
+        Next();
+    }
+
+    uint64_t Next()
+    {
+        uint64_t z = (state += 0x9E3779B97F4A7C15ull);
+        z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+        z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+        return z ^ (z >> 31);
+    }
+
+    // Uniform in [0, bound)
+    uint64_t Below(uint64_t bound) { return bound == 0 ? 0 : Next() % bound; }
+
+    // Uniform in (0, 1)
+    double Unit() { return (static_cast<double>(Next() >> 11) + 0.5) / 9007199254740992.0; }
+
+  private:
+    uint64_t state;
+};
+
+// Independent random streams per entry
+enum TSynthStream { ssProperties = 1, ssContent = 2 };
+//---------------------------------------------------------------------------
+
+TSynthSpec::TSynthSpec()
+    : entries(1000), seed(1), sizeModel(smLogNormal), minSize(64), medianSize(16 << 10),
+      maxSize(4 << 20), content(scText), pngFormat(pfRgb8), pngFilter(sfNone),
+      deflatePercent(100), level(TDeflater::DefaultLevel),
+      minNameLength(6), maxNameLength(24), depth(1), fanout(16)
+{
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Option Parsing
+ * Counts use decimal suffixes (10M entries = 10,000,000); byte sizes use
+ * binary ones (16k = 16384).
+ */
+static uint64_t ParseNumber(const std::string& text, uint64_t unit)
+{
+    char* end = nullptr;
+    unsigned long long value = strtoull(text.c_str(), &end, 10);
+    if (end == text.c_str())
+        throw std::invalid_argument("Not a number: " + text);
+    std::string suffix(end);
+    if (suffix == "k" || suffix == "K")
+        value *= unit;
+    else if (suffix == "m" || suffix == "M")
+        value *= unit * unit;
+    else if (suffix == "g" || suffix == "G")
+        value *= unit * unit * unit;
+    else if (!suffix.empty())
+        throw std::invalid_argument("Bad number suffix: " + text);
+    return value;
+}
+
+void ParseSynthOption(TSynthSpec& spec, const std::string& option)
+{
+    size_t equals = option.find('=');
+    if (equals == std::string::npos)
+        throw std::invalid_argument("Expected key=value: " + option);
+    std::string key = option.substr(0, equals);
+    std::string value = option.substr(equals + 1);
+
+    if (key == "entries") {
+        spec.entries = ParseNumber(value, 1000);
+    } else if (key == "seed") {
+        spec.seed = ParseNumber(value, 1000);
+    } else if (key == "sizes") {
+        if (value == "fixed")
+            spec.sizeModel = smFixed;
+        else if (value == "uniform")
+            spec.sizeModel = smUniform;
+        else if (value == "lognormal")
+            spec.sizeModel = smLogNormal;
+        else
+            throw std::invalid_argument("Unknown size model: " + value);
+    } else if (key == "min") {
+        spec.minSize = ParseNumber(value, 1024);
+    } else if (key == "median") {
+        spec.medianSize = ParseNumber(value, 1024);
+    } else if (key == "max") {
+        spec.maxSize = ParseNumber(value, 1024);
+    } else if (key == "content") {
+        if (value == "random")
+            spec.content = scRandom;
+        else if (value == "text")
+            spec.content = scText;
+        else if (value == "png")
+            spec.content = scPng;
+        else
+            throw std::invalid_argument("Unknown content: " + value);
+    } else if (key == "png") {
+        const char* const* name = std::find(PngFormatNames, PngFormatNames + 12, value);
+        if (name == PngFormatNames + 12)
+            throw std::invalid_argument("Unknown PNG format: " + value);
+        spec.pngFormat = static_cast<TSynthPngFormat>(name - PngFormatNames);
+    } else if (key == "filter") {
+        const char* const* name = std::find(PngFilterNames, PngFilterNames + 6, value);
+        if (name == PngFilterNames + 6)
+            throw std::invalid_argument("Unknown PNG filter: " + value);
+        spec.pngFilter = static_cast<TSynthPngFilter>(name - PngFilterNames);
+    } else if (key == "deflate") {
+        spec.deflatePercent = static_cast<unsigned>(std::min<uint64_t>(ParseNumber(value, 1000), 100));
+    } else if (key == "level") {
+        spec.level = static_cast<int>(std::min<uint64_t>(ParseNumber(value, 1000), 9));
+    } else if (key == "names") {
+        size_t dash = value.find('-');
+        spec.minNameLength = static_cast<unsigned>(ParseNumber(value.substr(0, dash), 1000));
+        spec.maxNameLength = dash == std::string::npos
+                                 ? spec.minNameLength
+                                 : static_cast<unsigned>(ParseNumber(value.substr(dash + 1), 1000));
+    } else if (key == "depth") {
+        spec.depth = static_cast<unsigned>(ParseNumber(value, 1000));
+    } else if (key == "fanout") {
+        spec.fanout = static_cast<unsigned>(std::max<uint64_t>(ParseNumber(value, 1000), 1));
+    } else {
+        throw std::invalid_argument("Unknown option: " + key);
+    }
+
+    if (spec.maxSize < spec.minSize)
+        spec.maxSize = spec.minSize;
+    if (spec.maxNameLength < spec.minNameLength)
+        spec.maxNameLength = spec.minNameLength;
+}
+
+std::string DescribeSynthSpec(const TSynthSpec& spec)
+{
+    static const char* const Models[] = {"fixed", "uniform", "lognormal"};
+    static const char* const Contents[] = {"random", "text", "png"};
+
+    std::ostringstream text;
+    text << "entries=" << spec.entries << " seed=" << spec.seed
+         << " sizes=" << Models[spec.sizeModel] << " min=" << spec.minSize
+         << " median=" << spec.medianSize << " max=" << spec.maxSize
+         << " content=" << Contents[spec.content] << " png=" << PngFormatNames[spec.pngFormat]
+         << " filter=" << PngFilterNames[spec.pngFilter] << " deflate=" << spec.deflatePercent
+         << " level=" << spec.level << " names=" << spec.minNameLength << "-" << spec.maxNameLength
+         << " depth=" << spec.depth << " fanout=" << spec.fanout;
+    return text.str();
+}
+
+const char* SynthPngFormatName(TSynthPngFormat format)
+{
+    return PngFormatNames[format];
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Entry Properties
+ * Drawn in a fixed order from the entry's property stream: size, method,
+ * then name. Do not reorder, or existing seeds change meaning.
+ */
+static uint64_t DrawSize(const TSynthSpec& spec, TSynthRandom& random)
+{
+    switch (spec.sizeModel) {
+        case smFixed:
+            return spec.medianSize;
+        case smUniform:
+            return spec.minSize + random.Below(spec.maxSize - spec.minSize + 1);
+        default: {
+            // Box-Muller: one standard normal sample from two uniforms
+            // (drawn into locals: argument evaluation order is unspecified)
+            double u1 = random.Unit();
+            double u2 = random.Unit();
+            double z = sqrt(-2.0 * log(u1)) * cos(2.0 * Pi * u2);
+            double size = static_cast<double>(spec.medianSize) * exp(LogNormalSigma * z);
+            if (size < static_cast<double>(spec.minSize))
+                return spec.minSize;
+            if (size > static_cast<double>(spec.maxSize))
+                return spec.maxSize;
+            return static_cast<uint64_t>(size);
+        }
+    }
+}
+
+static std::string Base36(uint64_t value)
+{
+    std::string digits;
+    do {
+        digits.insert(digits.begin(), "0123456789abcdefghijklmnopqrstuvwxyz"[value % 36]);
+        value /= 36;
+    } while (value > 0);
+    return digits;
+}
+
+uint64_t SynthEntrySize(const TSynthSpec& spec, uint64_t index)
+{
+    TSynthRandom random(spec.seed, index, ssProperties);
+    return DrawSize(spec, random);
+}
+
+static bool SynthEntryDeflated(const TSynthSpec& spec, TSynthRandom& random)
+{
+    return random.Below(100) < spec.deflatePercent;
+}
+
+/*
+ * Entry Name
+ * "<folders>/<padding>-<index in base 36>.<ext>". The padding uses only
+ * letters and the index follows the last '-', so names are unique.
+ */
+std::string SynthEntryName(const TSynthSpec& spec, uint64_t index)
+{
+    static const char* const Extensions[] = {".bin", ".txt", ".png"};
+
+    TSynthRandom random(spec.seed, index, ssProperties);
+    DrawSize(spec, random);
+    SynthEntryDeflated(spec, random);
+
+    std::string name;
+    for (unsigned level = 0; level < spec.depth; level++)
+        name += "d" + Base36(level) + "_" + Base36(random.Below(spec.fanout)) + "/";
+
+    std::string suffix = "-" + Base36(index) + Extensions[spec.content];
+    unsigned length = spec.minNameLength +
+                      static_cast<unsigned>(random.Below(spec.maxNameLength - spec.minNameLength + 1));
+    for (size_t i = suffix.size(); i < length; i++)
+        name += static_cast<char>('a' + random.Below(26));
+    return name + suffix;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Text Content
+ * Words drawn with a skewed distribution, roughly like natural text, so
+ * deflate reaches typical ratios.
+ */
+static void FillText(TSynthRandom& random, uint8_t* dst, size_t size)
+{
+    static const char* const Words[32] = {
+        "the", "of", "and", "flag", "to", "in", "is", "red", "white", "blue",
+        "green", "stripe", "star", "with", "for", "on", "cross", "field", "yellow", "as",
+        "black", "by", "emblem", "canton", "crescent", "sun", "band", "border", "coat", "arms",
+        "triangle", "disc"};
+
+    size_t pos = 0;
+    unsigned wordsOnLine = 0;
+    while (pos < size) {
+        const char* word = Words[random.Below(random.Below(32) + 1)];
+        while (*word != '\0' && pos < size)
+            dst[pos++] = static_cast<uint8_t>(*word++);
+        if (pos < size)
+            dst[pos++] = ++wordsOnLine % 12 == 0 ? '\n' : ' ';
+    }
+}
+
+static void PutBE32(std::vector<uint8_t>& out, uint32_t value)
+{
+    for (int shift = 24; shift >= 0; shift -= 8)
+        out.push_back(static_cast<uint8_t>(value >> shift));
+}
+
+static void PutChunk(std::vector<uint8_t>& png, const char* type, const uint8_t* data, size_t size)
+{
+    PutBE32(png, static_cast<uint32_t>(size));
+    size_t start = png.size();
+    png.insert(png.end(), type, type + 4);
+    png.insert(png.end(), data, data + size);
+    PutBE32(png, Crc32(&png[start], png.size() - start));
+}
+
+/*
+ * PNG Layouts
+ * IHDR bit depth and colour type, and samples per pixel, of each format.
+ */
+struct TPngLayout
+{
+    uint8_t depth;
+    uint8_t colorType;
+    unsigned channels;
+};
+
+static const TPngLayout PngLayouts[] = {
+    {8, 2, 3}, {8, 6, 4}, {16, 2, 3}, {16, 6, 4}, {8, 0, 1}, {16, 0, 1}, {8, 4, 2}, {16, 4, 2},
+    {1, 3, 1}, {2, 3, 1}, {4, 3, 1}, {8, 3, 1}};
+
+/*
+ * Filter One Scanline
+ * The encoder side of the PNG filters; `prev` is the unfiltered row above.
+ */
+static void FilterRow(unsigned filter, const uint8_t* line, const uint8_t* prev, size_t size,
+                      unsigned bpp, uint8_t* out)
+{
+    for (size_t i = 0; i < size; i++) {
+        int a = i >= bpp ? line[i - bpp] : 0;
+        int b = prev[i];
+        int c = i >= bpp ? prev[i - bpp] : 0;
+        int pred = 0;
+        switch (filter) {
+            case sfSub: pred = a; break;
+            case sfUp: pred = b; break;
+            case sfAverage: pred = (a + b) >> 1; break;
+            case sfPaeth: {
+                int pa = abs(b - c);
+                int pb = abs(a - c);
+                int pc = abs(a + b - 2 * c);
+                pred = (pa <= pb && pa <= pc) ? a : (pb <= pc ? b : c);
+                break;
+            }
+        }
+        out[i] = static_cast<uint8_t>(line[i] - pred);
+    }
+}
+
+/*
+ * PNG Content
+ * A flag-like image: a few solid bands with sparse noise, with as many
+ * pixels as `pixelBytes` of RGB8 data. The pixels are drawn the same way
+ * for every format and then stored in the spec's format and row filter
+ * (mixed uses filter y % 5 on row y). Bands get decreasing alpha, palette
+ * images index a palette derived from the band colours.
+ */
+static void BuildPng(TSynthRandom& random, uint64_t pixelBytes, const TSynthSpec& spec,
+                     std::vector<uint8_t>& png)
+{
+    uint64_t pixels = std::max<uint64_t>(pixelBytes / 3, 1);
+    uint32_t width = static_cast<uint32_t>(std::min(std::max(sqrt(pixels * 5.0 / 3.0), 1.0), 32768.0));
+    uint32_t height = static_cast<uint32_t>(std::max<uint64_t>(pixels / width, 1));
+
+    unsigned bands = 2 + static_cast<unsigned>(random.Below(4));
+    bool vertical = random.Below(2) == 0;
+    uint8_t colors[5][3];
+    for (unsigned b = 0; b < bands; b++) {
+        for (unsigned c = 0; c < 3; c++)
+            colors[b][c] = static_cast<uint8_t>(random.Below(256));
+    }
+
+    const TPngLayout& layout = PngLayouts[spec.pngFormat];
+    unsigned bitsPerPixel = layout.depth * layout.channels;
+    unsigned bpp = std::max(bitsPerPixel / 8, 1u);
+    unsigned paletteSize = layout.colorType == 3 ? 1u << layout.depth : 0;
+    size_t lineBytes = (static_cast<size_t>(width) * bitsPerPixel + 7) / 8;
+
+    size_t stride = 1 + lineBytes;
+    std::vector<uint8_t> raw(stride * height);
+    std::vector<uint8_t> line(lineBytes), above(lineBytes);
+    for (uint32_t y = 0; y < height; y++) {
+        std::fill(line.begin(), line.end(), 0);
+        for (uint32_t x = 0; x < width; x++) {
+            unsigned band = vertical ? x * bands / width : y * bands / height;
+            uint8_t rgb[3] = {colors[band][0], colors[band][1], colors[band][2]};
+            unsigned index = band % std::max(paletteSize, 1u);
+            if (random.Below(32) == 0) {
+                unsigned channel = static_cast<unsigned>(random.Below(3));
+                unsigned noise = static_cast<unsigned>(random.Below(16));
+                rgb[channel] ^= static_cast<uint8_t>(noise);
+                index = (band + 1 + noise) % std::max(paletteSize, 1u);
+            }
+            unsigned gray = (rgb[0] * 77 + rgb[1] * 150 + rgb[2] * 29) >> 8;
+            unsigned alpha = 255 - band * 48;
+
+            unsigned samples[4];
+            switch (layout.colorType) {
+                case 0: samples[0] = gray; break;
+                case 4: samples[0] = gray; samples[1] = alpha; break;
+                case 3: samples[0] = index; break;
+                default:
+                    samples[0] = rgb[0];
+                    samples[1] = rgb[1];
+                    samples[2] = rgb[2];
+                    samples[3] = alpha;
+                    break;
+            }
+            for (unsigned c = 0; c < layout.channels; c++) {
+                size_t bit = (static_cast<size_t>(x) * layout.channels + c) * layout.depth;
+                if (layout.depth == 16) {
+                    line[bit / 8] = static_cast<uint8_t>(samples[c]);
+                    line[bit / 8 + 1] = static_cast<uint8_t>(samples[c]);
+                } else if (layout.depth == 8) {
+                    line[bit / 8] = static_cast<uint8_t>(samples[c]);
+                } else {
+                    line[bit / 8] |= static_cast<uint8_t>(samples[c] << (8 - layout.depth - bit % 8));
+                }
+            }
+        }
+        unsigned filter =
+            spec.pngFilter == sfMixed ? y % 5 : static_cast<unsigned>(spec.pngFilter);
+        uint8_t* row = &raw[y * stride];
+        row[0] = static_cast<uint8_t>(filter);
+        FilterRow(filter, line.data(), above.data(), lineBytes, bpp, row + 1);
+        line.swap(above);
+    }
+
+    static const uint8_t Signature[8] = {0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A};
+    png.assign(Signature, Signature + 8);
+
+    std::vector<uint8_t> header;
+    PutBE32(header, width);
+    PutBE32(header, height);
+    header.push_back(layout.depth);
+    header.push_back(layout.colorType);
+    header.push_back(0);        // Compression
+    header.push_back(0);        // Filter method
+    header.push_back(0);        // No interlace
+    PutChunk(png, "IHDR", header.data(), header.size());
+
+    if (paletteSize > 0) {
+        std::vector<uint8_t> plte(paletteSize * 3);
+        for (unsigned i = 0; i < paletteSize; i++) {
+            for (unsigned c = 0; c < 3; c++)
+                plte[i * 3 + c] = static_cast<uint8_t>(colors[i % bands][c] ^ (i / bands * 8));
+        }
+        PutChunk(png, "PLTE", plte.data(), plte.size());
+    }
+
+    std::vector<uint8_t> idat;
+    TDeflater deflater(spec.level);
+    deflater.CompressZlib(raw.data(), raw.size(), idat);
+    PutChunk(png, "IDAT", idat.data(), idat.size());
+    PutChunk(png, "IEND", nullptr, 0);
+}
+
+void SynthEntryData(const TSynthSpec& spec, uint64_t index, std::vector<uint8_t>& data)
+{
+    uint64_t size = SynthEntrySize(spec, index);
+    TSynthRandom random(spec.seed, index, ssContent);
+
+    if (spec.content == scPng) {
+        BuildPng(random, size, spec, data);
+        return;
+    }
+
+    data.resize(static_cast<size_t>(size));
+    if (spec.content == scText) {
+        FillText(random, data.data(), data.size());
+        return;
+    }
+    size_t pos = 0;
+    for (; pos + 8 <= data.size(); pos += 8) {
+        uint64_t v = random.Next();
+        for (unsigned i = 0; i < 8; i++)
+            data[pos + i] = static_cast<uint8_t>(v >> (8 * i));
+    }
+    for (uint64_t v = random.Next(); pos < data.size(); pos++, v >>= 8)
+        data[pos] = static_cast<uint8_t>(v);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TSynthItem - One Generated Entry Awaiting Output
+ */
+struct TSynthItem
+{
+    TPackEntry info;
+    std::vector<uint8_t> data;
+    std::vector<uint8_t> compressed;
+    const uint8_t* bytes;           // Points into data or compressed
+};
+
+/*
+ * Write Synthetic Pack
+ */
+TSynthResult WriteSynthPack(const TSynthSpec& spec, const std::string& path, unsigned threads)
+{
+    TPackBuilder builder;
+    builder.Create(path);
+    TSynthResult result = {0, 0, 0, 0};
+
+    uint64_t next = 0;
+    while (next < spec.entries) {
+        // Plan a round by entry count and expected data volume
+        uint64_t first = next;
+        uint64_t planned = 0;
+        while (next < spec.entries && next - first < RoundEntries && planned < RoundBytes)
+            planned += SynthEntrySize(spec, next++);
+
+        std::vector<TSynthItem> items(static_cast<size_t>(next - first));
+        std::atomic<size_t> cursor(0);
+        TTaskPool::Shared().Run(threads, [&spec, &items, &cursor, first](unsigned) {
+            TDeflater deflater(spec.level);
+            for (size_t i = cursor.fetch_add(1); i < items.size(); i = cursor.fetch_add(1)) {
+                TSynthItem& item = items[i];
+                uint64_t index = first + i;
+                TSynthRandom random(spec.seed, index, ssProperties);
+                DrawSize(spec, random);
+                bool deflated = SynthEntryDeflated(spec, random);
+
+                item.info.name = SynthEntryName(spec, index);
+                item.info.flags = 0;
+                item.info.dosTime = 0;
+                item.info.dosDate = (1 << 5) | 1;   // 1980-01-01
+                SynthEntryData(spec, index, item.data);
+                item.bytes = CompressEntry(deflater, item.data.data(), item.data.size(),
+                                           deflated ? TFlagPack::MethodDeflated
+                                                    : TFlagPack::MethodStored,
+                                           item.info, item.compressed);
+            }
+        });
+
+        for (size_t i = 0; i < items.size(); i++) {
+            builder.AddRaw(items[i].info, items[i].bytes);
+            result.entries++;
+            result.bytes += items[i].info.size;
+            result.compressedBytes += items[i].info.compressedSize;
+        }
+    }
+
+    builder.Finish();
+    result.archiveBytes = builder.Offset();
+    return result;
+}
+//---------------------------------------------------------------------------
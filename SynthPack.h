@@ -0,0 +1,106 @@
+﻿/*
+ * SynthPack.h - Synthetic Pack Generator
+ *
+ * Declares a generator for deterministic synthetic packs used to test how
+ * the readers scale far beyond the 255 entries of flags.bin. Every entry
+ * property (name, size, method, content) is derived from the seed and the
+ * entry index alone, so the same spec always produces the same archive
+ * and a benchmark can recompute any entry's name without reading the pack.
+ *
+ * Options (key=value, sizes accept k/M/G suffixes):
+ *   entries=N           Number of entries (1k .. 10M)
+ *   seed=N              Generator seed
+ *   sizes=MODEL         fixed | uniform | lognormal
+ *   min=N median=N max=N
+ *                       Size bounds; fixed uses median, uniform min..max,
+ *                       lognormal is centred on median (sigma 1), clamped
+ *   content=KIND        random (incompressible) | text | png
+ *   png=FORMAT          PNG pixel format: rgb8 rgba8 rgb16 rgba16 gray8
+ *                       gray16 graya8 graya16 pal1 pal2 pal4 pal8
+ *   filter=TYPE         PNG row filter: none sub up average paeth, or
+ *                       mixed (cycles through all five row by row)
+ *   deflate=PCT         Percentage of entries deflated, the rest stored
+ *   level=N             Deflate level 1..9
+ *   names=MIN-MAX       File name length range (folders not included)
+ *   depth=N fanout=N    Folder levels above each entry, folders per level
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef SynthPackH
+#define SynthPackH
+//---------------------------------------------------------------------------
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+enum TSynthSizeModel { smFixed, smUniform, smLogNormal };
+enum TSynthContent { scRandom, scText, scPng };
+enum TSynthPngFormat {
+    pfRgb8, pfRgba8, pfRgb16, pfRgba16, pfGray8, pfGray16, pfGrayAlpha8, pfGrayAlpha16,
+    pfPalette1, pfPalette2, pfPalette4, pfPalette8
+};
+enum TSynthPngFilter { sfNone, sfSub, sfUp, sfAverage, sfPaeth, sfMixed };
+
+/*
+ * TSynthSpec - Generator Parameters
+ * For png content the size is the raw pixel data the image would have as
+ * RGB8, whatever its actual format, so every format has the same pixels.
+ */
+struct TSynthSpec
+{
+    uint64_t entries;
+    uint64_t seed;
+    TSynthSizeModel sizeModel;
+    uint64_t minSize;
+    uint64_t medianSize;
+    uint64_t maxSize;
+    TSynthContent content;
+    TSynthPngFormat pngFormat;
+    TSynthPngFilter pngFilter;
+    unsigned deflatePercent;
+    int level;
+    unsigned minNameLength;
+    unsigned maxNameLength;
+    unsigned depth;
+    unsigned fanout;
+
+    TSynthSpec();
+};
+
+/*
+ * TSynthResult - What Was Written
+ */
+struct TSynthResult
+{
+    uint64_t entries;
+    uint64_t bytes;                 // Uncompressed entry data
+    uint64_t compressedBytes;       // Entry data as stored in the archive
+    uint64_t archiveBytes;          // Whole file, headers and directory included
+};
+
+//---------------------------------------------------------------------------
+
+// Applies one "key=value" option; throws std::invalid_argument if unknown
+void ParseSynthOption(TSynthSpec& spec, const std::string& option);
+
+// One-line summary of a spec, e.g. for benchmark reports
+std::string DescribeSynthSpec(const TSynthSpec& spec);
+
+// Option value for a PNG format, e.g. "rgba8"
+const char* SynthPngFormatName(TSynthPngFormat format);
+
+// Per-entry properties, computable without the archive
+std::string SynthEntryName(const TSynthSpec& spec, uint64_t index);
+uint64_t SynthEntrySize(const TSynthSpec& spec, uint64_t index);
+void SynthEntryData(const TSynthSpec& spec, uint64_t index, std::vector<uint8_t>& data);
+
+// Writes the pack; entries are generated and compressed on `threads`
+// workers (0 = one per core) and written in index order
+TSynthResult WriteSynthPack(const TSynthSpec& spec, const std::string& path, unsigned threads = 0);
+
+//---------------------------------------------------------------------------
+#endif // SynthPackH
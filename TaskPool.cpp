@@ -0,0 +1,839 @@
+﻿/*
+ * TaskPool.cpp - Shared Work-Stealing Scheduler
+ *
+ * Implements the Chase-Lev deques (after Le, Pop, Cohen and Zappa Nardelli,
+ * "Correct and Efficient Work-Stealing for Weak Memory Models"), the
+ * worker loop with its sleep protocol, fork-join groups and the scheduler
+ * benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "TaskPool.h"
+#include "Metrics.h"              // MetricProbe
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>                // getenv, atoi
+#include <iomanip>
+
+#ifdef _WIN32
+#include <windows.h>              // SetThreadAffinityMask
+#elif defined(__linux__)
+#include <pthread.h>              // pthread_setaffinity_np
+#include <sched.h>
+#endif
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+static const int64_t InitialCapacity = 256;    // Deque slots, doubled when full
+static const size_t TaskCacheLimit = 1024;     // Free task nodes kept per thread
+static const unsigned SpinRounds = 64;         // Empty searches before a worker sleeps
+static const std::chrono::milliseconds SleepLimit(10);
+static const std::chrono::microseconds WaitSlice(500);
+//---------------------------------------------------------------------------
+
+/*
+ * TPoolTask - One Queued Closure
+ */
+struct TPoolTask
+{
+    std::function<void()> fn;
+    TTaskGroup* group;              // nullptr for Submit()
+    TTaskPriority priority;
+    TPoolTask* next;                // Free list link
+};
+
+/*
+ * Task Node Cache
+ * Nodes are recycled through a per-thread free list, so spawning does not
+ * touch the heap once a thread has warmed up. A node freed on another
+ * thread than it was made on just moves lists; the cap keeps a thread
+ * that only consumes from hoarding them.
+ */
+struct TTaskCache
+{
+    TPoolTask* head;
+    size_t count;
+
+    TTaskCache() : head(nullptr), count(0) {}
+    ~TTaskCache()
+    {
+        while (head != nullptr) {
+            TPoolTask* task = head;
+            head = task->next;
+            delete task;
+        }
+    }
+};
+
+static thread_local TTaskCache TaskCache;
+
+static TPoolTask* AllocateTask(std::function<void()>&& fn, TTaskGroup* group,
+                               TTaskPriority priority)
+{
+    TPoolTask* task = TaskCache.head;
+    if (task != nullptr) {
+        TaskCache.head = task->next;
+        TaskCache.count--;
+    } else {
+        task = new TPoolTask;
+    }
+    task->fn = std::move(fn);
+    task->group = group;
+    task->priority = priority;
+    return task;
+}
+
+static void ReleaseTask(TPoolTask* task)
+{
+    task->fn = nullptr;             // Drop the captures now, not on reuse
+    if (TaskCache.count < TaskCacheLimit) {
+        task->next = TaskCache.head;
+        TaskCache.head = task;
+        TaskCache.count++;
+    } else {
+        delete task;
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * TTaskDeque - Chase-Lev Work-Stealing Deque
+ *
+ * The owner pushes and takes at the bottom without atomic read-modify-
+ * write except when taking the last task; thieves take from the top with
+ * one CAS. A full ring is replaced by one twice the size; old rings stay
+ * allocated until the deque dies, since a thief may still be reading one.
+ */
+class TTaskDeque
+{
+  public:
+    TTaskDeque() : top(0), bottom(0), current(nullptr) { Grow(nullptr, 0, 0); }
+
+    void Push(TPoolTask* task)
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed);
+        int64_t t = top.load(std::memory_order_acquire);
+        TRing* ring = current.load(std::memory_order_relaxed);
+        if (b - t > ring->mask)
+            ring = Grow(ring, t, b);
+        ring->slots[b & ring->mask].store(task, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        bottom.store(b + 1, std::memory_order_relaxed);
+    }
+
+    TPoolTask* Take()
+    {
+        int64_t b = bottom.load(std::memory_order_relaxed) - 1;
+        TRing* ring = current.load(std::memory_order_relaxed);
+        bottom.store(b, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t t = top.load(std::memory_order_relaxed);
+        if (t > b) {
+            bottom.store(b + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        TPoolTask* task = ring->slots[b & ring->mask].load(std::memory_order_relaxed);
+        if (t == b) {
+            // Last task: race the thieves for it
+            if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                             std::memory_order_relaxed))
+                task = nullptr;
+            bottom.store(b + 1, std::memory_order_relaxed);
+        }
+        return task;
+    }
+
+    TPoolTask* Steal()
+    {
+        int64_t t = top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t b = bottom.load(std::memory_order_acquire);
+        if (t >= b)
+            return nullptr;
+        TRing* ring = current.load(std::memory_order_acquire);
+        TPoolTask* task = ring->slots[t & ring->mask].load(std::memory_order_relaxed);
+        if (!top.compare_exchange_strong(t, t + 1, std::memory_order_seq_cst,
+                                         std::memory_order_relaxed))
+            return nullptr;             // Lost to another thief or the owner
+        return task;
+    }
+
+    bool Empty() const
+    {
+        return bottom.load(std::memory_order_relaxed) <= top.load(std::memory_order_relaxed);
+    }
+
+    size_t Size() const
+    {
+        int64_t size = bottom.load(std::memory_order_relaxed) - top.load(std::memory_order_relaxed);
+        return size > 0 ? static_cast<size_t>(size) : 0;
+    }
+
+  private:
+    struct TRing
+    {
+        int64_t mask;
+        std::unique_ptr<std::atomic<TPoolTask*>[]> slots;
+    };
+
+    alignas(64) std::atomic<int64_t> top;
+    alignas(64) std::atomic<int64_t> bottom;
+    std::atomic<TRing*> current;
+    std::vector<std::unique_ptr<TRing> > rings;     // Owner only
+
+    TRing* Grow(TRing* old, int64_t t, int64_t b)
+    {
+        std::unique_ptr<TRing> ring(new TRing);
+        int64_t capacity = old != nullptr ? (old->mask + 1) * 2 : InitialCapacity;
+        ring->mask = capacity - 1;
+        ring->slots.reset(new std::atomic<TPoolTask*>[static_cast<size_t>(capacity)]);
+        for (int64_t i = t; i < b; i++)
+            ring->slots[i & ring->mask].store(old->slots[i & old->mask].load(std::memory_order_relaxed),
+                                              std::memory_order_relaxed);
+        rings.push_back(std::move(ring));
+        current.store(rings.back().get(), std::memory_order_release);
+        return rings.back().get();
+    }
+
+    TTaskDeque(const TTaskDeque&);
+    TTaskDeque& operator=(const TTaskDeque&);
+};
+//---------------------------------------------------------------------------
+
+/*
+ * TWorker - Per-Thread Scheduler State
+ * The counters are only written by their own thread, so they are bumped
+ * with a plain load and store instead of a locked add.
+ */
+struct TTaskPool::TWorker
+{
+    TTaskPool* pool;
+    TTaskDeque deques[TaskPriorityCount];
+    uint32_t random;                // Victim selection
+    std::atomic<uint64_t> spawned;
+    std::atomic<uint64_t> executed;
+    std::atomic<uint64_t> stolen;
+
+    TWorker(TTaskPool* pool, uint32_t seed)
+        : pool(pool), random(seed), spawned(0), executed(0), stolen(0) {}
+};
+
+thread_local TTaskPool::TWorker* TTaskPool::current = nullptr;
+
+// Background tasks running on this thread's stack; nested ones share the
+// slot the outermost one took, so a background job can wait on its own
+// background subtasks without needing a second slot
+static thread_local unsigned BackgroundDepth = 0;
+
+static void Bump(std::atomic<uint64_t>& counter)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static unsigned HardwareThreads()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/*
+ * Pin Calling Thread
+ * Best effort: a failure leaves the thread free to float.
+ */
+static void PinThread(unsigned cpu)
+{
+#ifdef _WIN32
+    if (cpu < sizeof(DWORD_PTR) * 8)
+        SetThreadAffinityMask(GetCurrentThread(), static_cast<DWORD_PTR>(1) << cpu);
+#elif defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)cpu;
+#endif
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Pool Lifetime
+ */
+TTaskPool::TTaskPool(unsigned threads, bool pinThreads)
+    : pinned(pinThreads), injectedCount(0), sleeping(0), stopping(false), backgroundRunning(0),
+      injectCount(0), outsideCount(0), sleepCount(0)
+{
+    // Background classes get every worker but one, so there have to be two
+    if (threads == 0)
+        threads = HardwareThreads() - 1;
+    threads = std::max(2u, threads);
+    backgroundLimit = threads - 1;
+
+    for (unsigned i = 0; i < threads; i++)
+        workers.push_back(std::unique_ptr<TWorker>(new TWorker(this, 2654435761u * (i + 1))));
+    for (unsigned i = 0; i < threads; i++)
+        this->threads.push_back(std::thread(&TTaskPool::WorkerLoop, this, workers[i].get(), i));
+}
+
+TTaskPool::~TTaskPool()
+{
+    {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        stopping.store(true);
+        wake.notify_all();
+    }
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    // Whatever is still queued was submitted and never waited for
+    for (size_t i = 0; i < workers.size(); i++) {
+        for (unsigned p = 0; p < TaskPriorityCount; p++) {
+            while (TPoolTask* task = workers[i]->deques[p].Take())
+                ReleaseTask(task);
+        }
+    }
+    for (unsigned p = 0; p < TaskPriorityCount; p++) {
+        for (size_t i = 0; i < injected[p].size(); i++)
+            ReleaseTask(injected[p][i]);
+    }
+}
+
+/*
+ * Shared Pool
+ * Sized by ConfigureShared(), else by ZIP_THREADS and ZIP_PIN=1 in the
+ * environment, else from the hardware. It is never destroyed: joining
+ * threads while the process exits can deadlock on Windows, and idle
+ * workers hold nothing that needs flushing.
+ */
+static std::mutex SharedLock;
+static bool SharedStarted = false;
+static bool SharedConfigured = false;
+static unsigned SharedThreads = 0;
+static bool SharedPin = false;
+
+static TTaskPool* StartSharedPool()
+{
+    std::lock_guard<std::mutex> guard(SharedLock);
+    if (!SharedConfigured) {
+        const char* threads = getenv("ZIP_THREADS");
+        const char* pin = getenv("ZIP_PIN");
+        SharedThreads = threads != nullptr ? static_cast<unsigned>(std::max(0, atoi(threads))) : 0;
+        SharedPin = pin != nullptr && atoi(pin) != 0;
+    }
+    SharedStarted = true;
+    TTaskPool* pool = new TTaskPool(SharedThreads, SharedPin);
+
+    MetricProbe("zip_pool_workers", "Worker threads of the shared task pool", mkGauge,
+                [pool]() { return static_cast<double>(pool->Workers()); });
+    MetricProbe("zip_pool_queued_tasks", "Tasks waiting in the shared pool's queues", mkGauge,
+                [pool]() { return static_cast<double>(pool->Queued()); });
+    MetricProbe("zip_pool_tasks_total", "Tasks executed by the shared pool", mkCounter,
+                [pool]() { return static_cast<double>(pool->Stats().executed); });
+    MetricProbe("zip_pool_steals_total", "Tasks taken from another worker's deque", mkCounter,
+                [pool]() { return static_cast<double>(pool->Stats().stolen); });
+    MetricProbe("zip_pool_sleeps_total", "Times a worker found nothing to do and slept", mkCounter,
+                [pool]() { return static_cast<double>(pool->Stats().sleeps); });
+    return pool;
+}
+
+TTaskPool& TTaskPool::Shared()
+{
+    static TTaskPool* pool = StartSharedPool();
+    return *pool;
+}
+
+bool TTaskPool::ConfigureShared(unsigned threads, bool pinThreads)
+{
+    std::lock_guard<std::mutex> guard(SharedLock);
+    if (SharedStarted)
+        return false;
+    SharedConfigured = true;
+    SharedThreads = threads;
+    SharedPin = pinThreads;
+    return true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Queue A Task
+ * Workers of this pool push onto their own deque; any other thread goes
+ * through the injection queue.
+ */
+void TTaskPool::Push(TPoolTask* task, TTaskPriority priority)
+{
+    TWorker* self = current;
+    if (self != nullptr && self->pool == this) {
+        self->deques[priority].Push(task);
+        Bump(self->spawned);
+    } else {
+        std::lock_guard<std::mutex> guard(injectLock);
+        injected[priority].push_back(task);
+        injectedCount.fetch_add(1, std::memory_order_relaxed);
+        injectCount.fetch_add(1, std::memory_order_relaxed);
+    }
+    WakeOne();
+}
+
+/*
+ * Wake A Sleeping Worker
+ * Pairs with the sleep check in WorkerLoop: the fence orders the push
+ * before reading `sleeping`, and the worker raises `sleeping` before it
+ * looks at the queues, so one of the two always sees the other. When no
+ * worker sleeps, which is the common case under load, this costs a fence.
+ */
+void TTaskPool::WakeOne()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> guard(sleepLock);
+        wake.notify_one();
+    }
+}
+
+void TTaskPool::Submit(std::function<void()> task, TTaskPriority priority)
+{
+    Push(AllocateTask(std::move(task), nullptr, priority), priority);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Find A Task
+ * Per priority, highest first, down to `lowest`. A background class is
+ * only searched after taking one of its `backgroundLimit` slots, which
+ * Execute() gives back; that way one worker always stays free to pick up
+ * interactive work the moment it is queued.
+ */
+TPoolTask* TTaskPool::Find(TWorker* self, unsigned lowest)
+{
+    for (unsigned p = 0; p <= lowest && p < TaskPriorityCount; p++) {
+        if (p < tpPrefetch || BackgroundDepth > 0) {
+            if (TPoolTask* task = FindAt(self, p))
+                return task;
+            continue;
+        }
+        unsigned running = backgroundRunning.load(std::memory_order_relaxed);
+        do {
+            if (running >= backgroundLimit)
+                return nullptr;
+        } while (!backgroundRunning.compare_exchange_weak(running, running + 1,
+                                                          std::memory_order_acq_rel));
+        if (TPoolTask* task = FindAt(self, p))
+            return task;
+        backgroundRunning.fetch_sub(1, std::memory_order_acq_rel);
+    }
+    return nullptr;
+}
+
+// Own deque (newest first), the injection queue, then the other workers'
+// deques from a random starting victim
+TPoolTask* TTaskPool::FindAt(TWorker* self, unsigned priority)
+{
+    if (self != nullptr) {
+        if (TPoolTask* task = self->deques[priority].Take())
+            return task;
+    }
+    if (injectedCount.load(std::memory_order_relaxed) > 0) {
+        std::lock_guard<std::mutex> guard(injectLock);
+        if (!injected[priority].empty()) {
+            TPoolTask* task = injected[priority].front();
+            injected[priority].pop_front();
+            injectedCount.fetch_sub(1, std::memory_order_relaxed);
+            return task;
+        }
+    }
+    return Steal(self, priority);
+}
+
+TPoolTask* TTaskPool::Steal(TWorker* self, unsigned priority)
+{
+    size_t count = workers.size();
+    uint32_t random;
+    if (self != nullptr) {
+        self->random ^= self->random << 13;
+        self->random ^= self->random >> 17;
+        self->random ^= self->random << 5;
+        random = self->random;
+    } else {
+        static std::atomic<uint32_t> outside(1);
+        random = outside.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        TWorker* victim = workers[(random + i) % count].get();
+        if (victim == self || victim->deques[priority].Empty())
+            continue;
+        if (TPoolTask* task = victim->deques[priority].Steal()) {
+            if (self != nullptr)
+                Bump(self->stolen);
+            return task;
+        }
+    }
+    return nullptr;
+}
+
+/*
+ * Anything This Worker Could Run
+ * Background work does not count while its slots are all taken: the
+ * threads holding them pick it up when they finish, so the spare worker
+ * can sleep instead of spinning on work it may not start.
+ */
+bool TTaskPool::HasWork() const
+{
+    unsigned classes = backgroundRunning.load(std::memory_order_relaxed) < backgroundLimit
+                           ? TaskPriorityCount
+                           : static_cast<unsigned>(tpPrefetch);
+    for (unsigned p = 0; p < classes; p++) {
+        if (injectedCount.load(std::memory_order_relaxed) > 0) {
+            std::lock_guard<std::mutex> guard(injectLock);
+            if (!injected[p].empty())
+                return true;
+        }
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (!workers[i]->deques[p].Empty())
+                return true;
+        }
+    }
+    return false;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Execute One Task
+ * A task without a group has nobody to report to, so its exception is
+ * dropped.
+ */
+void TTaskPool::Execute(TPoolTask* task)
+{
+    bool background = task->priority >= tpPrefetch;
+    if (background)
+        BackgroundDepth++;
+    std::exception_ptr failure;
+    try {
+        task->fn();
+    } catch (...) {
+        failure = std::current_exception();
+    }
+    TTaskGroup* group = task->group;
+    ReleaseTask(task);
+    if (background && --BackgroundDepth == 0) {
+        backgroundRunning.fetch_sub(1, std::memory_order_acq_rel);
+        WakeOne();                  // A worker may have slept on capped work
+    }
+    if (group != nullptr)
+        group->Finish(failure);
+}
+
+// Runs one queued task of class `lowest` or higher on the calling thread
+bool TTaskPool::RunOne(unsigned lowest)
+{
+    TWorker* self = current;
+    if (self != nullptr && self->pool != this)
+        self = nullptr;
+    TPoolTask* task = Find(self, lowest);
+    if (task == nullptr)
+        return false;
+    Execute(task);
+    if (self != nullptr)
+        Bump(self->executed);
+    else
+        outsideCount.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+/*
+ * Worker Loop
+ * Spins through a few empty searches before sleeping, since a fork-join
+ * job usually queues more work within microseconds. Sleeps are bounded
+ * as a safety net only; wakeups come from WakeOne().
+ */
+void TTaskPool::WorkerLoop(TWorker* self, unsigned index)
+{
+    current = self;
+    if (pinned)
+        PinThread((index + 1) % HardwareThreads());
+
+    unsigned idle = 0;
+    while (!stopping.load(std::memory_order_relaxed)) {
+        if (TPoolTask* task = Find(self, TaskPriorityCount - 1)) {
+            Execute(task);
+            Bump(self->executed);
+            idle = 0;
+            continue;
+        }
+        if (++idle < SpinRounds) {
+            std::this_thread::yield();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> guard(sleepLock);
+        sleeping.fetch_add(1, std::memory_order_seq_cst);
+        if (!HasWork() && !stopping.load(std::memory_order_relaxed)) {
+            sleepCount.fetch_add(1, std::memory_order_relaxed);
+            wake.wait_for(guard, SleepLimit);
+        }
+        sleeping.fetch_sub(1, std::memory_order_relaxed);
+        idle = 0;
+    }
+    current = nullptr;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Run On Up To `runners` Threads
+ */
+void TTaskPool::Run(unsigned runners, const std::function<void(unsigned)>& body,
+                    TTaskPriority priority)
+{
+    runners = Concurrency(runners);
+    TTaskGroup group(*this);
+    for (unsigned r = 1; r < runners; r++)
+        group.Spawn([&body, r]() { body(r); }, priority);
+
+    std::exception_ptr first;
+    try {
+        body(0);
+    } catch (...) {
+        first = std::current_exception();
+    }
+    try {
+        group.Wait();
+    } catch (...) {
+        if (!first)
+            first = std::current_exception();
+    }
+    if (first)
+        std::rethrow_exception(first);
+}
+
+// The pool may have more workers than cores (never fewer than two), but
+// one job fans out to no more runners than there are hardware threads
+unsigned TTaskPool::Concurrency(unsigned requested) const
+{
+    unsigned limit = std::min(Workers() + 1, HardwareThreads());
+    return requested == 0 || requested > limit ? limit : requested;
+}
+
+size_t TTaskPool::Queued() const
+{
+    size_t queued = injectedCount.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < workers.size(); i++) {
+        for (unsigned p = 0; p < TaskPriorityCount; p++)
+            queued += workers[i]->deques[p].Size();
+    }
+    return queued;
+}
+
+TPoolStats TTaskPool::Stats() const
+{
+    TPoolStats stats;
+    stats.injected = injectCount.load(std::memory_order_relaxed);
+    stats.spawned = stats.injected;
+    stats.executed = outsideCount.load(std::memory_order_relaxed);
+    stats.stolen = 0;
+    stats.sleeps = sleepCount.load(std::memory_order_relaxed);
+    for (size_t i = 0; i < workers.size(); i++) {
+        stats.spawned += workers[i]->spawned.load(std::memory_order_relaxed);
+        stats.executed += workers[i]->executed.load(std::memory_order_relaxed);
+        stats.stolen += workers[i]->stolen.load(std::memory_order_relaxed);
+    }
+    return stats;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Task Groups
+ *
+ * `finishing` keeps Wait() from returning, and the caller from destroying
+ * the group, while the last task is still inside Finish() after taking
+ * `pending` to zero.
+ */
+TTaskGroup::TTaskGroup(TTaskPool& pool) : pool(pool), pending(0), finishing(0), lowest(0)
+{
+}
+
+TTaskGroup::~TTaskGroup()
+{
+    try {
+        Wait();
+    } catch (...) {
+    }
+}
+
+void TTaskGroup::Spawn(std::function<void()> task, TTaskPriority priority)
+{
+    pending.fetch_add(1, std::memory_order_relaxed);
+    unsigned seen = lowest.load(std::memory_order_relaxed);
+    while (static_cast<unsigned>(priority) > seen &&
+           !lowest.compare_exchange_weak(seen, priority, std::memory_order_relaxed)) {
+    }
+    pool.Push(AllocateTask(std::move(task), this, priority), priority);
+}
+
+void TTaskGroup::Finish(std::exception_ptr failure)
+{
+    finishing.fetch_add(1, std::memory_order_acq_rel);
+    if (failure) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (!error)
+            error = failure;
+    }
+    if (pending.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        std::lock_guard<std::mutex> guard(lock);
+        done.notify_all();
+    }
+    finishing.fetch_sub(1, std::memory_order_release);
+}
+
+/*
+ * Wait For The Group
+ * Helps with any queued work meanwhile; a worker that waits therefore
+ * keeps its core busy, and nested groups cannot starve the pool. With
+ * nothing to help with, the thread blocks until the group is done or a
+ * short slice has passed and more work may have been queued.
+ */
+void TTaskGroup::Wait()
+{
+    while (pending.load(std::memory_order_acquire) != 0) {
+        if (pool.RunOne(lowest.load(std::memory_order_relaxed)))
+            continue;
+        std::unique_lock<std::mutex> guard(lock);
+        done.wait_for(guard, WaitSlice,
+                      [this]() { return pending.load(std::memory_order_acquire) == 0; });
+    }
+    while (finishing.load(std::memory_order_acquire) != 0)
+        std::this_thread::yield();
+
+    std::exception_ptr failure;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        std::swap(failure, error);
+    }
+    if (failure)
+        std::rethrow_exception(failure);
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Scheduler Benchmark
+ *
+ * Each case spawns empty tasks, so the time is pure scheduling overhead:
+ * - spawn/worker: one worker spawns them into its own deque and waits,
+ *   the others steal
+ * - spawn/outside: a non-pool thread spawns through the injection queue
+ * - fork-join: a binary tree where every task spawns its two children
+ *   and waits for them, the pattern of nested parallel jobs
+ * The spawn column times the spawning loop only; the total column runs
+ * until the last task has finished.
+ */
+static const unsigned BenchTasks = 1 << 20;
+static const unsigned BenchDepth = 18;
+
+static void ForkJoin(TTaskPool& pool, unsigned depth)
+{
+    if (depth == 0)
+        return;
+    TTaskGroup group(pool);
+    group.Spawn([&pool, depth]() { ForkJoin(pool, depth - 1); });
+    group.Spawn([&pool, depth]() { ForkJoin(pool, depth - 1); });
+    group.Wait();
+}
+
+// Runs `job` on a worker of `pool` and waits for it without helping
+static void OnWorker(TTaskPool& pool, const std::function<void()>& job)
+{
+    std::mutex lock;
+    std::condition_variable done;
+    bool finished = false;
+    pool.Submit([&]() {
+        job();
+        std::lock_guard<std::mutex> guard(lock);
+        finished = true;
+        done.notify_all();
+    });
+    std::unique_lock<std::mutex> guard(lock);
+    done.wait(guard, [&finished]() { return finished; });
+}
+
+static double NanosecondsSince(TClock::time_point start, uint64_t tasks)
+{
+    return std::chrono::duration<double, std::nano>(TClock::now() - start).count() / tasks;
+}
+
+void RunPoolBench(TTaskPool& pool, std::ostream& out)
+{
+    out << "Workers: " << pool.Workers() << (pool.Pinned() ? " (pinned)" : "") << "\n"
+        << std::left << std::setw(16) << "case" << std::right << std::setw(10) << "tasks"
+        << std::setw(12) << "spawn ns" << std::setw(12) << "total ns" << std::setw(10)
+        << "stolen" << std::endl;
+
+    struct TBenchCase
+    {
+        const char* name;
+        uint64_t tasks;
+        double spawnNs;
+        double totalNs;
+        TPoolStats before;
+    } cases[3];
+
+    // Warm the task caches and wake the workers
+    {
+        TTaskGroup group(pool);
+        for (unsigned i = 0; i < 4096; i++)
+            group.Spawn([]() {});
+        group.Wait();
+    }
+
+    cases[0].name = "spawn/worker";
+    cases[0].tasks = BenchTasks;
+    cases[0].before = pool.Stats();
+    OnWorker(pool, [&pool, &cases]() {
+        TTaskGroup group(pool);
+        TClock::time_point start = TClock::now();
+        for (unsigned i = 0; i < BenchTasks; i++)
+            group.Spawn([]() {});
+        cases[0].spawnNs = NanosecondsSince(start, BenchTasks);
+        group.Wait();
+        cases[0].totalNs = NanosecondsSince(start, BenchTasks);
+    });
+
+    cases[1].name = "spawn/outside";
+    cases[1].tasks = BenchTasks;
+    cases[1].before = pool.Stats();
+    {
+        TTaskGroup group(pool);
+        TClock::time_point start = TClock::now();
+        for (unsigned i = 0; i < BenchTasks; i++)
+            group.Spawn([]() {});
+        cases[1].spawnNs = NanosecondsSince(start, BenchTasks);
+        group.Wait();
+        cases[1].totalNs = NanosecondsSince(start, BenchTasks);
+    }
+
+    cases[2].name = "fork-join";
+    cases[2].tasks = (2ull << BenchDepth) - 2;
+    cases[2].before = pool.Stats();
+    cases[2].spawnNs = 0;
+    OnWorker(pool, [&pool, &cases]() {
+        TClock::time_point start = TClock::now();
+        ForkJoin(pool, BenchDepth);
+        cases[2].totalNs = NanosecondsSince(start, cases[2].tasks);
+    });
+    TPoolStats after = pool.Stats();
+
+    for (unsigned c = 0; c < 3; c++) {
+        uint64_t stolen = (c + 1 < 3 ? cases[c + 1].before.stolen : after.stolen) - cases[c].before.stolen;
+        out << std::left << std::setw(16) << cases[c].name << std::right << std::setw(10)
+            << cases[c].tasks << std::fixed << std::setprecision(1) << std::setw(12);
+        if (cases[c].spawnNs > 0)
+            out << cases[c].spawnNs;
+        else
+            out << "-";
+        out << std::setw(12) << cases[c].totalNs << std::setw(10) << stolen << std::endl;
+    }
+}
+//---------------------------------------------------------------------------
@@ -0,0 +1,199 @@
+﻿/*
+ * TaskPool.h - Shared Work-Stealing Scheduler
+ *
+ * Declares the one thread pool every parallel stage of the engine submits
+ * to: pack building, deflate, extraction, analysis and patching. Before it
+ * each of them started its own threads, so a nested or concurrent job ran
+ * cores x cores threads; now there is a fixed set of workers sized from
+ * the hardware and the "threads" options only cap how much of it one job
+ * may use.
+ *
+ * Each worker owns one Chase-Lev deque per priority. A task spawned from a
+ * worker goes to the bottom of its own deque, where that worker takes it
+ * back LIFO (hot in cache, no contention); idle workers steal FIFO from
+ * the top of the others. Threads outside the pool submit through a locked
+ * injection queue. Higher priorities are always searched first, and the
+ * background classes may never occupy every worker, so a click still finds
+ * a free thread while prefetch and maintenance work is queued.
+ *
+ * Waiting never blocks a worker while there is work: TTaskGroup::Wait()
+ * runs queued tasks until its own have finished, so jobs can nest freely.
+ * "Zip.exe --pack tasks bench" measures spawn and steal overhead.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef TaskPoolH
+#define TaskPoolH
+//---------------------------------------------------------------------------
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+/*
+ * TTaskPriority - Scheduling Classes
+ * Workers search every queue of a higher class before a lower one. Tasks
+ * already running are not preempted; instead the background classes
+ * (prefetch and maintenance) run on at most all workers but one.
+ *   tpInteractive  the user is waiting for this result right now
+ *   tpVisible      on screen or about to be; the default
+ *   tpPrefetch     likely wanted soon
+ *   tpMaintenance  statistics, verification, bulk jobs
+ */
+enum TTaskPriority { tpInteractive, tpVisible, tpPrefetch, tpMaintenance };
+const unsigned TaskPriorityCount = 4;
+
+/*
+ * TPoolStats - Scheduler Counters Since Start
+ */
+struct TPoolStats
+{
+    uint64_t spawned;               // Tasks queued, from workers or outside
+    uint64_t injected;              // Of those, queued from outside the pool
+    uint64_t executed;
+    uint64_t stolen;                // Taken from another worker's deque
+    uint64_t sleeps;                // Times a worker found nothing and slept
+};
+
+class TTaskGroup;
+struct TPoolTask;
+class TTaskDeque;
+
+/*
+ * TTaskPool - Worker Threads And Their Deques
+ */
+class TTaskPool
+{
+  public:
+    // 0 threads = one per hardware thread, less one for the submitting
+    // thread (which helps while it waits). Never fewer than 2, so one
+    // worker stays clear of the background classes even on 1 and 2-core
+    // machines. Pinning binds worker i to logical CPU i + 1, leaving CPU 0
+    // to the UI thread.
+    explicit TTaskPool(unsigned threads = 0, bool pinThreads = false);
+    ~TTaskPool();
+
+    // The engine-wide pool, started on first use
+    static TTaskPool& Shared();
+
+    // Sizes the shared pool; only has an effect before its first use
+    static bool ConfigureShared(unsigned threads, bool pinThreads);
+
+    unsigned Workers() const { return static_cast<unsigned>(workers.size()); }
+    unsigned BackgroundLimit() const { return backgroundLimit; }
+    bool Pinned() const { return pinned; }
+
+    // Queues a task nobody waits for; an exception it throws is dropped
+    void Submit(std::function<void()> task, TTaskPriority priority = tpVisible);
+
+    /*
+     * Run On Up To `runners` Threads
+     * Calls body(r) for r = 0 .. runners-1 as tasks, the calling thread
+     * taking r = 0, and returns when all have finished. The first
+     * exception is rethrown. 0 runners = Concurrency(0). The usual body
+     * claims work items from a shared atomic cursor.
+     */
+    void Run(unsigned runners, const std::function<void(unsigned)>& body,
+             TTaskPriority priority = tpVisible);
+
+    // Runners for a "threads" option: 0 = workers + 1, never above that
+    // nor above the hardware threads
+    unsigned Concurrency(unsigned requested) const;
+
+    TPoolStats Stats() const;
+
+    // Tasks waiting in any queue; approximate while workers run
+    size_t Queued() const;
+
+  private:
+    friend class TTaskGroup;
+    struct TWorker;
+    static thread_local TWorker* current;   // Worker running on this thread
+
+    std::vector<std::unique_ptr<TWorker> > workers;
+    std::vector<std::thread> threads;
+    bool pinned;
+
+    mutable std::mutex injectLock;
+    std::deque<TPoolTask*> injected[TaskPriorityCount];
+    std::atomic<size_t> injectedCount;
+
+    std::mutex sleepLock;
+    std::condition_variable wake;
+    std::atomic<unsigned> sleeping;
+    std::atomic<bool> stopping;
+
+    unsigned backgroundLimit;               // Threads that may run background tasks
+    std::atomic<unsigned> backgroundRunning;
+
+    std::atomic<uint64_t> injectCount;
+    std::atomic<uint64_t> outsideCount;     // Executed by helping outside threads
+    std::atomic<uint64_t> sleepCount;
+
+    void Push(TPoolTask* task, TTaskPriority priority);
+    TPoolTask* Find(TWorker* self, unsigned lowest);
+    TPoolTask* FindAt(TWorker* self, unsigned priority);
+    TPoolTask* Steal(TWorker* self, unsigned priority);
+    bool HasWork() const;
+    bool RunOne(unsigned lowest = TaskPriorityCount - 1);
+    void Execute(TPoolTask* task);
+    void WakeOne();
+    void WorkerLoop(TWorker* self, unsigned index);
+
+    TTaskPool(const TTaskPool&);
+    TTaskPool& operator=(const TTaskPool&);
+};
+
+/*
+ * TTaskGroup - Fork-Join Scope
+ *
+ * Spawn() queues tasks; Wait() runs queued work (its own or anyone's)
+ * until every task of the group has finished, then rethrows the first
+ * exception one of them threw. The destructor waits but swallows errors.
+ * While waiting it only helps with tasks of its own class or higher, so a
+ * foreground wait never gets stuck inside a long maintenance task.
+ */
+class TTaskGroup
+{
+  public:
+    explicit TTaskGroup(TTaskPool& pool = TTaskPool::Shared());
+    ~TTaskGroup();
+
+    void Spawn(std::function<void()> task, TTaskPriority priority = tpVisible);
+    void Wait();
+
+  private:
+    friend class TTaskPool;
+
+    TTaskPool& pool;
+    std::atomic<size_t> pending;
+    std::atomic<unsigned> finishing;
+    std::atomic<unsigned> lowest;   // Lowest class spawned, bounds helping
+    std::mutex lock;                // Guards error; signals done
+    std::condition_variable done;
+    std::exception_ptr error;
+
+    void Finish(std::exception_ptr failure);
+
+    TTaskGroup(const TTaskGroup&);
+    TTaskGroup& operator=(const TTaskGroup&);
+};
+
+//---------------------------------------------------------------------------
+
+// Spawn, steal and fork-join timings of `pool`, in nanoseconds per task
+void RunPoolBench(TTaskPool& pool, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // TaskPoolH
@@ -0,0 +1,725 @@
+﻿/*
+ * TiledImage.cpp - Tiled Pan/Zoom Decoding Of Very Large Flags
+ *
+ * Implements the opening pass that records row points and builds the
+ * overview, band decoding from a row point, the request bookkeeping that
+ * drops bands a viewport no longer needs, and the pan/zoom benchmark.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "TiledImage.h"
+#include "Metrics.h"              // MetricCounter, MetricHistogram, SamplePercentile
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstring>
+#include <exception>
+#include <iomanip>
+#include <stdexcept>
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+typedef std::chrono::steady_clock TClock;
+
+// Tile keys hold the level, the row and the column; 13 bits each for the
+// last two allow 8192 x 8192 tiles, a 2-gigapixel level 0
+static const unsigned TileIndexBits = 13;
+static const uint32_t MaxTileIndex = 1u << TileIndexBits;
+
+static const size_t HeaderBlock = 4096;        // Reads up to the first IDAT
+static const size_t BodyBlock = 64 * 1024;     // Reads of IDAT data
+
+static size_t TileKey(unsigned level, uint32_t column, uint32_t row)
+{
+    return (static_cast<size_t>(level) << (2 * TileIndexBits))
+           | (static_cast<size_t>(row) << TileIndexBits) | column;
+}
+
+/*
+ * TTileBand - One Tile Row Of One Level, Queued Or Being Decoded
+ * The column range may still change while the band is queued; once it
+ * has started, it is what the band makes.
+ */
+struct TTileBand
+{
+    unsigned level;
+    uint32_t row;
+    uint32_t column0;
+    uint32_t column1;
+    bool started;
+    TCancelToken cancel;
+
+    TTileBand(unsigned level, uint32_t row, const TCancelToken* parent)
+        : level(level), row(row), column0(0), column1(0), started(false), cancel(parent)
+    {
+    }
+};
+
+/*
+ * TEntryRangeSource - Entry Bytes From An Offset On
+ * Reads the entry through TPackVolumeSet::ReadAt() in `block` sized
+ * pieces, so a band touches only the part of the file it decodes.
+ */
+class TEntryRangeSource : public TByteSource
+{
+  public:
+    TEntryRangeSource(const TPackVolumeSet& pack, size_t entry, uint64_t offset, size_t block)
+        : pack(pack), entry(entry), offset(offset), buffer(block)
+    {
+    }
+
+    bool Next(const uint8_t*& data, size_t& size) override
+    {
+        size_t got = pack.ReadAt(entry, offset, buffer.data(), buffer.size());
+        if (got == 0)
+            return false;
+        offset += got;
+        data = buffer.data();
+        size = got;
+        return true;
+    }
+
+  private:
+    const TPackVolumeSet& pack;
+    size_t entry;
+    uint64_t offset;
+    std::vector<uint8_t> buffer;
+};
+
+/*
+ * TBoxFilter - Averages Source Rows Into One Row Of A Level
+ * Each output pixel of `level` covers up to 2^level x 2^level source
+ * pixels. Colours are summed premultiplied by their alpha, so transparent
+ * pixels do not darken the edges of what they surround. Only output
+ * columns [x0, x1) are made; at level 0 rows are just copied.
+ */
+class TBoxFilter
+{
+  public:
+    TBoxFilter(uint32_t sourceWidth, unsigned level, uint32_t x0, uint32_t x1)
+        : sourceWidth(sourceWidth), level(level), x0(x0), x1(x1), rows(0),
+          sums(level > 0 ? static_cast<size_t>(x1 - x0) * 4 : 0), out(x1 - x0)
+    {
+    }
+
+    void Add(const uint32_t* row)
+    {
+        if (level == 0) {
+            memcpy(out.data(), row + x0, out.size() * sizeof(uint32_t));
+            return;
+        }
+        uint64_t* sum = sums.data();
+        for (uint32_t x = x0; x < x1; x++, sum += 4) {
+            uint32_t from = x << level;
+            uint32_t to = std::min(from + (1u << level), sourceWidth);
+            for (uint32_t s = from; s < to; s++) {
+                uint32_t pixel = row[s];
+                uint32_t alpha = pixel >> 24;
+                sum[0] += (pixel & 0xFF) * alpha;
+                sum[1] += (pixel >> 8 & 0xFF) * alpha;
+                sum[2] += (pixel >> 16 & 0xFF) * alpha;
+                sum[3] += alpha;
+            }
+        }
+        rows++;
+    }
+
+    // The average of the rows added since the last call
+    const uint32_t* Emit()
+    {
+        if (level == 0)
+            return out.data();
+        uint64_t* sum = sums.data();
+        for (uint32_t x = x0; x < x1; x++, sum += 4) {
+            uint32_t from = x << level;
+            uint32_t to = std::min(from + (1u << level), sourceWidth);
+            uint64_t count = static_cast<uint64_t>(to - from) * rows;
+            uint64_t alpha = sum[3];
+            uint32_t pixel = 0;
+            if (alpha > 0) {
+                pixel = static_cast<uint32_t>((sum[0] + alpha / 2) / alpha)
+                        | static_cast<uint32_t>((sum[1] + alpha / 2) / alpha) << 8
+                        | static_cast<uint32_t>((sum[2] + alpha / 2) / alpha) << 16
+                        | static_cast<uint32_t>((alpha + count / 2) / count) << 24;
+            }
+            out[x - x0] = pixel;
+            sum[0] = sum[1] = sum[2] = sum[3] = 0;
+        }
+        rows = 0;
+        return out.data();
+    }
+
+  private:
+    uint32_t sourceWidth;
+    unsigned level;
+    uint32_t x0;
+    uint32_t x1;
+    uint32_t rows;
+    std::vector<uint64_t> sums;     // B, G, R (premultiplied) and A per output pixel
+    std::vector<uint32_t> out;
+};
+
+/*
+ * TLevelSink - Decoded Rows Scaled Down To One Level
+ * Takes the rows of the full-size image in order and hands every finished
+ * row of `level`, columns [x0, x1), to `emit` with its level row number.
+ * Like TFormatSink, a row is filtered when the decoder asks for the next
+ * one, and the last one by Finish().
+ */
+class TLevelSink : public TImageSink
+{
+  public:
+    typedef std::function<void(uint32_t y, const uint32_t* row)> TEmit;
+
+    TLevelSink(const TPngInfo& info, unsigned level, uint32_t x0, uint32_t x1, const TEmit& emit)
+        : height(info.height), level(level), filter(info.width, level, x0, x1), emit(emit),
+          staging(info.width), pending(-1)
+    {
+    }
+
+    void Begin(const TPngInfo&) override
+    {
+    }
+
+    uint8_t* Row(uint32_t y) override
+    {
+        Finish();
+        pending = y;
+        return reinterpret_cast<uint8_t*>(staging.data());
+    }
+
+    void Finish()
+    {
+        if (pending < 0)
+            return;
+        uint32_t y = static_cast<uint32_t>(pending);
+        pending = -1;
+        filter.Add(staging.data());
+        if (((y + 1) & ((1u << level) - 1)) == 0 || y + 1 == height)
+            emit(y >> level, filter.Emit());
+    }
+
+  private:
+    uint32_t height;
+    unsigned level;
+    TBoxFilter filter;
+    TEmit emit;
+    std::vector<uint32_t> staging;
+    int64_t pending;                // Row waiting in staging; -1 if none
+};
+
+static std::shared_ptr<TDecodedImage> NewTile(uint32_t width, uint32_t height)
+{
+    std::shared_ptr<TDecodedImage> tile(new TDecodedImage());
+    tile->info.width = width;
+    tile->info.height = height;
+    tile->info.bitDepth = 8;
+    tile->info.colorType = 6;
+    tile->info.interlace = 0;
+    tile->info.channels = 4;
+    tile->pixels.resize(tile->Stride() * height);
+    return tile;
+}
+
+// Cuts a `width` x `height` level image into row-major tiles
+static void CutTiles(const std::vector<uint32_t>& image, uint32_t width, uint32_t height,
+                     std::vector<std::shared_ptr<const TDecodedImage> >& tiles)
+{
+    const uint32_t size = TTiledImage::TileSize;
+    for (uint32_t y0 = 0; y0 < height; y0 += size) {
+        for (uint32_t x0 = 0; x0 < width; x0 += size) {
+            std::shared_ptr<TDecodedImage> tile =
+                NewTile(std::min(size, width - x0), std::min(size, height - y0));
+            for (uint32_t y = 0; y < tile->info.height; y++)
+                memcpy(tile->pixels.data() + y * tile->Stride(),
+                       &image[static_cast<size_t>(y0 + y) * width + x0], tile->Stride());
+            tiles.push_back(tile);
+        }
+    }
+}
+//---------------------------------------------------------------------------
+
+TTiledImage::TTiledImage(const TPackVolumeSet& pack, size_t entry, size_t cacheBytes,
+                         TTaskPool& pool)
+    : pack(pack), entry(entry), pool(pool), levels(0), overviewLevel(0), overviewBytes(0),
+      policy(cacheBytes, cpLru), stats(), tasks(pool)
+{
+    memset(&info, 0, sizeof(info));
+    stats.cacheBudget = cacheBytes;
+    Open();
+}
+
+TTiledImage::~TTiledImage()
+{
+    shutdown.Cancel();
+    try {
+        tasks.Wait();
+    } catch (...) {
+    }
+}
+
+uint32_t TTiledImage::LevelWidth(unsigned level) const
+{
+    return static_cast<uint32_t>((static_cast<uint64_t>(info.width) + (1u << level) - 1) >> level);
+}
+
+uint32_t TTiledImage::LevelHeight(unsigned level) const
+{
+    return static_cast<uint32_t>((static_cast<uint64_t>(info.height) + (1u << level) - 1) >> level);
+}
+
+uint32_t TTiledImage::Columns(unsigned level) const
+{
+    return (LevelWidth(level) + TileSize - 1) / TileSize;
+}
+
+uint32_t TTiledImage::Rows(unsigned level) const
+{
+    return (LevelHeight(level) + TileSize - 1) / TileSize;
+}
+
+unsigned TTiledImage::LevelFor(double scale) const
+{
+    unsigned level = 0;
+    while (level + 1 < levels && scale * (2u << level) <= 1.0)
+        level++;
+    return level;
+}
+
+static uint32_t TileIndex(double value, uint32_t count)
+{
+    if (!(value > 0))
+        return 0;
+    return value >= count ? count : static_cast<uint32_t>(value);
+}
+
+TTileRange TTiledImage::Visible(unsigned level, double left, double top, double width,
+                                double height) const
+{
+    TTileRange range;
+    range.level = level;
+    double tile = static_cast<double>(static_cast<uint64_t>(TileSize) << level);
+    range.column0 = TileIndex(std::floor(left / tile), Columns(level));
+    range.row0 = TileIndex(std::floor(top / tile), Rows(level));
+    range.column1 = TileIndex(std::ceil((left + width) / tile), Columns(level));
+    range.row1 = TileIndex(std::ceil((top + height) / tile), Rows(level));
+    return range;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Opening Pass
+ * One streaming decode records the row points and averages the image
+ * straight down to the first overview level; the coarser ones are halved
+ * from that. Nothing bigger than that level is ever held.
+ */
+void TTiledImage::Open()
+{
+    std::unique_ptr<TByteSource> source = pack.OpenEntry(entry);
+    TPngDecoder decoder(source.get());
+    decoder.SetCancelToken(&shutdown);
+    info = decoder.ReadHeader();
+    if (info.interlace)
+        throw EDecodeError("Interlaced PNGs cannot be tiled");
+
+    levels = 1;
+    while (LevelWidth(levels - 1) > TileSize || LevelHeight(levels - 1) > TileSize)
+        levels++;
+    if (Columns(0) > MaxTileIndex || Rows(0) > MaxTileIndex)
+        throw EDecodeError("PNG too large to tile");
+    while (static_cast<uint64_t>(LevelWidth(overviewLevel)) * LevelHeight(overviewLevel)
+           > OverviewPixels)
+        overviewLevel++;
+
+    uint32_t width = LevelWidth(overviewLevel);
+    uint32_t height = LevelHeight(overviewLevel);
+    std::vector<uint32_t> image(static_cast<size_t>(width) * height);
+    TLevelSink sink(info, overviewLevel, 0, width,
+                    [&image, width](uint32_t y, const uint32_t* row) {
+                        memcpy(&image[static_cast<size_t>(y) * width], row,
+                               width * sizeof(uint32_t));
+                    });
+    decoder.Decode(&sink, TileSize, points);
+    sink.Finish();
+    const uint8_t* rest; // Reading to the end checks the entry's CRC-32
+    size_t restSize;
+    while (source->Next(rest, restSize)) {
+    }
+
+    overview.resize(levels - overviewLevel);
+    for (unsigned level = overviewLevel;; level++) {
+        CutTiles(image, width, height, overview[level - overviewLevel]);
+        overviewBytes += image.size() * sizeof(uint32_t);
+        if (level + 1 == levels)
+            break;
+        uint32_t nextWidth = LevelWidth(level + 1);
+        uint32_t nextHeight = LevelHeight(level + 1);
+        std::vector<uint32_t> next(static_cast<size_t>(nextWidth) * nextHeight);
+        TBoxFilter filter(width, 1, 0, nextWidth);
+        for (uint32_t y = 0; y < height; y++) {
+            filter.Add(&image[static_cast<size_t>(y) * width]);
+            if ((y & 1) || y + 1 == height)
+                memcpy(&next[static_cast<size_t>(y / 2) * nextWidth], filter.Emit(),
+                       nextWidth * sizeof(uint32_t));
+        }
+        image.swap(next);
+        width = nextWidth;
+        height = nextHeight;
+    }
+}
+//---------------------------------------------------------------------------
+
+std::shared_ptr<const TDecodedImage> TTiledImage::Find(unsigned level, uint32_t column,
+                                                       uint32_t row)
+{
+    if (level >= levels || column >= Columns(level) || row >= Rows(level))
+        return std::shared_ptr<const TDecodedImage>();
+    std::lock_guard<std::mutex> guard(lock);
+    if (level >= overviewLevel) {
+        stats.hits++;
+        return overview[level - overviewLevel][static_cast<size_t>(row) * Columns(level) + column];
+    }
+    std::unordered_map<size_t, std::shared_ptr<const TDecodedImage> >::iterator found =
+        cache.find(TileKey(level, column, row));
+    if (found == cache.end()) {
+        stats.misses++;
+        return std::shared_ptr<const TDecodedImage>();
+    }
+    policy.Touch(found->first);
+    stats.hits++;
+    return found->second;
+}
+
+/*
+ * Request The Tiles Of A Viewport
+ * A band spans the first to the last missing tile of its row; tiles in
+ * between that happen to be cached are made again, which costs less than
+ * a second pass over the same rows. A queued band just takes the new
+ * columns. A running one that does not cover them is left to finish
+ * (what it makes is still wanted) and a new band queued next to it.
+ */
+void TTiledImage::Request(const TTileRange& range, TTaskPriority priority)
+{
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<size_t, std::shared_ptr<TTileBand> > wanted;
+    unsigned level = range.level;
+    if (level < overviewLevel) {
+        uint32_t columns = std::min(range.column1, Columns(level));
+        uint32_t rows = std::min(range.row1, Rows(level));
+        for (uint32_t row = range.row0; row < rows; row++) {
+            uint32_t first = range.column0;
+            uint32_t last = columns;
+            while (first < last && cache.count(TileKey(level, first, row)))
+                first++;
+            while (last > first && cache.count(TileKey(level, last - 1, row)))
+                last--;
+            if (first == last)
+                continue;
+
+            size_t key = TileKey(level, 0, row);
+            std::shared_ptr<TTileBand> band;
+            std::unordered_map<size_t, std::shared_ptr<TTileBand> >::iterator found =
+                bands.find(key);
+            if (found != bands.end()) {
+                band = found->second;
+                if (!band->started) {
+                    band->column0 = first;
+                    band->column1 = last;
+                } else if (band->column0 > first || band->column1 < last) {
+                    band.reset();
+                }
+            }
+            if (!band) {
+                band.reset(new TTileBand(level, row, &shutdown));
+                band->column0 = first;
+                band->column1 = last;
+                tasks.Spawn([this, band]() { Produce(band); }, priority);
+            }
+            wanted[key] = band;
+        }
+    }
+
+    for (std::unordered_map<size_t, std::shared_ptr<TTileBand> >::iterator i = bands.begin();
+         i != bands.end(); ++i) {
+        if (wanted.count(i->first) == 0)
+            i->second->cancel.Cancel();
+    }
+    bands.swap(wanted);
+}
+
+void TTiledImage::Produce(const std::shared_ptr<TTileBand>& band)
+{
+    static TCounter& tileCount =
+        MetricCounter("zip_tiles_total", "Image tiles decoded for the tiled viewer");
+    static THistogram& bandTime =
+        MetricHistogram("zip_tile_band_seconds", "Time to decode one band of image tiles");
+
+    uint32_t column0, column1;
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        if (band->cancel.Cancelled()) {
+            stats.dropped++;
+            Forget(band);
+            return;
+        }
+        band->started = true;
+        column0 = band->column0;
+        column1 = band->column1;
+    }
+
+    THistogram::TClock::time_point start = THistogram::TClock::now();
+    std::vector<std::shared_ptr<const TDecodedImage> > tiles;
+    bool made = false;
+    try {
+        DecodeBand(*band, column0, column1, tiles);
+        made = true;
+    } catch (std::exception&) {
+        // Cancelled, or a broken entry: the viewer keeps a coarser level
+    }
+    double ms =
+        std::chrono::duration<double, std::milli>(THistogram::TClock::now() - start).count();
+
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        Forget(band);
+        if (!made) {
+            if (band->cancel.Cancelled())
+                stats.cancelled++;
+            else
+                stats.failed++;
+            return;
+        }
+        stats.bands++;
+        stats.tiles += tiles.size();
+        stats.bandMs += ms;
+        std::vector<size_t> evicted;
+        for (uint32_t column = column0; column < column1; column++) {
+            size_t key = TileKey(band->level, column, band->row);
+            const std::shared_ptr<const TDecodedImage>& tile = tiles[column - column0];
+            cache[key] = tile;
+            evicted.clear();
+            policy.Add(key, tile->Bytes(), evicted);
+            for (size_t i = 0; i < evicted.size(); i++)
+                cache.erase(evicted[i]);
+            stats.evictions += evicted.size();
+        }
+    }
+    tileCount.Add(tiles.size());
+    bandTime.RecordSince(start);
+    if (onReady)
+        onReady();
+}
+
+/*
+ * Decode One Band
+ * A fresh decoder reads the header from the start of the entry, then
+ * inflates from the row point at the band's top: 2^level tile rows of
+ * source for one tile row of the level.
+ */
+void TTiledImage::DecodeBand(const TTileBand& band, uint32_t column0, uint32_t column1,
+                             std::vector<std::shared_ptr<const TDecodedImage> >& tiles)
+{
+    const uint32_t size = TileSize;
+    uint32_t levelWidth = LevelWidth(band.level);
+    uint32_t top = band.row * TileSize;
+    uint32_t bottom = std::min(top + TileSize, LevelHeight(band.level));
+    uint32_t x0 = column0 * TileSize;
+    uint32_t x1 = std::min(column1 * TileSize, levelWidth);
+
+    std::vector<std::shared_ptr<TDecodedImage> > made;
+    for (uint32_t x = x0; x < x1; x += size)
+        made.push_back(NewTile(std::min(size, levelWidth - x), bottom - top));
+
+    uint32_t firstRow = top << band.level;
+    uint32_t rows = std::min(bottom << band.level, info.height) - firstRow;
+    const TPngRowPoint& point = points[firstRow / TileSize];
+
+    TLevelSink sink(info, band.level, x0, x1, [&made, top](uint32_t y, const uint32_t* row) {
+        for (size_t i = 0; i < made.size(); i++) {
+            TDecodedImage& tile = *made[i];
+            memcpy(tile.pixels.data() + (y - top) * tile.Stride(), row + i * TileSize,
+                   tile.Stride());
+        }
+    });
+    TEntryRangeSource head(pack, entry, 0, HeaderBlock);
+    TPngDecoder decoder(&head);
+    decoder.SetCancelToken(&band.cancel);
+    decoder.ReadHeader();
+    TEntryRangeSource body(pack, entry, point.fileOffset, BodyBlock);
+    decoder.DecodeRows(&body, point, rows, &sink);
+    sink.Finish();
+    tiles.assign(made.begin(), made.end());
+}
+
+// Drops the band's slot unless a newer band has taken it; lock held
+void TTiledImage::Forget(const std::shared_ptr<TTileBand>& band)
+{
+    std::unordered_map<size_t, std::shared_ptr<TTileBand> >::iterator found =
+        bands.find(TileKey(band->level, 0, band->row));
+    if (found != bands.end() && found->second == band)
+        bands.erase(found);
+}
+
+void TTiledImage::Wait()
+{
+    tasks.Wait();
+}
+
+TTileStats TTiledImage::Stats() const
+{
+    std::lock_guard<std::mutex> guard(lock);
+    TTileStats result = stats;
+    result.cachedTiles = cache.size();
+    result.cachedBytes = policy.Bytes();
+    result.overviewBytes = overviewBytes;
+    result.pointBytes = 0;
+    for (size_t i = 0; i < points.size(); i++)
+        result.pointBytes += points[i].history.size() + points[i].above.size();
+    return result;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Tile Benchmark
+ * Every frame requests the viewport's tiles and waits for them, which is
+ * how long the view stays blurred; the fallback to coarser tiles means it
+ * never stays blank. A frame whose tiles were all cached costs nothing.
+ */
+static double MsSince(TClock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(TClock::now() - start).count();
+}
+
+/*
+ * TViewRun - Frames Of One Pan Or Zoom
+ */
+struct TViewRun
+{
+    std::vector<double> frameMs;
+    unsigned cachedFrames;          // Nothing to decode
+    size_t peakBytes;               // Largest tile cache seen
+
+    TViewRun() : cachedFrames(0), peakBytes(0) {}
+
+    void Show(TTiledImage& image, double scale, double left, double top, unsigned width,
+              unsigned height)
+    {
+        TTileRange range =
+            image.Visible(image.LevelFor(scale), left, top, width / scale, height / scale);
+        uint64_t before = image.Stats().bands;
+        TClock::time_point start = TClock::now();
+        image.Request(range);
+        image.Wait();
+        frameMs.push_back(MsSince(start));
+        TTileStats stats = image.Stats();
+        if (stats.bands == before)
+            cachedFrames++;
+        peakBytes = std::max(peakBytes, stats.cachedBytes);
+    }
+
+    void Print(const char* name, std::ostream& out) const
+    {
+        if (frameMs.empty())
+            return;
+        out << "  " << std::left << std::setw(6) << name << std::right << std::setw(6)
+            << frameMs.size() << " frames, " << std::setw(4) << cachedFrames
+            << " from cache, ms p50 " << std::setw(7) << SamplePercentile(frameMs, 0.5)
+            << " p99 " << std::setw(7) << SamplePercentile(frameMs, 0.99) << " max "
+            << std::setw(7) << SamplePercentile(frameMs, 1.0) << ", peak cache " << std::setw(6)
+            << peakBytes / 1024.0 / 1024.0 << " MB\n";
+    }
+};
+
+void RunTileBench(const TPackVolumeSet& pack, const std::string& name, unsigned viewWidth,
+                  unsigned viewHeight, size_t cacheBytes, std::ostream& out)
+{
+    size_t entry = pack.Count();
+    if (!name.empty()) {
+        int found = pack.Find(name);
+        if (found < 0)
+            throw std::invalid_argument("No entry named " + name);
+        entry = static_cast<size_t>(found);
+    } else {
+        uint64_t largest = 0;
+        std::vector<size_t> pngs = PngEntries(pack);
+        for (size_t k = 0; k < pngs.size(); k++) {
+            if (pack.Entry(pngs[k]).size >= largest) {
+                largest = pack.Entry(pngs[k]).size;
+                entry = pngs[k];
+            }
+        }
+    }
+    if (entry == pack.Count()) {
+        out << "No PNG entries\n";
+        return;
+    }
+
+    out << std::fixed << std::setprecision(1);
+    size_t wholeBytes;
+    double wholeMs;
+    {
+        TDecodedImage whole;
+        TClock::time_point start = TClock::now();
+        DecodePngEntry(pack, entry, whole);
+        wholeMs = MsSince(start);
+        wholeBytes = whole.Bytes();
+    }
+
+    TClock::time_point start = TClock::now();
+    TTiledImage image(pack, entry, cacheBytes);
+    double openMs = MsSince(start);
+    const TPngInfo& info = image.Info();
+    TTileStats opened = image.Stats();
+    out << pack.Entry(entry).name << ": " << info.width << " x " << info.height << ", "
+        << image.Levels() << " levels, overview from level " << image.OverviewLevel() << "\n"
+        << "  whole decode " << wholeMs << " ms, " << wholeBytes / 1024.0 / 1024.0 << " MB\n"
+        << "  tiled open   " << openMs << " ms, overview "
+        << opened.overviewBytes / 1024.0 / 1024.0 << " MB, row points "
+        << opened.pointBytes / 1024.0 / 1024.0 << " MB\n";
+
+    // Fitted, the whole image is overview tiles
+    double fit = std::min(1.0, std::min(static_cast<double>(viewWidth) / info.width,
+                                        static_cast<double>(viewHeight) / info.height));
+    TViewRun fitted;
+    fitted.Show(image, fit, 0, 0, viewWidth, viewHeight);
+
+    // A drag across the middle at full size, 32 pixels a frame; a
+    // viewport wider than the image shows it in one frame
+    TViewRun pan;
+    double top = std::max(0.0, (static_cast<double>(info.height) - viewHeight) / 2);
+    double lastLeft = std::max(0.0, static_cast<double>(info.width) - viewWidth);
+    for (double left = 0;; left = std::min(lastLeft, left + 32)) {
+        pan.Show(image, 1.0, left, top, viewWidth, viewHeight);
+        if (left >= lastLeft)
+            break;
+    }
+
+    // Zooming in on the centre from fitted to full size, a notch at a time
+    TViewRun zoom;
+    for (double scale = fit;; scale = std::min(1.0, scale * 1.25)) {
+        double left = info.width / 2.0 - viewWidth / scale / 2;
+        double top = info.height / 2.0 - viewHeight / scale / 2;
+        zoom.Show(image, scale, left, top, viewWidth, viewHeight);
+        if (scale == 1.0)
+            break;
+    }
+
+    out << "  viewport " << viewWidth << " x " << viewHeight << ", tile cache "
+        << cacheBytes / 1024 / 1024 << " MB\n";
+    out << std::setprecision(2);
+    fitted.Print("fit", out);
+    pan.Print("pan", out);
+    zoom.Print("zoom", out);
+
+    TTileStats stats = image.Stats();
+    size_t held = stats.cachedBytes + stats.overviewBytes + stats.pointBytes;
+    out << std::setprecision(1) << "  " << stats.bands << " bands, " << stats.tiles
+        << " tiles, " << (stats.bands ? stats.bandMs / stats.bands : 0.0) << " ms per band, "
+        << stats.evictions << " evictions\n"
+        << "  held now " << held / 1024.0 / 1024.0 << " MB, "
+        << 100.0 * held / wholeBytes << "% of the whole image\n";
+}
@@ -0,0 +1,192 @@
+﻿/*
+ * TiledImage.h - Tiled Pan/Zoom Decoding Of Very Large Flags
+ *
+ * Declares the tile pyramid the viewer shows archival flags through. An
+ * 8K-wide scan is about 130 MB of BGRA; decoding all of it to show it in
+ * a 700 x 400 panel wastes both the time and the memory. Instead:
+ *
+ * - Level 0 is the image at full size, every further level half the one
+ *   before (box filtered on premultiplied alpha), down to the first level
+ *   that fits in one tile. Each level is cut into TileSize square BGRA
+ *   tiles.
+ * - Opening an image decodes it once, streaming, without holding it:
+ *   the pass records a PNG row point (PngDecode.h) every TileSize rows and
+ *   builds the overview, the coarse levels from the first one of at most
+ *   OverviewPixels down. Those stay in memory; a fitted view in the
+ *   viewer's 700 x 400 panel needs nothing else.
+ * - Finer tiles are made on demand on the task pool. A task makes one
+ *   band of tiles, a tile row of one level: it inflates only the rows
+ *   that band covers, from the row point at its top, and keeps only the
+ *   requested columns.
+ * - Request() takes the tiles of the current viewport. Bands an earlier
+ *   viewport queued that this one does not need are dropped, running ones
+ *   stop at their next scanline, so a fast pan or zoom never waits behind
+ *   tiles that have scrolled away.
+ * - Finished tiles go to an LRU cache with a byte budget (TWTinyLfu in
+ *   cpLru mode: for panning, recency is the whole story).
+ *
+ * Memory is the tile cache budget plus the overview (under 6 MB) plus the
+ * row points (32 KB of inflater history and one raw row each, about 1 MB
+ * for an 8K x 4K image) - nothing grows with the image as a whole. Only
+ * non-interlaced PNGs can be tiled; Adam7 passes revisit every row.
+ *
+ * "Zip.exe --pack tiles <pack>" opens the largest PNG of a pack and times
+ * a pan and a zoom against decoding the image whole.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef TiledImageH
+#define TiledImageH
+//---------------------------------------------------------------------------
+
+#include "CancelToken.h"          // TCancelToken
+#include "DecodeScheduler.h"      // TDecodedImage
+#include "PackVolumes.h"          // TPackVolumeSet
+#include "PngDecode.h"            // TPngInfo, TPngRowPoint
+#include "TaskPool.h"             // TTaskPool, TTaskGroup, TTaskPriority
+#include "TinyLfu.h"              // TWTinyLfu
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+struct TTileBand;
+
+/*
+ * TTileStats - Tile Counters And Sizes
+ */
+struct TTileStats
+{
+    uint64_t hits;                  // Find() calls that returned a tile
+    uint64_t misses;
+    uint64_t bands;                 // Bands decoded
+    uint64_t tiles;                 // Tiles those made
+    uint64_t dropped;               // Queued bands no longer wanted, skipped
+    uint64_t cancelled;             // Running bands stopped part way
+    uint64_t failed;                // Stopped by a decode error
+    uint64_t evictions;
+    double bandMs;                  // Total decode time of finished bands
+    size_t cachedTiles;
+    size_t cachedBytes;
+    size_t cacheBudget;
+    size_t overviewBytes;
+    size_t pointBytes;              // Row point history and rows
+};
+
+/*
+ * TTileRange - Tiles Of One Level
+ * Columns [column0, column1) of rows [row0, row1).
+ */
+struct TTileRange
+{
+    unsigned level;
+    uint32_t column0;
+    uint32_t row0;
+    uint32_t column1;
+    uint32_t row1;
+};
+
+/*
+ * TTiledImage - Tile Pyramid Of One PNG Entry
+ * The pack must outlive the image. The constructor runs the opening
+ * pass on the calling thread and throws EDecodeError for images that
+ * cannot be tiled. The destructor drops queued bands and waits for
+ * running ones. Thread-safe.
+ */
+class TTiledImage
+{
+  public:
+    static const uint32_t TileSize = 256;
+    static const size_t OverviewPixels = 1 << 20;
+    static const size_t DefaultCacheBytes = 48 << 20;
+
+    // Called on a pool thread whenever a band of tiles was added
+    typedef std::function<void()> TReadyCallback;
+
+    TTiledImage(const TPackVolumeSet& pack, size_t entry, size_t cacheBytes = DefaultCacheBytes,
+                TTaskPool& pool = TTaskPool::Shared());
+    ~TTiledImage();
+
+    const TPngInfo& Info() const { return info; }
+    unsigned Levels() const { return levels; }
+    unsigned OverviewLevel() const { return overviewLevel; }
+    uint32_t LevelWidth(unsigned level) const;
+    uint32_t LevelHeight(unsigned level) const;
+    uint32_t Columns(unsigned level) const;
+    uint32_t Rows(unsigned level) const;
+
+    // The level to draw at `scale` screen pixels per image pixel: the
+    // coarsest one still at least as sharp as the screen
+    unsigned LevelFor(double scale) const;
+
+    // The tiles of `level` covering the image area with its top-left
+    // corner at (left, top), in full-size pixels
+    TTileRange Visible(unsigned level, double left, double top, double width,
+                       double height) const;
+
+    // The tile if it is ready, else null. Tiles are BGRA, TileSize square
+    // but for the right and bottom edges of a level
+    std::shared_ptr<const TDecodedImage> Find(unsigned level, uint32_t column, uint32_t row);
+
+    // Wants the tiles of `range`: queues those neither ready nor on their
+    // way, and drops the bands earlier calls queued that this one does not
+    // want. Overview levels are always ready
+    void Request(const TTileRange& range, TTaskPriority priority = tpVisible);
+
+    // Set before the first Request()
+    void SetReadyCallback(const TReadyCallback& callback) { onReady = callback; }
+
+    // Waits for every band queued so far (benchmarks)
+    void Wait();
+
+    TTileStats Stats() const;
+
+  private:
+    const TPackVolumeSet& pack;
+    size_t entry;
+    TTaskPool& pool;
+    TPngInfo info;
+    unsigned levels;
+    unsigned overviewLevel;                     // Levels from here on are the overview
+    std::vector<TPngRowPoint> points;           // One every TileSize rows
+    std::vector<std::vector<std::shared_ptr<const TDecodedImage> > > overview;  // Row-major tiles
+    size_t overviewBytes;
+    TReadyCallback onReady;
+    TCancelToken shutdown;                      // Parent of every band's token
+
+    mutable std::mutex lock;                    // Guards everything below
+    std::unordered_map<size_t, std::shared_ptr<const TDecodedImage> > cache;
+    TWTinyLfu policy;
+    std::unordered_map<size_t, std::shared_ptr<TTileBand> > bands;  // Queued or running
+    TTileStats stats;
+
+    TTaskGroup tasks;                           // Declared last: waited for first
+
+    void Open();
+    void Produce(const std::shared_ptr<TTileBand>& band);
+    void DecodeBand(const TTileBand& band, uint32_t column0, uint32_t column1,
+                    std::vector<std::shared_ptr<const TDecodedImage> >& tiles);
+    void Forget(const std::shared_ptr<TTileBand>& band);
+
+    TTiledImage(const TTiledImage&);
+    TTiledImage& operator=(const TTiledImage&);
+};
+
+//---------------------------------------------------------------------------
+
+// Opens the PNG entry `name` of `pack` (the largest one if empty) as a
+// tiled image and compares a pan and a zoom through a `viewWidth` x
+// `viewHeight` viewport with decoding it whole
+void RunTileBench(const TPackVolumeSet& pack, const std::string& name, unsigned viewWidth,
+                  unsigned viewHeight, size_t cacheBytes, std::ostream& out);
+
+//---------------------------------------------------------------------------
+#endif // TiledImageH
@@ -0,0 +1,278 @@
+﻿/*
+ * TinyLfu.cpp - W-TinyLFU Cache Admission And Eviction
+ *
+ * Implements the count-min frequency sketch and the window / probation /
+ * protected regions with the admission contest between them.
+ */
+
+//---------------------------------------------------------------------------
+
+#pragma hdrstop
+
+#include "TinyLfu.h"
+
+#include <algorithm>
+#include <iterator>               // std::advance
+//---------------------------------------------------------------------------
+#pragma package(smart_init)
+
+static const size_t MinSketchKeys = 64;
+static const size_t SampleFactor = 10;          // Accesses per key between agings
+static const uint64_t Seeds[4] = {0x9E3779B97F4A7C15ull, 0xC2B2AE3D27D4EB4Full,
+                                  0x165667B19E3779F9ull, 0xD6E8FEB86659FD93ull};
+
+// Splitmix64 finaliser: spreads consecutive entry numbers over the table
+static uint64_t Mix(uint64_t value)
+{
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9ull;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EBull;
+    return value ^ (value >> 31);
+}
+//---------------------------------------------------------------------------
+
+TFrequencySketch::TFrequencySketch()
+    : capacity(0), additions(0), sampleSize(0), agings(0)
+{
+    EnsureCapacity(MinSketchKeys);
+}
+
+/*
+ * Table Size
+ * Four counters per key in a power-of-two table of 16-counter words: one
+ * word per four keys, so a thousand keys cost 2 KB.
+ */
+void TFrequencySketch::EnsureCapacity(size_t keys)
+{
+    keys = std::max(keys, MinSketchKeys);
+    if (keys <= capacity)
+        return;
+    size_t words = 1;
+    while (words * 4 < keys)
+        words *= 2;
+    table.assign(words, 0);
+    capacity = words * 4;
+    sampleSize = SampleFactor * capacity;
+    additions = 0;
+}
+
+/*
+ * Counters
+ * Row i of a key is its hash mixed with seed i; each row owns a quarter
+ * of the table, so the four counters of a key never share a word slot.
+ */
+size_t TFrequencySketch::Counter(uint64_t key, unsigned row) const
+{
+    size_t rowCounters = table.size() * 16 / 4;
+    return row * rowCounters + static_cast<size_t>(Mix(key ^ Seeds[row]) & (rowCounters - 1));
+}
+
+void TFrequencySketch::Increment(uint64_t key)
+{
+    bool added = false;
+    for (unsigned row = 0; row < 4; row++) {
+        size_t counter = Counter(key, row);
+        uint64_t& word = table[counter >> 4];
+        unsigned shift = static_cast<unsigned>(counter & 15) * 4;
+        if (((word >> shift) & 15) != 15) {
+            word += uint64_t(1) << shift;
+            added = true;
+        }
+    }
+    if (added && ++additions >= sampleSize)
+        Age();
+}
+
+unsigned TFrequencySketch::Estimate(uint64_t key) const
+{
+    unsigned frequency = 15;
+    for (unsigned row = 0; row < 4; row++) {
+        size_t counter = Counter(key, row);
+        unsigned shift = static_cast<unsigned>(counter & 15) * 4;
+        frequency = std::min(frequency, static_cast<unsigned>((table[counter >> 4] >> shift) & 15));
+    }
+    return frequency;
+}
+
+// Halves every counter at once: shift the word, drop the bit that crossed
+// into each neighbouring counter
+void TFrequencySketch::Age()
+{
+    for (size_t i = 0; i < table.size(); i++)
+        table[i] = (table[i] >> 1) & 0x7777777777777777ull;
+    additions /= 2;
+    agings++;
+}
+
+void TFrequencySketch::Clear()
+{
+    std::fill(table.begin(), table.end(), 0);
+    additions = 0;
+}
+//---------------------------------------------------------------------------
+
+TWTinyLfu::TWTinyLfu(size_t budget, TCachePolicy policy)
+    : policy(policy), budget(0), windowBudget(0), protectedBudget(0), windowBytes(0),
+      probationBytes(0), protectedBytes(0), rejections(0)
+{
+    std::vector<size_t> none;
+    SetBudget(budget, none);
+}
+
+TWTinyLfu::TItemList& TWTinyLfu::List(TRegion region)
+{
+    if (region == rgWindow)
+        return window;
+    return region == rgProbation ? probation : protectedItems;
+}
+
+size_t& TWTinyLfu::RegionBytes(TRegion region)
+{
+    if (region == rgWindow)
+        return windowBytes;
+    return region == rgProbation ? probationBytes : protectedBytes;
+}
+
+// Moves an item to the most recently used end of `region`; iterators stay valid
+void TWTinyLfu::Move(TItemList::iterator item, TRegion region)
+{
+    RegionBytes(item->region) -= item->bytes;
+    RegionBytes(region) += item->bytes;
+    List(region).splice(List(region).begin(), List(item->region), item);
+    item->region = region;
+}
+
+void TWTinyLfu::Evict(TItemList::iterator item, std::vector<size_t>& evicted)
+{
+    evicted.push_back(item->key);
+    RegionBytes(item->region) -= item->bytes;
+    items.erase(item->key);
+    List(item->region).erase(item);
+}
+
+void TWTinyLfu::Record(size_t key)
+{
+    if (policy == cpTinyLfu)
+        sketch.Increment(key);
+}
+
+void TWTinyLfu::Touch(size_t key)
+{
+    std::unordered_map<size_t, TItemList::iterator>::iterator found = items.find(key);
+    if (found == items.end())
+        return;
+    TItemList::iterator item = found->second;
+    Move(item, item->region == rgProbation ? rgProtected : item->region);
+    while (protectedBytes > protectedBudget && !protectedItems.empty())
+        Move(--protectedItems.end(), rgProbation);
+}
+
+void TWTinyLfu::Add(size_t key, size_t bytes, std::vector<size_t>& evicted)
+{
+    std::unordered_map<size_t, TItemList::iterator>::iterator found = items.find(key);
+    if (found != items.end()) {
+        TItemList::iterator item = found->second;
+        RegionBytes(item->region) += bytes;
+        RegionBytes(item->region) -= item->bytes;
+        item->bytes = bytes;
+        Touch(key);
+    } else {
+        TItem added;
+        added.key = key;
+        added.bytes = bytes;
+        added.region = rgWindow;
+        window.push_front(added);
+        windowBytes += bytes;
+        items[key] = window.begin();
+        sketch.EnsureCapacity(items.size());
+    }
+    Rebalance(evicted);
+}
+
+void TWTinyLfu::Remove(size_t key)
+{
+    std::unordered_map<size_t, TItemList::iterator>::iterator found = items.find(key);
+    if (found == items.end())
+        return;
+    TItemList::iterator item = found->second;
+    RegionBytes(item->region) -= item->bytes;
+    List(item->region).erase(item);
+    items.erase(found);
+}
+
+void TWTinyLfu::SetBudget(size_t newBudget, std::vector<size_t>& evicted)
+{
+    budget = newBudget;
+    if (policy == cpLru) {
+        windowBudget = budget;
+        protectedBudget = 0;
+    } else {
+        windowBudget = budget / 100;
+        protectedBudget = (budget - windowBudget) / 5 * 4;
+    }
+    while (protectedBytes > protectedBudget && !protectedItems.empty())
+        Move(--protectedItems.end(), rgProbation);
+    Rebalance(evicted);
+}
+
+void TWTinyLfu::Clear()
+{
+    window.clear();
+    probation.clear();
+    protectedItems.clear();
+    items.clear();
+    windowBytes = probationBytes = protectedBytes = 0;
+    sketch.Clear();
+}
+
+/*
+ * Rebalance
+ * Items the window overflows with become candidates at the front of
+ * probation. While the cache is over budget, the oldest candidate is
+ * weighed against the victim, the least recently used item of probation
+ * that is not a candidate itself (or of protected, once probation holds
+ * only candidates), and the less frequent one goes. A tie goes against
+ * the candidate, so a scan never displaces what it ties with.
+ */
+void TWTinyLfu::Rebalance(std::vector<size_t>& evicted)
+{
+    if (policy == cpLru) {
+        while (windowBytes > windowBudget && !window.empty())
+            Evict(--window.end(), evicted);
+        return;
+    }
+
+    size_t candidates = 0;
+    while (windowBytes > windowBudget && window.size() > 1) {
+        Move(--window.end(), rgProbation);
+        candidates++;
+    }
+
+    while (Bytes() > budget) {
+        TItemList::iterator victim;
+        bool contested = true;
+        if (probation.size() > candidates)
+            victim = --probation.end();
+        else if (!protectedItems.empty())
+            victim = --protectedItems.end();
+        else if (candidates == 0)
+            victim = --window.end();
+        else
+            contested = false;      // Only candidates and the newest item left
+
+        if (candidates == 0) {
+            Evict(victim, evicted);
+            continue;
+        }
+        TItemList::iterator candidate = probation.begin();
+        std::advance(candidate, candidates - 1);
+        if (contested && sketch.Estimate(candidate->key) > sketch.Estimate(victim->key)) {
+            Evict(victim, evicted);
+        } else {
+            Evict(candidate, evicted);
+            candidates--;
+            if (contested)
+                rejections++;
+        }
+    }
+}
+//---------------------------------------------------------------------------
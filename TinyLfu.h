@@ -0,0 +1,139 @@
+﻿/*
+ * TinyLfu.h - W-TinyLFU Cache Admission And Eviction
+ *
+ * Declares the replacement policy of the image cache tiers. A plain LRU
+ * lets a single pass over the pack (a gallery scroll, a batch export)
+ * push out every flag the user keeps coming back to: each image of the
+ * sweep is the most recently used one for a moment. W-TinyLFU keeps
+ * recency for new arrivals but makes them earn a place in the main region
+ * by being used more often than what they would replace.
+ *
+ * - Frequency sketch: a count-min sketch of 4-bit counters estimates how
+ *   often each key was asked for recently, hits and misses alike. Every
+ *   counter is halved after a sample of ten accesses per cached key, so
+ *   old popularity fades.
+ * - Window: a small LRU (1% of the budget, but always its newest item)
+ *   that every new item enters, so a burst of accesses to a new image is
+ *   served before its frequency builds up.
+ * - Main: a segmented LRU. Items leaving the window go to its probation
+ *   segment only if the sketch rates them above the probation victim they
+ *   would displace; a hit in probation moves an item to the protected
+ *   segment (80% of main).
+ *
+ * Budgets are bytes; items have their own sizes. Keys are pack entries.
+ * The policy only orders keys: the cache owns the items and drops the
+ * ones Add() and SetBudget() report. Not thread-safe; TImageCache calls
+ * it under its own lock.
+ */
+
+//---------------------------------------------------------------------------
+
+#ifndef TinyLfuH
+#define TinyLfuH
+//---------------------------------------------------------------------------
+
+#include <cstddef>
+#include <cstdint>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+//---------------------------------------------------------------------------
+
+enum TCachePolicy
+{
+    cpLru,                          // Window only: plain LRU, for comparison
+    cpTinyLfu                       // Window, frequency filter, segmented main
+};
+
+/*
+ * TFrequencySketch - Count-Min Sketch With Aging
+ * Four counters per key, one in each quarter of the table; the estimate
+ * is the smallest. Counters saturate at 15.
+ */
+class TFrequencySketch
+{
+  public:
+    TFrequencySketch();
+
+    // Sizes the table for about `keys` distinct keys; grows only, and
+    // clears the counts when it does
+    void EnsureCapacity(size_t keys);
+
+    void Increment(uint64_t key);
+    unsigned Estimate(uint64_t key) const;
+    void Clear();
+
+    uint64_t Agings() const { return agings; }
+
+  private:
+    std::vector<uint64_t> table;    // 16 four-bit counters per word
+    size_t capacity;
+    size_t additions;               // Since the last aging
+    size_t sampleSize;
+    uint64_t agings;
+
+    size_t Counter(uint64_t key, unsigned row) const;
+    void Age();
+};
+
+/*
+ * TWTinyLfu - Window, Probation And Protected Regions Over Byte Budgets
+ */
+class TWTinyLfu
+{
+  public:
+    explicit TWTinyLfu(size_t budget, TCachePolicy policy = cpTinyLfu);
+
+    // An access to `key`, found or not: feeds the frequency sketch
+    void Record(size_t key);
+    // A hit on a cached key: updates its recency and segment
+    void Touch(size_t key);
+
+    // Adds a key in the window and evicts down to the budget. `evicted`
+    // receives every key to drop, possibly `key` itself if it lost its
+    // admission contest
+    void Add(size_t key, size_t bytes, std::vector<size_t>& evicted);
+    void Remove(size_t key);
+    void SetBudget(size_t budget, std::vector<size_t>& evicted);
+    void Clear();
+
+    bool Contains(size_t key) const { return items.count(key) != 0; }
+    size_t Bytes() const { return windowBytes + probationBytes + protectedBytes; }
+    size_t Count() const { return items.size(); }
+    TCachePolicy Policy() const { return policy; }
+    uint64_t Rejections() const { return rejections; }   // Candidates refused admission
+
+  private:
+    enum TRegion { rgWindow, rgProbation, rgProtected };
+    struct TItem
+    {
+        size_t key;
+        size_t bytes;
+        TRegion region;
+    };
+    typedef std::list<TItem> TItemList;
+
+    TCachePolicy policy;
+    size_t budget;
+    size_t windowBudget;
+    size_t protectedBudget;
+    TItemList window;               // Each list most recently used first
+    TItemList probation;
+    TItemList protectedItems;
+    size_t windowBytes;
+    size_t probationBytes;
+    size_t protectedBytes;
+    std::unordered_map<size_t, TItemList::iterator> items;
+    TFrequencySketch sketch;
+    uint64_t rejections;
+
+    TItemList& List(TRegion region);
+    size_t& RegionBytes(TRegion region);
+    void Move(TItemList::iterator item, TRegion region);
+    void Evict(TItemList::iterator item, std::vector<size_t>& evicted);
+    void Rebalance(std::vector<size_t>& evicted);
+};
+
+//---------------------------------------------------------------------------
+#endif // TinyLfuH
@@ -9,6 +9,9 @@
  * 4. Start the Windows message loop
  * 5. Handle any unhandled exceptions gracefully
  *
+ * Started as "Zip.exe --pack <command> ...", it runs one of the command-line
+ * pack tools (PackTool.h) instead and never creates a window.
+ *
  * This file demonstrates the basic structure of a C++ Builder (VCL) application
  * and shows how Windows GUI applications are bootstrapped.
  */
@@ -18,11 +21,37 @@
 #include <vcl.h>           // Visual Component Library - Core VCL framework
 #pragma hdrstop            // Stop processing headers at this point for precompiled headers
 #include <tchar.h>         // Unicode/ANSI character type definitions (_TCHAR, _tWinMain, etc.)
+#include <cstdio>          // freopen for the tool console
+#include <string>
+#include <vector>
+#include "PackTool.h"      // Command-line pack tools (--pack)
+#include "Metrics.h"       // ZIP_METRICS periodic dump
 // ---------------------------------------------------------------------------
 USEFORM("Zipu1.cpp", Form1);
 
 // ---------------------------------------------------------------------------
 int WINAPI _tWinMain(HINSTANCE, HINSTANCE, LPTSTR, int) {
+	// ZIP_METRICS=<file> keeps a metrics dump current in either mode
+	StartMetricsFromEnvironment();
+
+	/*
+	 * Pack Tool Mode
+	 * A GUI-subsystem process has no console of its own, so attach to the
+	 * console of the shell that started us for the tool's output.
+	 */
+	if (ParamCount() >= 1 && ParamStr(1) == "--pack") {
+		if (AttachConsole(ATTACH_PARENT_PROCESS)) {
+			freopen("CONOUT$", "w", stdout);
+			freopen("CONOUT$", "w", stderr);
+		}
+		std::vector<std::string> args;
+		for (int i = 2; i <= ParamCount(); i++)
+			args.push_back(UTF8String(ParamStr(i)).c_str());
+		int result = RunPackTool(args);
+		StopMetricsDump();
+		return result;
+	}
+
 	try {
 		/*
 		 * Application Initialization Phase
@@ -96,6 +125,9 @@ int WINAPI _tWinMain(HINSTANCE, HINSTANCE, LPTSTR, int) {
 		}
 	}
 
+	// Final metrics dump while every thread can still be joined
+	StopMetricsDump();
+
 	/*
 	 * Application Exit
 	 * Return 0 to indicate successful program termination
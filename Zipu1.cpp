@@ -1,14 +1,19 @@
 ﻿/*
  * Flag Display Application - Zipu1.cpp
  *
- * This C++ Builder (VCL) application extracts flag images from an embedded ZIP resource
+ * This C++ Builder (VCL) application decodes flag images from an embedded ZIP resource
  * and displays them randomly. The application:
- * 1. Extracts a ZIP file embedded as a resource (ID: 108) in the executable
- * 2. Extracts the ZIP contents to a temporary directory
- * 3. Loads all image files (PNG, JPG, JPEG, BMP, GIF) from the extracted files
- * 4. Displays random flag images with their names
+ * 1. Opens the ZIP file embedded as a resource (ID: 1) directly in memory,
+ *    or the multi-volume pack listed in flags.volumes next to the executable
+ * 2. Catalogs all image entries (PNG, JPG, JPEG, BMP, GIF) in the archive
+ * 3. Decodes PNG entries in one fused pass (inflate -> unfilter -> convert)
+ *    on the shared task pool, without temporary files; the flag for the
+ *    next click is decoded in the background while the current one is shown,
+ *    and the whole pack is kept decoded in a compressed image cache
+ * 4. Displays random flag images with their names, counting views per flag
+ *    so the pack can later be reordered with the hot flags first; flags
+ *    too large to decode whole are shown as tiles, with pan and zoom
  * 5. Provides a refresh button to show different random flags
- * 6. Cleans up temporary files when the application closes
  */
 
 //---------------------------------------------------------------------------
@@ -17,27 +22,138 @@
 #pragma hdrstop
 
 #include "Zipu1.h" // Header file for this form class
+
+#include <algorithm> // std::min, std::max for the tiled view
+#include <cctype> // tolower for extension matching
+#include <cmath> // floor for tile edges
+#include <cstring> // strlen, memcpy
+#include <memory> // std::unique_ptr for decoder-owned objects
 //---------------------------------------------------------------------------
 #pragma package(smart_init) // Enable smart initialization for packages
 #pragma resource "*.dfm" // Link the form's visual design file
 #pragma resource \
     "flags.RES" // Link custom resource file containing flag images ZIP
 TForm1* Form1; // Global pointer to the main form instance
+
+// Image cache budgets: a dozen large flags raw, the whole pack compressed
+static const size_t HotCacheBytes = 32 << 20;
+static const size_t ColdCacheBytes = 24 << 20;
+// Decoded flags kept across sessions: about a hundred of the largest
+static const uint64_t DiskCacheBytes = 256 << 20;
+// PNGs above this many pixels (64 MB of BGRA) are shown as tiles
+static const uint64_t TiledPixels = 16 << 20;
+// Closest zoom of the tiled view, and one mouse wheel notch
+static const double MaxTileScale = 4.0;
+static const double TileZoomStep = 1.25;
+//---------------------------------------------------------------------------
+
+/*
+ * Matte Colour
+ * TColor is 0x00BBGGRR; decoded pixels are BGRA in memory, 0xAARRGGBB
+ * as a number.
+ */
+static uint32_t MatteColor(TColor color)
+{
+    COLORREF rgb = ColorToRGB(color);
+    return 0xFF000000 | (GetRValue(rgb) << 16) | (GetGValue(rgb) << 8) | GetBValue(rgb);
+}
+
+/*
+ * Image Palette
+ * The bitmap takes ownership of the handle.
+ */
+static HPALETTE CreateImagePalette(const std::vector<uint32_t>& colours)
+{
+    std::vector<uint8_t> buffer(sizeof(LOGPALETTE) + colours.size() * sizeof(PALETTEENTRY));
+    LOGPALETTE* palette = reinterpret_cast<LOGPALETTE*>(buffer.data());
+    palette->palVersion = 0x300;
+    palette->palNumEntries = static_cast<WORD>(colours.size());
+    for (size_t i = 0; i < colours.size(); i++) {
+        palette->palPalEntry[i].peRed = static_cast<BYTE>(colours[i] >> 16);
+        palette->palPalEntry[i].peGreen = static_cast<BYTE>(colours[i] >> 8);
+        palette->palPalEntry[i].peBlue = static_cast<BYTE>(colours[i]);
+        palette->palPalEntry[i].peFlags = 0;
+    }
+    return CreatePalette(palette);
+}
+
+/*
+ * Copy Decoded Image To Bitmap
+ * Every decoded format matches a VCL bitmap format byte for byte: BGRA
+ * a 32-bit one, RGB565 a 16-bit one (5-6-5 bit fields) and indexed
+ * pixels an 8-bit one with the image's palette. The image may be shared
+ * with other holders, so its rows are copied rather than decoded into
+ * the bitmap directly.
+ */
+static void CopyToBitmap(const TDecodedImage& image, Graphics::TBitmap* bitmap)
+{
+    if (image.format == ifRgb565) {
+        bitmap->PixelFormat = pf16bit;
+    } else if (image.format == ifIndexed8) {
+        bitmap->PixelFormat = pf8bit;
+        bitmap->Palette = CreateImagePalette(image.palette);
+    } else {
+        bitmap->PixelFormat = pf32bit;
+        bitmap->AlphaFormat = afIgnored; // Straight alpha while filling
+    }
+    bitmap->SetSize(image.info.width, image.info.height);
+
+    size_t stride = image.Stride();
+    for (uint32_t y = 0; y < image.info.height; y++)
+        memcpy(bitmap->ScanLine[y], image.pixels.data() + y * stride, stride);
+}
+
+/*
+ * Supported Image Entry Check
+ * Case-insensitive extension match on an archive entry name
+ */
+static bool IsImageEntry(const std::string& name)
+{
+    static const char* const extensions[] = {".png", ".jpg", ".jpeg", ".bmp", ".gif"};
+
+    std::string lower(name);
+    for (size_t i = 0; i < lower.size(); i++)
+        lower[i] = static_cast<char>(tolower(static_cast<unsigned char>(lower[i])));
+
+    for (size_t i = 0; i < sizeof(extensions) / sizeof(extensions[0]); i++) {
+        size_t len = strlen(extensions[i]);
+        if (lower.size() > len && lower.compare(lower.size() - len, len, extensions[i]) == 0)
+            return true;
+    }
+    return false;
+}
+
+/*
+ * Large PNG Check
+ * Reads only the header. A non-interlaced PNG above TiledPixels is shown
+ * through a TTiledImage instead of being decoded whole; interlaced ones
+ * cannot be tiled and are decoded whole regardless.
+ */
+static bool IsLargePng(const TPackVolumeSet& pack, int entry)
+{
+    try {
+        std::unique_ptr<TByteSource> source = pack.OpenEntry(entry);
+        TPngDecoder decoder(source.get());
+        const TPngInfo& info = decoder.ReadHeader();
+        return !info.interlace && static_cast<uint64_t>(info.width) * info.height > TiledPixels;
+    } catch (std::exception&) {
+        return false; // The whole decode reports it
+    }
+}
 //---------------------------------------------------------------------------
 
 /*
  * Form Constructor
  * Initializes the form and sets up the application state
  */
-__fastcall TForm1::TForm1(TComponent* Owner) : TForm(Owner)
+__fastcall TForm1::TForm1(TComponent* Owner)
+    : TForm(Owner), tileScale(1), tileFitScale(1), tileLeft(0), tileTop(0), tileDragging(false),
+      tileDragX(0), tileDragY(0), nextIndex(-1)
 {
     // Initialize random number generator with current system tick count
     // This ensures different random sequences each time the app runs
     randomGenerator.seed(GetTickCount());
 
-    // Initialize temporary directory path (will be set during resource extraction)
-    tempDirectory = "";
-
     // Initialize application after form is fully constructed
     // This ensures all UI components are ready before we start processing
     InitializeApplication();
@@ -50,8 +166,20 @@ __fastcall TForm1::TForm1(TComponent* Owner) : TForm(Owner)
  */
 __fastcall TForm1::~TForm1()
 {
-    // Clean up any temporary files and directories created during execution
-    CleanupTempFiles();
+    // Persist this session's view counts for pack reordering
+    SaveAccessStats();
+
+    // Drop the pending prefetch and wait for decodes still reading the pack
+    nextJob.reset();
+    tiledImage.reset();
+    pressureMonitor.reset();
+    pressureShrinker.reset();
+    decoder.reset();
+    imageCache.reset();
+    diskCache.reset();
+
+    // Release the archive index (the resource memory itself is owned by Windows)
+    flagPack.Close();
 }
 //---------------------------------------------------------------------------
 
@@ -61,31 +189,70 @@ __fastcall TForm1::~TForm1()
  */
 void TForm1::InitializeApplication()
 {
-    // Update status to show we're starting the extraction process
-    LabelStatus->Caption = "Status: Extracting resource...";
+    // Update status to show we're starting to read the resource
+    LabelStatus->Caption = "Status: Opening resource...";
     Application
         ->ProcessMessages(); // Force UI update to show status immediately
 
-    // Extract and load flag images from embedded ZIP resource
-    if (ExtractResourceAsZip()) {
-        // If extraction successful, load all image files from extracted directory
+    // Open the embedded ZIP resource and catalog its flag images
+    if (OpenResourcePack()) {
+        // Reordered packs keep the usual flags together at the front;
+        // read that region in one request before the first click
+        flagPack.PrefetchHot();
+
+        // If the archive was parsed, collect all image entries
         LoadFlagImages();
 
-        if (flagFiles.size() > 0) {
+        // Small panels keep their flags as RGB565 or 8-bit indexed pixels,
+        // blended onto the form's background
+        TImageFormat format;
+        if (ParseImageFormat(UTF8String(GetEnvironmentVariable("ZIP_PIXELS")).c_str(), format))
+            imageOutput = TImageOutput(format, MatteColor(Color));
+
+        imageCache.reset(new TImageCache(HotCacheBytes, ColdCacheBytes));
+        OpenDiskCache();
+        decoder.reset(new TDecodeScheduler(flagPack, TTaskPool::Shared(), imageCache.get(),
+                                           imageOutput));
+
+        // Give cached pixels back while other programs are short of memory
+        pressureShrinker.reset(new TCacheShrinker(*imageCache, HotCacheBytes, ColdCacheBytes));
+        TCacheShrinker* shrinker = pressureShrinker.get();
+        pressureMonitor.reset(new TMemoryPressureMonitor(
+            [shrinker](const TPressureReading& reading) { shrinker->Sample(reading.level); }));
+
+        // Continue counting on top of the views of earlier sessions
+        statsPath = TPath::Combine(TPath::GetHomePath(), "FlagDisplay.stats");
+        accessStats.Reset(flagPack.Count());
+        accessStats.Load(UTF8String(statsPath).c_str());
+        tracePath = GetEnvironmentVariable("ZIP_TRACE");
+
+        if (flagEntries.size() > 0) {
             // Success: Update status with count of loaded images
             LabelStatus->Caption =
                 "Status: Successfully loaded " +
-                IntToStr(static_cast<int>(flagFiles.size())) + " flag images";
+                IntToStr(static_cast<int>(flagEntries.size())) + " flag images";
 
             // Display the first random flag
             ShowRandomFlag();
+
+            // Decode the rest of the PNG flags into the compressed cache
+            // tier in the background, so later clicks skip PNG decoding;
+            // large ones are tiled and would only push the others out.
+            // Not over the network: only the flags viewed are fetched
+            std::vector<size_t> pngEntries;
+            for (size_t i = 0; i < flagEntries.size() && !flagPack.IsRemote(); i++) {
+                String name = UTF8ToString(flagPack.Entry(flagEntries[i]).name.c_str());
+                if (SameText(TPath::GetExtension(name), ".png") && !IsLargeFlag(flagEntries[i]))
+                    pngEntries.push_back(flagEntries[i]);
+            }
+            decoder->Warm(pngEntries);
         } else {
             // No images found after extraction
             LabelStatus->Caption = "Status: No image files found";
             LabelStatus->Font->Color = clRed; // Red text to indicate error
         }
     } else {
-        // Resource extraction failed
+        // Resource could not be opened
         LabelStatus->Caption = "Status: Resource extraction failed";
         LabelStatus->Font->Color = clRed; // Red text to indicate error
     }
@@ -93,13 +260,24 @@ void TForm1::InitializeApplication()
 //---------------------------------------------------------------------------
 
 /*
- * Extract Embedded ZIP Resource
- * Extracts a ZIP file that was embedded as a resource in the executable
+ * Open Flag Pack
+ * A "flags.volumes" manifest next to the executable selects an external
+ * multi-volume pack, which may also be a pack on a web server.
+ * Otherwise the ZIP file embedded as a resource is used:
+ * its central directory is parsed in place, and since the locked resource
+ * memory stays valid for the lifetime of the process no copy is needed.
  * Resource ID: 1, Type: RT_RCDATA (raw data)
  */
-bool TForm1::ExtractResourceAsZip()
+bool TForm1::OpenResourcePack()
 {
     try {
+        // External volumes take precedence over the embedded resource
+        String manifest = TPath::Combine(ExtractFilePath(Application->ExeName), "flags.volumes");
+        if (FileExists(manifest)) {
+            flagPack.OpenManifest(UTF8String(manifest).c_str());
+            return true;
+        }
+
         HRSRC hResource = NULL;
 		// Find the embedded resource by ID (1) and type (RT_RCDATA)
 		hResource = FindResource(HInstance, MAKEINTRESOURCE(1), RT_RCDATA);
@@ -125,23 +303,13 @@ bool TForm1::ExtractResourceAsZip()
             return false;
         }
 
-        // Copy resource data to a memory stream for ZIP processing
-        TMemoryStream* zipStream = new TMemoryStream();
-        try {
-            // Write the raw resource data to the memory stream
-            zipStream->WriteBuffer(pResourceData, resourceSize);
-            zipStream->Position = 0; // Reset stream position to beginning
-
-            // Extract the ZIP file contents to temporary directory
-            bool result = ExtractZipToTemp(zipStream);
-
-            delete zipStream; // Clean up memory stream
-            return result;
-        } catch (Exception &e) {
-            delete zipStream; // Ensure cleanup on exception
-            ShowMessage("Error processing ZIP data: " + e.Message);
-            return false;
-        }
+        // Parse the ZIP directory directly over the resource bytes
+        flagPack.AddVolume(pResourceData, resourceSize, "flags.RES");
+        return true;
+    } catch (std::exception &e) {
+        flagPack.Close();
+        ShowMessage("Error processing ZIP data: " + String(e.what()));
+        return false;
     } catch (Exception &e) {
         ShowMessage("Error extracting resource: " + e.Message);
         return false;
@@ -150,102 +318,69 @@ bool TForm1::ExtractResourceAsZip()
 //---------------------------------------------------------------------------
 
 /*
- * Extract ZIP Contents to Temporary Directory
- * Takes a memory stream containing ZIP data and extracts all files
- * to a newly created temporary directory
+ * Load Flag Image Entries
+ * Scans the archive directory for all supported image formats
+ * and builds a list of available flag image entries
  */
-bool TForm1::ExtractZipToTemp(TMemoryStream* zipStream)
+void TForm1::LoadFlagImages()
 {
-    try {
-        // Create a unique temporary directory name using current tick count
-        tempDirectory = TPath::GetTempPath() + "FlagImages_" +
-                        IntToStr(static_cast<int>(GetTickCount()));
-        try {
-            // Create the temporary directory
-            TDirectory::CreateDirectory(tempDirectory);
-            if (!TDirectory::Exists(tempDirectory)) {
-                ShowMessage("Unable to create temporary directory");
-                return false;
-            }
-        } catch (...) {
-            ShowMessage("Unable to create temporary directory");
-            return false;
-        }
-
-        // Use C++ Builder's TZipFile class to handle ZIP extraction
-        TZipFile* zipFile = new TZipFile();
-        try {
-            // Open the ZIP file from memory stream in read mode
-            zipFile->Open(zipStream, zmRead);
-
-            // Extract all files from the ZIP archive
-            for (int i = 0; i < zipFile->FileCount; i++) {
-                String fileName = zipFile->FileNames[i];
-                String fullPath = TPath::Combine(tempDirectory, fileName);
-
-                // Ensure the target directory exists (for nested folder structures)
-                String dir = TPath::GetDirectoryName(fullPath);
-                if (!TDirectory::Exists(dir)) {
-                    TDirectory::CreateDirectory(dir);
-                }
-
-                // Extract the individual file
-                zipFile->Extract(fileName, dir);
-            }
-
-            zipFile->Close(); // Close the ZIP file
-            delete zipFile; // Clean up ZIP file object
-            return true; // Success
-        } catch (Exception &e) {
-            delete zipFile; // Ensure cleanup on exception
-            ShowMessage("Error extracting ZIP file: " + e.Message);
-            return false;
-        }
-    } catch (Exception &e) {
-        ShowMessage("Error creating temporary directory: " + e.Message);
-        return false;
+    // Clear any previously loaded entry list
+    flagEntries.clear();
+    largeFlags.assign(flagPack.Count(), -1);
+
+    // Directory entries ("flags/") and other files are skipped
+    for (size_t i = 0; i < flagPack.Count(); i++) {
+        if (IsImageEntry(flagPack.Entry(i).name))
+            flagEntries.push_back(static_cast<int>(i));
     }
 }
 //---------------------------------------------------------------------------
 
 /*
- * Load Flag Image Files
- * Searches the extracted temporary directory for all supported image formats
- * and builds a list of available flag image files
+ * Decode Flag Image Entry
+ * PNG entries go through the decode scheduler at interactive priority: a
+ * prefetched flag is already decoded or in progress, and one still queued
+ * is decoded right here instead of waiting behind background work. Large
+ * PNGs go to the tiled view instead.
+ * Other formats are rare in the pack; their bytes are collected into a
+ * memory stream and handed to the Windows Imaging Component.
  */
-void TForm1::LoadFlagImages()
+void TForm1::LoadFlagImage(int entry)
 {
-    // Clear any previously loaded file list
-    flagFiles.clear();
+    const TPackEntry& info = flagPack.Entry(entry);
+    CloseTiled();
+
+    String name = UTF8ToString(info.name.c_str());
+    if (SameText(TPath::GetExtension(name), ".png")) {
+        if (IsLargeFlag(entry)) {
+            ShowTiled(entry);
+            return;
+        }
 
-    // Validate that temporary directory exists
-    if (tempDirectory.IsEmpty() || !TDirectory::Exists(tempDirectory))
-        return;
+        std::shared_ptr<const TDecodedImage> image = decoder->Decode(entry);
+        std::unique_ptr<Graphics::TBitmap> bitmap(new Graphics::TBitmap());
+        CopyToBitmap(*image, bitmap.get());
 
-    try {
-        // Define supported image file extensions
-        TStringDynArray extensions;
-        extensions.Length = 5;
-        extensions[0] = "*.png"; // Portable Network Graphics
-        extensions[1] = "*.jpg"; // JPEG
-        extensions[2] = "*.jpeg"; // JPEG (alternative extension)
-        extensions[3] = "*.bmp"; // Windows Bitmap
-        extensions[4] = "*.gif"; // Graphics Interchange Format
-
-        // Search for files matching each extension pattern
-        for (int i = 0; i < extensions.Length; i++) {
-            // Get all files matching current extension in all subdirectories
-            TStringDynArray files = TDirectory::GetFiles(
-                tempDirectory, extensions[i], TSearchOption::soAllDirectories);
-
-            // Add each found file to our flag files collection
-            for (int j = 0; j < files.Length; j++) {
-                flagFiles.push_back(files[j]);
-            }
-        }
-    } catch (Exception &e) {
-        ShowMessage("Error searching for image files: " + e.Message);
+        if (image->format == ifBgra32)
+            bitmap->AlphaFormat = afDefined; // VCL premultiplies on this switch
+        ImageFlag->Picture->Assign(bitmap.get());
+        return;
     }
+
+    std::unique_ptr<TByteSource> source = flagPack.OpenEntry(entry);
+
+    std::unique_ptr<TMemoryStream> stream(new TMemoryStream());
+    stream->Size = static_cast<__int64>(info.size);
+    stream->Position = 0;
+    const uint8_t* data;
+    size_t size;
+    while (source->Next(data, size))
+        stream->WriteBuffer(data, static_cast<NativeInt>(size));
+    stream->Position = 0;
+
+    std::unique_ptr<TWICImage> image(new TWICImage());
+    image->LoadFromStream(stream.get());
+    ImageFlag->Picture->Assign(image.get());
 }
 //---------------------------------------------------------------------------
 
@@ -256,55 +391,122 @@ void TForm1::LoadFlagImages()
 void TForm1::ShowRandomFlag()
 {
     // Check if any flag images are available
-    if (flagFiles.size() == 0) {
+    if (flagEntries.size() == 0) {
         LabelFlagName->Caption = "No flag images available";
         return;
     }
 
     try {
-        // Generate random index to select a flag image
-        std::uniform_int_distribution<int> dist(0, flagFiles.size() - 1);
-        int index = dist(randomGenerator);
+        // Take the flag picked (and prefetched) after the last one, if any
+        int index = nextIndex;
+        if (index < 0) {
+            std::uniform_int_distribution<int> dist(0, flagEntries.size() - 1);
+            index = dist(randomGenerator);
+        }
 
-        // Get the selected file path
-        String selectedFile = flagFiles[index];
+        // Get the selected archive entry
+        int entry = flagEntries[index];
 
-        // Load and display the image in the ImageFlag component
-        ImageFlag->Picture->LoadFromFile(selectedFile);
+        // Decode and display the image in the ImageFlag component
+        LoadFlagImage(entry);
+        accessStats.Record(entry);
+        if (!tracePath.IsEmpty())
+            AppendAccessTrace(UTF8String(tracePath).c_str(), flagPack.Entry(entry).name);
 
         // Extract and display the filename (without path and extension)
-        String fileName = TPath::GetFileNameWithoutExtension(selectedFile);
+        String fileName = TPath::GetFileNameWithoutExtension(
+            UTF8ToString(flagPack.Entry(entry).name.c_str()));
         LabelFlagName->Caption = "Flag: " + fileName;
 
         // Update status to show current position in collection
         LabelStatus->Caption =
             "Status: Displaying " + IntToStr(index + 1) + "/" +
-            IntToStr(static_cast<int>(flagFiles.size())) + " flag";
+            IntToStr(static_cast<int>(flagEntries.size())) + " flag";
+    } catch (std::exception &e) {
+        ShowMessage("Error displaying image: " + String(e.what()));
+        LabelFlagName->Caption = "Image loading failed";
     } catch (Exception &e) {
         ShowMessage("Error displaying image: " + e.Message);
         LabelFlagName->Caption = "Image loading failed";
     }
+
+    // Decode the next flag while the user looks at this one
+    PrefetchNextFlag();
 }
 //---------------------------------------------------------------------------
 
 /*
- * Cleanup Temporary Files
- * Removes the temporary directory and all extracted files
- * Called during application shutdown
+ * Large Flag Check
+ * The header of each PNG entry is read at most once: at startup for the
+ * warm-up list, or at its first click or prefetch on a remote pack.
  */
-void TForm1::CleanupTempFiles()
+bool TForm1::IsLargeFlag(int entry)
 {
-    if (!tempDirectory.IsEmpty() && TDirectory::Exists(tempDirectory)) {
-        try {
-            // Delete the entire temporary directory and all its contents
-            TDirectory::Delete(tempDirectory, true); // true = recursive delete
-        } catch (Exception &e) {
-            // Ignore cleanup errors - this is called during shutdown
-            // and we don't want to show error messages at this point
-        }
+    if (largeFlags[entry] < 0)
+        largeFlags[entry] = IsLargePng(flagPack, entry) ? 1 : 0;
+    return largeFlags[entry] != 0;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Prefetch Next Flag
+ * The next random pick is made now, so its decode can run in the
+ * background. Replacing the previous job cancels the decode of a flag
+ * that was never clicked, whether it is still queued or half done.
+ * Large flags are not prefetched: only the tiles in view get decoded.
+ */
+void TForm1::PrefetchNextFlag()
+{
+    std::uniform_int_distribution<int> dist(0, flagEntries.size() - 1);
+    nextIndex = dist(randomGenerator);
+
+    int entry = flagEntries[nextIndex];
+    String name = UTF8ToString(flagPack.Entry(entry).name.c_str());
+    if (SameText(TPath::GetExtension(name), ".png") && !IsLargeFlag(entry))
+        nextJob = decoder->Request(entry, tpPrefetch);
+    else
+        nextJob.reset();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Open Disk Cache
+ * Flags decoded in earlier sessions come back from disk instead of being
+ * decoded again. A second copy of the viewer reads the cache but leaves
+ * writing to the first; a cache folder that cannot be used just means
+ * decoding everything, as before.
+ */
+void TForm1::OpenDiskCache()
+{
+    try {
+        String folder = TPath::Combine(TPath::GetCachePath(), "FlagDisplay");
+        diskCache.reset(new TDiskImageCache(UTF8String(folder).c_str(), DiskCacheBytes));
+        imageCache->AttachDisk(diskCache.get(), PackFingerprint(flagPack), imageOutput);
+    } catch (...) {
+        diskCache.reset();
     }
 }
+//---------------------------------------------------------------------------
 
+/*
+ * Save Access Statistics
+ * Writes the merged view counts (history plus this session) by entry name
+ */
+void TForm1::SaveAccessStats()
+{
+    if (statsPath.IsEmpty())
+        return;
+
+    try {
+        std::vector<std::string> names(flagPack.Count());
+        for (size_t i = 0; i < names.size(); i++)
+            names[i] = flagPack.Entry(i).name;
+        accessStats.Save(UTF8String(statsPath).c_str(), names);
+    } catch (...) {
+        // Ignore errors - this is called during shutdown
+        // and statistics are only an optimization hint
+    }
+}
 //---------------------------------------------------------------------------
 
 /*
@@ -329,3 +531,198 @@ void __fastcall TForm1::ButtonRandomClick(TObject* Sender)
     ShowRandomFlag();
 }
 //---------------------------------------------------------------------------
+
+/*
+ * Show Large Flag As Tiles
+ * The opening pass reads the entry once (see TiledImage.h); from then on
+ * only the overview and the tiles around the view are held. Bands report
+ * from the task pool, so the callback only posts a message to the form.
+ */
+void TForm1::ShowTiled(int entry)
+{
+    tiledImage.reset(new TTiledImage(flagPack, entry));
+    HWND handle = Handle;
+    tiledImage->SetReadyCallback([handle]() { PostMessage(handle, WM_TILEREADY, 0, 0); });
+
+    const TPngInfo& info = tiledImage->Info();
+    tileFitScale = std::min(1.0, std::min(static_cast<double>(PaintTiles->Width) / info.width,
+                                          static_cast<double>(PaintTiles->Height) / info.height));
+    tileScale = tileFitScale;
+    ClampTiles();
+
+    ImageFlag->Visible = false;
+    PaintTiles->Visible = true;
+    PaintTiles->Invalidate();
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Close Tiled View
+ * Waits for bands still decoding; queued ones are dropped.
+ */
+void TForm1::CloseTiled()
+{
+    if (!tiledImage)
+        return;
+
+    tiledImage.reset();
+    tileDragging = false;
+    PaintTiles->Visible = false;
+    ImageFlag->Visible = true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Clamp Tiled View
+ * A view larger than the flag centres it, like ImageFlag does
+ */
+void TForm1::ClampTiles()
+{
+    const TPngInfo& info = tiledImage->Info();
+    double width = PaintTiles->Width / tileScale;
+    double height = PaintTiles->Height / tileScale;
+
+    if (width >= info.width)
+        tileLeft = (info.width - width) / 2;
+    else
+        tileLeft = std::max(0.0, std::min(tileLeft, info.width - width));
+    if (height >= info.height)
+        tileTop = (info.height - height) / 2;
+    else
+        tileTop = std::max(0.0, std::min(tileTop, info.height - height));
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Draw Tiles
+ * Each ready tile of the range, stretched to where it falls in the view.
+ * Both edges come from image coordinates, so neighbours meet without gaps.
+ */
+void TForm1::DrawTiles(TCanvas* canvas, const TTileRange& range)
+{
+    double span = static_cast<double>(TTiledImage::TileSize << range.level);
+
+    for (uint32_t row = range.row0; row < range.row1; row++) {
+        for (uint32_t column = range.column0; column < range.column1; column++) {
+            std::shared_ptr<const TDecodedImage> tile = tiledImage->Find(range.level, column, row);
+            if (!tile)
+                continue;
+
+            double x0 = column * span - tileLeft;
+            double y0 = row * span - tileTop;
+            double x1 = x0 + static_cast<double>(tile->info.width << range.level);
+            double y1 = y0 + static_cast<double>(tile->info.height << range.level);
+            TRect rect(static_cast<int>(std::floor(x0 * tileScale)),
+                       static_cast<int>(std::floor(y0 * tileScale)),
+                       static_cast<int>(std::floor(x1 * tileScale)),
+                       static_cast<int>(std::floor(y1 * tileScale)));
+
+            std::unique_ptr<Graphics::TBitmap> bitmap(new Graphics::TBitmap());
+            CopyToBitmap(*tile, bitmap.get());
+            bitmap->AlphaFormat = afDefined; // VCL premultiplies on this switch
+            canvas->StretchDraw(rect, bitmap.get());
+        }
+    }
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Tiled View Paint Event Handler
+ * The overview is always ready. Every finer level down to the one the
+ * zoom wants is drawn over it with whatever tiles it has, so a missing
+ * tile shows its best stand-in, blurred, until its band arrives. Only the
+ * wanted level is requested, which drops the bands a pan has left behind.
+ */
+void __fastcall TForm1::PaintTilesPaint(TObject* Sender)
+{
+    TCanvas* canvas = PaintTiles->Canvas;
+    canvas->Brush->Color = Color;
+    canvas->FillRect(PaintTiles->ClientRect);
+    if (!tiledImage)
+        return;
+
+    double width = PaintTiles->Width / tileScale;
+    double height = PaintTiles->Height / tileScale;
+    unsigned wanted = tiledImage->LevelFor(tileScale);
+    unsigned coarsest = std::max(wanted, tiledImage->OverviewLevel());
+    for (unsigned level = coarsest + 1; level-- > wanted;)
+        DrawTiles(canvas, tiledImage->Visible(level, tileLeft, tileTop, width, height));
+
+    tiledImage->Request(tiledImage->Visible(wanted, tileLeft, tileTop, width, height));
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Tiled View Drag Event Handlers
+ * Dragging with the left button pans; the paint box has the mouse
+ * captured while the button is down
+ */
+void __fastcall TForm1::PaintTilesMouseDown(TObject* Sender, TMouseButton Button,
+                                            TShiftState Shift, int X, int Y)
+{
+    if (Button != mbLeft)
+        return;
+
+    tileDragging = true;
+    tileDragX = X;
+    tileDragY = Y;
+}
+
+void __fastcall TForm1::PaintTilesMouseMove(TObject* Sender, TShiftState Shift, int X, int Y)
+{
+    if (!tileDragging || !tiledImage)
+        return;
+
+    tileLeft -= (X - tileDragX) / tileScale;
+    tileTop -= (Y - tileDragY) / tileScale;
+    tileDragX = X;
+    tileDragY = Y;
+    ClampTiles();
+    PaintTiles->Invalidate();
+}
+
+void __fastcall TForm1::PaintTilesMouseUp(TObject* Sender, TMouseButton Button,
+                                          TShiftState Shift, int X, int Y)
+{
+    if (Button == mbLeft)
+        tileDragging = false;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Mouse Wheel Event Handler
+ * Zooms the tiled view about the image pixel under the cursor, between
+ * the fitted view and MaxTileScale
+ */
+void __fastcall TForm1::FormMouseWheel(TObject* Sender, TShiftState Shift, int WheelDelta,
+                                       const TPoint& MousePos, bool& Handled)
+{
+    if (!tiledImage)
+        return;
+
+    TPoint at = PaintTiles->ScreenToClient(MousePos);
+    if (at.x < 0 || at.y < 0 || at.x >= PaintTiles->Width || at.y >= PaintTiles->Height)
+        return;
+
+    double x = tileLeft + at.x / tileScale;
+    double y = tileTop + at.y / tileScale;
+    double scale = WheelDelta > 0 ? tileScale * TileZoomStep : tileScale / TileZoomStep;
+    tileScale = std::max(tileFitScale, std::min(MaxTileScale, scale));
+    tileLeft = x - at.x / tileScale;
+    tileTop = y - at.y / tileScale;
+    ClampTiles();
+    PaintTiles->Invalidate();
+    Handled = true;
+}
+//---------------------------------------------------------------------------
+
+/*
+ * Tile Ready Message Handler
+ * Posted once per finished band; repaints merge
+ */
+void __fastcall TForm1::WMTileReady(TMessage& Message)
+{
+    if (tiledImage)
+        PaintTiles->Invalidate();
+}
+//---------------------------------------------------------------------------
@@ -2,19 +2,24 @@
  * Zipu1.h - Flag Display Application Header File
  *
  * This header file defines the main form class (TForm1) for a Windows GUI application
- * that extracts flag images from an embedded ZIP resource and displays them randomly.
+ * that decodes flag images from an embedded ZIP resource and displays them randomly.
  * 
  * Key Features:
- * - Extracts ZIP files embedded as Windows resources
- * - Displays random flag images from extracted collection
- * - Manages temporary file cleanup
+ * - Reads the ZIP archive embedded as a Windows resource in place (no copy)
+ * - Optionally reads a multi-volume pack listed in "flags.volumes" instead
+ * - Records per-flag view counts so packs can be reordered for locality
+ * - Decodes PNG entries in a single fused inflate/unfilter/convert pass
+ * - Prefetches the next random flag in the background; a click promotes it
+ * - Keeps decoded flags in a two-tier cache (raw and LZ4-compressed pixels)
+ * - Shows very large flags as decoded-on-demand tiles with pan and zoom
+ * - Displays random flag images from the archive
  * - Provides user interface for flag browsing
  *
  * Architecture:
  * - Uses VCL (Visual Component Library) for Windows GUI components
  * - Follows Model-View pattern with form handling both UI and business logic
  * - Resource management with RAII principles (constructor/destructor cleanup)
- * - Exception-safe temporary file handling
+ * - No temporary files: images are decoded in memory and copied into the display bitmap
  */
 
 //---------------------------------------------------------------------------
@@ -44,36 +49,52 @@
 
 /*
  * System and File Management Includes
- * Utilities for ZIP handling, file operations, and system integration
+ * Utilities for path handling and system integration
  */
-#include <System.zip.hpp>         // ZIP file compression/decompression (TZipFile)
 #include <System.IOUtils.hpp>     // Modern file I/O utilities (TPath, TDirectory, TFile)
 
+/*
+ * Archive and Image Decoding Includes
+ * In-memory ZIP reader and streaming PNG decoder
+ */
+#include "PackVolumes.h"          // Unified reader over one or more ZIP volumes (TPackVolumeSet)
+#include "DecodeScheduler.h"      // Prioritized, deduplicated PNG decodes on the task pool
+#include "ImageCache.h"           // Decoded flags kept raw (hot) and LZ4-compressed (cold)
+#include "DiskImageCache.h"       // Decoded flags kept on disk for the next launch
+#include "MemoryPressure.h"       // Shrinks the image cache while memory is short
+#include "AccessStats.h"          // Per-entry access counters persisted across runs
+#include "TiledImage.h"           // Tile pyramid for flags too large to decode whole
+
 /*
  * Standard C++ Library Includes
  * Modern C++ containers and utilities for enhanced functionality
  */
+#include <memory>                 // std::unique_ptr for the decode scheduler and cache
 #include <vector>                 // Dynamic array container for storing file paths
 #include <random>                 // Modern C++ random number generation
 
 //---------------------------------------------------------------------------
 
+// Posted from the task pool when a band of tiles is ready
+#define WM_TILEREADY (WM_APP + 1)
+
+//---------------------------------------------------------------------------
+
 /*
  * TForm1 - Main Application Form Class
  *
  * This class represents the main window of the flag display application.
  * It inherits from TForm (VCL's base form class) and implements:
  * 
- * 1. Resource Management: Extracts ZIP files embedded in the executable
- * 2. Image Processing: Loads and displays various image formats
+ * 1. Resource Management: Opens the ZIP archive embedded in the executable
+ * 2. Image Processing: Decodes and displays various image formats
  * 3. User Interface: Provides controls for user interaction
- * 4. Temporary File Management: Handles cleanup of extracted files
- * 5. Random Selection: Displays random flags from the collection
+ * 4. Random Selection: Displays random flags from the collection
  *
  * Design Pattern: This class follows a hybrid approach combining:
  * - Presentation Layer: UI components and event handling
- * - Business Logic: File extraction, image loading, random selection
- * - Resource Management: Temporary directory and file cleanup
+ * - Business Logic: Archive access, image decoding, random selection
+ * - Resource Management: Archive lifetime tied to the form
  */
 class TForm1 : public TForm
 {
@@ -100,12 +121,28 @@ class TForm1 : public TForm
                                 // Shows: loading states, error messages, success counts
                                 // Color-coded: normal (black) vs error (red) states
 
+    TPaintBox* PaintTiles;      // Stands in for ImageFlag when a flag is too large to
+                                // decode whole; drag to pan, mouse wheel to zoom
+
     /*
      * Event Handler Declaration
      * This function is called automatically when ButtonRandomFlag is clicked
      */
     void __fastcall ButtonRandomClick(TObject* Sender);
 
+    /*
+     * Tiled View Event Handlers
+     * Painting, dragging and wheel zoom of PaintTiles
+     */
+    void __fastcall PaintTilesPaint(TObject* Sender);
+    void __fastcall PaintTilesMouseDown(TObject* Sender, TMouseButton Button, TShiftState Shift,
+                                        int X, int Y);
+    void __fastcall PaintTilesMouseMove(TObject* Sender, TShiftState Shift, int X, int Y);
+    void __fastcall PaintTilesMouseUp(TObject* Sender, TMouseButton Button, TShiftState Shift,
+                                      int X, int Y);
+    void __fastcall FormMouseWheel(TObject* Sender, TShiftState Shift, int WheelDelta,
+                                   const TPoint& MousePos, bool& Handled);
+
   private: // User declarations
     /*
      * Private Data Members
@@ -113,15 +150,58 @@ class TForm1 : public TForm
      * accessible from outside the class, ensuring data encapsulation.
      */
     
-    std::vector<String> flagFiles;  // Dynamic collection of discovered flag image file paths
+    TPackVolumeSet flagPack;        // Unified ZIP reader over the pack volumes
+                                    // Either the locked resource memory (single volume)
+                                    // or the memory-mapped files listed in flags.volumes
+                                    // Entry data is read straight from the mapped bytes
+    
+    std::vector<int> flagEntries;   // Dynamic collection of flag image entry indices in flagPack
                                     // Uses std::vector for efficient random access and iteration
-                                    // Stores full file paths to extracted images
                                     // Populated during LoadFlagImages() execution
     
-    String tempDirectory;           // Path to temporary directory containing extracted files
-                                    // Created during resource extraction process
-                                    // Used for cleanup during application shutdown
-                                    // Format: %TEMP%/FlagImages_<timestamp>
+    std::vector<int8_t> largeFlags; // Per entry: 1 shown tiled, 0 decoded whole, -1 not checked
+                                    // Filled in by IsLargeFlag(), so each header is read once
+    
+    TAccessStats accessStats;       // How often each pack entry was displayed
+                                    // Loaded from and saved to statsPath
+                                    // Input for "Zip.exe --pack reorder" (hot flags first)
+    
+    String statsPath;               // Access statistics file: %APPDATA%\FlagDisplay.stats
+    
+    String tracePath;               // Access trace file from ZIP_TRACE; empty = not recording
+                                    // Replayed by "Zip.exe --pack cachetrace"
+    
+    TImageOutput imageOutput;       // Pixel format of decoded flags, from ZIP_PIXELS
+                                    // (rgb565 or indexed8); BGRA by default
+    
+    std::unique_ptr<TDiskImageCache> diskCache; // Decoded flags from earlier sessions (null if unusable)
+                                                // Declared before imageCache, which reads it
+    
+    std::unique_ptr<TImageCache> imageCache;    // Decoded flags: a few raw, the whole pack compressed
+                                                // Declared before decoder, which uses it
+    
+    std::unique_ptr<TCacheShrinker> pressureShrinker;        // Cache budgets under memory pressure
+    std::unique_ptr<TMemoryPressureMonitor> pressureMonitor; // Feeds pressureShrinker from its
+                                                             // thread; the destructor resets it
+                                                             // before pressureShrinker
+    
+    std::unique_ptr<TDecodeScheduler> decoder;  // PNG decodes over flagPack on the task pool
+                                                // Created once the pack is open; warms imageCache
+    
+    std::unique_ptr<TTiledImage> tiledImage;    // The flag shown in PaintTiles, if it is large
+                                                // Null while ImageFlag shows a decoded flag
+    
+    double tileScale;               // Screen pixels per image pixel in PaintTiles
+    double tileFitScale;            // The whole flag in view: the furthest zoom out
+    double tileLeft;                // Image pixel at the top-left corner of PaintTiles
+    double tileTop;
+    bool tileDragging;              // Left button held down on PaintTiles
+    int tileDragX;                  // Mouse position the drag last moved from
+    int tileDragY;
+    
+    int nextIndex;                  // Index into flagEntries shown on the next click (-1 = none)
+    TDecodeJobPtr nextJob;          // Its decode, requested at tpPrefetch
+                                    // Promoted to tpInteractive when the click comes
     
     std::mt19937 randomGenerator;   // Modern C++ Mersenne Twister random number generator
                                     // Seeded with system tick count for different sequences
@@ -134,34 +214,52 @@ class TForm1 : public TForm
      * and are called internally to perform specific operations.
      */
     
-    bool ExtractResourceAsZip();    // Extracts embedded ZIP resource from executable
-                                    // Resource ID: 108, Type: RT_RCDATA
-                                    // Returns: true if extraction successful, false otherwise
+    bool OpenResourcePack();        // Opens the flag pack volumes
+                                    // flags.volumes next to the executable, if present,
+                                    // otherwise the embedded resource (ID: 1, Type: RT_RCDATA)
+                                    // Returns: true if the archive was parsed, false otherwise
                                     // Handles Windows resource API calls and error checking
     
-    bool ExtractZipToTemp(TMemoryStream* zipStream);  // Extracts ZIP contents to temp directory
-                                                      // Parameter: Memory stream containing ZIP data
-                                                      // Creates unique temporary directory
-                                                      // Returns: success/failure status
-                                                      // Uses TZipFile for actual extraction
+    void LoadFlagImages();          // Catalogs all image entries in the archive
+                                    // Matches: .png, .jpg, .jpeg, .bmp, .gif (any folder depth)
+                                    // Populates flagEntries vector with entry indices
     
-    void LoadFlagImages();          // Discovers and catalogs all image files in temp directory
-                                    // Searches for: *.png, *.jpg, *.jpeg, *.bmp, *.gif
-                                    // Populates flagFiles vector with found file paths
-                                    // Supports recursive subdirectory searching
+    void LoadFlagImage(int entry);  // Decodes one archive entry into ImageFlag
+                                    // PNG: through decoder, reusing a prefetched result
+                                    // Other formats: entry bytes loaded through TWICImage
+                                    // Throws on corrupt data; caller reports the error
     
     void ShowRandomFlag();          // Selects and displays a random flag from the collection
                                     // Updates ImageFlag, LabelFlagName, and LabelStatus
                                     // Uses randomGenerator for fair selection
                                     // Handles image loading errors gracefully
     
-    void CleanupTempFiles();        // Removes temporary directory and all extracted files
-                                    // Called during form destruction (destructor)
-                                    // Implements RAII pattern for resource cleanup
-                                    // Ignores errors during shutdown to prevent exceptions
+    bool IsLargeFlag(int entry);    // True for PNG entries shown through tiledImage
+                                    // Reads the PNG header on first use, then largeFlags
+    
+    void PrefetchNextFlag();        // Picks the flag for the next click and queues
+                                    // its decode at tpPrefetch
+    
+    void ShowTiled(int entry);      // Opens a large PNG entry as tiledImage, fitted and
+                                    // centred in PaintTiles, which replaces ImageFlag
+    
+    void CloseTiled();              // Drops tiledImage and shows ImageFlag again
+    
+    void ClampTiles();              // Keeps the view over the flag (centred if smaller)
+    
+    void DrawTiles(TCanvas* canvas, const TTileRange& range);  // Draws the ready tiles
+                                                               // of a range scaled to view
+    
+    void __fastcall WMTileReady(TMessage& Message);  // Repaints PaintTiles as bands arrive
+    
+    void OpenDiskCache();           // Opens diskCache in the user's cache folder and
+                                    // attaches it to imageCache; leaves it null on failure
+    
+    void SaveAccessStats();         // Persists accessStats to statsPath
+                                    // Called during form destruction; errors are ignored
     
     void InitializeApplication();   // Main initialization routine called from constructor
-                                    // Orchestrates: resource extraction → image loading → display
+                                    // Orchestrates: resource opening → image cataloging → display
                                     // Updates UI status during each phase
                                     // Handles initialization errors with user feedback
 
@@ -179,10 +277,15 @@ class TForm1 : public TForm
                                            // Follows VCL constructor convention with __fastcall
     
     __fastcall ~TForm1();                  // Destructor: Cleanup resources before form destruction
-                                           // Calls CleanupTempFiles() to remove temporary data
+                                           // Saves access statistics, drains the decoder
+                                           // and closes the archive reader
                                            // Ensures no resource leaks when application closes
                                            // Implements RAII pattern for automatic cleanup
 
+    BEGIN_MESSAGE_MAP
+        VCL_MESSAGE_HANDLER(WM_TILEREADY, TMessage, WMTileReady)
+    END_MESSAGE_MAP(TForm)
+
     // Note: Event handler functions are declared in __published section above
     // Additional public methods can be added here if needed for external access
 };